@@ -1,6 +1,9 @@
 #pragma once
 
 #include "MPM/base.h"
+#include "MPM/surface.h"
+
+#include <vector>
 
 namespace mpm {
 
@@ -38,4 +41,48 @@ public:
   virtual VT normal(const VT &x) const override;
 };
 
+class Box_LevelSet : public MPM_LevelSet {
+public:
+  VT box_min;
+  VT box_max;
+
+  Box_LevelSet(const VT &box_min, const VT &box_max);
+  ~Box_LevelSet() = default;
+
+  virtual bool inside(const VT &x) const override;
+  virtual T signed_distance(const VT &x) const override;
+  virtual VT normal(const VT &x) const override;
+};
+
+// Signed distance of a closed triangle mesh, sampled on nodes of spacing
+// dx around the mesh and interpolated trilinearly. The sign comes from
+// the parity of ray crossings along x for every node column, the distance
+// is exact within `band` nodes of the surface and clamped beyond. Both
+// passes run in parallel over z slabs of nodes.
+class Mesh_LevelSet : public MPM_LevelSet {
+public:
+  Mesh_LevelSet(const SurfaceMesh &mesh, T dx, int band = 3);
+  ~Mesh_LevelSet() = default;
+
+  virtual bool inside(const VT &x) const override;
+  virtual T signed_distance(const VT &x) const override;
+  virtual VT normal(const VT &x) const override;
+
+  // bounding box of the mesh vertices
+  const VT &get_min() const { return mesh_min; }
+  const VT &get_max() const { return mesh_max; }
+
+private:
+  VT mesh_min, mesh_max;
+  VT origin;
+  T dx;
+  T far;
+  VINT nodes;
+  std::vector<float> phi;
+
+  T node_phi(int i, int j, int k) const {
+    return phi[(size_t(k) * nodes[1] + j) * nodes[0] + i];
+  }
+};
+
 } // namespace mpm
\ No newline at end of file
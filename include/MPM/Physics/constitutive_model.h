@@ -6,30 +6,49 @@ namespace mpm {
 // Constitutive Model for simulation
 class MPM_CM {
 public:
+  virtual ~MPM_CM() = default;
   virtual MT calc_stress_tensor(const Particle &particle) = 0;
   virtual T calc_psi(const Particle &particle) = 0;
   virtual std::tuple<MT, MT> calc_mixed_stress_tensor(const Particle &particle);
+  // kirchhoff stress (stress_F * F^T + stress_J) of `count` consecutive
+  // particles, one virtual call per batch instead of one per particle
+  virtual void calc_kirchhoff_stress_batch(const Particle *particles,
+                                           int count, MT *tau);
 };
 
-class NeoHookean_Piola : public MPM_CM {
+// implements the batch kernel with statically bound, inlined calls into
+// the concrete model
+template <class Model> class MPM_CM_Batched : public MPM_CM {
+public:
+  virtual void calc_kirchhoff_stress_batch(const Particle *particles,
+                                           int count, MT *tau) override;
+};
+
+class NeoHookean_Piola : public MPM_CM_Batched<NeoHookean_Piola> {
+public:
   virtual MT calc_stress_tensor(const Particle &particle);
   virtual T calc_psi(const Particle &particle);
+  virtual std::tuple<MT, MT> calc_mixed_stress_tensor(const Particle &particle);
 };
 
-class QuatraticVolumePenalty : public MPM_CM {
+class QuatraticVolumePenalty : public MPM_CM_Batched<QuatraticVolumePenalty> {
+public:
   virtual MT calc_stress_tensor(const Particle &particle);
   virtual T calc_psi(const Particle &particle);
   virtual std::tuple<MT, MT> calc_mixed_stress_tensor(const Particle &particle);
 };
 
-class NeoHookean_Fluid : public MPM_CM {
+class NeoHookean_Fluid : public MPM_CM_Batched<NeoHookean_Fluid> {
+public:
   virtual MT calc_stress_tensor(const Particle &particle);
   virtual T calc_psi(const Particle &particle);
+  virtual std::tuple<MT, MT> calc_mixed_stress_tensor(const Particle &particle);
 };
 
-class CDMPM_Fluid : public MPM_CM {
+class CDMPM_Fluid : public MPM_CM_Batched<CDMPM_Fluid> {
+public:
   virtual MT calc_stress_tensor(const Particle &particle);
   virtual T calc_psi(const Particle &particle);
   virtual std::tuple<MT, MT> calc_mixed_stress_tensor(const Particle &particle);
 };
-} // namespace mpm
\ No newline at end of file
+} // namespace mpm
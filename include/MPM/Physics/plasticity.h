@@ -14,6 +14,9 @@ public:
   virtual bool projectStrain(Particle &particle) = 0;
 };
 
+// the parameters only, the hardening state lives per particle in
+// Particle::gamma_p: the yield stress grows by xi * gamma_p and the
+// equivalent plastic strain is alpha + sqrt(2 / 3) * gamma_p
 class vonMises : public Plasticity {
 public:
   T yield_stress, fail_stress, xi, alpha;
@@ -26,10 +29,12 @@ public:
 
 class Snow : public Plasticity {
 public:
-  T Jp, psi, theta_c, theta_s, min_Jp, max_Jp;
+  // hardening state lives per particle in Particle::Jp. psi is stored
+  // but not applied, mu and lambda stay those of the material
+  T psi, theta_c, theta_s, min_Jp, max_Jp;
   Snow(T psi_in = 10, T theta_c_in = 2e-2, T theta_s_in = 7.5e-3,
        T min_Jp_in = 0.6, T max_Jp_in = 20)
-      : Jp(1), psi(psi_in), theta_c(theta_c_in), theta_s(theta_s_in),
+      : psi(psi_in), theta_c(theta_c_in), theta_s(theta_s_in),
         min_Jp(min_Jp_in), max_Jp(max_Jp_in) {}
 
   bool projectStrain(Particle &particle);
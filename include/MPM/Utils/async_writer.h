@@ -0,0 +1,64 @@
+#pragma once
+
+#include "MPM/base.h"
+#include "MPM/particle_export.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <tbb/concurrent_queue.h>
+
+namespace mpm {
+
+// Background frame output stage.
+// A fixed pool of snapshot buffers cycles between the simulator and a set of
+// writer threads, so frame n is serialized/compressed while frame n+1 is
+// simulated. When every buffer is in flight acquire() blocks (back-pressure).
+class MPM_AsyncWriter {
+public:
+  using Snapshot = ParticleSnapshot;
+  using WriteFunc =
+      std::function<bool(const std::string &path, const Snapshot &snapshot)>;
+
+  MPM_AsyncWriter(int num_workers = 2, int num_buffers = 3);
+  MPM_AsyncWriter(WriteFunc write_func, int num_workers = 2,
+                  int num_buffers = 3);
+  virtual ~MPM_AsyncWriter();
+
+  MPM_AsyncWriter(const MPM_AsyncWriter &) = delete;
+  MPM_AsyncWriter &operator=(const MPM_AsyncWriter &) = delete;
+
+  // blocks until a snapshot buffer returns from the writers
+  Snapshot *acquire();
+  // hand a filled snapshot to the writer pool, buffer is recycled afterwards
+  void submit(const std::string &path, Snapshot *snapshot);
+  // wait until all submitted frames reach the disk
+  bool flush();
+
+  int get_failed_count() const { return failed_count; }
+
+private:
+  struct Job {
+    std::string path;
+    Snapshot *snapshot = nullptr;
+  };
+
+  WriteFunc write_func;
+  std::vector<std::unique_ptr<Snapshot>> buffers;
+  tbb::concurrent_bounded_queue<Snapshot *> free_buffers;
+  tbb::concurrent_bounded_queue<Job> jobs;
+  std::vector<std::thread> workers;
+
+  std::mutex pending_mutex;
+  std::condition_variable pending_cv;
+  int pending_count = 0;
+  std::atomic<int> failed_count{0};
+
+  void worker_loop();
+};
+
+} // namespace mpm
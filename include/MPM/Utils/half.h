@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+namespace mpm {
+
+// IEEE 754 binary16 conversion, round to nearest even
+inline uint16_t float_to_half(float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  uint32_t sign = (bits >> 16) & 0x8000u;
+  uint32_t abs = bits & 0x7fffffffu;
+
+  if (abs >= 0x7f800000u) { // inf / nan
+    return uint16_t(sign | 0x7c00u | (abs > 0x7f800000u ? 0x200u : 0u));
+  }
+  if (abs >= 0x477ff000u) { // overflow after rounding
+    return uint16_t(sign | 0x7c00u);
+  }
+  if (abs < 0x38800000u) { // subnormal or zero
+    if (abs < 0x33000000u) {
+      return uint16_t(sign);
+    }
+    uint32_t mantissa = (abs & 0x007fffffu) | 0x00800000u;
+    int shift = 126 - int(abs >> 23);
+    uint32_t half = mantissa >> shift;
+    uint32_t rest = mantissa & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift - 1);
+    if (rest > halfway || (rest == halfway && (half & 1u))) {
+      half++;
+    }
+    return uint16_t(sign | half);
+  }
+  uint32_t half = ((abs - 0x38000000u) >> 13);
+  uint32_t rest = abs & 0x1fffu;
+  if (rest > 0x1000u || (rest == 0x1000u && (half & 1u))) {
+    half++;
+  }
+  return uint16_t(sign | half);
+}
+
+inline float half_to_float(uint16_t value) {
+  uint32_t sign = uint32_t(value & 0x8000u) << 16;
+  uint32_t exponent = (value >> 10) & 0x1fu;
+  uint32_t mantissa = value & 0x3ffu;
+  uint32_t bits;
+
+  if (exponent == 0) {
+    if (mantissa == 0) {
+      bits = sign;
+    } else { // renormalize subnormal
+      exponent = 127 - 15 + 1;
+      while (!(mantissa & 0x400u)) {
+        mantissa <<= 1;
+        exponent--;
+      }
+      bits = sign | (exponent << 23) | ((mantissa & 0x3ffu) << 13);
+    }
+  } else if (exponent == 0x1f) {
+    bits = sign | 0x7f800000u | (mantissa << 13);
+  } else {
+    bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+  }
+
+  float result;
+  std::memcpy(&result, &bits, sizeof(result));
+  return result;
+}
+
+} // namespace mpm
@@ -1,16 +1,42 @@
 #pragma once
 
 #include "MPM/base.h"
+#include "MPM/grid_export.h"
+#include "MPM/particle_export.h"
+#include "MPM/surface.h"
 #include <string>
 
 namespace mpm {
-bool read_particles(const std::string &model_path, std::vector<VT> &positions);
+// accepts `v x y z` (obj) and bare `x y z` lines, parsed in parallel from a
+// memory-mapped file. A `<model_path>.mpmcache` sidecar keyed by the source
+// size and mtime makes repeated loads a single bulk read.
+bool read_particles(const std::string &model_path, std::vector<VT> &positions,
+                    bool use_cache = true);
+// triangles of an .obj (`v` and `f` lines), polygons are split into fans
+bool read_mesh(const std::string &model_path, SurfaceMesh &mesh);
 bool write_particles(const std::string &write_path,
                      const std::vector<VT> &positions);
+// bulk export straight from (strided) simulator storage, .bgeo/.bgeo.gz
+// bypass the intermediate Partio container
+bool write_particles(const std::string &write_path,
+                     const StridedSpan<VT> &positions);
+// every channel of the snapshot becomes a point attribute
+bool write_particles(const std::string &write_path,
+                     const ParticleSnapshot &snapshot);
+// triangle mesh as .ply (binary little endian) or text .obj otherwise
+bool write_mesh(const std::string &write_path, const SurfaceMesh &mesh);
+// sparse tiled grid file, little endian:
+//   "MPMGRID1", int32 dims[3], float h, float time, int32 frame,
+//   int32 block_size, int32 tile_count, int32 channel_count, then per
+//   channel int32 components, int32 type (0 float32, 1 float16) and a
+//   length prefixed name. every tile follows as int32 coords[3], its node
+//   mask and block_size^3 values per channel, so a reader can seek to any
+//   tile; skipped tiles are all zero
+bool write_grid(const std::string &write_path, const GridSnapshot &snapshot);
 
 bool is_dir(const std::string &path);
 bool is_file(const std::string &path);
 bool mkdir(const std::string &path);
 bool exists(const std::string &path);
 
-} // namespace mpm
\ No newline at end of file
+} // namespace mpm
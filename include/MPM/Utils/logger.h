@@ -4,12 +4,38 @@
 #include "spdlog/sinks/stdout_color_sinks.h"
 #include "spdlog/spdlog.h"
 
+#include <atomic>
+
+// compile-time minimum log level, calls below it are compiled out.
+// release builds keep info and up, which also strips MPM_DEBUG_ASSERT
+// from the inner loops
+#define MPM_LEVEL_TRACE 0
+#define MPM_LEVEL_DEBUG 1
+#define MPM_LEVEL_INFO 2
+#define MPM_LEVEL_WARN 3
+#define MPM_LEVEL_ERROR 4
+#define MPM_LEVEL_FATAL 5
+
+#ifndef MPM_LOG_LEVEL
+#ifdef NDEBUG
+#define MPM_LOG_LEVEL MPM_LEVEL_INFO
+#else
+#define MPM_LOG_LEVEL MPM_LEVEL_TRACE
+#endif
+#endif
+
 namespace mpm {
 
 // define logger
 class MPMLog {
 public:
-  static void init();
+  // async: messages go through a bounded queue to a background thread,
+  // when it is full the oldest message is dropped instead of blocking
+  static void init(bool async = false, size_t queue_size = 8192);
+  // drain the async queue and drop the logger, call before leaving main
+  // once no other thread logs. later messages are discarded
+  static void shutdown();
+
   MPMLog() = default;
   virtual ~MPMLog() = default;
 
@@ -21,16 +47,70 @@ private:
   static std::shared_ptr<spdlog::logger> s_logger;
 };
 
+// Counters of the aggregated call sites inside hot loops, one table per
+// owner (a simulator), so runs sharing the process count separately. The
+// first event of a site after a flush may log its details, the others are
+// only counted and reported as a single line by flush(), e.g.
+// "J<0 on 12345 particles this step".
+class MPMLogAggregates {
+public:
+  static constexpr int MAX_SITES = 64;
+
+  MPMLogAggregates() = default;
+  virtual ~MPMLogAggregates() = default;
+
+  // process-wide index of a call site, summary is a format string with
+  // one {} for the count
+  static int register_site(spdlog::level::level_enum level,
+                           const char *summary);
+  // true for the first event of the site since the last flush
+  bool hit(int site) {
+    return counts[site].fetch_add(1, std::memory_order_relaxed) == 0;
+  }
+  // log the summaries of the sites hit since the last flush and reset them
+  void flush();
+
+private:
+  std::atomic<uint64_t> counts[MAX_SITES] = {};
+};
+
 } // namespace mpm
 
 #ifndef MPM_NO_DEBUG
 
-// Client log macros
-#define MPM_FATAL(...) ::mpm::MPMLog::get_logger()->fatal(__VA_ARGS__)
-#define MPM_ERROR(...) ::mpm::MPMLog::get_logger()->error(__VA_ARGS__)
-#define MPM_WARN(...) ::mpm::MPMLog::get_logger()->warn(__VA_ARGS__)
-#define MPM_INFO(...) ::mpm::MPMLog::get_logger()->info(__VA_ARGS__)
-#define MPM_TRACE(...) ::mpm::MPMLog::get_logger()->trace(__VA_ARGS__)
+// Client log macros, no-ops before init() and after shutdown()
+#define MPM_LOG(level, ...)                                                    \
+  do {                                                                         \
+    if (auto &mpm_logger = ::mpm::MPMLog::get_logger()) {                      \
+      mpm_logger->level(__VA_ARGS__);                                          \
+    }                                                                          \
+  } while (false)
+
+#if MPM_LOG_LEVEL <= MPM_LEVEL_FATAL
+#define MPM_FATAL(...) MPM_LOG(critical, __VA_ARGS__)
+#else
+#define MPM_FATAL(...)
+#endif
+#if MPM_LOG_LEVEL <= MPM_LEVEL_ERROR
+#define MPM_ERROR(...) MPM_LOG(error, __VA_ARGS__)
+#else
+#define MPM_ERROR(...)
+#endif
+#if MPM_LOG_LEVEL <= MPM_LEVEL_WARN
+#define MPM_WARN(...) MPM_LOG(warn, __VA_ARGS__)
+#else
+#define MPM_WARN(...)
+#endif
+#if MPM_LOG_LEVEL <= MPM_LEVEL_INFO
+#define MPM_INFO(...) MPM_LOG(info, __VA_ARGS__)
+#else
+#define MPM_INFO(...)
+#endif
+#if MPM_LOG_LEVEL <= MPM_LEVEL_TRACE
+#define MPM_TRACE(...) MPM_LOG(trace, __VA_ARGS__)
+#else
+#define MPM_TRACE(...)
+#endif
 
 #define MPM_ASSERT(condition, ...)                                             \
   do {                                                                         \
@@ -40,6 +120,28 @@ private:
     }                                                                          \
   } while (false)
 
+// for per-particle and per-node checks, gone below debug level
+#if MPM_LOG_LEVEL <= MPM_LEVEL_DEBUG
+#define MPM_DEBUG_ASSERT(condition, ...) MPM_ASSERT(condition, __VA_ARGS__)
+#else
+#define MPM_DEBUG_ASSERT(condition, ...)
+#endif
+
+// warning from a hot loop: details of the first event per flush, a count
+// of all of them from aggregates.flush()
+#if MPM_LOG_LEVEL <= MPM_LEVEL_WARN
+#define MPM_WARN_AGGREGATED(aggregates, summary, ...)                          \
+  do {                                                                         \
+    static const int mpm_site = ::mpm::MPMLogAggregates::register_site(        \
+        ::spdlog::level::warn, summary);                                       \
+    if ((aggregates).hit(mpm_site)) {                                          \
+      MPM_WARN(__VA_ARGS__);                                                   \
+    }                                                                          \
+  } while (false)
+#else
+#define MPM_WARN_AGGREGATED(aggregates, summary, ...)
+#endif
+
 #else
 
 #define MPM_FATAL(...)
@@ -49,5 +151,7 @@ private:
 #define MPM_TRACE(...)
 
 #define MPM_ASSERT(condition, ...)
+#define MPM_DEBUG_ASSERT(condition, ...)
+#define MPM_WARN_AGGREGATED(aggregates, summary, ...)
 
-#endif
\ No newline at end of file
+#endif
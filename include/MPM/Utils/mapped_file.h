@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace mpm {
+
+// Read-only view of a whole file.
+// Uses mmap where the platform supports it and falls back to a single bulk
+// read into an owned buffer otherwise.
+class MPM_MappedFile {
+public:
+  MPM_MappedFile() = default;
+  explicit MPM_MappedFile(const std::string &path);
+  virtual ~MPM_MappedFile();
+
+  MPM_MappedFile(const MPM_MappedFile &) = delete;
+  MPM_MappedFile &operator=(const MPM_MappedFile &) = delete;
+
+  bool open(const std::string &path);
+  void close();
+
+  bool is_open() const { return opened; }
+  const char *data() const { return ptr; }
+  size_t size() const { return length; }
+
+private:
+  const char *ptr = nullptr;
+  size_t length = 0;
+  bool opened = false;
+  bool mapped = false;
+  std::vector<char> fallback;
+};
+
+} // namespace mpm
@@ -0,0 +1,164 @@
+#pragma once
+
+#include "MPM/Utils/profiler.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/task_arena.h>
+#include <tbb/task_group.h>
+
+namespace mpm {
+
+struct NumaOptions {
+  bool enabled = false;
+  // memory domains, 0 for one per NUMA node. any other count splits the
+  // work the same way without pinning threads, which only helps to test
+  // the layout on a single-socket machine
+  int domains = 0;
+  // substeps between two re-placements of the particles, which drift off
+  // the grid part of their domain as they move; 0 places them only when
+  // they are added, resampled or restored
+  int place_interval = 100;
+};
+
+// pages of an array by the node they were found on
+struct NumaLocality {
+  size_t pages = 0;
+  // on the node of the domain whose partition holds them
+  size_t local = 0;
+  // not placed yet or not reported by the kernel
+  size_t unknown = 0;
+  std::vector<size_t> node_pages;
+
+  double local_fraction() const {
+    return pages ? double(local) / double(pages) : 0.0;
+  }
+};
+
+// Work partitioning over NUMA nodes. Each domain gets a TBB arena pinned
+// to the cores of its node (through tbbbind). Arrays are split into
+// contiguous parts; part q belongs to domain q % size(), so a partition
+// may hand every domain several ranges. Storage first touched through
+// parallel_for() lands on the node of its part, and the stages running
+// their loops with the same bounds keep every thread on local memory.
+// With a single domain (the default) all loops are plain tbb calls.
+class MPM_NumaDomains {
+public:
+  explicit MPM_NumaDomains(const NumaOptions &options = {});
+  virtual ~MPM_NumaDomains() = default;
+
+  bool active() const { return arenas.size() > 1; }
+  int size() const {
+    return arenas.empty() ? 1 : static_cast<int>(arenas.size());
+  }
+  // NUMA node of a domain, -1 when it is not pinned
+  int node(int domain) const {
+    return domain < int(nodes.size()) ? nodes[domain] : -1;
+  }
+
+  // bounds of [begin, end) split into one part per domain, sized by the
+  // domains' threads; appended to `bounds` when it already ends at begin
+  void split(int begin, int end, std::vector<int> &bounds) const;
+  std::vector<int> split(int begin, int end) const {
+    std::vector<int> bounds;
+    split(begin, end, bounds);
+    return bounds;
+  }
+
+  // body(blocked_range) over `range`; the pieces of every part run in the
+  // arena of its domain
+  template <class Body>
+  void parallel_for(const std::vector<int> &bounds,
+                    const tbb::blocked_range<int> &range,
+                    const Body &body) const {
+    if (!active()) {
+      tbb::parallel_for(range, body);
+      return;
+    }
+    for_parts(bounds, range, [&](const tbb::blocked_range<int> &part, int) {
+      tbb::parallel_for(part, body);
+    });
+  }
+
+  template <class Value, class Body, class Join>
+  Value parallel_reduce(const std::vector<int> &bounds,
+                        const tbb::blocked_range<int> &range,
+                        const Value &identity, const Body &body,
+                        const Join &join) const {
+    if (!active()) {
+      return tbb::parallel_reduce(range, identity, body, join);
+    }
+    std::vector<Value> values(bounds.size(), identity);
+    for_parts(bounds, range,
+              [&](const tbb::blocked_range<int> &part, int index) {
+                values[index] =
+                    tbb::parallel_reduce(part, identity, body, join);
+              });
+    Value value = identity;
+    for (auto &part : values) {
+      value = join(value, part);
+    }
+    return value;
+  }
+
+  // drop-in for traced_parallel_for(begin, end, func)
+  template <class Func>
+  void for_each(const std::vector<int> &bounds, int begin, int end,
+                const Func &func) const {
+    if (!active()) {
+      traced_parallel_for(begin, end, func);
+      return;
+    }
+    // the stage is per thread and the arenas run on other threads
+    int stage = MPM_Profiler::current_stage();
+    parallel_for(bounds, tbb::blocked_range<int>(begin, end),
+                 [&](const tbb::blocked_range<int> &r) {
+                   MPMTaskProfiler task(stage);
+                   for (int i = r.begin(); i != r.end(); ++i) {
+                     func(i);
+                   }
+                 });
+  }
+
+  // where the pages of the partitioned array at `data` (elements of
+  // `stride` bytes, bounds in elements) live. Linux only
+  NumaLocality locality(const void *data, size_t stride,
+                        const std::vector<int> &bounds) const;
+
+private:
+  std::vector<int> nodes;
+  std::vector<int> concurrency;
+  std::vector<std::unique_ptr<tbb::task_arena>> arenas;
+
+  // part(range, index of the part) in the arena of every part overlapping
+  // range, all domains at once
+  template <class Part>
+  void for_parts(const std::vector<int> &bounds,
+                 const tbb::blocked_range<int> &range,
+                 const Part &part) const {
+    std::vector<tbb::task_group> groups(arenas.size());
+    for (size_t q = 0; q + 1 < bounds.size(); q++) {
+      int begin = std::max(bounds[q], range.begin());
+      int end = std::min(bounds[q + 1], range.end());
+      if (begin >= end) {
+        continue;
+      }
+      size_t d = q % arenas.size();
+      tbb::blocked_range<int> piece(begin, end, range.grainsize());
+      arenas[d]->execute([&, d, q, piece] {
+        groups[d].run([&, q, piece] { part(piece, int(q)); });
+      });
+    }
+    for (size_t d = 0; d < arenas.size(); d++) {
+      arenas[d]->execute([&, d] { groups[d].wait(); });
+    }
+  }
+};
+
+} // namespace mpm
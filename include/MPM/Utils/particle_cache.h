@@ -0,0 +1,161 @@
+#pragma once
+
+#include "MPM/Utils/mapped_file.h"
+#include "MPM/base.h"
+#include "MPM/particle_export.h"
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+namespace mpm {
+
+// Streaming particle cache (.mpc), one file for a whole shot.
+//
+//   CacheFileHeader
+//   frame records, appended as the simulation runs:
+//     CacheFrameHeader
+//     CacheChannelDesc[channel_count]
+//     CacheChunkEntry[channel_count * chunk_count]
+//     compressed chunk payloads
+//   CacheIndexEntry[frame_count]
+//   CacheFooter
+//
+// Positions are quantised to integer multiples of position_quantum. On
+// keyframes every chunk stores its residuals against the chunk's own
+// origin, in between only the integer deltas from the previous frame are
+// stored. Every channel is split into chunks of CACHE_CHUNK_SIZE particles,
+// byte-shuffled and compressed in parallel, so single channels of single
+// frames can be decoded without touching the rest of the file.
+// A file without footer (crashed run) is recovered by scanning the records.
+constexpr uint32_t CACHE_VERSION = 1;
+constexpr size_t CACHE_CHUNK_SIZE = 1 << 14;
+
+struct CacheFileHeader {
+  char magic[8] = {'M', 'P', 'M', 'C', 'A', 'C', 'H', 'E'};
+  uint32_t version = CACHE_VERSION;
+  uint32_t chunk_size = CACHE_CHUNK_SIZE;
+};
+
+struct CacheFrameHeader {
+  enum Flags : uint32_t { KEYFRAME = 1 };
+
+  char magic[4] = {'M', 'P', 'C', 'F'};
+  uint32_t flags = 0;
+  uint64_t record_size = 0; // bytes including this header
+  int32_t frame = 0;
+  uint32_t channel_count = 0;
+  uint64_t particle_count = 0;
+  uint64_t chunk_count = 0;
+  double time = 0;
+  double position_quantum = 0;
+};
+
+struct CacheChannelDesc {
+  enum Encoding : uint32_t {
+    SHUFFLED = 0,         // raw words, byte-shuffled
+    QUANTIZED_ORIGIN = 1, // int32 origin per chunk + residuals
+    QUANTIZED_DELTA = 2   // zigzag deltas from the previous frame
+  };
+
+  int32_t channel = 0;
+  int32_t type = 0;
+  int32_t components = 0;
+  uint32_t encoding = SHUFFLED;
+};
+
+struct CacheChunkEntry {
+  uint64_t offset = 0; // from the start of the frame record
+  uint32_t stored_size = 0;
+  uint32_t raw_size = 0; // stored uncompressed when equal
+};
+
+struct CacheIndexEntry {
+  int32_t frame = 0;
+  uint32_t flags = 0;
+  uint64_t offset = 0;
+  uint64_t size = 0;
+};
+
+struct CacheFooter {
+  uint64_t index_offset = 0;
+  uint64_t frame_count = 0;
+  char magic[8] = {'M', 'P', 'C', 'I', 'N', 'D', 'E', 'X'};
+};
+
+struct CacheOptions {
+  // absolute position tolerance is half of this
+  T position_quantum = 1e-4;
+  // delta chains are at most this long
+  int keyframe_interval = 16;
+  // zlib level, 0 stores chunks uncompressed
+  int compression_level = 1;
+};
+
+class MPM_CacheWriter {
+public:
+  MPM_CacheWriter(const std::string &path,
+                  const CacheOptions &options = CacheOptions());
+  virtual ~MPM_CacheWriter();
+
+  MPM_CacheWriter(const MPM_CacheWriter &) = delete;
+  MPM_CacheWriter &operator=(const MPM_CacheWriter &) = delete;
+
+  bool is_open() const { return bool(output); }
+  // frames have to arrive in order, snapshot.frame is stored as frame number
+  bool write_frame(const ParticleSnapshot &snapshot);
+  // appends the frame index, called by the destructor as well
+  bool close();
+
+private:
+  std::string path;
+  CacheOptions options;
+  std::ofstream output;
+  uint64_t write_offset = 0;
+  std::vector<CacheIndexEntry> index;
+
+  // quantised positions of the last frame, the base for deltas
+  std::vector<int32_t> last_quantized;
+  int frames_since_keyframe = 0;
+};
+
+class MPM_CacheReader {
+public:
+  MPM_CacheReader() = default;
+  explicit MPM_CacheReader(const std::string &path);
+  virtual ~MPM_CacheReader() = default;
+
+  bool open(const std::string &path);
+  bool is_open() const { return file.is_open() && valid; }
+
+  size_t frame_count() const { return index.size(); }
+  // frame numbers in file order
+  std::vector<int> frames() const;
+
+  // decode one frame, only the listed channels (all when empty). position
+  // is always decoded as channel 0. a damaged record fails the frame.
+  bool read_frame(int frame, ParticleSnapshot &snapshot,
+                  const std::vector<ExportChannel> &channels = {});
+
+private:
+  MPM_MappedFile file;
+  bool valid = false;
+  std::vector<CacheIndexEntry> index;
+
+  // the last decoded quantised positions, sequential reads skip
+  // replaying the delta chain
+  int decoded_entry = -1;
+  std::vector<int32_t> decoded_quantized;
+
+  int find_entry(int frame) const;
+  // every offset and size of the record lies inside it and matches the
+  // particle count
+  bool check_record(int entry) const;
+  bool decode_positions(int entry);
+};
+
+// writes every frame of the cache as <output_dir>/<frame>.bgeo
+bool convert_cache_to_bgeo(const std::string &cache_path,
+                           const std::string &output_dir);
+
+} // namespace mpm
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace mpm {
+
+enum PerfCounter {
+  PERF_CYCLES = 0,
+  PERF_INSTRUCTIONS,
+  PERF_LLC_MISSES,
+  PERF_REMOTE_HITM,
+  PERF_COUNTER_COUNT
+};
+
+// Per-thread hardware counters through Linux perf_event_open, user space
+// only so the default perf_event_paranoid level is enough.
+// Every thread opens its own counter group on the first read(). Events the
+// CPU or kernel does not offer are left out and read as 0; without any
+// counters (other platforms, containers, paranoid 3) read() returns false
+// and the callers keep timing only.
+// Remote HITM has no generic perf event. Set MPM_PERF_HITM to the raw event
+// code of the CPU, e.g. 0x04d3 (MEM_LOAD_L3_MISS_RETIRED.REMOTE_HITM on
+// Skylake-SP), to count it.
+class MPM_PerfCounters {
+public:
+  // probes the calling thread, false when no counter can be opened
+  static bool is_supported();
+  // whether the calling thread's group contains the event
+  static bool has_counter(PerfCounter counter);
+  // current values of the calling thread, scaled when multiplexed
+  static bool read(uint64_t values[PERF_COUNTER_COUNT]);
+
+  static const char *name(PerfCounter counter);
+  // why counters are unavailable, empty when they work
+  static std::string error();
+};
+
+} // namespace mpm
@@ -1,7 +1,16 @@
 #pragma once
 
+#include "MPM/Utils/perf_counters.h"
+
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <cstdint>
 #include <string>
+#include <vector>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
 
 namespace mpm {
 class MPMScopedProfiler {
@@ -13,6 +22,153 @@ private:
   std::string tag;
   std::chrono::high_resolution_clock::time_point start;
 };
+
+// Stage profiler for code that runs every step.
+// Every thread owns its counters (count, total, min, max and a log-linear
+// duration histogram per stage) and updates them with relaxed atomics, so
+// recording a scope never takes a lock. report() merges the threads and
+// logs the difference to the previous report, nested stages are listed
+// under the stage they were first entered from.
+// With begin_trace() the scopes, plus the TBB task chunks spawned from them
+// (see traced_parallel_for), are also streamed as Chrome trace_event JSON
+// that chrome://tracing or Perfetto can open.
+// Profiling is off by default, set_enabled(true) turns the stage scopes
+// on; a disabled scope is one relaxed load.
+// enable_counters() adds hardware counters (MPM/Utils/perf_counters.h):
+// every stage and task boundary reads the thread's counters and charges the
+// difference to the innermost open stage, so each thread's events are split
+// over the stages without double counting.
+class MPM_Profiler {
+public:
+  static constexpr int MAX_STAGES = 64;
+
+  struct StageStats {
+    std::string name;
+    int parent = -1; // index into the collected stages, -1 for roots
+    uint64_t count = 0;
+    uint64_t total_ns = 0;
+    uint64_t min_ns = 0;
+    uint64_t p99_ns = 0;
+    uint64_t max_ns = 0;
+    // hardware events including nested stages, summed over the threads
+    // and per profiler thread index; zero without enable_counters()
+    std::array<uint64_t, PERF_COUNTER_COUNT> counters = {};
+    std::vector<std::array<uint64_t, PERF_COUNTER_COUNT>> thread_counters;
+  };
+
+  // one id per distinct name, call sites cache it in a static
+  static int register_stage(const char *name);
+
+  static void set_enabled(bool enabled);
+  static bool is_enabled() {
+    return s_enabled.load(std::memory_order_relaxed);
+  }
+  static bool is_tracing() {
+    return s_tracing.load(std::memory_order_relaxed);
+  }
+  // falls back to timing only and returns false when the calling thread
+  // can not open any hardware counter
+  static bool enable_counters(bool enabled);
+  static bool is_counting() {
+    return s_counting.load(std::memory_order_relaxed);
+  }
+  // task chunks are only worth recording for the trace or the counters
+  static bool is_task_profiling() {
+    return is_enabled() && (is_tracing() || is_counting());
+  }
+
+  // merge the threads, statistics since the previous collect() or report().
+  // indexed by stage id, stages without calls have count 0
+  static std::vector<StageStats> collect();
+  // log collect() as a table and flush pending trace events
+  static void report(const std::string &title);
+
+  static bool begin_trace(const std::string &path);
+  static void end_trace();
+
+  // nanoseconds since the profiler's epoch
+  static uint64_t now();
+  // innermost open stage of the calling thread, -1 if none. never sets up
+  // the thread's counters, so it is free while profiling is off
+  static int current_stage();
+
+  static void enter_stage(int stage);
+  static void leave_stage(int stage, uint64_t start, uint64_t end);
+  static void enter_task(int stage);
+  static void leave_task(int stage, uint64_t start, uint64_t end);
+
+private:
+  static std::atomic<bool> s_enabled;
+  static std::atomic<bool> s_tracing;
+  static std::atomic<bool> s_counting;
+};
+
+class MPMStageProfiler {
+public:
+  explicit MPMStageProfiler(int stage)
+      : stage(MPM_Profiler::is_enabled() ? stage : -1) {
+    if (this->stage >= 0) {
+      MPM_Profiler::enter_stage(stage);
+      start = MPM_Profiler::now();
+    }
+  }
+  ~MPMStageProfiler() {
+    if (stage >= 0) {
+      MPM_Profiler::leave_stage(stage, start, MPM_Profiler::now());
+    }
+  }
+
+  MPMStageProfiler(const MPMStageProfiler &) = delete;
+  MPMStageProfiler &operator=(const MPMStageProfiler &) = delete;
+
+private:
+  int stage;
+  uint64_t start = 0;
+};
+
+// attributes one task chunk to the stage that spawned it, for the trace
+// spans and the hardware counters of the executing thread
+class MPMTaskProfiler {
+public:
+  explicit MPMTaskProfiler(int stage)
+      : stage(MPM_Profiler::is_task_profiling() ? stage : -1) {
+    if (this->stage >= 0) {
+      MPM_Profiler::enter_task(stage);
+      start = MPM_Profiler::now();
+    }
+  }
+  ~MPMTaskProfiler() {
+    if (stage >= 0) {
+      MPM_Profiler::leave_task(stage, start, MPM_Profiler::now());
+    }
+  }
+
+  MPMTaskProfiler(const MPMTaskProfiler &) = delete;
+  MPMTaskProfiler &operator=(const MPMTaskProfiler &) = delete;
+
+private:
+  int stage;
+  uint64_t start = 0;
+};
+
+// drop-in for tbb::parallel_for(begin, end, func), every task chunk is
+// attributed to the enclosing stage. Without a trace or counters it is the
+// plain tbb call.
+template <class Func>
+void traced_parallel_for(int begin, int end, const Func &func) {
+  if (!MPM_Profiler::is_task_profiling()) {
+    tbb::parallel_for(begin, end, func);
+    return;
+  }
+  int stage = MPM_Profiler::current_stage();
+  tbb::parallel_for(tbb::blocked_range<int>(begin, end),
+                    [&](const tbb::blocked_range<int> &r) {
+                      MPMTaskProfiler task(stage);
+                      for (int i = r.begin(); i != r.end(); ++i) {
+                        func(i);
+                      }
+                    });
+}
 } // namespace mpm
 
 #ifndef MPM_NO_DEBUG
@@ -27,4 +183,22 @@ private:
 #define MPM_SCOPED_PROFILE(tag)
 #define MPM_PROFILE_FUNCTION()
 
-#endif
\ No newline at end of file
+#endif
+
+// stage scopes stay in release builds and cost a branch while profiling
+// is off, MPM_NO_PROFILE strips them completely
+#ifndef MPM_NO_PROFILE
+
+#define MPM_PROFILE_CONCAT_IMPL(a, b) a##b
+#define MPM_PROFILE_CONCAT(a, b) MPM_PROFILE_CONCAT_IMPL(a, b)
+#define MPM_PROFILE_STAGE(name)                                                \
+  static const int MPM_PROFILE_CONCAT(stage_id_, __LINE__) =                   \
+      ::mpm::MPM_Profiler::register_stage(name);                               \
+  ::mpm::MPMStageProfiler MPM_PROFILE_CONCAT(stage_timer_, __LINE__)(          \
+      MPM_PROFILE_CONCAT(stage_id_, __LINE__))
+
+#else
+
+#define MPM_PROFILE_STAGE(name)
+
+#endif
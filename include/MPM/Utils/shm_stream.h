@@ -0,0 +1,122 @@
+#pragma once
+
+#include "MPM/particle_export.h"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace mpm {
+
+// Shared-memory layout of the live particle stream, one POSIX segment
+// (shm_open name) holding a header and a ring of frame slots:
+//
+//   ShmStreamHeader | slot 0 | slot 1 | ... | slot slot_count - 1
+//   slot = ShmSlotHeader + channel data at the offsets it lists
+//
+// Every slot is guarded by a seqlock. The publisher makes the sequence odd,
+// writes the slot, makes it even again and only then advances `published`.
+// A reader takes `published`, reads the slot sequence, uses the data in
+// place and accepts it when the sequence is still the same even value. The
+// publisher never waits for readers; a reader too slow for the ring just
+// fails the check and moves on to the newest frame.
+constexpr uint32_t SHM_STREAM_VERSION = 1;
+constexpr int SHM_MAX_CHANNELS = 16;
+
+struct ShmChannelDesc {
+  char name[24];
+  int32_t type; // ExportType
+  int32_t components;
+  uint64_t offset; // from the start of the slot
+  uint64_t bytes;
+};
+
+struct ShmSlotHeader {
+  std::atomic<uint64_t> sequence;
+  int32_t frame;
+  int32_t particle_count;
+  double time;
+  int32_t channel_count;
+  ShmChannelDesc channels[SHM_MAX_CHANNELS];
+};
+
+struct ShmStreamHeader {
+  char magic[8]; // "MPMLIVE"
+  uint32_t version;
+  uint32_t slot_count;
+  uint64_t slot_bytes;
+  // frames published so far, the newest is in slot (published - 1) %
+  // slot_count
+  std::atomic<uint64_t> published;
+  // cleared when the publisher retires the segment, e.g. to grow it.
+  // readers then open the name again
+  std::atomic<uint32_t> alive;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "the seqlock needs lock free 64bit atomics in shared memory");
+
+// Publishing side, owns the segment and unlinks it on destruction. The
+// slots grow (by recreating the segment) when a frame does not fit.
+class MPM_ShmPublisher {
+public:
+  MPM_ShmPublisher(const std::string &name, uint32_t slot_count = 3,
+                   size_t initial_slot_bytes = 0);
+  virtual ~MPM_ShmPublisher();
+
+  MPM_ShmPublisher(const MPM_ShmPublisher &) = delete;
+  MPM_ShmPublisher &operator=(const MPM_ShmPublisher &) = delete;
+
+  // copy the snapshot into the next slot, never blocks on readers
+  bool publish(const ParticleSnapshot &snapshot);
+  bool is_open() const { return header != nullptr; }
+
+private:
+  std::string name;
+  uint32_t slot_count;
+  size_t slot_bytes = 0;
+  ShmStreamHeader *header = nullptr;
+  size_t mapped_bytes = 0;
+
+  bool create(size_t bytes_per_slot);
+  void retire();
+  char *slot(uint64_t index) const;
+};
+
+// one frame read in place from the segment
+struct ShmFrameView {
+  const ShmSlotHeader *slot = nullptr;
+  uint64_t sequence = 0;
+
+  int size() const { return slot->particle_count; }
+  const void *channel_data(int c) const {
+    return reinterpret_cast<const char *>(slot) + slot->channels[c].offset;
+  }
+};
+
+// Reading side for viewers and monitors, maps the segment read-only.
+class MPM_ShmSubscriber {
+public:
+  explicit MPM_ShmSubscriber(const std::string &name);
+  virtual ~MPM_ShmSubscriber();
+
+  MPM_ShmSubscriber(const MPM_ShmSubscriber &) = delete;
+  MPM_ShmSubscriber &operator=(const MPM_ShmSubscriber &) = delete;
+
+  // the newest complete frame, false when there is none yet or the
+  // publisher is gone. reopens the segment after it was retired
+  bool latest(ShmFrameView &view);
+  // whether the data read through the view since latest() is consistent,
+  // i.e. the publisher did not start overwriting its slot meanwhile
+  bool validate(const ShmFrameView &view) const;
+
+private:
+  std::string name;
+  const ShmStreamHeader *header = nullptr;
+  size_t mapped_bytes = 0;
+
+  bool open();
+  void close();
+};
+
+} // namespace mpm
@@ -25,6 +25,9 @@ struct Particle {
   // MT Fe;
   // MT Fp;
   MT Bp; // for APIC transfer
+  T Jp;  // plastic volume ratio (snow hardening)
+  // accumulated plastic shear strain (von Mises hardening)
+  T gamma_p;
 
   // T cp;  // fluids ratio
   // MT Dp; // inertia tensor
@@ -54,6 +57,24 @@ struct SimInfo {
 
   T max_velocity = 0.0f;
   unsigned int curr_step = 0;
+  T curr_time = 0.0f;
+};
+
+// read-only strided view, e.g. one channel of the AoS particle array
+template <class Elem> struct StridedSpan {
+  const char *data = nullptr;
+  size_t count = 0;
+  size_t stride = sizeof(Elem);
+
+  StridedSpan() = default;
+  StridedSpan(const Elem *first, size_t count, size_t stride = sizeof(Elem))
+      : data(reinterpret_cast<const char *>(first)), count(count),
+        stride(stride) {}
+
+  size_t size() const { return count; }
+  const Elem &operator[](size_t i) const {
+    return *reinterpret_cast<const Elem *>(data + i * stride);
+  }
 };
 
 // MT neohookean_piola(T E, T nu, const MT &F);
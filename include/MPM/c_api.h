@@ -0,0 +1,91 @@
+#pragma once
+
+/* C interface of libmpm for host applications and in-process renderers.
+ * The simulator is an opaque handle. Objects are added from packed xyz
+ * buffers and particle state is read back as strided views straight over
+ * the simulator storage, nothing is copied. Functions returning int give
+ * 0 on success and a negative value on invalid arguments. */
+
+#include <stddef.h>
+
+#if defined(_WIN32) && defined(MPM_SHARED)
+#ifdef MPM_BUILDING_LIBRARY
+#define MPM_API __declspec(dllexport)
+#else
+#define MPM_API __declspec(dllimport)
+#endif
+#else
+#define MPM_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct mpm_simulator mpm_simulator;
+
+typedef enum {
+  MPM_MODEL_NEOHOOKEAN = 0,
+  MPM_MODEL_VOLUME_PENALTY,
+  MPM_MODEL_NEOHOOKEAN_FLUID,
+  MPM_MODEL_CDMPM_FLUID
+} mpm_model;
+
+typedef enum {
+  MPM_PLASTICITY_NONE = 0,
+  MPM_PLASTICITY_SNOW,
+  MPM_PLASTICITY_VON_MISES
+} mpm_plasticity;
+
+typedef struct {
+  double youngs_modulus;
+  double poisson_ratio;
+  double particle_mass;
+  double density;
+  mpm_model model;
+  mpm_plasticity plasticity;
+  /* von Mises only */
+  double yield_stress;
+} mpm_material_desc;
+
+typedef enum {
+  MPM_CHANNEL_POSITION = 0, /* 3 doubles */
+  MPM_CHANNEL_VELOCITY,     /* 3 doubles */
+  MPM_CHANNEL_F,            /* 9 doubles, column major */
+  MPM_CHANNEL_J,            /* 1 double */
+  MPM_CHANNEL_PLASTIC_JP    /* 1 double */
+} mpm_channel;
+
+/* particle i starts at (const char *)data + i * stride */
+typedef struct {
+  const double *data;
+  size_t count;
+  size_t stride;
+  int components;
+} mpm_span;
+
+/* grid spacing h over the box [0, world_size], NULL on invalid input */
+MPM_API mpm_simulator *mpm_create(const double gravity[3],
+                                  const double world_size[3], double h);
+MPM_API void mpm_destroy(mpm_simulator *sim);
+
+/* count particles from packed xyz positions, velocities may be NULL */
+MPM_API int mpm_add_object(mpm_simulator *sim, const double *positions,
+                           const double *velocities, size_t count,
+                           const mpm_material_desc *material);
+
+/* advance by `time` seconds in CFL limited substeps, returns the number of
+ * substeps taken */
+MPM_API int mpm_advance(mpm_simulator *sim, double time);
+
+MPM_API size_t mpm_particle_count(const mpm_simulator *sim);
+MPM_API double mpm_time(const mpm_simulator *sim);
+
+/* valid until the next mpm_add_object or mpm_destroy, the values change in
+ * place with every mpm_advance */
+MPM_API mpm_span mpm_get_channel(const mpm_simulator *sim,
+                                 mpm_channel channel);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "MPM/base.h"
+
+#include <cstdint>
+#include <future>
+#include <string>
+
+namespace mpm {
+
+class MPM_Simulator;
+
+// Restart file layout (native endian, uncompressed so it can be mapped):
+//   CheckpointHeader
+//   CheckpointMaterial[material_count]
+//   CheckpointGroup[group_count]
+//   one CHECKPOINT_ALIGN aligned SoA section per particle channel,
+//   located by the offsets in the header
+// Bump CHECKPOINT_VERSION whenever the layout changes.
+constexpr uint32_t CHECKPOINT_VERSION = 4;
+constexpr size_t CHECKPOINT_ALIGN = 64;
+
+// resample's mass-scaled copies keep the index of their base material
+// and their level; a base is its own base at level 0
+struct CheckpointMaterial {
+  T E, nu, mass, density;
+  uint32_t base;
+  int32_t level;
+};
+
+// particle range of one model group, the models themselves are matched
+// to the caller's groups by index
+struct CheckpointGroup {
+  uint64_t begin, end;
+};
+
+struct CheckpointHeader {
+  char magic[8] = {'M', 'P', 'M', 'C', 'K', 'P', 'T', '\0'};
+  uint32_t version = CHECKPOINT_VERSION;
+  uint32_t header_size = sizeof(CheckpointHeader);
+  uint32_t dim = DIM;
+  uint32_t scalar_size = sizeof(T);
+
+  // SimInfo
+  uint64_t particle_size = 0;
+  int32_t grid_w = 0, grid_h = 0, grid_l = 0;
+  int32_t transfer_scheme = 0;
+  T alpha = 0;
+  T gravity[DIM] = {};
+  T world_area[DIM] = {};
+  T h = 0;
+  T max_velocity = 0;
+  T curr_time = 0;
+  uint64_t curr_step = 0;
+
+  uint32_t material_count = 0;
+  uint32_t group_count = 0;
+
+  // byte offsets from the start of the file
+  uint64_t pos_offset = 0;
+  uint64_t vel_offset = 0;
+  uint64_t F_offset = 0;
+  uint64_t J_offset = 0;
+  uint64_t Bp_offset = 0;
+  uint64_t Jp_offset = 0;
+  uint64_t gamma_p_offset = 0;
+  uint64_t material_id_offset = 0;
+  uint64_t file_size = 0;
+};
+
+// Writes `<output_dir>/checkpoint_<frame>.mpmckpt` every `interval` frames.
+// The state is serialized on the calling thread (a parallel copy) and the
+// disk write runs in the background; only one checkpoint is in flight, a
+// new one waits for the previous write to finish.
+class MPM_Checkpointer {
+public:
+  MPM_Checkpointer(const std::string &output_dir, int interval);
+  virtual ~MPM_Checkpointer();
+
+  bool on_frame(const MPM_Simulator &sim, int frame);
+  // block until the pending write is on disk
+  bool wait();
+
+private:
+  std::string output_dir;
+  int interval;
+  std::vector<char> image;
+  std::future<bool> pending;
+};
+
+} // namespace mpm
@@ -15,6 +15,7 @@ public:
   virtual ~MPM_Collision() = default;
 
   virtual void solve_collision(const VT &xi, VT &vi);
+  T signed_distance(const VT &x) const;
 
 private:
   std::shared_ptr<MPM_LevelSet> levelset;
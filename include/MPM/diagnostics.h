@@ -0,0 +1,42 @@
+#pragma once
+
+#include "MPM/base.h"
+
+#include <fstream>
+#include <string>
+
+namespace mpm {
+
+// Whole-simulation totals of one substep. They are reduced inside the
+// passes the step already runs (P2G grid pass, update_F, particle
+// collision), so enabling them adds no sweep over particles or nodes.
+// energies and momentum are taken at the end of the step, grid mass is
+// the mass transferred by P2G.
+struct SimDiagnostics {
+  unsigned int step = 0;
+  T time = 0;
+  T dt = 0;
+  T kinetic_energy = 0;
+  T elastic_energy = 0; // sum of volume * psi(F) over the particles
+  VT momentum = VT::Zero();
+  T grid_mass = 0;
+  T min_J = 1;
+  T max_J = 1;
+};
+
+// Per-step time series as CSV, one row per substep. Rows go through the
+// stream buffer and reach the disk on flush() or when it fills up.
+class MPM_DiagnosticsWriter {
+public:
+  explicit MPM_DiagnosticsWriter(const std::string &path);
+  virtual ~MPM_DiagnosticsWriter();
+
+  bool is_open() const { return out.is_open(); }
+  void write(const SimDiagnostics &diagnostics);
+  void flush();
+
+private:
+  std::ofstream out;
+};
+
+} // namespace mpm
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "MPM/base.h"
+#include "MPM/particle_export.h"
+#include "MPM/step_controller.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace mpm {
+
+class MPM_Simulator;
+
+// one scene of an ensemble. setup() builds it into a fresh simulator;
+// whatever it hands over by pointer (materials) has to live as long as the
+// run, e.g. captured by the lambda as a shared_ptr
+struct EnsembleRun {
+  std::string name; // output goes to <output_dir>/<name>/
+  std::function<void(MPM_Simulator &)> setup;
+  int frames = 60;
+  T frame_rate = 30;
+  StepControllerOptions step_options;
+  ExportDesc export_desc;
+};
+
+struct EnsembleOptions {
+  std::string output_dir;
+  // worker threads of the shared arena, 0 for all cores
+  int threads = 0;
+  // scenes smaller than this run on a single thread and are packed side by
+  // side; bigger ones also spread their own loops over the arena
+  int serial_particles = 20000;
+  bool write_frames = true;
+  bool write_diagnostics = true;
+};
+
+struct EnsembleResult {
+  std::string name;
+  int particles = 0;
+  int frames = 0;
+  int substeps = 0;
+  int rejected_steps = 0;
+  double seconds = 0;
+  bool ok = false;
+};
+
+// Steps many independent simulators concurrently in one TBB arena instead
+// of one process per scene. Scenes are set up in parallel and started
+// largest first (particles * frames) so the long ones do not end up alone
+// at the tail. Each scene runs as one task of the arena: large scenes keep
+// their nested parallel loops and share the workers through work stealing,
+// small ones run in a single-threaded arena where the fork-join overhead
+// of their loops would outweigh the work. A run only steals tasks of its
+// own loops while it waits, so no thread ever holds two scenes half done.
+// Every run writes its frames and diagnostics under its own directory and
+// the results are summarized in <output_dir>/ensemble.csv.
+class MPM_Ensemble {
+public:
+  explicit MPM_Ensemble(const EnsembleOptions &options = {});
+  virtual ~MPM_Ensemble() = default;
+
+  void add(EnsembleRun run) { runs.push_back(std::move(run)); }
+  size_t size() const { return runs.size(); }
+
+  // results in the order the runs were added
+  std::vector<EnsembleResult> run();
+
+private:
+  EnsembleOptions options;
+  std::vector<EnsembleRun> runs;
+};
+
+} // namespace mpm
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "MPM/base.h"
+#include "MPM/particle_export.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace mpm {
+
+enum class GridChannel {
+  MASS,
+  DENSITY, // mass / h^3
+  VELOCITY,
+  FORCE
+};
+
+// which grid quantities to export. FLOAT16 halves the file, INT32 is not
+// meaningful for grid data and falls back to FLOAT32.
+struct GridExportDesc {
+  // nodes per tile side, tiles without mass are not written
+  int block_size = 8;
+  ExportType type = ExportType::FLOAT32;
+  std::vector<GridChannel> channels;
+
+  GridExportDesc &add(GridChannel channel) {
+    channels.push_back(channel);
+    return *this;
+  }
+};
+
+struct GridBuffer {
+  GridChannel channel;
+  ExportType type;
+  int components = 1;
+  std::string name;
+  // block_size^3 values per tile, x major like the simulator grid
+  std::vector<char> data;
+
+  size_t element_size() const {
+    return (type == ExportType::FLOAT16 ? 2 : 4) * components;
+  }
+  template <class Elem> Elem *as() {
+    return reinterpret_cast<Elem *>(data.data());
+  }
+  template <class Elem> const Elem *as() const {
+    return reinterpret_cast<const Elem *>(data.data());
+  }
+};
+
+// the simulator grid of the last substep cut into cubic tiles, only tiles
+// holding a node with mass are kept. node i sits at i * h.
+struct GridSnapshot {
+  VINT dims = VINT::Zero(); // nodes per axis
+  T h = 0;
+  T time = 0;
+  int frame = 0;
+  int block_size = 8;
+  // tile coordinates, in units of block_size nodes
+  std::vector<VINT> blocks;
+  // block_size^3 bits per tile, set for the nodes with mass
+  std::vector<uint8_t> masks;
+  std::vector<GridBuffer> channels;
+
+  size_t mask_bytes() const {
+    return (size_t(block_size) * block_size * block_size + 7) / 8;
+  }
+};
+
+int grid_channel_components(GridChannel channel);
+std::string grid_channel_name(GridChannel channel);
+
+} // namespace mpm
@@ -13,6 +13,9 @@ struct MPM_Material {
   T K;      // bulk modulus
   T volume; // particle's volume at time 0
   MPM_Material(T E, T nu, T mass, T density);
+
+  // elastic (p-)wave speed sqrt((lambda + 2 mu) / rho)
+  T wave_speed() const;
 };
 
 } // namespace mpm
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "MPM/base.h"
+
+#include <cstdint>
+#include <string>
+
+namespace mpm {
+
+enum class ExportChannel {
+  POSITION,
+  VELOCITY,
+  J,
+  DET_F,
+  PLASTIC_JP,
+  MATERIAL_ID,
+  VON_MISES // von Mises equivalent of the Cauchy stress
+};
+
+enum class ExportType { FLOAT32, FLOAT16, INT32 };
+
+// which channels to export and how to store them. position is always
+// exported first, everything else only when listed here.
+struct ExportDesc {
+  struct Entry {
+    ExportChannel channel;
+    ExportType type = ExportType::FLOAT32;
+  };
+
+  ExportType position_type = ExportType::FLOAT32;
+  std::vector<Entry> channels;
+
+  ExportDesc &add(ExportChannel channel,
+                  ExportType type = ExportType::FLOAT32) {
+    channels.push_back({channel, type});
+    return *this;
+  }
+};
+
+struct ChannelBuffer {
+  ExportChannel channel;
+  ExportType type;
+  int components = 1;
+  std::string name; // attribute name in the output file
+  std::vector<char> data;
+
+  size_t element_size() const {
+    return (type == ExportType::FLOAT16 ? 2 : 4) * components;
+  }
+  template <class Elem> Elem *as() {
+    return reinterpret_cast<Elem *>(data.data());
+  }
+  template <class Elem> const Elem *as() const {
+    return reinterpret_cast<const Elem *>(data.data());
+  }
+  // component k of particle i widened back to float
+  float get(size_t i, int k) const;
+};
+
+// one frame of exported particle data, channels[0] is always position.
+// buffers keep their capacity when a snapshot is refilled.
+struct ParticleSnapshot {
+  int size = 0;
+  int frame = 0; // set by the caller, stored by the particle cache
+  T time = 0;
+  std::vector<ChannelBuffer> channels;
+};
+
+int export_channel_components(ExportChannel channel);
+std::string export_channel_name(ExportChannel channel);
+
+} // namespace mpm
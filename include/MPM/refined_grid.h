@@ -0,0 +1,111 @@
+#pragma once
+
+#include "MPM/base.h"
+
+#include <memory>
+#include <vector>
+
+#include <tbb/spin_mutex.h>
+
+namespace mpm {
+
+struct RefinementOptions {
+  // refined levels above the simulator grid (1 or 2), 0 turns refinement
+  // off. level l has the spacing h / 2^l
+  int levels = 1;
+  // cells per block side on every level, even
+  int block_size = 4;
+  // substeps between two rebuilds of the refined regions
+  int regrid_interval = 10;
+  // a block holding particles is refined when any of these holds:
+  // its parent cells average at least refine_ppc particles (0 disables)
+  T refine_ppc = 0;
+  // it is at the free surface, one of its neighbour blocks is empty
+  bool refine_surface = true;
+  // its centre is closer to a collider than collider_band parent cells
+  T collider_band = 2;
+};
+
+// One refined level of the adaptive grid, stored as sparse blocks of cells.
+// The levels form a truncated hierarchical B-spline basis: the quadratic
+// B-splines of a level nest in the ones of its parent when their nodes sit
+// at the cell centres, (k + 0.5) * h. A node is active when its support
+// lies in refined blocks; a coarser function gives the part of its support
+// covered by active finer functions to them, so the weights of a particle
+// over all levels still sum to one and P2G/G2P conserve momentum across
+// level boundaries.
+class MPM_RefinedLevel {
+public:
+  // cells: cell count per axis of this level
+  MPM_RefinedLevel(int level, T h, const VINT &cells, int block_size);
+  virtual ~MPM_RefinedLevel() = default;
+
+  int level;
+  T h;
+  VINT cell_dims;
+  int block_size;
+  VINT block_dims;
+
+  // flags over the whole block grid of the level, allocates the refined
+  // blocks and marks their active nodes
+  void build(const std::vector<uint8_t> &refined);
+  size_t get_block_count() const { return block_slots.size(); }
+  size_t get_active_node_count() const { return active_nodes; }
+
+  int block_index(const VINT &block) const {
+    return (block[0] * block_dims[1] + block[1]) * block_dims[2] + block[2];
+  }
+  int block_of_node(const VINT &node) const {
+    return block_index(node / block_size);
+  }
+  bool in_grid(const VINT &node) const {
+    return (node.array() >= 0).all() &&
+           (node.array() < cell_dims.array()).all();
+  }
+  bool is_refined(const VINT &block) const {
+    return slot_of[block_index(block)] >= 0;
+  }
+  // storage index of an active node, -1 otherwise
+  int active_index(const VINT &node) const {
+    if (!in_grid(node)) {
+      return -1;
+    }
+    int slot = slot_of[block_of_node(node)];
+    if (slot < 0) {
+      return -1;
+    }
+    VINT local = node - (node / block_size) * block_size;
+    int index = slot * block_volume +
+                (local[0] * block_size + local[1]) * block_size + local[2];
+    return active[index] ? index : -1;
+  }
+  VT node_position(const VINT &node) const {
+    return (node.cast<T>().array() + T(0.5)).matrix() * h;
+  }
+
+  void clear_nodes();
+
+  std::vector<GridAttr> nodes;
+  std::vector<uint8_t> active;
+  std::unique_ptr<tbb::spin_mutex[]> mutexs;
+
+private:
+  int block_volume;
+  size_t mutex_count = 0;
+  size_t active_nodes = 0;
+  // slot of every block of the level, -1 when not refined
+  std::vector<int> slot_of;
+  std::vector<int> block_slots;
+};
+
+// weight of a particle on one node of the composite grid, level 0 indexes
+// the simulator grid and the others MPM_RefinedLevel::nodes
+struct CompositeWeight {
+  int level;
+  int index;
+  T w;
+  VT dw;
+  VT x;
+};
+
+} // namespace mpm
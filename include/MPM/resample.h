@@ -0,0 +1,51 @@
+#pragma once
+
+#include "MPM/base.h"
+
+namespace mpm {
+
+class MPM_Simulator;
+
+struct ResampleOptions {
+  // frames between two passes of MPM_Resampler
+  int interval = 10;
+  // grid cells per block side, blocks are processed in parallel
+  int block_size = 4;
+  // cells with more particles merge pairs down towards max_ppc, cells with
+  // fewer split particles up towards min_ppc
+  int min_ppc = 4;
+  int max_ppc = 16;
+  // merge candidates: ||F^T F - I|| and ||grad v|| (from APIC Bp) below
+  T merge_strain = 0.05;
+  T merge_strain_rate = 0.5;
+  // split candidates: ||F^T F - I|| above
+  T split_strain = 0.5;
+  // limits on the mass of a resampled particle, as powers of two of the
+  // mass the object was added with
+  int max_merge_level = 3;
+  int max_split_level = 2;
+};
+
+struct ResampleStats {
+  int merged = 0; // pairs merged into one particle
+  int split = 0;  // particles split into two
+  int particles_before = 0;
+  int particles_after = 0;
+};
+
+// Runs MPM_Simulator::resample every `interval` frames.
+class MPM_Resampler {
+public:
+  explicit MPM_Resampler(const ResampleOptions &options = {});
+  virtual ~MPM_Resampler() = default;
+
+  // true when a pass ran
+  bool on_frame(MPM_Simulator &sim, int frame);
+  const ResampleStats &get_last_stats() const { return last_stats; }
+
+private:
+  ResampleOptions options;
+  ResampleStats last_stats;
+};
+
+} // namespace mpm
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "MPM/Math/levelset.h"
+#include "MPM/base.h"
+#include "MPM/surface.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace mpm {
+
+struct PoissonSampleOptions {
+  // minimum distance between two particles, in units of the grid spacing h
+  T spacing = T(0.5);
+  // darts thrown at every cell that is still empty
+  int attempts = 30;
+  // background cells per block side, the unit of the parallel tasks
+  int block_cells = 4;
+  uint64_t seed = 0;
+};
+
+struct PoissonSamples {
+  std::vector<VT> positions;
+  // volume of the sampled region and its share per particle. objects take
+  // their mass from the material, so the caller creates it with
+  // mass = density * particle_volume
+  T volume = 0;
+  T particle_volume = 0;
+};
+
+// Blue-noise (Poisson-disk) volume sampling of a level set, so objects
+// need no offline sampling step. Darts are thrown into a background grid
+// of cells with diagonal r, which hold one particle at most. Blocks of
+// cells are run in eight phases by the parity of their coordinates: blocks
+// of one phase are a whole block apart, at least r, so they neither test
+// nor write the same cells and run in parallel without locks. Every cell
+// draws its darts from its own random stream, which keeps the result
+// independent of the thread count.
+class MPM_PoissonSampler {
+public:
+  explicit MPM_PoissonSampler(const PoissonSampleOptions &options = {});
+  virtual ~MPM_PoissonSampler() = default;
+
+  // particles inside `levelset` within [box_min, box_max]
+  bool sample(const MPM_LevelSet &levelset, const VT &box_min,
+              const VT &box_max, T h, PoissonSamples &samples) const;
+  // interior of a closed triangle mesh
+  bool sample(const SurfaceMesh &mesh, T h, PoissonSamples &samples) const;
+
+  const PoissonSampleOptions &get_options() const { return options; }
+
+private:
+  PoissonSampleOptions options;
+};
+
+} // namespace mpm
@@ -0,0 +1,131 @@
+#pragma once
+
+#include "MPM/Utils/numa.h"
+#include "MPM/base.h"
+#include "MPM/collision.h"
+#include "MPM/material.h"
+#include "MPM/particle_export.h"
+#include "MPM/refined_grid.h"
+#include "MPM/resample.h"
+#include "MPM/simulator.h"
+#include "MPM/sleep_blocks.h"
+#include "MPM/step_controller.h"
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace mpm {
+
+// Scene description file, one directive per line followed by `key value`
+// pairs, `#` starts a comment. Paths are relative to the scene file.
+//
+//   grid       gravity 0 -9.8 0  area 10 10 10  h 0.1
+//   transfer   apic                     # apic | flip99 | flip95
+//   material   water  E 5e5  nu 0.4  mass 0.01  density 1000
+//   model      fluid  volume_penalty    # neohookean | volume_penalty |
+//                                       # neohookean_fluid | cdmpm_fluid
+//   plasticity snow1  snow  psi 10  theta_c 2e-2  theta_s 7.5e-3
+//   plasticity metal  von_mises  yield 1e3  xi 0  alpha 0
+//   default    model fluid  plasticity snow1
+//   wall       normal 1 0 0  point 2 0 0  [sticky]  [friction 0.2]
+//   sphere     center 5 1 5  radius 0.5  [sticky]  [friction 0.2]
+//   object     file ../models/sand.obj  material water  [model fluid]
+//              [plasticity snow1]  [velocity 0 0 0]
+//   object     box_min 1 1 1  box_max 2 2 2  spacing 0.05  material water
+//   object     file ../models/rock.obj  sample 0.5  material water
+//                                       # blue-noise sampling of a closed
+//                                       # mesh (or box), spacing in h
+//   export     v float16                # one channel per line, named as in
+//                                       # the exported files
+//   time       frame_rate 30  frames 300  max_dt 1e-2  [min_dt]
+//              [initial_dt]  [cfl]  [acoustic_cfl]
+//   output     dir ../output/test/  [cache 0]  [surface 0]  [grid 0]
+//              [live 0]  [diagnostics 1]  [checkpoint_interval 50]
+//                                       # 1 turns an output on, 0 off
+//   profile    [stages 0]  [trace 0]  [counters 0]
+//   sleeping   on
+//   numa       on  [domains 2]  [place_interval 100]
+//                                       # see MPM/Utils/numa.h
+//   refinement levels 1  [block_size 4]  [regrid_interval 10]
+//                                       # 0 to 2 levels, even block size
+//   resample   on  [interval 10]  [min_ppc 4]  [max_ppc 16]
+//
+// The wrapped entries above are single lines in a file. Errors are
+// reported with file and line and make load() fail.
+class MPM_Scene {
+public:
+  MPM_Scene() = default;
+  virtual ~MPM_Scene() = default;
+
+  bool load(const std::string &path);
+  // set up a fresh simulator: grid, models, colliders, objects and the
+  // performance settings. build() can run for several simulators, they
+  // share the scene's materials, which have to outlive them; every
+  // simulator gets its own plasticity instances
+  bool build(MPM_Simulator &sim) const;
+
+  const std::string &get_path() const { return path; }
+
+  // time stepping and output, read by the caller's frame loop
+  int frame_rate = 30;
+  int frames = 300;
+  StepControllerOptions step_options;
+  ExportDesc export_desc;
+  std::string output_dir = "output/";
+  // outputs of the frame loop: one native particle cache instead of a
+  // .bgeo per frame, a surface mesh and the grid tiles per frame, the
+  // newest frame in shared memory and the diagnostics time series
+  bool particle_cache = false;
+  bool mesh_surface = false;
+  bool grid_fields = false;
+  bool stream_live = false;
+  bool write_diagnostics = true;
+  // frames between restart files, 0 for none
+  int checkpoint_interval = 50;
+  // per-stage timings in the frame reports, a chrome://tracing timeline
+  // and hardware counters per stage
+  bool profile_stages = false;
+  bool write_trace = false;
+  bool hw_counters = false;
+  // merge and split particles every resample_options.interval frames
+  bool adaptive_sampling = false;
+  ResampleOptions resample_options;
+
+private:
+  struct ObjectDesc {
+    int line = 0;
+    std::string file;
+    VT box_min = VT::Zero(), box_max = VT::Zero();
+    T spacing = 0;
+    T sample = 0;
+    std::string material, model, plasticity;
+    VT velocity = VT::Zero();
+    // poisson sampled once at load, with the material scaled to the
+    // particle volume of the samples
+    std::vector<VT> positions;
+    std::shared_ptr<MPM_Material> sampled_material;
+  };
+
+  bool sample_objects();
+
+  std::string path;
+  VT gravity = VT(0, -9.8, 0);
+  VT area = VT::Ones();
+  T h = T(0.02);
+  MPM_Simulator::TransferScheme transfer = MPM_Simulator::APIC;
+  std::map<std::string, std::unique_ptr<MPM_Material>> materials;
+  std::map<std::string, std::shared_ptr<MPM_CM>> models;
+  std::map<std::string, std::function<std::shared_ptr<Plasticity>()>>
+      plasticities;
+  std::string default_model, default_plasticity;
+  std::vector<MPM_Collision> colliders;
+  std::vector<ObjectDesc> objects;
+  bool sleeping = false;
+  NumaOptions numa;
+  RefinementOptions refinement{0};
+};
+
+} // namespace mpm
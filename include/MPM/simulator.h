@@ -1,10 +1,22 @@
 #pragma once
 
 #include "MPM/base.h"
+#include "MPM/diagnostics.h"
+#include "MPM/grid_export.h"
 #include "MPM/material.h"
+#include "MPM/particle_export.h"
+#include "MPM/refined_grid.h"
+#include "MPM/resample.h"
+#include "MPM/sleep_blocks.h"
+#include "MPM/Utils/logger.h"
+#include "MPM/Utils/numa.h"
 #include "tbb/concurrent_vector.h"
 #include "tbb/spin_mutex.h"
 
+#include <atomic>
+#include <map>
+#include <unordered_map>
+
 namespace mpm {
 
 struct Particle;
@@ -15,6 +27,15 @@ class MPM_CM;
 class Plasticity;
 class MPM_Collision;
 
+// particles sharing one constitutive model and plasticity, kept in the
+// contiguous range [begin, end) of the particle array
+struct ParticleGroup {
+  int begin = 0;
+  int end = 0;
+  std::shared_ptr<MPM_CM> cm;
+  std::shared_ptr<Plasticity> plasticity;
+};
+
 // neohookean model
 class MPM_Simulator {
 public:
@@ -27,21 +48,99 @@ public:
 
   void mpm_initialize(const VT &gravity, const VT &world_area, T h);
 
+  // object_cm / object_plas override the simulator-wide models for this
+  // object, nullptr falls back to set_constitutive_model / set_plasticity
   void add_object(const std::vector<VT> &positions,
-                  const std::vector<VT> &velocities, MPM_Material *material);
+                  const std::vector<VT> &velocities, MPM_Material *material,
+                  const std::shared_ptr<MPM_CM> &object_cm = nullptr,
+                  const std::shared_ptr<Plasticity> &object_plas = nullptr);
 
-  void add_object(const std::vector<VT> &positions, MPM_Material *material);
+  void add_object(const std::vector<VT> &positions, MPM_Material *material,
+                  const std::shared_ptr<MPM_CM> &object_cm = nullptr,
+                  const std::shared_ptr<Plasticity> &object_plas = nullptr);
 
   void set_constitutive_model(const std::shared_ptr<MPM_CM> &cm);
   void set_plasticity(const std::shared_ptr<Plasticity> &plas);
 
   void set_transfer_scheme(TransferScheme ts);
+  // FLIP share of the velocity update (1 - alpha is PIC) for the FLIP
+  // schemes, overrides the 0.99 / 0.95 of set_transfer_scheme
+  void set_flip_alpha(T alpha);
   // void grid_initialize();
   // void particle_initialize();
   std::vector<VT> get_positions() const;
+  // read-only view of one particle member straight over particle storage,
+  // e.g. get_particle_span(&Particle::pos_p). valid until the particles
+  // are reallocated or reordered: add_object, resample, load_checkpoint,
+  // clear_simulation, set_numa and every substep that re-places the
+  // particles on their NUMA domains (each place_interval substeps)
+  template <class Elem>
+  StridedSpan<Elem> get_particle_span(Elem Particle::*member) const {
+    if (!particles) {
+      return {};
+    }
+    return {&(particles[0].*member), size_t(sim_info.particle_size),
+            sizeof(Particle)};
+  }
+  // fill a caller-owned buffer, reuses its storage across frames
+  void get_positions(std::vector<VT> &positions) const;
   T get_max_velocity() const;
+  size_t get_active_node_count() const { return active_nodes.size(); }
+  const SimInfo &get_sim_info() const { return sim_info; }
+  const std::vector<ParticleGroup> &get_groups() const { return groups; }
+  const std::vector<MPM_Material *> &get_materials() const {
+    return materials;
+  }
+  // reduce SimDiagnostics in the passes of every substep, off by default
+  void set_diagnostics(bool enabled) { diagnostics_enabled = enabled; }
+  // totals of the last substep, only valid with diagnostics enabled
+  const SimDiagnostics &get_diagnostics() const { return diagnostics; }
+  // evaluate the requested channels into the snapshot in one parallel pass
+  void export_snapshot(const ExportDesc &desc,
+                       ParticleSnapshot &snapshot) const;
+  // synchronous export straight from particle storage, no position copy
+  bool export_particles(const std::string &export_path) const;
+  // tiles of the simulator grid around the nodes with mass after the last
+  // substep, see MPM/grid_export.h. refined levels are not included
+  void export_grid(const GridExportDesc &desc, GridSnapshot &snapshot) const;
 
   void substep(T dt);
+  // keep the particle state from the start of every substep (copied in
+  // P2G) so a failed step can be undone, see MPM/step_controller.h
+  void set_rollback(bool enabled) { rollback_enabled = enabled; }
+  // the last substep produced a NaN velocity gradient or J <= 0
+  bool step_failed() const {
+    return failed_step.load(std::memory_order_relaxed);
+  }
+  // restore particles, sleep state and step counters to the start of the
+  // last substep
+  void rollback_step();
+  // freeze blocks of settled particles, see MPM/sleep_blocks.h
+  void set_sleeping(bool enabled, const SleepOptions &options = {});
+  // particles skipped by the last substep
+  int get_sleeping_particle_count() const { return sleeping_particles; }
+  // merge and split particles by the local sampling, see MPM/resample.h.
+  // particles are reordered block by block within their groups
+  ResampleStats resample(const ResampleOptions &options);
+  // finer grid levels near the surface and colliders, see
+  // MPM/refined_grid.h. the regions are rebuilt every regrid_interval
+  // substeps
+  void set_refinement(const RefinementOptions &options);
+  // spacing of the finest level in use, for the CFL limit
+  T get_min_h() const;
+  // the transfer weights of a particle at pos on the nodes of the grid and
+  // the refined levels it reaches, as P2G and G2P use them
+  void transfer_weights(const VT &pos,
+                        std::vector<CompositeWeight> &weights) const;
+  // split grid and particle storage and the stage loops over the NUMA
+  // nodes, see MPM/Utils/numa.h. particles are then kept ordered by grid
+  // node within their groups, sorted again every place_interval substeps.
+  // storage that exists already is moved, so it is cheapest before
+  // mpm_initialize
+  void set_numa(const NumaOptions &options);
+  // where the pages of the grid and the particles live
+  NumaLocality get_grid_locality() const;
+  NumaLocality get_particle_locality() const;
   void clear_simulation();
   void add_collision(const MPM_Collision &coll);
 
@@ -52,6 +151,14 @@ public:
   }
   // bool export_result(const std::string &export_path, int curr_frame);
 
+  // full particle state + SimInfo + step counter, see MPM/checkpoint.h.
+  // constitutive model, plasticity and colliders are code and must be set
+  // up again by the caller before resuming.
+  bool save_checkpoint(const std::string &path) const;
+  bool load_checkpoint(const std::string &path);
+  // serialize into the exact file image, used for async checkpointing
+  void serialize_checkpoint(std::vector<char> &image) const;
+
 private:
   SimInfo sim_info;
   Particle *particles;
@@ -63,12 +170,96 @@ private:
   TransferScheme transfer_scheme = TransferScheme::APIC;
   std::shared_ptr<MPM_CM> cm;
   std::shared_ptr<Plasticity> plasticity;
+  std::vector<ParticleGroup> groups;
+  // particles per virtual stress call in update_grid_force
+  static constexpr int STRESS_BATCH = 64;
+  // a group's particles cut into batches, the batches of all groups are
+  // numbered in one index space so the stress runs as a single loop
+  struct StressRun {
+    int begin, end;
+    int first_batch;
+    MPM_CM *cm;
+  };
+  std::vector<StressRun> stress_runs;
+  // batch index where every part of particle_bounds starts, the batches
+  // run on the domain of their particles
+  std::vector<int> stress_bounds;
+
+  bool diagnostics_enabled = false;
+  SimDiagnostics diagnostics;
+
+  bool rollback_enabled = false;
+  std::vector<Particle> rollback_particles;
+  SimInfo rollback_info;
+  // set by any particle of the current substep, written only on failure
+  std::atomic<bool> failed_step{false};
+  // aggregated warnings of this simulator, flushed at the end of a substep
+  MPMLogAggregates log_aggregates;
+
+  bool sleeping_enabled = false;
+  SleepOptions sleep_options;
+  MPM_SleepBlocks sleep_blocks;
+  int sleeping_particles = 0;
+  MPM_SleepBlocks::Snapshot rollback_sleep;
+  int rollback_sleeping = 0;
+
+  bool is_asleep(const Particle &particle) const {
+    return sleeping_enabled &&
+           sleep_blocks.asleep(sleep_blocks.block_of(particle.pos_p));
+  }
+
+  // off until set_refinement
+  RefinementOptions refinement{0};
+  std::vector<std::unique_ptr<MPM_RefinedLevel>> refined_levels;
+  bool regrid_pending = false;
+  // finest level with active nodes around the particle, 0 when it only
+  // sees the simulator grid and goes through the plain transfers
+  std::vector<uint8_t> particle_owner;
+  // volume * kirchhoff stress of the last update_grid_force
+  std::vector<MT> stress_cache;
+  static constexpr int MAX_COMPOSITE_WEIGHTS = 27 * 3;
+
+  int owner_level(int particle) const {
+    return refinement.levels > 0 ? particle_owner[particle] : 0;
+  }
+
+  NumaOptions numa_options;
+  std::unique_ptr<MPM_NumaDomains> numa =
+      std::make_unique<MPM_NumaDomains>();
+  // parts of the stage loops, part q runs on domain q % numa->size().
+  // particle parts follow the grid parts, group by group
+  std::vector<int> grid_bounds;
+  std::vector<int> particle_bounds;
+  std::vector<int> active_bounds;
+  // allocate the grid, first touched part by part
+  void place_grid();
+  // reorder and move the particles onto their domains
+  void place_particles();
 
   // storage the degree of freedoms
   tbb::concurrent_vector<int> active_nodes;
   std::vector<MPM_Collision> colls;
+
+  // material table, a particle's material id is its index here
+  std::vector<MPM_Material *> materials;
+  // materials recreated by load_checkpoint or made by resample
+  std::vector<std::unique_ptr<MPM_Material>> owned_materials;
+  // resample gives merged and split particles a copy of their material
+  // with the mass scaled by 2^level
+  struct MaterialLevel {
+    MPM_Material *base;
+    int level;
+  };
+  std::unordered_map<const MPM_Material *, MaterialLevel> material_levels;
+  std::map<std::pair<const MPM_Material *, int>, MPM_Material *>
+      level_materials;
   // std::vector<int> active_nodes;
 
+  int register_material(MPM_Material *material);
+  void prepare_material_levels(const ResampleOptions &options);
+  MPM_CM *group_cm(const ParticleGroup &group) const;
+  Plasticity *group_plasticity(const ParticleGroup &group) const;
+
   void prestep();
   void transfer_P2G();
   void add_gravity();
@@ -80,6 +271,30 @@ private:
   void transfer_G2P();
   void advection(T dt);
 
+  // adaptive grid, src/MPM/refinement.cpp
+  void regrid();
+  int finest_level(const VT &pos) const;
+  // weights and gradients of pos on the active nodes of all levels up to
+  // finest, returns their count
+  int composite_weights(const VT &pos, int finest,
+                        CompositeWeight *weights) const;
+  GridAttr &composite_node(const CompositeWeight &weight) const {
+    return weight.level ? refined_levels[weight.level - 1]->nodes[weight.index]
+                        : grid_attrs[weight.index];
+  }
+  tbb::spin_mutex &composite_mutex(const CompositeWeight &weight) const {
+    return weight.level
+               ? refined_levels[weight.level - 1]->mutexs[weight.index]
+               : grid_mutexs[weight.index];
+  }
+  void refined_prestep();
+  // scatter of the particles near refined levels, returns the level mass
+  T refined_P2G();
+  void refined_grid_force();
+  void refined_grid_velocity(T dt);
+  MT refined_grad_v(const VT &pos, int owner) const;
+  void refined_G2P(Particle &particle, int owner) const;
+
   // handle collision
   void solve_particle_collision();
   void solve_grid_collision();
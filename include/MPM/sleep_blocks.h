@@ -0,0 +1,118 @@
+#pragma once
+
+#include "MPM/base.h"
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace mpm {
+
+class MPM_Collision;
+
+struct SleepOptions {
+  // grid cells per block side
+  int block_size = 4;
+  // particles slower than this are at rest
+  T velocity = 1e-2;
+  // and so are velocity gradients with a smaller norm
+  T strain_rate = 1e-1;
+  // steps a block has to stay at rest before it sleeps
+  int quiet_steps = 20;
+  // P2G velocity of awake material on a sleeping block's nodes that wakes
+  // the block
+  T wake_velocity = 5e-2;
+  // change of the collider distance at a sleeping block's centre, in
+  // cells, that wakes the block
+  T wake_distance = 0.25;
+};
+
+// Sleep state of the grid split into blocks of block_size^3 cells.
+// The particle passes report into it (mark_occupied, mark_busy,
+// request_wake) with relaxed flag writes that only happen on a change, and
+// update() at the end of every substep decides which blocks sleep:
+//  - an occupied block at rest for quiet_steps falls asleep unless one of
+//    its 26 neighbours still holds moving material, so a halo of one block
+//    stays awake around everything that moves
+//  - a sleeping block wakes when it is asked to (grid velocity, a particle
+//    moving in), when a collider moved near it, or when a neighbour
+//    starts moving; the last case wakes it as halo, still counted at rest
+// Particles in a sleeping block are skipped by every stage and its grid
+// nodes act as a sticky boundary for the awake material around it.
+class MPM_SleepBlocks {
+public:
+  MPM_SleepBlocks() = default;
+  virtual ~MPM_SleepBlocks() = default;
+
+  void initialize(const SimInfo &info, const SleepOptions &options);
+  void clear();
+  bool is_initialized() const { return block_count > 0; }
+  const SleepOptions &get_options() const { return options; }
+
+  int block_of_node(const VINT &node) const {
+    return (node[0] / options.block_size * blocks[1] +
+            node[1] / options.block_size) *
+               blocks[2] +
+           node[2] / options.block_size;
+  }
+  int block_of(const VT &pos) const {
+    VINT node;
+    for (int d = 0; d < DIM; d++) {
+      node[d] = std::min(std::max(static_cast<int>(pos[d] * inv_h), 0),
+                         cells[d] - 1);
+    }
+    return block_of_node(node);
+  }
+  bool asleep(int block) const { return asleep_flags[block] != 0; }
+
+  void mark_occupied(int block) { raise(occupied[block]); }
+  void mark_busy(int block) { raise(busy[block]); }
+  void request_wake(int block) { raise(wake[block]); }
+
+  // apply this substep's reports, colls are checked for sleeping blocks
+  void update(const std::vector<MPM_Collision> &colls);
+  // e.g. after particles were added or replaced
+  void wake_all();
+
+  // the state between two substeps, so a rolled back substep leaves no
+  // trace: a diverged step has NaN velocities that report no motion
+  struct Snapshot {
+    std::vector<uint8_t> asleep;
+    std::vector<uint16_t> quiet;
+    std::vector<T> sleep_distance;
+    int asleep_blocks = 0;
+  };
+  void save(Snapshot &snapshot) const;
+  void restore(const Snapshot &snapshot);
+
+  int get_asleep_blocks() const { return asleep_blocks; }
+
+private:
+  using Flags = std::unique_ptr<std::atomic<uint8_t>[]>;
+
+  SleepOptions options;
+  T h = 0;
+  T inv_h = 0;
+  VINT cells = VINT::Zero();
+  VINT blocks = VINT::Zero();
+  int block_count = 0;
+  int asleep_blocks = 0;
+
+  // only changed in update(), read by the particle passes
+  std::vector<uint8_t> asleep_flags;
+  std::vector<uint8_t> next_asleep;
+  std::vector<uint16_t> quiet;
+  std::vector<T> sleep_distance;
+  // written by the particle passes during a substep
+  Flags occupied, busy, wake;
+
+  static void raise(std::atomic<uint8_t> &flag) {
+    if (!flag.load(std::memory_order_relaxed)) {
+      flag.store(1, std::memory_order_relaxed);
+    }
+  }
+  T collider_distance(int block,
+                      const std::vector<MPM_Collision> &colls) const;
+};
+
+} // namespace mpm
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "MPM/base.h"
+
+#include <functional>
+
+namespace mpm {
+
+class MPM_Simulator;
+
+struct StepControllerOptions {
+  T min_dt = 1e-6;
+  T max_dt = 1e-2;
+  // first dt tried, max_dt when 0
+  T initial_dt = 0;
+  // aggressive advective CFL, the failure checks catch the steps it breaks
+  T cfl = 0.9;
+  // elastic waves must not cross more than acoustic_cfl cells per step
+  T acoustic_cfl = 0.6;
+  // a step moving a particle further than spike_cfl cells is a velocity
+  // spike and gets rejected
+  T spike_cfl = 1.5;
+  // dt *= shrink after a failed step
+  T shrink = 0.5;
+  // dt *= grow after grow_after accepted steps in a row
+  T grow = 1.25;
+  int grow_after = 8;
+};
+
+// Optimistic time stepping. Every substep is tried with the largest dt the
+// controller currently trusts, capped by
+//   advective CFL: cfl * h / max particle velocity
+//   acoustic CFL:  acoustic_cfl * h / sqrt((lambda + 2 mu) / rho), taken
+//                  per material in the simulator's material table
+// The velocity comes from the advection reduction of the previous step, so
+// the limits cost no particle pass.
+// The simulator flags NaN velocity gradients and J <= 0 inside update_F and
+// the controller checks max velocity * dt against spike_cfl. A failed step
+// is undone from the simulator's rollback copy and retried with a smaller
+// dt, and dt grows again after a run of successes.
+class MPM_StepController {
+public:
+  MPM_StepController(MPM_Simulator &sim,
+                     const StepControllerOptions &options = {});
+  virtual ~MPM_StepController() = default;
+
+  // largest dt the next substep may take
+  T stable_dt() const;
+
+  // take one accepted substep of at most `remaining` seconds, returns the
+  // dt actually taken. When `remaining` needs several steps it is split
+  // into equal ones, so no step shrinks to fit the end of the interval.
+  T advance(T remaining);
+
+  // substeps until exactly frame_time seconds have passed, on_step sees
+  // every accepted dt. returns the number of substeps
+  int advance_frame(T frame_time,
+                    const std::function<void(T dt)> &on_step = nullptr);
+
+  T get_dt() const { return dt; }
+  int get_accepted_steps() const { return accepted_steps; }
+  int get_rejected_steps() const { return rejected_steps; }
+
+private:
+  MPM_Simulator &sim;
+  StepControllerOptions options;
+  T dt;
+  int success_run = 0;
+  int accepted_steps = 0;
+  int rejected_steps = 0;
+
+  bool step_failed(T step_dt) const;
+};
+
+} // namespace mpm
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "MPM/base.h"
+#include "MPM/particle_export.h"
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+namespace mpm {
+
+struct SurfaceOptions {
+  // edge length of the density voxels, around the particle spacing
+  T voxel_size = T(0.01);
+  // voxels per block side, the unit of allocation and of the parallel tasks
+  int block_size = 8;
+  // the surface passes where the density falls to this fraction of the
+  // bulk density, which is estimated from the field itself
+  T iso = T(0.5);
+  // [1 2 1] filter passes over the splatted density
+  int smoothing = 1;
+};
+
+struct SurfaceMesh {
+  std::vector<std::array<float, 3>> vertices;
+  std::vector<std::array<uint32_t, 3>> triangles;
+
+  void clear() {
+    vertices.clear();
+    triangles.clear();
+  }
+};
+
+// In-engine surface reconstruction of a particle frame.
+// Particles are splatted with the quadratic B-spline of the simulator into
+// sparse voxel blocks around the occupied ones. Each particle is splatted
+// once into its own block, padded by the nodes its support reaches across
+// the faces, and every block then sums the overlapping padding of its
+// neighbours, so the splat needs no locks. Marching cubes then runs block
+// by block. An edge belongs to the block of its lower node and crossing
+// edges become vertices there, so triangles across a block seam share
+// their vertices and the mesh comes out stitched.
+// extract() keeps no state and can run on several writer threads at once.
+class MPM_SurfaceMesher {
+public:
+  explicit MPM_SurfaceMesher(const SurfaceOptions &options = {});
+  virtual ~MPM_SurfaceMesher() = default;
+
+  void extract(const StridedSpan<VT> &positions, SurfaceMesh &mesh) const;
+  // positions from channel 0 of an exported frame
+  void extract(const ParticleSnapshot &snapshot, SurfaceMesh &mesh) const;
+
+  const SurfaceOptions &get_options() const { return options; }
+
+private:
+  SurfaceOptions options;
+
+  template <class Position>
+  void extract(size_t n, Position &&position, SurfaceMesh &mesh) const;
+};
+
+} // namespace mpm
@@ -0,0 +1,626 @@
+// Synthetic stage benchmarks.
+//
+// usage: mpm_bench [--sizes 1e4,1e5,1e6,1e7] [--ppc 1,8,27]
+//                  [--threads 1,2,4] [--model neohookean|fluid]
+//                  [--steps 10] [--warmup 2] [--counters 1]
+//                  [--numa off|on|<domains>] [--overhead 0]
+//                  [--mode stages|transfer|ensemble] [--scenes 8]
+//                  [--output bench.json]
+//
+// Every (size, particles per cell, threads) combination builds a rotating
+// jittered block of particles, runs a few warm-up steps and then times each
+// substep stage plus the frame export through MPM_Profiler. The result is
+// written as JSON (stdout without --output): per stage the call count,
+// mean/min/p99/max time, particles per second and the effective bandwidth
+// of the compulsory particle and grid traffic the stage has to do. With
+// --counters 1 (the default) and perf_event_open available, every stage
+// also carries its hardware counters in total and per thread. With --numa
+// the storage and the stage loops are split over the NUMA nodes and every
+// run reports the share of grid and particle pages on their own node.
+// --overhead 1 first times the same steps with the profiler switched off
+// and reports the wall time the stage scopes add on top.
+//
+// --mode transfer checks the interpolation instead of timing it. The scene
+// of the first size and ppc runs one substep with two refined levels at
+// its surface, then at every particle the weights on the grid and on the
+// refined levels have to sum to one, their first moment sum w (x_i - x_p)
+// has to vanish and a linear field has to come back exactly, for the value
+// and its gradient. The worst errors go to the JSON and the exit code is 1
+// when one is above round-off.
+//
+// --mode ensemble times --scenes copies of the scene of the first size and
+// ppc, --steps frames of dt each under the step controller, once one after
+// another with every scene spreading its loops over the machine and once
+// side by side through MPM_Ensemble. Both times include the setup; the
+// JSON has them with the particle substeps per second of each.
+
+#include "MPM/Physics/constitutive_model.h"
+#include "MPM/ensemble.h"
+#include "MPM/material.h"
+#include "MPM/mpm_pch.h"
+#include "MPM/refined_grid.h"
+#include "MPM/simulator.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <map>
+#include <random>
+
+#include <tbb/global_control.h>
+#include <tbb/info.h>
+
+using namespace mpm;
+namespace fs = std::filesystem;
+
+namespace {
+
+struct BenchOptions {
+  // 1e7 particles take about 4 GB with ppc 1, pass a shorter list on
+  // smaller machines
+  std::vector<double> sizes = {1e4, 1e5, 1e6, 1e7};
+  std::vector<int> ppc = {1, 8, 27};
+  std::vector<int> threads;
+  std::string model = "neohookean";
+  int steps = 10;
+  int warmup = 2;
+  bool counters = true;
+  bool overhead = false;
+  std::string mode = "stages";
+  int scenes = 8;
+  NumaOptions numa;
+  T dt = 1e-4;
+  T h = 1.0 / 64;
+  std::string output;
+};
+
+struct BenchScene {
+  std::unique_ptr<MPM_Simulator> sim;
+  std::unique_ptr<MPM_Material> material;
+  int particles = 0;
+  int ppc = 0;
+};
+
+// bytes of particle and grid state a stage has to read or write once
+struct TrafficModel {
+  double particles, grid_size, active_nodes, boundary_nodes, export_bytes;
+
+  double bytes(const std::string &stage) const {
+    const double vt = sizeof(VT), mt = sizeof(MT), t = sizeof(T);
+    const double ptr = sizeof(void *), node = sizeof(GridAttr);
+    if (stage == "prestep") {
+      return grid_size * node;
+    } else if (stage == "transfer_P2G") {
+      return particles * (2 * vt + mt + ptr) + grid_size * node +
+             2 * active_nodes * node;
+    } else if (stage == "update_grid_force") {
+      return particles * (vt + mt + 2 * t + ptr) + 2 * active_nodes * vt;
+    } else if (stage == "add_gravity" || stage == "update_grid_velocity" ||
+               stage == "solve_grid_collision") {
+      return 2 * active_nodes * node;
+    } else if (stage == "solve_grid_boundary") {
+      return 2 * boundary_nodes * node;
+    } else if (stage == "update_F") {
+      return particles * (vt + 2 * (mt + 2 * t)) + active_nodes * vt;
+    } else if (stage == "transfer_G2P") {
+      return particles * (2 * vt + mt) + 2 * active_nodes * vt;
+    } else if (stage == "advection") {
+      return particles * 3 * vt;
+    } else if (stage == "solve_particle_collision") {
+      return particles * 4 * vt;
+    } else if (stage == "export_snapshot") {
+      return particles * (2 * vt + t) + export_bytes;
+    }
+    return 0;
+  }
+};
+
+template <class Elem>
+std::vector<Elem> parse_list(const std::string &text) {
+  std::vector<Elem> values;
+  std::stringstream stream(text);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    if (!item.empty()) {
+      values.push_back(static_cast<Elem>(std::stod(item)));
+    }
+  }
+  return values;
+}
+
+bool parse_options(int argc, char **argv, BenchOptions &options) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      std::fprintf(stderr, "missing value for %s\n", arg.c_str());
+      return false;
+    }
+    std::string value = argv[++i];
+    if (arg == "--sizes") {
+      options.sizes = parse_list<double>(value);
+    } else if (arg == "--ppc") {
+      options.ppc = parse_list<int>(value);
+    } else if (arg == "--threads") {
+      options.threads = parse_list<int>(value);
+    } else if (arg == "--model") {
+      options.model = value;
+    } else if (arg == "--steps") {
+      options.steps = std::max(1, std::atoi(value.c_str()));
+    } else if (arg == "--warmup") {
+      options.warmup = std::max(0, std::atoi(value.c_str()));
+    } else if (arg == "--counters") {
+      options.counters = std::atoi(value.c_str()) != 0;
+    } else if (arg == "--overhead") {
+      options.overhead = std::atoi(value.c_str()) != 0;
+    } else if (arg == "--mode") {
+      options.mode = value;
+    } else if (arg == "--scenes") {
+      options.scenes = std::max(1, std::atoi(value.c_str()));
+    } else if (arg == "--numa") {
+      options.numa.enabled = value != "off";
+      options.numa.domains = value == "on" || value == "off"
+                                 ? 0
+                                 : std::max(0, std::atoi(value.c_str()));
+    } else if (arg == "--output") {
+      options.output = value;
+    } else {
+      std::fprintf(stderr, "unknown option %s\n", arg.c_str());
+      return false;
+    }
+  }
+  if (options.threads.empty()) {
+    // powers of two up to the machine, plus the machine itself
+    int hardware = tbb::info::default_concurrency();
+    for (int t = 1; t < hardware; t *= 2) {
+      options.threads.push_back(t);
+    }
+    options.threads.push_back(hardware);
+  }
+  return (options.model == "neohookean" || options.model == "fluid") &&
+         (options.mode == "stages" || options.mode == "transfer" ||
+          options.mode == "ensemble");
+}
+
+// jittered lattice with cbrt(ppc) particles per cell and axis, rotating
+// around the vertical axis through its center, built into `sim`. returns
+// the particles per cell actually used
+int build_scene(const BenchOptions &options, int particles, int ppc,
+                const std::shared_ptr<MPM_CM> &cm, MPM_Simulator &sim,
+                std::unique_ptr<MPM_Material> &material) {
+  const int margin = 4;
+  int per_axis = std::max(1, static_cast<int>(std::lround(std::cbrt(ppc))));
+  int side = static_cast<int>(std::ceil(std::cbrt(double(particles))));
+  int cells = (side + per_axis - 1) / per_axis;
+  T dx = options.h / per_axis;
+
+  T density = 1000;
+  material = std::make_unique<MPM_Material>(1e5, 0.3, density * dx * dx * dx,
+                                            density);
+
+  std::vector<VT> positions, velocities;
+  positions.reserve(particles);
+  velocities.reserve(particles);
+  std::mt19937 rng(particles * 31 + ppc);
+  std::uniform_real_distribution<T> jitter(-0.25 * dx, 0.25 * dx);
+  VT origin = VT::Constant(margin * options.h + 0.5 * dx);
+  VT center = origin + VT::Constant(0.5 * side * dx);
+  VT omega(0, 2, 0);
+  for (int i = 0; i < side && int(positions.size()) < particles; i++)
+    for (int j = 0; j < side && int(positions.size()) < particles; j++)
+      for (int k = 0; k < side && int(positions.size()) < particles; k++) {
+        VT pos = origin + VT(i, j, k) * dx +
+                 VT(jitter(rng), jitter(rng), jitter(rng));
+        positions.push_back(pos);
+        velocities.push_back(omega.cross(pos - center));
+      }
+
+  // before the storage is allocated, so it is placed only once
+  if (options.numa.enabled) {
+    sim.set_numa(options.numa);
+  }
+  T world = (cells + 2 * margin) * options.h;
+  sim.mpm_initialize(VT(0, -9.8, 0), VT::Constant(world), options.h);
+  sim.set_constitutive_model(cm);
+  sim.add_object(positions, velocities, material.get());
+  return per_axis * per_axis * per_axis;
+}
+
+BenchScene make_scene(const BenchOptions &options, int particles, int ppc,
+                      const std::shared_ptr<MPM_CM> &cm) {
+  BenchScene scene;
+  scene.particles = particles;
+  scene.sim = std::make_unique<MPM_Simulator>();
+  scene.ppc =
+      build_scene(options, particles, ppc, cm, *scene.sim, scene.material);
+  return scene;
+}
+
+std::string json_number(double value) { return fmt::format("{:.6g}", value); }
+
+std::string json_counters(const MPM_Profiler::StageStats &stage) {
+  auto values = [](const std::array<uint64_t, PERF_COUNTER_COUNT> &counters) {
+    std::string text;
+    for (int c = 0; c < PERF_COUNTER_COUNT; c++) {
+      text += fmt::format("{}{}", c ? ", " : "", counters[c]);
+    }
+    return text;
+  };
+  std::string text = "{";
+  for (int c = 0; c < PERF_COUNTER_COUNT; c++) {
+    text += fmt::format("\"{}\": {}, ",
+                        MPM_PerfCounters::name(PerfCounter(c)),
+                        stage.counters[c]);
+  }
+  text += "\"per_thread\": [";
+  bool first = true;
+  for (auto &thread : stage.thread_counters) {
+    if (thread[PERF_CYCLES] > 0) {
+      text += fmt::format("{}[{}]", first ? "" : ", ", values(thread));
+      first = false;
+    }
+  }
+  return text + "]}";
+}
+
+// worst errors of the transfer weights over a set of particles, each
+// relative to the scale of the quantity it checks
+struct TransferErrors {
+  int particles = 0;
+  // |sum w - 1|
+  T unity = 0;
+  // |sum w (x_i - x_p)| / h
+  T moment = 0;
+  // |sum w f(x_i) - f(x_p)| / F for f(x) = c + G x, F = |c| + |G| |x_p|
+  T linear = 0;
+  // |sum dw| h
+  T gradient_sum = 0;
+  // |sum f(x_i) dw^T - G| h / F
+  T gradient_linear = 0;
+
+  T worst() const {
+    return std::max({unity, moment, linear, gradient_sum, gradient_linear});
+  }
+  std::string json() const {
+    return fmt::format(
+        "{{\"particles\": {}, \"unity\": {}, \"moment\": {}, "
+        "\"linear\": {}, \"gradient_sum\": {}, \"gradient_linear\": {}}}",
+        particles, json_number(unity), json_number(moment),
+        json_number(linear), json_number(gradient_sum),
+        json_number(gradient_linear));
+  }
+};
+
+bool write_json(const std::string &json, const std::string &output) {
+  if (output.empty()) {
+    std::fputs(json.c_str(), stdout);
+    return true;
+  }
+  std::ofstream file(output);
+  file << json;
+  if (!file) {
+    std::fprintf(stderr, "can not write %s\n", output.c_str());
+    return false;
+  }
+  return true;
+}
+
+int run_transfer_check(const BenchOptions &options,
+                       const std::shared_ptr<MPM_CM> &cm) {
+  auto scene = make_scene(options, static_cast<int>(options.sizes.front()),
+                          options.ppc.front(), cm);
+  auto &sim = *scene.sim;
+  RefinementOptions refinement;
+  refinement.levels = 2;
+  sim.set_refinement(refinement);
+  sim.substep(options.dt);
+
+  // any field with all coefficients in play
+  const VT c(0.3, -1.2, 2.1);
+  MT G;
+  G << 1.5, -0.7, 0.2, 0.4, 2.3, -1.1, -0.9, 0.6, 1.7;
+  auto field = [&](const VT &x) { return VT(c + G * x); };
+
+  TransferErrors grid, refined;
+  std::vector<CompositeWeight> weights;
+  auto positions = sim.get_particle_span(&Particle::pos_p);
+  for (size_t p = 0; p < positions.size(); p++) {
+    const VT x_p = positions[p];
+    sim.transfer_weights(x_p, weights);
+    int finest = 0;
+    T sum_w = 0;
+    VT moment = VT::Zero(), value = VT::Zero(), sum_dw = VT::Zero();
+    MT gradient = MT::Zero();
+    for (auto &weight : weights) {
+      finest = std::max(finest, weight.level);
+      sum_w += weight.w;
+      moment += weight.w * (weight.x - x_p);
+      value += weight.w * field(weight.x);
+      sum_dw += weight.dw;
+      gradient += field(weight.x) * weight.dw.transpose();
+    }
+    T h = sim.get_sim_info().h / T(1 << finest);
+    // round-off grows with the values summed up, not with the result
+    T scale = c.norm() + G.norm() * x_p.norm();
+    auto &errors = finest ? refined : grid;
+    errors.particles++;
+    errors.unity = std::max(errors.unity, std::abs(sum_w - 1));
+    errors.moment = std::max(errors.moment, moment.norm() / h);
+    errors.linear =
+        std::max(errors.linear, (value - field(x_p)).norm() / scale);
+    errors.gradient_sum = std::max(errors.gradient_sum, sum_dw.norm() * h);
+    errors.gradient_linear = std::max(errors.gradient_linear,
+                                      (gradient - G).norm() * h / scale);
+  }
+
+  // a few hundred ulps of the coordinates
+  const T tolerance = 1e3 * std::numeric_limits<T>::epsilon();
+  bool passed = grid.worst() <= tolerance && refined.worst() <= tolerance;
+  std::string json = fmt::format(
+      "{{\n  \"benchmark\": \"mpm_bench\",\n  \"mode\": \"transfer\",\n"
+      "  \"scalar_bytes\": {},\n  \"tolerance\": {},\n"
+      "  \"grid\": {},\n  \"refined\": {},\n  \"passed\": {}\n}}\n",
+      sizeof(T), json_number(tolerance), grid.json(), refined.json(),
+      passed ? "true" : "false");
+  if (!write_json(json, options.output)) {
+    return 1;
+  }
+  if (!passed) {
+    std::fprintf(stderr,
+                 "transfer weights off by %g on the grid and %g on the "
+                 "refined levels, tolerance %g\n",
+                 double(grid.worst()), double(refined.worst()),
+                 double(tolerance));
+  }
+  return passed ? 0 : 1;
+}
+
+int run_ensemble_comparison(const BenchOptions &options,
+                            const std::shared_ptr<MPM_CM> &cm) {
+  const int particles = static_cast<int>(options.sizes.front());
+  const int ppc = options.ppc.front();
+  StepControllerOptions step_options;
+  step_options.max_dt = options.dt;
+  // a frame is at least one substep
+  const T frame_time = options.dt;
+
+  std::fprintf(stderr, "%d scenes of %d particles, one after another\n",
+               options.scenes, particles);
+  long long sequential_steps = 0;
+  auto start = MPM_Profiler::now();
+  for (int s = 0; s < options.scenes; s++) {
+    auto scene = make_scene(options, particles, ppc, cm);
+    MPM_StepController controller(*scene.sim, step_options);
+    for (int frame = 0; frame < options.steps; frame++) {
+      sequential_steps += controller.advance_frame(frame_time);
+    }
+  }
+  double sequential_s = (MPM_Profiler::now() - start) / 1e9;
+
+  std::fprintf(stderr, "%d scenes of %d particles, as an ensemble\n",
+               options.scenes, particles);
+  // only the summary is written, frames and diagnostics are off
+  auto output_dir = fs::temp_directory_path() / "mpm_bench_ensemble";
+  EnsembleOptions ensemble_options;
+  ensemble_options.output_dir = output_dir.generic_string();
+  ensemble_options.write_frames = false;
+  ensemble_options.write_diagnostics = false;
+  MPM_Ensemble ensemble(ensemble_options);
+  std::vector<std::unique_ptr<MPM_Material>> materials(options.scenes);
+  for (int s = 0; s < options.scenes; s++) {
+    EnsembleRun run;
+    run.name = fmt::format("scene{}", s);
+    run.frames = options.steps;
+    run.frame_rate = 1 / frame_time;
+    run.step_options = step_options;
+    run.setup = [&, s](MPM_Simulator &sim) {
+      build_scene(options, particles, ppc, cm, sim, materials[s]);
+    };
+    ensemble.add(std::move(run));
+  }
+  start = MPM_Profiler::now();
+  auto results = ensemble.run();
+  double ensemble_s = (MPM_Profiler::now() - start) / 1e9;
+  std::error_code ec;
+  fs::remove_all(output_dir, ec);
+
+  long long ensemble_steps = 0;
+  bool ok = true;
+  for (auto &result : results) {
+    ensemble_steps += result.substeps;
+    ok = ok && result.ok;
+  }
+  std::string json = fmt::format(
+      "{{\n  \"benchmark\": \"mpm_bench\",\n  \"mode\": \"ensemble\",\n"
+      "  \"hardware_threads\": {},\n  \"model\": \"{}\",\n"
+      "  \"scenes\": {},\n  \"particles\": {},\n  \"frames\": {},\n"
+      "  \"dt\": {},\n"
+      "  \"sequential\": {{\"seconds\": {}, \"substeps\": {}, "
+      "\"particle_steps_per_s\": {}}},\n"
+      "  \"ensemble\": {{\"seconds\": {}, \"substeps\": {}, "
+      "\"particle_steps_per_s\": {}, \"ok\": {}}},\n"
+      "  \"speedup\": {}\n}}\n",
+      tbb::info::default_concurrency(), options.model, options.scenes,
+      particles, options.steps, json_number(options.dt),
+      json_number(sequential_s), sequential_steps,
+      json_number(double(particles) * sequential_steps / sequential_s),
+      json_number(ensemble_s), ensemble_steps,
+      json_number(double(particles) * ensemble_steps / ensemble_s),
+      ok ? "true" : "false", json_number(sequential_s / ensemble_s));
+  return write_json(json, options.output) && ok ? 0 : 1;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  MPMLog::init();
+  MPMLog::get_logger()->set_level(spdlog::level::warn);
+
+  BenchOptions options;
+  if (!parse_options(argc, argv, options)) {
+    std::fprintf(stderr,
+                 "usage: mpm_bench [--sizes 1e4,1e5,1e6,1e7] [--ppc 1,8,27] "
+                 "[--threads 1,2,4] [--model neohookean|fluid] [--steps 10] "
+                 "[--warmup 2] [--counters 1] [--numa off|on|<domains>] "
+                 "[--overhead 0] [--mode stages|transfer|ensemble] "
+                 "[--scenes 8] [--output bench.json]\n");
+    return 1;
+  }
+  std::shared_ptr<MPM_CM> cm;
+  if (options.model == "fluid") {
+    cm = std::make_shared<QuatraticVolumePenalty>();
+  } else {
+    cm = std::make_shared<NeoHookean_Piola>();
+  }
+  if (options.mode == "transfer") {
+    return run_transfer_check(options, cm);
+  }
+  if (options.mode == "ensemble") {
+    return run_ensemble_comparison(options, cm);
+  }
+
+  MPM_Profiler::set_enabled(true);
+  bool counting = options.counters && MPM_Profiler::enable_counters(true);
+
+  ExportDesc export_desc;
+  export_desc.add(ExportChannel::VELOCITY, ExportType::FLOAT16)
+      .add(ExportChannel::J);
+  ParticleSnapshot snapshot;
+
+  std::string runs;
+  for (double size : options.sizes) {
+    for (int ppc : options.ppc) {
+      double base_substep_ms = 0;
+      for (int threads : options.threads) {
+        tbb::global_control parallelism(
+            tbb::global_control::max_allowed_parallelism, threads);
+
+        int particles = static_cast<int>(size);
+        std::fprintf(stderr, "particles %d, ppc %d, threads %d\n", particles,
+                     ppc, threads);
+        auto setup_start = MPM_Profiler::now();
+        auto scene = make_scene(options, particles, ppc, cm);
+        double setup_ms = (MPM_Profiler::now() - setup_start) / 1e6;
+        auto &sim = *scene.sim;
+
+        for (int step = 0; step < options.warmup; step++) {
+          sim.substep(options.dt);
+          sim.export_snapshot(export_desc, snapshot);
+        }
+        auto run_steps = [&] {
+          auto start = MPM_Profiler::now();
+          for (int step = 0; step < options.steps; step++) {
+            sim.substep(options.dt);
+            sim.export_snapshot(export_desc, snapshot);
+          }
+          return (MPM_Profiler::now() - start) / 1e6;
+        };
+        std::string overhead;
+        double unprofiled_ms = 0;
+        if (options.overhead) {
+          MPM_Profiler::set_enabled(false);
+          unprofiled_ms = run_steps();
+          MPM_Profiler::set_enabled(true);
+        }
+        MPM_Profiler::collect();
+        double profiled_ms = run_steps();
+        auto stats = MPM_Profiler::collect();
+        if (options.overhead) {
+          overhead = fmt::format(
+              ", \"profiler_overhead\": {{\"off_ms\": {}, \"on_ms\": {}, "
+              "\"ratio\": {}}}",
+              json_number(unprofiled_ms), json_number(profiled_ms),
+              json_number(profiled_ms / unprofiled_ms - 1));
+        }
+
+        const auto &info = sim.get_sim_info();
+        TrafficModel traffic;
+        traffic.particles = info.particle_size;
+        traffic.grid_size = info.grid_size;
+        traffic.active_nodes = double(sim.get_active_node_count());
+        traffic.boundary_nodes =
+            2.0 * 2 *
+            (double(info.grid_w) * info.grid_h +
+             double(info.grid_h) * info.grid_l +
+             double(info.grid_w) * info.grid_l);
+        traffic.export_bytes = 0;
+        for (auto &channel : snapshot.channels) {
+          traffic.export_bytes += channel.data.size();
+        }
+
+        double substep_bytes = 0, substep_ms = 0;
+        std::string stages;
+        for (auto &stage : stats) {
+          if (stage.count == 0) {
+            continue;
+          }
+          double mean_s = stage.total_ns / 1e9 / stage.count;
+          double bytes = traffic.bytes(stage.name);
+          if (stage.name == "substep") {
+            substep_ms = mean_s * 1e3;
+            continue;
+          }
+          substep_bytes += stage.name == "export_snapshot" ? 0 : bytes;
+          stages += fmt::format(
+              "{}\n        \"{}\": {{\"calls\": {}, \"mean_ms\": {}, "
+              "\"min_ms\": {}, \"p99_ms\": {}, \"max_ms\": {}, "
+              "\"particles_per_s\": {}, \"gb_per_s\": {}{}}}",
+              stages.empty() ? "" : ",", stage.name, stage.count,
+              json_number(mean_s * 1e3), json_number(stage.min_ns / 1e6),
+              json_number(stage.p99_ns / 1e6), json_number(stage.max_ns / 1e6),
+              json_number(info.particle_size / mean_s),
+              json_number(bytes / mean_s / 1e9),
+              counting ? ", \"counters\": " + json_counters(stage) : "");
+        }
+        if (threads == options.threads.front()) {
+          base_substep_ms = substep_ms;
+        }
+        std::string numa;
+        if (options.numa.enabled) {
+          numa = fmt::format(
+              ", \"numa\": {{\"grid_local\": {}, \"particles_local\": {}}}",
+              json_number(sim.get_grid_locality().local_fraction()),
+              json_number(sim.get_particle_locality().local_fraction()));
+        }
+
+        runs += fmt::format(
+            "{}\n    {{\"particles\": {}, \"ppc\": {}, \"threads\": {}, "
+            "\"grid\": [{}, {}, {}], \"active_nodes\": {}, "
+            "\"setup_ms\": {}{}{},\n      \"substep_ms\": {}, "
+            "\"particles_per_s\": {}, \"gb_per_s\": {}, \"speedup\": {},\n"
+            "      \"stages\": {{{}\n      }}}}",
+            runs.empty() ? "" : ",", info.particle_size, scene.ppc, threads,
+            info.grid_w, info.grid_h, info.grid_l,
+            sim.get_active_node_count(), json_number(setup_ms), numa,
+            overhead,
+            json_number(substep_ms),
+            json_number(info.particle_size / (substep_ms / 1e3)),
+            json_number(substep_bytes / (substep_ms / 1e3) / 1e9),
+            json_number(base_substep_ms / substep_ms), stages);
+      }
+    }
+  }
+
+  std::string counter_events;
+  for (int c = 0; c < PERF_COUNTER_COUNT; c++) {
+    if (counting && MPM_PerfCounters::has_counter(PerfCounter(c))) {
+      counter_events += fmt::format("{}\"{}\"",
+                                    counter_events.empty() ? "" : ", ",
+                                    MPM_PerfCounters::name(PerfCounter(c)));
+    }
+  }
+
+  std::string json = fmt::format(
+      "{{\n  \"benchmark\": \"mpm_bench\",\n"
+      "  \"hardware_threads\": {},\n  \"scalar_bytes\": {},\n"
+      "  \"model\": \"{}\",\n  \"steps\": {},\n  \"warmup\": {},\n"
+      "  \"dt\": {},\n  \"h\": {},\n"
+      "  \"counters\": {{\"enabled\": {}, \"error\": \"{}\", "
+      "\"events\": [{}]}},\n"
+      "  \"runs\": [{}\n  ]\n}}\n",
+      tbb::info::default_concurrency(), sizeof(T), options.model,
+      options.steps, options.warmup, json_number(options.dt),
+      json_number(options.h), counting ? "true" : "false",
+      counting ? "" : MPM_PerfCounters::error(), counter_events, runs);
+
+  return write_json(json, options.output) ? 0 : 1;
+}
@@ -1,7 +1,53 @@
 #include "MPM/Math/levelset.h"
+#include "MPM/mpm_pch.h"
+
+#include <tbb/parallel_for.h>
 
 namespace mpm {
 
+namespace {
+
+// closest point on triangle abc to p (Ericson, Real-Time Collision
+// Detection 5.1.5)
+VT closest_on_triangle(const VT &p, const VT &a, const VT &b, const VT &c) {
+  VT ab = b - a, ac = c - a, ap = p - a;
+  T d1 = ab.dot(ap), d2 = ac.dot(ap);
+  if (d1 <= 0 && d2 <= 0) {
+    return a;
+  }
+  VT bp = p - b;
+  T d3 = ab.dot(bp), d4 = ac.dot(bp);
+  if (d3 >= 0 && d4 <= d3) {
+    return b;
+  }
+  T vc = d1 * d4 - d3 * d2;
+  if (vc <= 0 && d1 >= 0 && d3 <= 0) {
+    return a + d1 / (d1 - d3) * ab;
+  }
+  VT cp = p - c;
+  T d5 = ab.dot(cp), d6 = ac.dot(cp);
+  if (d6 >= 0 && d5 <= d6) {
+    return c;
+  }
+  T vb = d5 * d2 - d1 * d6;
+  if (vb <= 0 && d2 >= 0 && d6 <= 0) {
+    return a + d2 / (d2 - d6) * ac;
+  }
+  T va = d3 * d6 - d5 * d4;
+  if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0) {
+    return b + (d4 - d3) / ((d4 - d3) + (d5 - d6)) * (c - b);
+  }
+  T denom = 1 / (va + vb + vc);
+  return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+// the rays of the parity test pass slightly off the node columns so they
+// do not hit mesh vertices and edges that lie exactly on the lattice
+constexpr T RAY_OFFSET_Y = T(1.234567e-5);
+constexpr T RAY_OFFSET_Z = T(2.345678e-5);
+
+} // namespace
+
 HalfPlane_LevelSet::HalfPlane_LevelSet(const VT &direction, const VT &origin)
     : direction(direction), origin(origin) {
   this->direction.normalize();
@@ -30,4 +76,175 @@ T Sphere_LevelSet::signed_distance(const VT &x) const {
 
 VT Sphere_LevelSet::normal(const VT &x) const { return x - center; }
 
-} // namespace mpm
\ No newline at end of file
+Box_LevelSet::Box_LevelSet(const VT &box_min, const VT &box_max)
+    : box_min(box_min), box_max(box_max) {}
+
+bool Box_LevelSet::inside(const VT &x) const {
+  return (x.array() >= box_min.array()).all() &&
+         (x.array() <= box_max.array()).all();
+}
+
+T Box_LevelSet::signed_distance(const VT &x) const {
+  VT q = (box_min - x).cwiseMax(x - box_max);
+  return q.cwiseMax(0).norm() + std::min(q.maxCoeff(), T(0));
+}
+
+VT Box_LevelSet::normal(const VT &x) const {
+  VT q = (box_min - x).cwiseMax(x - box_max);
+  VT n = VT::Zero();
+  if (q.maxCoeff() > 0) {
+    for (int d = 0; d < DIM; d++) {
+      n[d] = x[d] > box_max[d] ? q[d] : x[d] < box_min[d] ? -q[d] : 0;
+    }
+    return n.normalized();
+  }
+  int axis;
+  q.maxCoeff(&axis);
+  n[axis] = x[axis] - box_min[axis] < box_max[axis] - x[axis] ? -1 : 1;
+  return n;
+}
+
+Mesh_LevelSet::Mesh_LevelSet(const SurfaceMesh &mesh, T dx, int band)
+    : dx(dx), far(band * dx) {
+  mesh_min = VT::Zero();
+  mesh_max = VT::Zero();
+  std::vector<VT> vertices(mesh.vertices.size());
+  for (size_t v = 0; v < vertices.size(); v++) {
+    vertices[v] = VT(mesh.vertices[v][0], mesh.vertices[v][1],
+                     mesh.vertices[v][2]);
+    mesh_min = v == 0 ? vertices[v] : mesh_min.cwiseMin(vertices[v]);
+    mesh_max = v == 0 ? vertices[v] : mesh_max.cwiseMax(vertices[v]);
+  }
+  origin = mesh_min - VT::Constant((band + 1) * dx);
+  nodes = ((mesh_max - mesh_min) / dx).array().ceil().cast<int>() +
+          2 * (band + 1) + 1;
+  phi.assign(size_t(nodes.cast<int64_t>().prod()), float(far));
+  // vertices in node units from here on
+  for (auto &v : vertices) {
+    v = (v - origin) / dx;
+  }
+
+  // triangles by the z slabs of nodes they can cross (sign) and the slabs
+  // within the band (distance)
+  std::vector<std::vector<uint32_t>> crossing(nodes[2]), near(nodes[2]);
+  for (uint32_t t = 0; t < mesh.triangles.size(); t++) {
+    auto &tri = mesh.triangles[t];
+    T z0 = std::min({vertices[tri[0]][2], vertices[tri[1]][2],
+                     vertices[tri[2]][2]});
+    T z1 = std::max({vertices[tri[0]][2], vertices[tri[1]][2],
+                     vertices[tri[2]][2]});
+    for (int k = std::max(int(std::floor(z0)), 0);
+         k <= std::min(int(std::ceil(z1)), nodes[2] - 1); k++) {
+      crossing[k].push_back(t);
+    }
+    for (int k = std::max(int(std::floor(z0)) - band, 0);
+         k <= std::min(int(std::ceil(z1)) + band, nodes[2] - 1); k++) {
+      near[k].push_back(t);
+    }
+  }
+
+  tbb::parallel_for(0, nodes[2], [&](int k) {
+    float *slab = &phi[size_t(k) * nodes[1] * nodes[0]];
+    for (uint32_t t : near[k]) {
+      auto &tri = mesh.triangles[t];
+      const VT &a = vertices[tri[0]], &b = vertices[tri[1]],
+               &c = vertices[tri[2]];
+      VINT lo = (a.cwiseMin(b).cwiseMin(c).array() - band)
+                    .ceil()
+                    .cast<int>()
+                    .max(0);
+      VINT hi = (a.cwiseMax(b).cwiseMax(c).array() + band)
+                    .floor()
+                    .cast<int>()
+                    .min(nodes.array() - 1);
+      for (int j = lo[1]; j <= hi[1]; j++)
+        for (int i = lo[0]; i <= hi[0]; i++) {
+          VT p(i, j, k);
+          float d = float((p - closest_on_triangle(p, a, b, c)).norm() * dx);
+          float &value = slab[size_t(j) * nodes[0] + i];
+          value = std::min(value, d);
+        }
+    }
+
+    // crossings of the rays along x, one per node column of the slab
+    std::vector<std::vector<T>> columns(nodes[1]);
+    T z = k + RAY_OFFSET_Z;
+    for (uint32_t t : crossing[k]) {
+      auto &tri = mesh.triangles[t];
+      const VT &a = vertices[tri[0]], &b = vertices[tri[1]],
+               &c = vertices[tri[2]];
+      T area = (b[1] - a[1]) * (c[2] - a[2]) - (b[2] - a[2]) * (c[1] - a[1]);
+      if (area == 0) {
+        continue;
+      }
+      int j0 = std::max(int(std::ceil(std::min({a[1], b[1], c[1]}))) - 1, 0);
+      int j1 = std::min(int(std::floor(std::max({a[1], b[1], c[1]}))),
+                        nodes[1] - 1);
+      for (int j = j0; j <= j1; j++) {
+        T y = j + RAY_OFFSET_Y;
+        // barycentric weights of the ray in the yz projection
+        T wa = (b[1] - y) * (c[2] - z) - (b[2] - z) * (c[1] - y);
+        T wb = (c[1] - y) * (a[2] - z) - (c[2] - z) * (a[1] - y);
+        T wc = area - wa - wb;
+        if ((wa < 0 || wb < 0 || wc < 0) && (wa > 0 || wb > 0 || wc > 0)) {
+          continue;
+        }
+        columns[j].push_back((wa * a[0] + wb * b[0] + wc * c[0]) / area);
+      }
+    }
+    for (int j = 0; j < nodes[1]; j++) {
+      auto &xs = columns[j];
+      std::sort(xs.begin(), xs.end());
+      size_t passed = 0;
+      for (int i = 0; i < nodes[0]; i++) {
+        while (passed < xs.size() && xs[passed] < i) {
+          passed++;
+        }
+        if (passed & 1) {
+          float &value = slab[size_t(j) * nodes[0] + i];
+          value = -value;
+        }
+      }
+    }
+  });
+}
+
+bool Mesh_LevelSet::inside(const VT &x) const {
+  return signed_distance(x) <= 0;
+}
+
+T Mesh_LevelSet::signed_distance(const VT &x) const {
+  VT u = (x - origin) / dx;
+  VT clamped = u.cwiseMax(0).cwiseMin((nodes.array() - 1).cast<T>().matrix());
+  VINT base = clamped.array()
+                  .floor()
+                  .cast<int>()
+                  .min(nodes.array() - 2)
+                  .max(0);
+  VT f = clamped - base.cast<T>();
+  T value = 0;
+  for (int corner = 0; corner < 8; corner++) {
+    VINT offset(corner & 1, corner >> 1 & 1, corner >> 2 & 1);
+    VINT node = base + offset;
+    T weight = 1;
+    for (int d = 0; d < DIM; d++) {
+      weight *= offset[d] ? f[d] : 1 - f[d];
+    }
+    value += weight * node_phi(node[0], node[1], node[2]);
+  }
+  // past the sampled nodes the distance only grows
+  return value + (u - clamped).norm() * dx;
+}
+
+VT Mesh_LevelSet::normal(const VT &x) const {
+  VT n;
+  for (int d = 0; d < DIM; d++) {
+    VT step = VT::Zero();
+    step[d] = dx;
+    n[d] = signed_distance(x + step) - signed_distance(x - step);
+  }
+  T norm = n.norm();
+  return norm > 0 ? VT(n / norm) : n;
+}
+
+} // namespace mpm
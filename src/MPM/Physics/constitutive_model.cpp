@@ -6,6 +6,26 @@ std::tuple<MT, MT> MPM_CM::calc_mixed_stress_tensor(const Particle &particle) {
   return {calc_stress_tensor(particle), MT::Zero()};
 }
 
+void MPM_CM::calc_kirchhoff_stress_batch(const Particle *particles, int count,
+                                         MT *tau) {
+  for (int i = 0; i < count; i++) {
+    auto [stress_F, stress_J] = calc_mixed_stress_tensor(particles[i]);
+    tau[i] = stress_F * particles[i].F.transpose() + stress_J;
+  }
+}
+
+template <class Model>
+void MPM_CM_Batched<Model>::calc_kirchhoff_stress_batch(
+    const Particle *particles, int count, MT *tau) {
+  auto model = static_cast<Model *>(this);
+  for (int i = 0; i < count; i++) {
+    // qualified call, bound at compile time
+    auto [stress_F, stress_J] = model->Model::calc_mixed_stress_tensor(
+        particles[i]);
+    tau[i] = stress_F * particles[i].F.transpose() + stress_J;
+  }
+}
+
 MT NeoHookean_Piola::calc_stress_tensor(const Particle &particle) {
   auto m = particle.material;
   auto F = particle.F;
@@ -26,6 +46,11 @@ T NeoHookean_Piola::calc_psi(const Particle &particle) {
   return psi;
 }
 
+std::tuple<MT, MT>
+NeoHookean_Piola::calc_mixed_stress_tensor(const Particle &particle) {
+  return {NeoHookean_Piola::calc_stress_tensor(particle), MT::Zero()};
+}
+
 MT QuatraticVolumePenalty::calc_stress_tensor(const Particle &particle) {
   auto m = particle.material;
   auto F = particle.F;
@@ -70,6 +95,11 @@ T NeoHookean_Fluid::calc_psi(const Particle &particle) {
   return psi;
 }
 
+std::tuple<MT, MT>
+NeoHookean_Fluid::calc_mixed_stress_tensor(const Particle &particle) {
+  return {NeoHookean_Fluid::calc_stress_tensor(particle), MT::Zero()};
+}
+
 MT CDMPM_Fluid::calc_stress_tensor(const Particle &particle) {
   throw std::logic_error("function not implement yet");
 }
@@ -98,4 +128,9 @@ CDMPM_Fluid::calc_mixed_stress_tensor(const Particle &particle) {
   return {MT::Zero(), piola};
 }
 
+template class MPM_CM_Batched<NeoHookean_Piola>;
+template class MPM_CM_Batched<QuatraticVolumePenalty>;
+template class MPM_CM_Batched<NeoHookean_Fluid>;
+template class MPM_CM_Batched<CDMPM_Fluid>;
+
 } // namespace mpm
\ No newline at end of file
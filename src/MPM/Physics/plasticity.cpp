@@ -16,14 +16,13 @@ bool vonMises::projectStrain(Particle &particle) {
   VT epsilon_dev = epsilon - (trace_epsilon / 3) * VT::Ones();
   T epsilon_dev_norm = epsilon_dev.norm();
 
-  T delta_gamma = epsilon_dev_norm - yield_stress / (2 * c->mu);
+  // hardening
+  T yield = yield_stress + xi * particle.gamma_p;
+  T delta_gamma = epsilon_dev_norm - yield / (2 * c->mu);
   if (delta_gamma < 0) { // case I
     return false;
   }
-  alpha += sqrt(2.f / 3.f) * delta_gamma;
-
-  // hardening
-  yield_stress += xi * delta_gamma;
+  particle.gamma_p += delta_gamma;
 
   VT H = epsilon - delta_gamma / epsilon_dev_norm * epsilon_dev; // case II
   F = U * vectorToMatrix(H.array().exp()) * V.transpose();
@@ -31,7 +30,6 @@ bool vonMises::projectStrain(Particle &particle) {
 }
 
 bool Snow::projectStrain(Particle &particle) {
-  auto c = particle.material;
   auto &F = particle.F;
   MT U, V;
   VT Sigma;
@@ -47,7 +45,7 @@ bool Snow::projectStrain(Particle &particle) {
   MT Fe = U * sigma_m * V.transpose();
   // T Jp_new = std::max(std::min(Jp * F.determinant() / Fe_det, max_Jp),
   // min_Jp);
-  T Jp_new = Jp * F.determinant() / Fe_det;
+  T Jp_new = particle.Jp * F.determinant() / Fe_det;
   if (!(Jp_new <= max_Jp))
     Jp_new = max_Jp;
   if (!(Jp_new >= min_Jp))
@@ -56,7 +54,7 @@ bool Snow::projectStrain(Particle &particle) {
   F = Fe;
   /*c->mu *= std::exp(psi * (Jp - Jp_new));
   c->lambda *= std::exp(psi * (Jp - Jp_new));*/
-  Jp = Jp_new;
+  particle.Jp = Jp_new;
 
   return false;
 }
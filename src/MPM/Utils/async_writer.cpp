@@ -0,0 +1,93 @@
+#include "MPM/Utils/async_writer.h"
+#include "MPM/Utils/io.h"
+#include "MPM/mpm_pch.h"
+
+namespace mpm {
+
+MPM_AsyncWriter::MPM_AsyncWriter(int num_workers, int num_buffers)
+    : MPM_AsyncWriter(
+          [](const std::string &path, const Snapshot &snapshot) {
+            return write_particles(path, snapshot);
+          },
+          num_workers, num_buffers) {}
+
+MPM_AsyncWriter::MPM_AsyncWriter(WriteFunc write_func, int num_workers,
+                                 int num_buffers)
+    : write_func(std::move(write_func)) {
+  MPM_ASSERT(num_workers > 0 && num_buffers > 0,
+             "ASYNC WRITER NEEDS AT LEAST ONE WORKER AND ONE BUFFER");
+
+  // one buffer is being filled while the others are in flight,
+  // so more workers than buffers would never be busy
+  num_workers = std::min(num_workers, num_buffers);
+
+  for (int i = 0; i < num_buffers; i++) {
+    buffers.emplace_back(std::make_unique<Snapshot>());
+    free_buffers.push(buffers.back().get());
+  }
+  for (int i = 0; i < num_workers; i++) {
+    workers.emplace_back([this] { worker_loop(); });
+  }
+}
+
+MPM_AsyncWriter::~MPM_AsyncWriter() {
+  flush();
+  // an empty job tells a worker to quit
+  for (size_t i = 0; i < workers.size(); i++) {
+    jobs.push(Job());
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+MPM_AsyncWriter::Snapshot *MPM_AsyncWriter::acquire() {
+  Snapshot *snapshot = nullptr;
+  if (!free_buffers.try_pop(snapshot)) {
+    MPM_SCOPED_PROFILE("async_writer stall");
+    free_buffers.pop(snapshot);
+  }
+  return snapshot;
+}
+
+void MPM_AsyncWriter::submit(const std::string &path, Snapshot *snapshot) {
+  MPM_ASSERT(snapshot != nullptr, "SUBMIT A NULL SNAPSHOT TO ASYNC WRITER");
+  {
+    std::lock_guard<std::mutex> lock(pending_mutex);
+    pending_count++;
+  }
+  jobs.push(Job{path, snapshot});
+}
+
+bool MPM_AsyncWriter::flush() {
+  std::unique_lock<std::mutex> lock(pending_mutex);
+  pending_cv.wait(lock, [this] { return pending_count == 0; });
+  return failed_count == 0;
+}
+
+void MPM_AsyncWriter::worker_loop() {
+  Job job;
+  while (true) {
+    jobs.pop(job);
+    if (!job.snapshot) {
+      return;
+    }
+
+    {
+      MPM_PROFILE_STAGE("async_write");
+      if (!write_func(job.path, *job.snapshot)) {
+        MPM_ERROR("async writer failed to write {}", job.path);
+        failed_count++;
+      }
+    }
+    free_buffers.push(job.snapshot);
+
+    {
+      std::lock_guard<std::mutex> lock(pending_mutex);
+      pending_count--;
+    }
+    pending_cv.notify_all();
+  }
+}
+
+} // namespace mpm
@@ -1,57 +1,410 @@
 #include "MPM/Utils/io.h"
+#include "MPM/Utils/half.h"
+#include "MPM/Utils/mapped_file.h"
 #include "MPM/mpm_pch.h"
 #include "Partio.h"
+#include "io/ZIP.h"
+
+#include <charconv>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
 
 namespace mpm {
 
-bool read_particles(const std::string &model_path, std::vector<VT> &positions) {
-  std::ifstream input(model_path);
-  std::string line;
-  std::stringstream ss;
+namespace {
+
+// bytes of text parsed by one task
+constexpr size_t LOAD_CHUNK_SIZE = 1 << 20;
+
+struct ParticleCacheHeader {
+  char magic[4] = {'M', 'P', 'C', 'H'};
+  uint32_t version = 1;
+  uint32_t dim = DIM;
+  uint32_t scalar_size = sizeof(T);
+  uint64_t source_size = 0;
+  int64_t source_mtime = 0;
+  uint64_t count = 0;
+};
+
+std::string particle_cache_path(const std::string &model_path) {
+  return model_path + ".mpmcache";
+}
+
+bool stat_source(const std::string &path, uint64_t &size, int64_t &mtime) {
+  std::error_code ec;
+  size = std::filesystem::file_size(path, ec);
+  if (ec) {
+    return false;
+  }
+  mtime = std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+  return !ec;
+}
+
+bool read_particle_cache(const std::string &model_path, uint64_t source_size,
+                         int64_t source_mtime, std::vector<VT> &positions) {
+  auto cache_path = particle_cache_path(model_path);
+  std::error_code ec;
+  uint64_t cache_size = std::filesystem::file_size(cache_path, ec);
+  std::ifstream input(cache_path, std::ios::in | std::ios::binary);
+  if (ec || !input || cache_size < sizeof(ParticleCacheHeader)) {
+    return false;
+  }
+
+  ParticleCacheHeader expected, header;
+  input.read(reinterpret_cast<char *>(&header), sizeof(header));
+  if (!input || std::memcmp(header.magic, expected.magic, 4) != 0 ||
+      header.version != expected.version || header.dim != expected.dim ||
+      header.scalar_size != expected.scalar_size ||
+      header.source_size != source_size ||
+      header.source_mtime != source_mtime) {
+    return false;
+  }
+  // a truncated or damaged cache must not size the buffer
+  if (header.count > (cache_size - sizeof(header)) / sizeof(VT)) {
+    MPM_WARN("particle cache {} is truncated, reloading the source",
+             cache_path);
+    return false;
+  }
+
+  positions.resize(header.count);
+  input.read(reinterpret_cast<char *>(positions.data()),
+             header.count * sizeof(VT));
+  return bool(input);
+}
+
+void write_particle_cache(const std::string &model_path, uint64_t source_size,
+                          int64_t source_mtime,
+                          const std::vector<VT> &positions) {
+  ParticleCacheHeader header;
+  header.source_size = source_size;
+  header.source_mtime = source_mtime;
+  header.count = positions.size();
+
+  auto cache_path = particle_cache_path(model_path);
+  std::ofstream output(cache_path, std::ios::out | std::ios::binary);
+  output.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  output.write(reinterpret_cast<const char *>(positions.data()),
+               positions.size() * sizeof(VT));
+  if (!output) {
+    MPM_WARN("failed to write particle cache {}", cache_path);
+  }
+}
+
+inline bool is_blank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+inline const char *skip_blank(const char *first, const char *last) {
+  while (first != last && is_blank(*first)) {
+    ++first;
+  }
+  return first;
+}
+
+// parse one line of either `v x y z` (obj) or bare `x y z` (xyz),
+// comments, groups, normals and faces are skipped
+bool parse_point_line(const char *first, const char *last, VT &pos) {
+  first = skip_blank(first, last);
+  if (first == last) {
+    return false;
+  }
+  if (*first == 'v') {
+    if (first + 1 == last || !is_blank(first[1])) {
+      return false; // vn, vt, ...
+    }
+    ++first;
+  } else if (!(std::isdigit(static_cast<unsigned char>(*first)) ||
+               *first == '-' || *first == '+' || *first == '.')) {
+    return false;
+  }
+
+  for (int k = 0; k < DIM; k++) {
+    first = skip_blank(first, last);
+    if (first != last && *first == '+') {
+      ++first; // from_chars rejects an explicit plus sign
+    }
+    auto [ptr, ec] = std::from_chars(first, last, pos[k]);
+    if (ec != std::errc()) {
+      return false;
+    }
+    first = ptr;
+  }
+  return true;
+}
+
+void parse_point_chunk(const char *first, const char *last,
+                       std::vector<VT> &points) {
   VT pos;
-  T x, y, z;
-
-  if (input) {
-    positions.clear();
-    while (std::getline(input, line)) {
-      if (line[0] == 'v') {
-        ss.clear();
-        ss.str(line.c_str() + 1);
-        if constexpr (DIM == 3) {
-          ss >> x >> y >> z;
-          pos << x, y, z;
-        } else if constexpr (DIM == 2) {
-          ss >> x >> y;
-          pos << x, y;
+  while (first < last) {
+    auto eol =
+        static_cast<const char *>(std::memchr(first, '\n', last - first));
+    if (!eol) {
+      eol = last;
+    }
+    if (parse_point_line(first, eol, pos)) {
+      points.push_back(pos);
+    }
+    first = eol + 1;
+  }
+}
+
+} // namespace
+
+bool read_particles(const std::string &model_path, std::vector<VT> &positions,
+                    bool use_cache) {
+  uint64_t source_size = 0;
+  int64_t source_mtime = 0;
+  if (!stat_source(model_path, source_size, source_mtime)) {
+    MPM_ERROR("model_path:{} not found", model_path);
+    return false;
+  }
+
+  if (use_cache &&
+      read_particle_cache(model_path, source_size, source_mtime, positions)) {
+    MPM_INFO("read in particles[size: {}] from {} (cached) SUCCESS",
+             positions.size(), model_path);
+    return true;
+  }
+
+  MPM_MappedFile file(model_path);
+  if (!file.is_open()) {
+    MPM_ERROR("model_path:{} can not be opened", model_path);
+    return false;
+  }
+
+  // split into chunks that end on a newline so no line is cut in two
+  const char *begin = file.data();
+  const char *end = begin + file.size();
+  std::vector<const char *> bounds{begin};
+  while (bounds.back() != end) {
+    const char *cut = bounds.back() + std::min<size_t>(LOAD_CHUNK_SIZE,
+                                                       end - bounds.back());
+    if (cut != end) {
+      auto eol = static_cast<const char *>(std::memchr(cut, '\n', end - cut));
+      cut = eol ? eol + 1 : end;
+    }
+    bounds.push_back(cut);
+  }
+
+  const int num_chunks = static_cast<int>(bounds.size()) - 1;
+  std::vector<std::vector<VT>> chunk_points(num_chunks);
+  tbb::parallel_for(0, num_chunks, [&](int i) {
+    parse_point_chunk(bounds[i], bounds[i + 1], chunk_points[i]);
+  });
+
+  std::vector<size_t> offsets(num_chunks + 1, 0);
+  for (int i = 0; i < num_chunks; i++) {
+    offsets[i + 1] = offsets[i] + chunk_points[i].size();
+  }
+  positions.resize(offsets.back());
+  tbb::parallel_for(0, num_chunks, [&](int i) {
+    std::copy(chunk_points[i].begin(), chunk_points[i].end(),
+              positions.begin() + offsets[i]);
+  });
+
+  MPM_INFO("read in particles[size: {}] from {} SUCCESS", positions.size(),
+           model_path);
+  if (use_cache) {
+    write_particle_cache(model_path, source_size, source_mtime, positions);
+  }
+  return true;
+}
+
+bool read_mesh(const std::string &model_path, SurfaceMesh &mesh) {
+  MPM_MappedFile file(model_path);
+  if (!file.is_open()) {
+    MPM_ERROR("model_path:{} can not be opened", model_path);
+    return false;
+  }
+  mesh.clear();
+  const char *first = file.data();
+  const char *end = first + file.size();
+  std::vector<int64_t> polygon;
+  int line = 0;
+  for (; first < end; ++line) {
+    auto eol = static_cast<const char *>(std::memchr(first, '\n', end - first));
+    if (!eol) {
+      eol = end;
+    }
+    VT pos;
+    const char *cursor = skip_blank(first, eol);
+    if (cursor != eol && *cursor == 'v' && parse_point_line(first, eol, pos)) {
+      mesh.vertices.push_back({float(pos[0]), float(pos[1]), float(pos[2])});
+    } else if (cursor + 1 < eol && cursor[0] == 'f' && is_blank(cursor[1])) {
+      // `f a b c ...`, every corner may carry /uv/normal and negative
+      // indices count back from the last vertex
+      polygon.clear();
+      cursor++;
+      while ((cursor = skip_blank(cursor, eol)) != eol) {
+        int64_t index = 0;
+        auto [ptr, ec] = std::from_chars(cursor, eol, index);
+        if (ec != std::errc() || index == 0) {
+          MPM_ERROR("{}:{}: malformed face", model_path, line + 1);
+          return false;
+        }
+        index = index > 0 ? index - 1 : int64_t(mesh.vertices.size()) + index;
+        if (index < 0 || index >= int64_t(mesh.vertices.size())) {
+          MPM_ERROR("{}:{}: face index out of range", model_path, line + 1);
+          return false;
         }
-        positions.push_back(pos);
+        polygon.push_back(index);
+        cursor = ptr;
+        while (cursor != eol && !is_blank(*cursor)) {
+          cursor++;
+        }
+      }
+      // polygons as triangle fans
+      for (size_t i = 2; i < polygon.size(); i++) {
+        mesh.triangles.push_back({uint32_t(polygon[0]),
+                                  uint32_t(polygon[i - 1]),
+                                  uint32_t(polygon[i])});
       }
     }
+    first = eol + 1;
+  }
+  MPM_INFO("read in mesh[vertices: {}, triangles: {}] from {} SUCCESS",
+           mesh.vertices.size(), mesh.triangles.size(), model_path);
+  return true;
+}
 
-    MPM_INFO("read in particles[size: {}] from {} SUCCESS", positions.size(),
-             model_path);
-    return true;
-  } else {
-    MPM_ERROR("model_path:{} not found", model_path);
+namespace {
+
+// particles per parallel encoding task
+constexpr size_t EXPORT_GRAIN = 1 << 14;
+
+bool ends_with(const std::string &str, const std::string &suffix) {
+  return str.size() >= suffix.size() &&
+         str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+template <class Scalar> void put_big_endian(char *dst, Scalar value) {
+  static_assert(sizeof(Scalar) == 4, "bgeo stores 32bit words");
+  uint32_t word;
+  std::memcpy(&word, &value, sizeof(word));
+  dst[0] = char(word >> 24);
+  dst[1] = char(word >> 16);
+  dst[2] = char(word >> 8);
+  dst[3] = char(word);
+}
+
+template <class Scalar> void append_big_endian(std::string &out, Scalar value) {
+  char bytes[sizeof(Scalar)];
+  put_big_endian(bytes, value);
+  out.append(bytes, sizeof(Scalar));
+}
+
+void append_big_endian(std::string &out, uint16_t value) {
+  out.push_back(char(value >> 8));
+  out.push_back(char(value));
+}
+
+struct BgeoAttr {
+  std::string name;
+  int houdini_type; // 0 float, 1 int, 5 vector
+  int count;
+};
+
+// Houdini bgeo V5 point cloud, the same layout Partio's writeBGEO produces.
+// Every point is a record of 32bit words: x y z w followed by the
+// attributes. encode(begin, end, records) fills the records of a particle
+// range and runs in parallel over one contiguous buffer.
+template <class Encode>
+bool write_bgeo(const std::string &write_path, size_t n,
+                const std::vector<BgeoAttr> &attrs, bool compressed,
+                Encode &&encode) {
+  int record_words = 4;
+  for (auto &attr : attrs) {
+    record_words += attr.count;
+  }
+
+  std::string header;
+  append_big_endian(header, int((((('B' << 8) | 'g') << 8) | 'e') << 8 | 'o'));
+  header.push_back('V');
+  // version, points, prims, point/prim groups, point/vertex/prim/detail
+  // attributes
+  for (int v : {5, int(n), 0, 0, 0, int(attrs.size()), 0, 0, 0}) {
+    append_big_endian(header, v);
+  }
+  for (auto &attr : attrs) {
+    append_big_endian(header, uint16_t(attr.name.size()));
+    header.append(attr.name);
+    append_big_endian(header, uint16_t(attr.count));
+    append_big_endian(header, attr.houdini_type);
+    for (int k = 0; k < attr.count; k++) {
+      append_big_endian(header, 0); // default value
+    }
+  }
+
+  const size_t record_size = record_words * sizeof(float);
+  std::vector<char> body(n * record_size);
+  tbb::parallel_for(tbb::blocked_range<size_t>(0, n, EXPORT_GRAIN),
+                    [&](const tbb::blocked_range<size_t> &r) {
+                      encode(r.begin(), r.end(), record_size,
+                             body.data() + r.begin() * record_size);
+                    });
+
+  std::unique_ptr<std::ostream> output(
+      compressed
+          ? Partio::Gzip_Out(write_path, std::ios::out | std::ios::binary)
+          : new std::ofstream(write_path, std::ios::out | std::ios::binary));
+  if (!output || !*output) {
+    MPM_ERROR("unable to open {} for writing", write_path);
     return false;
   }
+  output->write(header.data(), header.size());
+  output->write(body.data(), body.size());
+  // end of the (empty) detail attributes and the end-of-geometry marker
+  output->put(char(0x00));
+  output->put(char(0xff));
+  return bool(*output);
 }
 
-bool write_particles(const std::string &write_path,
-                     const std::vector<VT> &positions) {
-  Partio::ParticlesDataMutable *parts = Partio::create();
-  Partio::ParticleAttribute pos_attr =
-      parts->addAttribute("position", Partio::VECTOR, 3);
-  Partio::ParticleAttribute index_attr =
-      parts->addAttribute("index", Partio::INT, 1);
+int bgeo_houdini_type(const ChannelBuffer &buffer) {
+  if (buffer.type == ExportType::INT32) {
+    return 1;
+  }
+  return buffer.components == 3 ? 5 : 0;
+}
+
+Partio::ParticleAttributeType partio_type(const ChannelBuffer &buffer) {
+  if (buffer.type == ExportType::INT32) {
+    return Partio::INT;
+  }
+  return buffer.components == 3 ? Partio::VECTOR : Partio::FLOAT;
+}
 
-  for (auto i = 0; i < positions.size(); i++) {
-    int idx = parts->addParticle();
-    auto *p = parts->dataWrite<Eigen::Vector3f>(pos_attr, idx);
-    auto *index = parts->dataWrite<int>(index_attr, idx);
+bool write_partio(const std::string &write_path,
+                  const ParticleSnapshot &snapshot) {
+  const int n = snapshot.size;
+  Partio::ParticlesDataMutable *parts = Partio::create();
+  std::vector<Partio::ParticleAttribute> attrs;
+  for (auto &buffer : snapshot.channels) {
+    attrs.push_back(parts->addAttribute(
+        buffer.name.c_str(), partio_type(buffer), buffer.components));
+  }
 
-    *p = positions[i].cast<float>();
-    *index = i;
+  if (n > 0) {
+    parts->addParticles(n);
+    // ParticlesSimple keeps every attribute in one contiguous array
+    for (size_t c = 0; c < snapshot.channels.size(); c++) {
+      auto &buffer = snapshot.channels[c];
+      auto count = size_t(n) * buffer.components;
+      if (buffer.type == ExportType::INT32) {
+        std::memcpy(parts->dataWrite<int>(attrs[c], 0), buffer.data.data(),
+                    count * sizeof(int));
+      } else if (buffer.type == ExportType::FLOAT32) {
+        std::memcpy(parts->dataWrite<float>(attrs[c], 0), buffer.data.data(),
+                    count * sizeof(float));
+      } else {
+        auto *dst = parts->dataWrite<float>(attrs[c], 0);
+        auto *src = buffer.as<uint16_t>();
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, count, EXPORT_GRAIN),
+                          [&](const tbb::blocked_range<size_t> &r) {
+                            for (auto i = r.begin(); i != r.end(); ++i) {
+                              dst[i] = half_to_float(src[i]);
+                            }
+                          });
+      }
+    }
   }
 
   Partio::write(write_path.c_str(), *parts);
@@ -59,6 +412,219 @@ bool write_particles(const std::string &write_path,
   return true;
 }
 
+} // namespace
+
+bool write_particles(const std::string &write_path,
+                     const std::vector<VT> &positions) {
+  return write_particles(write_path,
+                         StridedSpan<VT>(positions.data(), positions.size()));
+}
+
+bool write_particles(const std::string &write_path,
+                     const StridedSpan<VT> &positions) {
+  bool bgeo = ends_with(write_path, ".bgeo");
+  if (bgeo || ends_with(write_path, ".bgeo.gz")) {
+    return write_bgeo(
+        write_path, positions.size(), {}, !bgeo,
+        [&](size_t begin, size_t end, size_t record_size, char *records) {
+          for (auto i = begin; i != end; ++i, records += record_size) {
+            const VT &pos = positions[i];
+            for (int k = 0; k < 3; k++) {
+              put_big_endian(records + 4 * k, float(pos[k]));
+            }
+            put_big_endian(records + 12, 1.0f);
+          }
+        });
+  }
+
+  // other formats go through Partio, but fill its arrays in bulk
+  ParticleSnapshot snapshot;
+  snapshot.size = static_cast<int>(positions.size());
+  snapshot.channels.resize(1);
+  auto &buffer = snapshot.channels[0];
+  buffer.channel = ExportChannel::POSITION;
+  buffer.type = ExportType::FLOAT32;
+  buffer.components = 3;
+  buffer.name = export_channel_name(ExportChannel::POSITION);
+  buffer.data.resize(positions.size() * buffer.element_size());
+  auto *pos = buffer.as<float>();
+  tbb::parallel_for(tbb::blocked_range<size_t>(0, positions.size(),
+                                               EXPORT_GRAIN),
+                    [&](const tbb::blocked_range<size_t> &r) {
+                      for (auto i = r.begin(); i != r.end(); ++i) {
+                        for (int k = 0; k < 3; k++) {
+                          pos[3 * i + k] = float(positions[i][k]);
+                        }
+                      }
+                    });
+  return write_partio(write_path, snapshot);
+}
+
+bool write_particles(const std::string &write_path,
+                     const ParticleSnapshot &snapshot) {
+  MPM_ASSERT(!snapshot.channels.empty() &&
+                 snapshot.channels[0].channel == ExportChannel::POSITION,
+             "SNAPSHOT SHOULD START WITH THE POSITION CHANNEL");
+
+  bool bgeo = ends_with(write_path, ".bgeo");
+  if (!bgeo && !ends_with(write_path, ".bgeo.gz")) {
+    return write_partio(write_path, snapshot);
+  }
+
+  std::vector<BgeoAttr> attrs;
+  for (size_t c = 1; c < snapshot.channels.size(); c++) {
+    auto &buffer = snapshot.channels[c];
+    attrs.push_back(
+        {buffer.name, bgeo_houdini_type(buffer), buffer.components});
+  }
+
+  return write_bgeo(
+      write_path, snapshot.size, attrs, !bgeo,
+      [&](size_t begin, size_t end, size_t record_size, char *records) {
+        // channel by channel so each source buffer streams through once
+        size_t word = 0;
+        for (size_t c = 0; c < snapshot.channels.size(); c++) {
+          auto &buffer = snapshot.channels[c];
+          char *dst = records + word * 4;
+          for (auto i = begin; i != end; ++i, dst += record_size) {
+            for (int k = 0; k < buffer.components; k++) {
+              if (buffer.type == ExportType::INT32) {
+                put_big_endian(dst + 4 * k,
+                               buffer.as<int32_t>()[i * buffer.components + k]);
+              } else {
+                put_big_endian(dst + 4 * k, buffer.get(i, k));
+              }
+            }
+          }
+          // position is followed by the homogeneous w
+          word += buffer.components + (c == 0 ? 1 : 0);
+        }
+        char *w = records + 12;
+        for (auto i = begin; i != end; ++i, w += record_size) {
+          put_big_endian(w, 1.0f);
+        }
+      });
+}
+
+bool write_mesh(const std::string &write_path, const SurfaceMesh &mesh) {
+  std::ofstream out(write_path, std::ios::binary);
+  if (!out) {
+    MPM_ERROR("unable to open {} for writing", write_path);
+    return false;
+  }
+  const size_t nv = mesh.vertices.size(), nf = mesh.triangles.size();
+  const size_t chunks = (std::max(nv, nf) + EXPORT_GRAIN - 1) / EXPORT_GRAIN;
+  std::vector<std::string> vertex_text(chunks), face_text(chunks);
+
+  if (ends_with(write_path, ".ply")) {
+    // vertices are raw floats, faces a uchar count and three int32 indices;
+    // both match the host byte order on the little endian targets
+    out << "ply\nformat binary_little_endian 1.0\n"
+        << "element vertex " << nv << "\nproperty float x\n"
+        << "property float y\nproperty float z\n"
+        << "element face " << nf << "\n"
+        << "property list uchar int vertex_indices\nend_header\n";
+    out.write(reinterpret_cast<const char *>(mesh.vertices.data()),
+              std::streamsize(nv * sizeof(mesh.vertices[0])));
+    constexpr size_t FACE_BYTES = 1 + 3 * sizeof(int32_t);
+    std::string faces(nf * FACE_BYTES, '\0');
+    tbb::parallel_for(
+        tbb::blocked_range<size_t>(0, nf, EXPORT_GRAIN),
+        [&](const tbb::blocked_range<size_t> &r) {
+          for (auto i = r.begin(); i != r.end(); ++i) {
+            char *dst = &faces[i * FACE_BYTES];
+            dst[0] = 3;
+            for (int k = 0; k < 3; k++) {
+              int32_t id = static_cast<int32_t>(mesh.triangles[i][k]);
+              std::memcpy(dst + 1 + 4 * k, &id, sizeof(id));
+            }
+          }
+        });
+    out.write(faces.data(), std::streamsize(faces.size()));
+    return bool(out);
+  }
+
+  tbb::parallel_for(size_t(0), chunks, [&](size_t c) {
+    fmt::memory_buffer buffer;
+    for (size_t i = c * EXPORT_GRAIN; i < std::min(nv, (c + 1) * EXPORT_GRAIN);
+         i++) {
+      auto &v = mesh.vertices[i];
+      fmt::format_to(buffer, "v {} {} {}\n", v[0], v[1], v[2]);
+    }
+    vertex_text[c] = fmt::to_string(buffer);
+    buffer.clear();
+    // obj indices are 1-based
+    for (size_t i = c * EXPORT_GRAIN; i < std::min(nf, (c + 1) * EXPORT_GRAIN);
+         i++) {
+      auto &f = mesh.triangles[i];
+      fmt::format_to(buffer, "f {} {} {}\n", f[0] + 1, f[1] + 1, f[2] + 1);
+    }
+    face_text[c] = fmt::to_string(buffer);
+  });
+  for (auto &text : vertex_text) {
+    out << text;
+  }
+  for (auto &text : face_text) {
+    out << text;
+  }
+  return bool(out);
+}
+
+bool write_grid(const std::string &write_path, const GridSnapshot &snapshot) {
+  std::string header("MPMGRID1");
+  auto append = [&](auto value) {
+    header.append(reinterpret_cast<const char *>(&value), sizeof(value));
+  };
+  for (int d = 0; d < DIM; d++) {
+    append(int32_t(snapshot.dims[d]));
+  }
+  append(float(snapshot.h));
+  append(float(snapshot.time));
+  append(int32_t(snapshot.frame));
+  append(int32_t(snapshot.block_size));
+  append(int32_t(snapshot.blocks.size()));
+  append(int32_t(snapshot.channels.size()));
+  const size_t tile_nodes =
+      size_t(snapshot.block_size) * snapshot.block_size * snapshot.block_size;
+  size_t record_size = 3 * sizeof(int32_t) + snapshot.mask_bytes();
+  for (auto &buffer : snapshot.channels) {
+    append(int32_t(buffer.components));
+    append(int32_t(buffer.type == ExportType::FLOAT16 ? 1 : 0));
+    append(int32_t(buffer.name.size()));
+    header += buffer.name;
+    record_size += tile_nodes * buffer.element_size();
+  }
+
+  // every tile encodes into its own slot of one buffer
+  const size_t nb = snapshot.blocks.size();
+  std::string body(nb * record_size, '\0');
+  tbb::parallel_for(size_t(0), nb, [&](size_t b) {
+    char *dst = &body[b * record_size];
+    for (int d = 0; d < DIM; d++) {
+      int32_t coord = snapshot.blocks[b][d];
+      std::memcpy(dst, &coord, sizeof(coord));
+      dst += sizeof(coord);
+    }
+    std::memcpy(dst, snapshot.masks.data() + b * snapshot.mask_bytes(),
+                snapshot.mask_bytes());
+    dst += snapshot.mask_bytes();
+    for (auto &buffer : snapshot.channels) {
+      size_t tile_bytes = tile_nodes * buffer.element_size();
+      std::memcpy(dst, buffer.data.data() + b * tile_bytes, tile_bytes);
+      dst += tile_bytes;
+    }
+  });
+
+  std::ofstream out(write_path, std::ios::binary);
+  if (!out) {
+    MPM_ERROR("unable to open {} for writing", write_path);
+    return false;
+  }
+  out.write(header.data(), std::streamsize(header.size()));
+  out.write(body.data(), std::streamsize(body.size()));
+  return bool(out);
+}
+
 template <typename Vec> void read_from_string(Vec &x, const char *str) {}
 
 } // namespace mpm
\ No newline at end of file
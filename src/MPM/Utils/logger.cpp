@@ -1,12 +1,69 @@
 #include "MPM/Utils/logger.h"
 
+#include "spdlog/async.h"
+
+#include <mutex>
+#include <vector>
+
 namespace mpm {
 
+namespace {
+struct AggregateSite {
+  spdlog::level::level_enum level;
+  const char *summary;
+};
+std::mutex g_site_mutex;
+std::atomic<int> g_site_count{0};
+AggregateSite g_sites[MPMLogAggregates::MAX_SITES];
+} // namespace
+
 std::shared_ptr<spdlog::logger> MPMLog::s_logger;
-void MPMLog::init() {
-  s_logger = spdlog::stdout_color_mt("MPM");
+void MPMLog::init(bool async, size_t queue_size) {
+  spdlog::drop("MPM");
+  if (async) {
+    spdlog::init_thread_pool(queue_size, 1);
+    auto sink = std::make_shared<spdlog::sinks::stdout_color_sink_mt>();
+    s_logger = std::make_shared<spdlog::async_logger>(
+        "MPM", sink, spdlog::thread_pool(),
+        spdlog::async_overflow_policy::overrun_oldest);
+    spdlog::register_logger(s_logger);
+  } else {
+    s_logger = spdlog::stdout_color_mt("MPM");
+  }
   s_logger->set_pattern("[%^%l%$][%n]%v");
   s_logger->set_level(spdlog::level::level_enum::trace);
 }
 
-} // namespace mpm
\ No newline at end of file
+void MPMLog::shutdown() {
+  if (s_logger) {
+    s_logger->flush();
+  }
+  // the async thread pool goes away with spdlog::shutdown(), so nothing
+  // may reach the logger afterwards
+  s_logger.reset();
+  spdlog::drop("MPM");
+  spdlog::shutdown();
+}
+
+int MPMLogAggregates::register_site(spdlog::level::level_enum level,
+                                    const char *summary) {
+  std::lock_guard<std::mutex> lock(g_site_mutex);
+  int site = g_site_count.load(std::memory_order_relaxed);
+  MPM_ASSERT(site < MAX_SITES, "TOO MANY AGGREGATED LOG CALL SITES");
+  g_sites[site] = {level, summary};
+  g_site_count.store(site + 1, std::memory_order_release);
+  return site;
+}
+
+void MPMLogAggregates::flush() {
+  int sites = g_site_count.load(std::memory_order_acquire);
+  for (int site = 0; site < sites; site++) {
+    auto events = counts[site].exchange(0, std::memory_order_relaxed);
+    if (events > 0 && MPMLog::get_logger()) {
+      MPMLog::get_logger()->log(g_sites[site].level, g_sites[site].summary,
+                                events);
+    }
+  }
+}
+
+} // namespace mpm
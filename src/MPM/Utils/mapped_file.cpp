@@ -0,0 +1,73 @@
+#include "MPM/Utils/mapped_file.h"
+#include "MPM/mpm_pch.h"
+
+#if defined(MPM_PLATFORM_LINUX)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace mpm {
+
+MPM_MappedFile::MPM_MappedFile(const std::string &path) { open(path); }
+
+MPM_MappedFile::~MPM_MappedFile() { close(); }
+
+bool MPM_MappedFile::open(const std::string &path) {
+  close();
+#if defined(MPM_PLATFORM_LINUX)
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    ::close(fd);
+    return false;
+  }
+  length = static_cast<size_t>(st.st_size);
+  if (length > 0) {
+    void *addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+      ::close(fd);
+      length = 0;
+      return false;
+    }
+    // every caller walks the whole file, start paging it in now
+    madvise(addr, length, MADV_WILLNEED);
+    ptr = static_cast<const char *>(addr);
+    mapped = true;
+  }
+  ::close(fd);
+  opened = true;
+  return true;
+#else
+  std::ifstream input(path, std::ios::in | std::ios::binary | std::ios::ate);
+  if (!input) {
+    return false;
+  }
+  length = static_cast<size_t>(input.tellg());
+  fallback.resize(length);
+  input.seekg(0);
+  input.read(fallback.data(), length);
+  ptr = fallback.data();
+  opened = bool(input);
+  return opened;
+#endif
+}
+
+void MPM_MappedFile::close() {
+#if defined(MPM_PLATFORM_LINUX)
+  if (mapped) {
+    munmap(const_cast<char *>(ptr), length);
+  }
+#endif
+  fallback.clear();
+  ptr = nullptr;
+  length = 0;
+  opened = false;
+  mapped = false;
+}
+
+} // namespace mpm
@@ -0,0 +1,132 @@
+#include "MPM/Utils/numa.h"
+#include "MPM/mpm_pch.h"
+
+#include <tbb/info.h>
+
+#if defined(MPM_PLATFORM_LINUX)
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace mpm {
+
+namespace {
+
+// pages per move_pages query
+constexpr size_t PAGE_BATCH = 4096;
+
+} // namespace
+
+MPM_NumaDomains::MPM_NumaDomains(const NumaOptions &options) {
+  if (!options.enabled) {
+    return;
+  }
+  // {-1} without tbbbind or on a single node
+  std::vector<tbb::numa_node_id> numa_nodes = tbb::info::numa_nodes();
+  bool pinned = numa_nodes.size() > 1 &&
+                (options.domains == 0 ||
+                 options.domains == static_cast<int>(numa_nodes.size()));
+  int count = options.domains > 0 ? options.domains
+                                  : static_cast<int>(numa_nodes.size());
+  if (count < 2) {
+    // all memory is on the one node, which the locality then reports
+    if (numa_nodes.size() == 1) {
+      nodes.push_back(numa_nodes[0]);
+    }
+    MPM_INFO("numa: a single memory domain, loops stay unpartitioned");
+    return;
+  }
+  for (int d = 0; d < count; d++) {
+    if (pinned) {
+      nodes.push_back(numa_nodes[d]);
+      concurrency.push_back(tbb::info::default_concurrency(numa_nodes[d]));
+      arenas.push_back(std::make_unique<tbb::task_arena>(
+          tbb::task_arena::constraints(numa_nodes[d])));
+    } else {
+      nodes.push_back(-1);
+      concurrency.push_back(
+          std::max(1, tbb::info::default_concurrency() / count));
+      arenas.push_back(std::make_unique<tbb::task_arena>(concurrency.back()));
+    }
+  }
+  MPM_INFO("numa: {} memory domains, {}, threads {}", count,
+           pinned ? fmt::format("nodes {}", fmt::join(nodes, " "))
+                  : std::string("not pinned"),
+           fmt::join(concurrency, " "));
+}
+
+void MPM_NumaDomains::split(int begin, int end,
+                            std::vector<int> &bounds) const {
+  if (bounds.empty() || bounds.back() != begin) {
+    bounds.push_back(begin);
+  }
+  int64_t total = 0;
+  for (int threads : concurrency) {
+    total += threads;
+  }
+  if (total == 0) {
+    bounds.push_back(end);
+    return;
+  }
+  int64_t before = 0;
+  for (int threads : concurrency) {
+    before += threads;
+    bounds.push_back(begin + static_cast<int>(int64_t(end - begin) * before /
+                                              total));
+  }
+}
+
+NumaLocality MPM_NumaDomains::locality(const void *data, size_t stride,
+                                       const std::vector<int> &bounds) const {
+  NumaLocality result;
+#if defined(MPM_PLATFORM_LINUX)
+  if (!data || bounds.size() < 2 || bounds.back() <= bounds.front()) {
+    return result;
+  }
+  const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+  const uintptr_t begin = reinterpret_cast<uintptr_t>(data);
+  const uintptr_t end = begin + size_t(bounds.back()) * stride;
+  std::vector<void *> pages;
+  std::vector<int> status;
+  for (uintptr_t first = begin / page * page; first < end;
+       first += PAGE_BATCH * page) {
+    size_t count =
+        std::min<size_t>(PAGE_BATCH, (end - first + page - 1) / page);
+    pages.resize(count);
+    status.assign(count, -1);
+    for (size_t i = 0; i < count; i++) {
+      pages[i] = reinterpret_cast<void *>(first + i * page);
+    }
+    // without target nodes move_pages only reports where the pages are
+    if (syscall(SYS_move_pages, 0, count, pages.data(), nullptr,
+                status.data(), 0) != 0) {
+      result.unknown += count;
+      continue;
+    }
+    for (size_t i = 0; i < count; i++) {
+      int found = status[i];
+      if (found < 0) {
+        result.unknown++;
+        continue;
+      }
+      if (size_t(found) >= result.node_pages.size()) {
+        result.node_pages.resize(found + 1, 0);
+      }
+      result.node_pages[found]++;
+      result.pages++;
+      // the page counts for the part holding its first element
+      uintptr_t address = std::max(first + i * page, begin);
+      int element = static_cast<int>((address - begin) / stride);
+      size_t q = std::upper_bound(bounds.begin(), bounds.end(), element) -
+                 bounds.begin();
+      q = std::min(std::max<size_t>(q, 1), bounds.size() - 1) - 1;
+      if (found == node(static_cast<int>(q % size()))) {
+        result.local++;
+      }
+    }
+  }
+#endif
+  return result;
+}
+
+} // namespace mpm
@@ -0,0 +1,591 @@
+#include "MPM/Utils/particle_cache.h"
+#include "MPM/Utils/half.h"
+#include "MPM/Utils/io.h"
+#include "MPM/mpm_pch.h"
+
+#include <tbb/parallel_for.h>
+
+#ifdef MPM_USE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace mpm {
+
+namespace {
+
+template <class Elem> const Elem *at(const char *base, uint64_t offset) {
+  return reinterpret_cast<const Elem *>(base + offset);
+}
+
+size_t word_size(ExportType type) {
+  return type == ExportType::FLOAT16 ? 2 : 4;
+}
+
+// plane b holds byte b of every word, slowly varying high bytes then
+// compress to almost nothing
+void shuffle_bytes(const char *src, size_t words, size_t size, char *dst) {
+  for (size_t w = 0; w < words; w++) {
+    for (size_t b = 0; b < size; b++) {
+      dst[b * words + w] = src[w * size + b];
+    }
+  }
+}
+
+void unshuffle_bytes(const char *src, size_t words, size_t size, char *dst) {
+  for (size_t w = 0; w < words; w++) {
+    for (size_t b = 0; b < size; b++) {
+      dst[w * size + b] = src[b * words + w];
+    }
+  }
+}
+
+inline uint32_t zigzag(int32_t v) {
+  return (uint32_t(v) << 1) ^ uint32_t(v >> 31);
+}
+inline int32_t unzigzag(uint32_t v) {
+  return int32_t(v >> 1) ^ -int32_t(v & 1);
+}
+
+void compress_chunk(const std::vector<char> &raw, int level,
+                    std::vector<char> &stored) {
+#ifdef MPM_USE_ZLIB
+  if (level > 0 && !raw.empty()) {
+    uLongf size = compressBound(raw.size());
+    stored.resize(size);
+    if (compress2(reinterpret_cast<Bytef *>(stored.data()), &size,
+                  reinterpret_cast<const Bytef *>(raw.data()), raw.size(),
+                  level) == Z_OK &&
+        size < raw.size()) {
+      stored.resize(size);
+      return;
+    }
+  }
+#endif
+  stored = raw;
+}
+
+bool decompress_chunk(const char *stored, const CacheChunkEntry &chunk,
+                      char *raw) {
+  if (chunk.stored_size == chunk.raw_size) {
+    std::memcpy(raw, stored, chunk.raw_size);
+    return true;
+  }
+#ifdef MPM_USE_ZLIB
+  uLongf size = chunk.raw_size;
+  return uncompress(reinterpret_cast<Bytef *>(raw), &size,
+                    reinterpret_cast<const Bytef *>(stored),
+                    chunk.stored_size) == Z_OK &&
+         size == chunk.raw_size;
+#else
+  return false;
+#endif
+}
+
+inline void store_position(ChannelBuffer &buffer, size_t i, int k, T value) {
+  if (buffer.type == ExportType::FLOAT16) {
+    buffer.as<uint16_t>()[i * DIM + k] = float_to_half(float(value));
+  } else {
+    buffer.as<float>()[i * DIM + k] = float(value);
+  }
+}
+
+} // namespace
+
+MPM_CacheWriter::MPM_CacheWriter(const std::string &path,
+                                 const CacheOptions &options)
+    : path(path), options(options),
+      output(path, std::ios::out | std::ios::binary) {
+  if (!output) {
+    MPM_ERROR("unable to open particle cache {} for writing", path);
+    return;
+  }
+  CacheFileHeader header;
+  output.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  write_offset = sizeof(header);
+}
+
+MPM_CacheWriter::~MPM_CacheWriter() { close(); }
+
+bool MPM_CacheWriter::write_frame(const ParticleSnapshot &snapshot) {
+  MPM_SCOPED_PROFILE("cache write_frame");
+  if (!output) {
+    return false;
+  }
+  MPM_ASSERT(!snapshot.channels.empty() &&
+                 snapshot.channels[0].channel == ExportChannel::POSITION,
+             "SNAPSHOT SHOULD START WITH THE POSITION CHANNEL");
+
+  const size_t n = snapshot.size;
+  const size_t num_chunks = (n + CACHE_CHUNK_SIZE - 1) / CACHE_CHUNK_SIZE;
+  const size_t num_channels = snapshot.channels.size();
+  const T inv_quantum = 1 / options.position_quantum;
+
+  bool keyframe = last_quantized.size() != n * DIM ||
+                  ++frames_since_keyframe >= options.keyframe_interval;
+  if (keyframe) {
+    frames_since_keyframe = 0;
+  }
+
+  std::vector<int32_t> quantized(n * DIM);
+  const auto &positions = snapshot.channels[0];
+  tbb::parallel_for(size_t(0), n, [&](size_t i) {
+    for (int k = 0; k < DIM; k++) {
+      T q = std::round(positions.get(i, k) * inv_quantum);
+      q = std::max<T>(std::min<T>(q, INT32_MAX), INT32_MIN);
+      quantized[i * DIM + k] = static_cast<int32_t>(q);
+    }
+  });
+
+  // encode and compress every (channel, chunk) pair independently
+  std::vector<std::vector<char>> stored(num_channels * num_chunks);
+  std::vector<uint32_t> raw_sizes(num_channels * num_chunks);
+  tbb::parallel_for(size_t(0), num_channels * num_chunks, [&](size_t task) {
+    size_t c = task / num_chunks;
+    size_t begin = (task % num_chunks) * CACHE_CHUNK_SIZE;
+    size_t count = std::min(CACHE_CHUNK_SIZE, n - begin);
+    auto &buffer = snapshot.channels[c];
+    std::vector<char> raw;
+
+    if (c == 0) {
+      size_t words = count * DIM;
+      std::vector<uint32_t> values(words);
+      const int32_t *q = quantized.data() + begin * DIM;
+      if (keyframe) {
+        int32_t origin[DIM];
+        for (int k = 0; k < DIM; k++) {
+          origin[k] = INT32_MAX;
+          for (size_t i = 0; i < count; i++) {
+            origin[k] = std::min(origin[k], q[i * DIM + k]);
+          }
+        }
+        for (size_t w = 0; w < words; w++) {
+          values[w] = uint32_t(int64_t(q[w]) - origin[w % DIM]);
+        }
+        raw.resize(sizeof(origin) + words * 4);
+        std::memcpy(raw.data(), origin, sizeof(origin));
+        shuffle_bytes(reinterpret_cast<const char *>(values.data()), words, 4,
+                      raw.data() + sizeof(origin));
+      } else {
+        const int32_t *prev = last_quantized.data() + begin * DIM;
+        for (size_t w = 0; w < words; w++) {
+          // wrapping difference, undone by the wrapping sum on decode
+          values[w] = zigzag(int32_t(uint32_t(q[w]) - uint32_t(prev[w])));
+        }
+        raw.resize(words * 4);
+        shuffle_bytes(reinterpret_cast<const char *>(values.data()), words, 4,
+                      raw.data());
+      }
+    } else {
+      size_t size = word_size(buffer.type);
+      size_t words = count * buffer.components;
+      raw.resize(words * size);
+      shuffle_bytes(buffer.data.data() + begin * buffer.element_size(), words,
+                    size, raw.data());
+    }
+
+    raw_sizes[task] = static_cast<uint32_t>(raw.size());
+    compress_chunk(raw, options.compression_level, stored[task]);
+  });
+
+  // assemble the record
+  CacheFrameHeader header;
+  header.flags = keyframe ? CacheFrameHeader::KEYFRAME : 0;
+  header.frame = snapshot.frame;
+  header.channel_count = static_cast<uint32_t>(num_channels);
+  header.particle_count = n;
+  header.chunk_count = num_chunks;
+  header.time = snapshot.time;
+  header.position_quantum = options.position_quantum;
+
+  std::vector<CacheChannelDesc> descs(num_channels);
+  for (size_t c = 0; c < num_channels; c++) {
+    auto &buffer = snapshot.channels[c];
+    descs[c].channel = static_cast<int32_t>(buffer.channel);
+    descs[c].type = static_cast<int32_t>(buffer.type);
+    descs[c].components = buffer.components;
+    descs[c].encoding = c != 0 ? CacheChannelDesc::SHUFFLED
+                        : keyframe ? CacheChannelDesc::QUANTIZED_ORIGIN
+                                   : CacheChannelDesc::QUANTIZED_DELTA;
+  }
+
+  std::vector<CacheChunkEntry> chunks(num_channels * num_chunks);
+  uint64_t offset = sizeof(header) + descs.size() * sizeof(CacheChannelDesc) +
+                    chunks.size() * sizeof(CacheChunkEntry);
+  for (size_t task = 0; task < chunks.size(); task++) {
+    chunks[task].offset = offset;
+    chunks[task].stored_size = static_cast<uint32_t>(stored[task].size());
+    chunks[task].raw_size = raw_sizes[task];
+    offset += stored[task].size();
+  }
+  header.record_size = offset;
+
+  output.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  output.write(reinterpret_cast<const char *>(descs.data()),
+               descs.size() * sizeof(CacheChannelDesc));
+  output.write(reinterpret_cast<const char *>(chunks.data()),
+               chunks.size() * sizeof(CacheChunkEntry));
+  for (auto &payload : stored) {
+    output.write(payload.data(), payload.size());
+  }
+  output.flush();
+  if (!output) {
+    MPM_ERROR("failed to append frame {} to particle cache {}", snapshot.frame,
+              path);
+    return false;
+  }
+
+  index.push_back({snapshot.frame, header.flags, write_offset, offset});
+  write_offset += offset;
+  last_quantized.swap(quantized);
+  return true;
+}
+
+bool MPM_CacheWriter::close() {
+  if (!output.is_open()) {
+    return true;
+  }
+  CacheFooter footer;
+  footer.index_offset = write_offset;
+  footer.frame_count = index.size();
+  output.write(reinterpret_cast<const char *>(index.data()),
+               index.size() * sizeof(CacheIndexEntry));
+  output.write(reinterpret_cast<const char *>(&footer), sizeof(footer));
+  output.close();
+  if (output.fail()) {
+    MPM_ERROR("failed to finalize particle cache {}", path);
+    return false;
+  }
+  return true;
+}
+
+MPM_CacheReader::MPM_CacheReader(const std::string &path) { open(path); }
+
+bool MPM_CacheReader::open(const std::string &path) {
+  valid = false;
+  index.clear();
+  decoded_entry = -1;
+  if (!file.open(path) || file.size() < sizeof(CacheFileHeader)) {
+    MPM_ERROR("particle cache {} not found or truncated", path);
+    return false;
+  }
+
+  const char *base = file.data();
+  CacheFileHeader expected, header;
+  std::memcpy(&header, base, sizeof(header));
+  if (std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 ||
+      header.version != CACHE_VERSION ||
+      header.chunk_size != CACHE_CHUNK_SIZE) {
+    MPM_ERROR("particle cache {} is incompatible: version {}, chunk size {}",
+              path, header.version, header.chunk_size);
+    return false;
+  }
+
+  CacheFooter expected_footer, footer;
+  if (file.size() >= sizeof(CacheFileHeader) + sizeof(CacheFooter)) {
+    std::memcpy(&footer, base + file.size() - sizeof(footer), sizeof(footer));
+  }
+  bool indexed =
+      std::memcmp(footer.magic, expected_footer.magic, sizeof(footer.magic)) ==
+          0 &&
+      footer.frame_count <= file.size() / sizeof(CacheIndexEntry) &&
+      footer.index_offset <= file.size() &&
+      footer.index_offset + footer.frame_count * sizeof(CacheIndexEntry) +
+              sizeof(CacheFooter) ==
+          file.size();
+  if (indexed) {
+    // every record has to lie between the file header and the index
+    auto *entries = at<CacheIndexEntry>(base, footer.index_offset);
+    for (uint64_t i = 0; indexed && i < footer.frame_count; i++) {
+      indexed = entries[i].offset >= sizeof(CacheFileHeader) &&
+                entries[i].offset <= footer.index_offset &&
+                entries[i].size >= sizeof(CacheFrameHeader) &&
+                entries[i].size <= footer.index_offset - entries[i].offset;
+    }
+    if (indexed) {
+      index.assign(entries, entries + footer.frame_count);
+    } else {
+      MPM_WARN("particle cache {} has a damaged index", path);
+    }
+  }
+  if (!indexed) {
+    // no index, the writer died: recover every complete record
+    uint64_t offset = sizeof(CacheFileHeader);
+    CacheFrameHeader frame_expected;
+    while (offset + sizeof(CacheFrameHeader) <= file.size()) {
+      auto *frame = at<CacheFrameHeader>(base, offset);
+      if (std::memcmp(frame->magic, frame_expected.magic,
+                      sizeof(frame->magic)) != 0 ||
+          frame->record_size < sizeof(CacheFrameHeader) ||
+          frame->record_size > file.size() - offset) {
+        break;
+      }
+      index.push_back({frame->frame, frame->flags, offset, frame->record_size});
+      offset += frame->record_size;
+    }
+    MPM_WARN("particle cache {} has no index, recovered {} frames", path,
+             index.size());
+  }
+
+  valid = true;
+  return true;
+}
+
+std::vector<int> MPM_CacheReader::frames() const {
+  std::vector<int> result;
+  for (auto &entry : index) {
+    result.push_back(entry.frame);
+  }
+  return result;
+}
+
+int MPM_CacheReader::find_entry(int frame) const {
+  for (size_t i = 0; i < index.size(); i++) {
+    if (index[i].frame == frame) {
+      return static_cast<int>(i);
+    }
+  }
+  return -1;
+}
+
+bool MPM_CacheReader::check_record(int entry) const {
+  const auto &record_entry = index[entry];
+  const uint64_t size = record_entry.size;
+  if (size < sizeof(CacheFrameHeader) || record_entry.offset > file.size() ||
+      size > file.size() - record_entry.offset) {
+    return false;
+  }
+  const char *record = file.data() + record_entry.offset;
+  auto *header = at<CacheFrameHeader>(record, 0);
+  CacheFrameHeader expected;
+  const uint64_t n = header->particle_count;
+  if (std::memcmp(header->magic, expected.magic, sizeof(expected.magic)) !=
+          0 ||
+      header->record_size != size || header->flags != record_entry.flags ||
+      header->channel_count == 0 || n > uint64_t(INT32_MAX) ||
+      header->chunk_count != (n + CACHE_CHUNK_SIZE - 1) / CACHE_CHUNK_SIZE ||
+      header->channel_count > size / sizeof(CacheChannelDesc)) {
+    return false;
+  }
+  const uint64_t chunk_count = header->chunk_count;
+  const uint64_t tables =
+      sizeof(CacheFrameHeader) +
+      header->channel_count * sizeof(CacheChannelDesc) +
+      header->channel_count * chunk_count * sizeof(CacheChunkEntry);
+  if (tables > size) {
+    return false;
+  }
+
+  // the position channel comes first and is quantised, the rest shuffled
+  const bool keyframe = header->flags & CacheFrameHeader::KEYFRAME;
+  auto *descs = at<CacheChannelDesc>(record, sizeof(CacheFrameHeader));
+  auto *chunks = at<CacheChunkEntry>(
+      record, sizeof(CacheFrameHeader) +
+                  header->channel_count * sizeof(CacheChannelDesc));
+  for (uint32_t c = 0; c < header->channel_count; c++) {
+    const auto &desc = descs[c];
+    const bool position = c == 0;
+    uint32_t encoding = !position ? CacheChannelDesc::SHUFFLED
+                        : keyframe ? CacheChannelDesc::QUANTIZED_ORIGIN
+                                   : CacheChannelDesc::QUANTIZED_DELTA;
+    if (desc.encoding != encoding || desc.type < 0 ||
+        desc.type > static_cast<int32_t>(ExportType::INT32) ||
+        desc.components < 1 || desc.components > DIM * DIM ||
+        (position &&
+         (desc.channel != static_cast<int32_t>(ExportChannel::POSITION) ||
+          desc.components != DIM ||
+          desc.type == static_cast<int32_t>(ExportType::INT32)))) {
+      return false;
+    }
+    const uint64_t word_bytes =
+        position ? 4 : word_size(static_cast<ExportType>(desc.type));
+    for (uint64_t j = 0; j < chunk_count; j++) {
+      const auto &chunk = chunks[c * chunk_count + j];
+      uint64_t count = std::min<uint64_t>(CACHE_CHUNK_SIZE,
+                                          n - j * CACHE_CHUNK_SIZE);
+      uint64_t raw_size = count * desc.components * word_bytes;
+      if (position && keyframe) {
+        raw_size += DIM * sizeof(int32_t);
+      }
+      if (chunk.raw_size != raw_size || chunk.offset < tables ||
+          chunk.offset > size || chunk.stored_size > size - chunk.offset) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool MPM_CacheReader::decode_positions(int entry) {
+  if (decoded_entry == entry) {
+    return true;
+  }
+  // replay from the closest keyframe, or continue a sequential read
+  int first = entry;
+  while (first > 0 && !(index[first].flags & CacheFrameHeader::KEYFRAME) &&
+         first - 1 != decoded_entry) {
+    first--;
+  }
+  if (!(index[first].flags & CacheFrameHeader::KEYFRAME) &&
+      first - 1 != decoded_entry) {
+    return false;
+  }
+
+  for (int e = first; e <= entry; e++) {
+    if (!check_record(e)) {
+      decoded_entry = -1;
+      return false;
+    }
+    const char *record = file.data() + index[e].offset;
+    auto *header = at<CacheFrameHeader>(record, 0);
+    auto *chunks = at<CacheChunkEntry>(
+        record, sizeof(CacheFrameHeader) +
+                    header->channel_count * sizeof(CacheChannelDesc));
+    const size_t n = header->particle_count;
+    const bool keyframe = header->flags & CacheFrameHeader::KEYFRAME;
+    if (!keyframe && decoded_quantized.size() != n * DIM) {
+      return false;
+    }
+    decoded_quantized.resize(n * DIM);
+
+    std::atomic<bool> ok{true};
+    tbb::parallel_for(uint64_t(0), header->chunk_count, [&](uint64_t j) {
+      // the position channel is always the first one
+      const auto &chunk = chunks[j];
+      size_t begin = j * CACHE_CHUNK_SIZE;
+      size_t words = std::min(CACHE_CHUNK_SIZE, n - begin) * DIM;
+      std::vector<char> raw(chunk.raw_size);
+      if (!decompress_chunk(record + chunk.offset, chunk, raw.data())) {
+        ok = false;
+        return;
+      }
+      std::vector<uint32_t> values(words);
+      int32_t *q = decoded_quantized.data() + begin * DIM;
+      if (keyframe) {
+        int32_t origin[DIM];
+        std::memcpy(origin, raw.data(), sizeof(origin));
+        unshuffle_bytes(raw.data() + sizeof(origin), words, 4,
+                        reinterpret_cast<char *>(values.data()));
+        for (size_t w = 0; w < words; w++) {
+          q[w] = int32_t(int64_t(origin[w % DIM]) + values[w]);
+        }
+      } else {
+        unshuffle_bytes(raw.data(), words, 4,
+                        reinterpret_cast<char *>(values.data()));
+        for (size_t w = 0; w < words; w++) {
+          q[w] = int32_t(uint32_t(q[w]) + uint32_t(unzigzag(values[w])));
+        }
+      }
+    });
+    if (!ok) {
+      decoded_entry = -1;
+      return false;
+    }
+    decoded_entry = e;
+  }
+  return true;
+}
+
+bool MPM_CacheReader::read_frame(int frame, ParticleSnapshot &snapshot,
+                                 const std::vector<ExportChannel> &channels) {
+  MPM_SCOPED_PROFILE("cache read_frame");
+  int entry = is_open() ? find_entry(frame) : -1;
+  if (entry < 0) {
+    MPM_ERROR("frame {} is not in the particle cache", frame);
+    return false;
+  }
+  if (!check_record(entry)) {
+    MPM_ERROR("frame {} of the particle cache is damaged", frame);
+    return false;
+  }
+
+  const char *record = file.data() + index[entry].offset;
+  auto *header = at<CacheFrameHeader>(record, 0);
+  auto *descs = at<CacheChannelDesc>(record, sizeof(CacheFrameHeader));
+  auto *chunks = at<CacheChunkEntry>(
+      record, sizeof(CacheFrameHeader) +
+                  header->channel_count * sizeof(CacheChannelDesc));
+  const size_t n = header->particle_count;
+
+  snapshot.size = static_cast<int>(n);
+  snapshot.frame = header->frame;
+  snapshot.time = header->time;
+  snapshot.channels.clear();
+
+  for (uint32_t c = 0; c < header->channel_count; c++) {
+    // positions are always decoded, every consumer expects them first
+    auto channel = static_cast<ExportChannel>(descs[c].channel);
+    if (c != 0 && !channels.empty() &&
+        std::find(channels.begin(), channels.end(), channel) ==
+            channels.end()) {
+      continue;
+    }
+
+    snapshot.channels.emplace_back();
+    auto &buffer = snapshot.channels.back();
+    buffer.channel = channel;
+    buffer.type = static_cast<ExportType>(descs[c].type);
+    buffer.components = descs[c].components;
+    buffer.name = export_channel_name(channel);
+    buffer.data.resize(n * buffer.element_size());
+
+    if (c == 0) {
+      if (!decode_positions(entry)) {
+        MPM_ERROR("failed to decode positions of frame {}", frame);
+        return false;
+      }
+      const T quantum = header->position_quantum;
+      tbb::parallel_for(size_t(0), n, [&](size_t i) {
+        for (int k = 0; k < DIM; k++) {
+          store_position(buffer, i, k,
+                         decoded_quantized[i * DIM + k] * quantum);
+        }
+      });
+      continue;
+    }
+
+    std::atomic<bool> ok{true};
+    const size_t size = word_size(buffer.type);
+    tbb::parallel_for(uint64_t(0), header->chunk_count, [&](uint64_t j) {
+      const auto &chunk = chunks[c * header->chunk_count + j];
+      size_t begin = j * CACHE_CHUNK_SIZE;
+      size_t words = std::min(CACHE_CHUNK_SIZE, n - begin) * buffer.components;
+      std::vector<char> raw(chunk.raw_size);
+      if (!decompress_chunk(record + chunk.offset, chunk, raw.data())) {
+        ok = false;
+        return;
+      }
+      unshuffle_bytes(raw.data(), words, size,
+                      buffer.data.data() + begin * buffer.element_size());
+    });
+    if (!ok) {
+      MPM_ERROR("failed to decode channel {} of frame {}", buffer.name, frame);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool convert_cache_to_bgeo(const std::string &cache_path,
+                           const std::string &output_dir) {
+  MPM_CacheReader reader(cache_path);
+  if (!reader.is_open()) {
+    return false;
+  }
+  std::filesystem::create_directories(output_dir);
+
+  ParticleSnapshot snapshot;
+  for (int frame : reader.frames()) {
+    auto path = (std::filesystem::path(output_dir) /
+                 (std::to_string(frame) + ".bgeo"))
+                    .generic_string();
+    if (!reader.read_frame(frame, snapshot) ||
+        !write_particles(path, snapshot)) {
+      return false;
+    }
+  }
+  MPM_INFO("converted {} frames of {} to {}", reader.frame_count(), cache_path,
+           output_dir);
+  return true;
+}
+
+} // namespace mpm
@@ -0,0 +1,166 @@
+#include "MPM/Utils/perf_counters.h"
+#include "MPM/Utils/debug.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+#if defined(MPM_PLATFORM_LINUX)
+#include <cerrno>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace mpm {
+
+namespace {
+
+std::mutex g_error_mutex;
+std::string g_error;
+
+void set_error(const std::string &error) {
+  std::lock_guard<std::mutex> lock(g_error_mutex);
+  if (g_error.empty()) {
+    g_error = error;
+  }
+}
+
+#if defined(MPM_PLATFORM_LINUX)
+
+struct CounterGroup {
+  bool opened = false;
+  int leader = -1;
+  int fds[PERF_COUNTER_COUNT] = {-1, -1, -1, -1};
+  // position of each event in the group read, -1 when not counted
+  int slot[PERF_COUNTER_COUNT] = {-1, -1, -1, -1};
+  int size = 0;
+
+  ~CounterGroup() {
+    for (int fd : fds) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+  }
+};
+
+thread_local CounterGroup t_group;
+
+int open_event(uint32_t type, uint64_t config, int group_fd) {
+  perf_event_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                     PERF_FORMAT_TOTAL_TIME_RUNNING;
+  attr.disabled = group_fd < 0 ? 1 : 0;
+  return static_cast<int>(
+      syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0));
+}
+
+CounterGroup &thread_group() {
+  auto &group = t_group;
+  if (group.opened) {
+    return group;
+  }
+  group.opened = true;
+
+  group.leader = open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1);
+  if (group.leader < 0) {
+    set_error(std::string("perf_event_open failed: ") + std::strerror(errno));
+    return group;
+  }
+  group.fds[PERF_CYCLES] = group.leader;
+  group.slot[PERF_CYCLES] = group.size++;
+
+  auto add = [&](PerfCounter counter, uint32_t type, uint64_t config) {
+    int fd = open_event(type, config, group.leader);
+    if (fd >= 0) {
+      group.fds[counter] = fd;
+      group.slot[counter] = group.size++;
+    }
+  };
+  add(PERF_INSTRUCTIONS, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+  add(PERF_LLC_MISSES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+  if (const char *hitm = std::getenv("MPM_PERF_HITM")) {
+    add(PERF_REMOTE_HITM, PERF_TYPE_RAW, std::strtoull(hitm, nullptr, 0));
+  }
+
+  ioctl(group.leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(group.leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  return group;
+}
+
+#endif
+
+} // namespace
+
+bool MPM_PerfCounters::is_supported() {
+#if defined(MPM_PLATFORM_LINUX)
+  return thread_group().leader >= 0;
+#else
+  set_error("hardware counters need Linux perf_event_open");
+  return false;
+#endif
+}
+
+bool MPM_PerfCounters::has_counter(PerfCounter counter) {
+#if defined(MPM_PLATFORM_LINUX)
+  return thread_group().slot[counter] >= 0;
+#else
+  return false;
+#endif
+}
+
+bool MPM_PerfCounters::read(uint64_t values[PERF_COUNTER_COUNT]) {
+#if defined(MPM_PLATFORM_LINUX)
+  auto &group = thread_group();
+  if (group.leader < 0) {
+    return false;
+  }
+  // nr, time_enabled, time_running, values[nr]
+  uint64_t buffer[3 + PERF_COUNTER_COUNT];
+  auto bytes = ::read(group.leader, buffer, sizeof(buffer));
+  if (bytes < static_cast<ssize_t>(sizeof(uint64_t) * (3 + group.size))) {
+    return false;
+  }
+  double scale = buffer[2] > 0 && buffer[2] < buffer[1]
+                     ? double(buffer[1]) / double(buffer[2])
+                     : 1.0;
+  for (int c = 0; c < PERF_COUNTER_COUNT; c++) {
+    values[c] = group.slot[c] >= 0
+                    ? static_cast<uint64_t>(buffer[3 + group.slot[c]] * scale)
+                    : 0;
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+const char *MPM_PerfCounters::name(PerfCounter counter) {
+  switch (counter) {
+  case PERF_CYCLES:
+    return "cycles";
+  case PERF_INSTRUCTIONS:
+    return "instructions";
+  case PERF_LLC_MISSES:
+    return "llc_misses";
+  case PERF_REMOTE_HITM:
+    return "remote_hitm";
+  default:
+    return "unknown";
+  }
+}
+
+std::string MPM_PerfCounters::error() {
+  std::lock_guard<std::mutex> lock(g_error_mutex);
+  return g_error;
+}
+
+} // namespace mpm
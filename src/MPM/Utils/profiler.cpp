@@ -1,6 +1,14 @@
 #include "MPM/Utils/profiler.h"
 #include "MPM/Utils/logger.h"
 
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <tbb/spin_mutex.h>
+
 namespace mpm {
 
 MPMScopedProfiler::MPMScopedProfiler(const std::string &tag) : tag(tag) {
@@ -8,10 +16,485 @@ MPMScopedProfiler::MPMScopedProfiler(const std::string &tag) : tag(tag) {
 }
 
 MPMScopedProfiler::~MPMScopedProfiler() {
-  auto end = std::chrono::high_resolution_clock::now();
+  // unused when trace messages are compiled out
+  [[maybe_unused]] auto end = std::chrono::high_resolution_clock::now();
   MPM_TRACE("[profiler] {} cost {} ms", tag,
             std::chrono::duration_cast<std::chrono::microseconds>(end - start)
                     .count() /
                 1000.0f);
 }
-} // namespace mpm
\ No newline at end of file
+
+std::atomic<bool> MPM_Profiler::s_enabled{false};
+std::atomic<bool> MPM_Profiler::s_tracing{false};
+std::atomic<bool> MPM_Profiler::s_counting{false};
+
+namespace {
+
+constexpr int STAGE_UNSEEN = -2;
+constexpr int MAX_DEPTH = 32;
+
+// log-linear buckets, 8 per power of two: at most 12.5% error on p99
+constexpr int HIST_SUB_BITS = 3;
+constexpr int HIST_SUB = 1 << HIST_SUB_BITS;
+constexpr int HIST_BUCKETS = 64 << HIST_SUB_BITS;
+
+int hist_bucket(uint64_t ns) {
+  if (ns < HIST_SUB) {
+    return static_cast<int>(ns);
+  }
+  int msb = 63 - __builtin_clzll(ns);
+  int sub = static_cast<int>(ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1);
+  return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) | sub;
+}
+
+uint64_t hist_upper_bound(int bucket) {
+  if (bucket < HIST_SUB) {
+    return bucket;
+  }
+  int msb = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+  uint64_t sub = bucket & (HIST_SUB - 1);
+  uint64_t width = uint64_t(1) << (msb - HIST_SUB_BITS);
+  return ((HIST_SUB | sub) << (msb - HIST_SUB_BITS)) + width - 1;
+}
+
+struct StageInfo {
+  std::string name;
+  std::atomic<int> parent{STAGE_UNSEEN};
+};
+
+// written by the owning thread only: count/total/hist are plain
+// load + store, min/max are reset by the reporter and updated with CAS
+struct StageCounters {
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> total{0};
+  std::atomic<uint64_t> min{UINT64_MAX};
+  std::atomic<uint64_t> max{0};
+  std::atomic<uint64_t> hist[HIST_BUCKETS] = {};
+  // hardware events while this stage was the innermost one
+  std::atomic<uint64_t> hw[PERF_COUNTER_COUNT] = {};
+};
+
+struct TraceEvent {
+  uint64_t start, end;
+  int stage;
+  bool task;
+};
+
+struct ThreadState {
+  int index = 0;
+  StageCounters stages[MPM_Profiler::MAX_STAGES];
+  int stack[MAX_DEPTH];
+  int depth = 0;
+
+  // counter values at the last stage or task boundary
+  uint64_t hw_last[PERF_COUNTER_COUNT] = {};
+  bool hw_valid = false;
+
+  tbb::spin_mutex event_mutex;
+  std::vector<TraceEvent> events;
+};
+
+// what the previous report saw, to log differences only
+struct ReportedCounters {
+  uint64_t count[MPM_Profiler::MAX_STAGES] = {};
+  uint64_t total[MPM_Profiler::MAX_STAGES] = {};
+  uint64_t hw[MPM_Profiler::MAX_STAGES][PERF_COUNTER_COUNT] = {};
+  std::vector<uint64_t> hist =
+      std::vector<uint64_t>(MPM_Profiler::MAX_STAGES * HIST_BUCKETS, 0);
+};
+
+StageInfo g_stages[MPM_Profiler::MAX_STAGES];
+std::atomic<int> g_stage_count{0};
+std::mutex g_registry_mutex;
+std::vector<std::unique_ptr<ThreadState>> g_threads;
+
+std::mutex g_report_mutex;
+std::vector<std::unique_ptr<ReportedCounters>> g_reported;
+uint64_t g_last_report = 0;
+std::ofstream g_trace;
+bool g_trace_first = true;
+size_t g_trace_named_threads = 0;
+
+const auto g_epoch = std::chrono::steady_clock::now();
+
+thread_local ThreadState *t_state = nullptr;
+
+ThreadState &thread_state() {
+  if (!t_state) {
+    std::lock_guard<std::mutex> lock(g_registry_mutex);
+    g_threads.emplace_back(std::make_unique<ThreadState>());
+    t_state = g_threads.back().get();
+    t_state->index = static_cast<int>(g_threads.size()) - 1;
+  }
+  return *t_state;
+}
+
+void add_relaxed(std::atomic<uint64_t> &counter, uint64_t value) {
+  counter.store(counter.load(std::memory_order_relaxed) + value,
+                std::memory_order_relaxed);
+}
+
+int top_stage(const ThreadState &state) {
+  return state.depth > 0 ? state.stack[std::min(state.depth, MAX_DEPTH) - 1]
+                         : -1;
+}
+
+// charge the events since the last boundary to the innermost stage
+void account_counters(ThreadState &state) {
+  uint64_t values[PERF_COUNTER_COUNT];
+  if (!MPM_Profiler::is_counting() || !MPM_PerfCounters::read(values)) {
+    return;
+  }
+  int stage = top_stage(state);
+  if (state.hw_valid && stage >= 0) {
+    for (int c = 0; c < PERF_COUNTER_COUNT; c++) {
+      // multiplexed counters are scaled estimates and can step back
+      uint64_t last = state.hw_last[c];
+      add_relaxed(state.stages[stage].hw[c],
+                  values[c] > last ? values[c] - last : 0);
+    }
+  }
+  std::copy(values, values + PERF_COUNTER_COUNT, state.hw_last);
+  state.hw_valid = true;
+}
+
+void push_stage(ThreadState &state, int stage) {
+  account_counters(state);
+  if (state.depth < MAX_DEPTH) {
+    state.stack[state.depth] = stage;
+  }
+  state.depth++;
+}
+
+void pop_stage(ThreadState &state) {
+  account_counters(state);
+  state.depth--;
+}
+
+void push_event(ThreadState &state, const TraceEvent &event) {
+  tbb::spin_mutex::scoped_lock lock(state.event_mutex);
+  state.events.push_back(event);
+}
+
+void write_trace_event(const char *name, const char *category, int tid,
+                       uint64_t start, uint64_t end) {
+  char line[256];
+  std::snprintf(line, sizeof(line),
+                "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":0,"
+                "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                g_trace_first ? "" : ",\n", name, category, tid,
+                start / 1000.0, (end - start) / 1000.0);
+  g_trace << line;
+  g_trace_first = false;
+}
+
+// caller holds g_report_mutex
+void drain_trace_events() {
+  std::vector<ThreadState *> threads;
+  {
+    std::lock_guard<std::mutex> lock(g_registry_mutex);
+    for (auto &thread : g_threads) {
+      threads.push_back(thread.get());
+    }
+  }
+  for (; g_trace_named_threads < threads.size(); g_trace_named_threads++) {
+    g_trace << (g_trace_first ? "" : ",\n")
+            << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":"
+            << g_trace_named_threads << ",\"args\":{\"name\":\"thread "
+            << g_trace_named_threads << "\"}}";
+    g_trace_first = false;
+  }
+
+  std::vector<TraceEvent> events;
+  for (auto *thread : threads) {
+    {
+      tbb::spin_mutex::scoped_lock lock(thread->event_mutex);
+      events.swap(thread->events);
+    }
+    for (auto &event : events) {
+      write_trace_event(g_stages[event.stage].name.c_str(),
+                        event.task ? "task" : "stage", thread->index,
+                        event.start, event.end);
+    }
+    events.clear();
+  }
+  g_trace.flush();
+}
+
+} // namespace
+
+int MPM_Profiler::register_stage(const char *name) {
+  std::lock_guard<std::mutex> lock(g_registry_mutex);
+  int count = g_stage_count.load();
+  for (int i = 0; i < count; i++) {
+    if (g_stages[i].name == name) {
+      return i;
+    }
+  }
+  if (count == MAX_STAGES) {
+    MPM_WARN("[profiler] more than {} stages, {} is not profiled",
+             MAX_STAGES, name);
+    return -1;
+  }
+  g_stages[count].name = name;
+  g_stage_count.store(count + 1);
+  return count;
+}
+
+void MPM_Profiler::set_enabled(bool enabled) { s_enabled = enabled; }
+
+uint64_t MPM_Profiler::now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now() - g_epoch)
+      .count();
+}
+
+bool MPM_Profiler::enable_counters(bool enabled) {
+  if (enabled && !MPM_PerfCounters::is_supported()) {
+    MPM_WARN("[profiler] hardware counters unavailable ({}), timing only",
+             MPM_PerfCounters::error());
+    enabled = false;
+  }
+  s_counting = enabled;
+  return enabled;
+}
+
+int MPM_Profiler::current_stage() {
+  // a thread without counters has never entered a stage
+  return t_state ? top_stage(*t_state) : -1;
+}
+
+void MPM_Profiler::enter_stage(int stage) {
+  auto &state = thread_state();
+  int parent = current_stage();
+  if (g_stages[stage].parent.load(std::memory_order_relaxed) ==
+      STAGE_UNSEEN) {
+    int unseen = STAGE_UNSEEN;
+    g_stages[stage].parent.compare_exchange_strong(unseen, parent);
+  }
+  push_stage(state, stage);
+}
+
+void MPM_Profiler::leave_stage(int stage, uint64_t start, uint64_t end) {
+  auto &state = thread_state();
+  pop_stage(state);
+
+  auto &counters = state.stages[stage];
+  uint64_t ns = end - start;
+  add_relaxed(counters.count, 1);
+  add_relaxed(counters.total, ns);
+  add_relaxed(counters.hist[hist_bucket(ns)], 1);
+  auto curr = counters.min.load(std::memory_order_relaxed);
+  while (ns < curr && !counters.min.compare_exchange_weak(curr, ns)) {
+  }
+  curr = counters.max.load(std::memory_order_relaxed);
+  while (ns > curr && !counters.max.compare_exchange_weak(curr, ns)) {
+  }
+
+  if (is_tracing()) {
+    push_event(state, {start, end, stage, false});
+  }
+}
+
+void MPM_Profiler::enter_task(int stage) { push_stage(thread_state(), stage); }
+
+void MPM_Profiler::leave_task(int stage, uint64_t start, uint64_t end) {
+  auto &state = thread_state();
+  pop_stage(state);
+  if (is_tracing()) {
+    push_event(state, {start, end, stage, true});
+  }
+}
+
+namespace {
+
+// caller holds g_report_mutex
+std::vector<MPM_Profiler::StageStats> collect_locked() {
+  std::vector<ThreadState *> threads;
+  {
+    std::lock_guard<std::mutex> lock(g_registry_mutex);
+    for (auto &thread : g_threads) {
+      threads.push_back(thread.get());
+    }
+  }
+  while (g_reported.size() < threads.size()) {
+    g_reported.emplace_back(std::make_unique<ReportedCounters>());
+  }
+
+  int stage_count = g_stage_count.load();
+  std::vector<MPM_Profiler::StageStats> stats(stage_count);
+  for (int s = 0; s < stage_count; s++) {
+    stats[s].name = g_stages[s].name;
+    stats[s].parent = std::max(g_stages[s].parent.load(), -1);
+    stats[s].thread_counters.resize(threads.size());
+  }
+
+  // hardware events are charged to the innermost stage only, sum them up
+  // the stage tree per thread
+  for (size_t t = 0; t < threads.size(); t++) {
+    auto &reported = *g_reported[t];
+    for (int s = 0; s < stage_count; s++) {
+      for (int c = 0; c < PERF_COUNTER_COUNT; c++) {
+        uint64_t value =
+            threads[t]->stages[s].hw[c].load(std::memory_order_relaxed);
+        uint64_t delta = value - reported.hw[s][c];
+        reported.hw[s][c] = value;
+        for (int a = s, depth = 0; a >= 0 && depth < stage_count;
+             a = stats[a].parent, depth++) {
+          stats[a].thread_counters[t][c] += delta;
+          stats[a].counters[c] += delta;
+        }
+      }
+    }
+  }
+
+  std::vector<uint64_t> hist(HIST_BUCKETS);
+  for (int s = 0; s < stage_count; s++) {
+    auto &m = stats[s];
+    m.min_ns = UINT64_MAX;
+    std::fill(hist.begin(), hist.end(), 0);
+    for (size_t t = 0; t < threads.size(); t++) {
+      auto &counters = threads[t]->stages[s];
+      auto &reported = *g_reported[t];
+      uint64_t count = counters.count.load(std::memory_order_relaxed);
+      if (count == reported.count[s]) {
+        continue;
+      }
+      uint64_t total = counters.total.load(std::memory_order_relaxed);
+      m.count += count - reported.count[s];
+      m.total_ns += total - reported.total[s];
+      reported.count[s] = count;
+      reported.total[s] = total;
+      m.min_ns =
+          std::min<uint64_t>(m.min_ns, counters.min.exchange(UINT64_MAX));
+      m.max_ns = std::max<uint64_t>(m.max_ns, counters.max.exchange(0));
+      for (int b = 0; b < HIST_BUCKETS; b++) {
+        uint64_t value = counters.hist[b].load(std::memory_order_relaxed);
+        hist[b] += value - reported.hist[s * HIST_BUCKETS + b];
+        reported.hist[s * HIST_BUCKETS + b] = value;
+      }
+    }
+    if (m.count == 0) {
+      m.min_ns = 0;
+      continue;
+    }
+    uint64_t target = (m.count * 99 + 99) / 100, seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+      seen += hist[b];
+      if (seen >= target) {
+        m.p99_ns = std::min(std::max(hist_upper_bound(b), m.min_ns), m.max_ns);
+        break;
+      }
+    }
+  }
+  return stats;
+}
+
+} // namespace
+
+std::vector<MPM_Profiler::StageStats> MPM_Profiler::collect() {
+  std::lock_guard<std::mutex> report_lock(g_report_mutex);
+  return collect_locked();
+}
+
+void MPM_Profiler::report(const std::string &title) {
+  std::lock_guard<std::mutex> report_lock(g_report_mutex);
+  uint64_t curr = now();
+  double wall_ms = (curr - g_last_report) / 1e6;
+  g_last_report = curr;
+  auto stats = collect_locked();
+
+  std::string table = fmt::format(
+      "[profiler] {}: {:.3f} ms wall\n"
+      "  {:<32}{:>8}{:>11}{:>7}{:>10}{:>10}{:>10}{:>10}",
+      title, wall_ms, "stage", "calls", "total ms", "%", "mean us",
+      "min us", "p99 us", "max us");
+  // depth first, children in registration order
+  auto print = [&](auto &self, int parent, int depth) -> void {
+    for (size_t s = 0; s < stats.size(); s++) {
+      auto &m = stats[s];
+      if (m.parent != parent || m.count == 0) {
+        continue;
+      }
+      table += fmt::format(
+          "\n  {:<32}{:>8}{:>11.3f}{:>7.1f}{:>10.2f}{:>10.2f}{:>10.2f}"
+          "{:>10.2f}",
+          std::string(2 * depth, ' ') + m.name, m.count, m.total_ns / 1e6,
+          wall_ms > 0 ? 100 * m.total_ns / 1e6 / wall_ms : 0.0,
+          m.total_ns / 1e3 / m.count, m.min_ns / 1e3, m.p99_ns / 1e3,
+          m.max_ns / 1e3);
+      self(self, static_cast<int>(s), depth + 1);
+    }
+  };
+  print(print, -1, 0);
+
+  if (is_counting()) {
+    table += fmt::format("\n  {:<32}{:>12}{:>12}{:>7}{:>12}{:>8}{:>10}{:>10}",
+                         "hardware counters", "Mcycles", "Minstr", "IPC",
+                         "LLC miss K", "MPKI", "HITM K", "imbalance");
+    auto print_counters = [&](auto &self, int parent, int depth) -> void {
+      for (size_t s = 0; s < stats.size(); s++) {
+        auto &m = stats[s];
+        if (m.parent != parent || m.counters[PERF_CYCLES] == 0) {
+          continue;
+        }
+        double cycles = m.counters[PERF_CYCLES];
+        double instructions = m.counters[PERF_INSTRUCTIONS];
+        // slowest thread against the mean of the threads that took part
+        double busiest = 0, busy_threads = 0;
+        for (auto &thread : m.thread_counters) {
+          busiest = std::max(busiest, double(thread[PERF_CYCLES]));
+          busy_threads += thread[PERF_CYCLES] > 0;
+        }
+        table += fmt::format(
+            "\n  {:<32}{:>12.2f}{:>12.2f}{:>7.2f}{:>12.1f}{:>8.2f}{:>10.1f}"
+            "{:>10.2f}",
+            std::string(2 * depth, ' ') + m.name, cycles / 1e6,
+            instructions / 1e6, instructions / cycles,
+            m.counters[PERF_LLC_MISSES] / 1e3,
+            instructions > 0
+                ? m.counters[PERF_LLC_MISSES] / (instructions / 1e3)
+                : 0.0,
+            m.counters[PERF_REMOTE_HITM] / 1e3,
+            busiest * busy_threads / cycles);
+        self(self, static_cast<int>(s), depth + 1);
+      }
+    };
+    print_counters(print_counters, -1, 0);
+  }
+  MPM_INFO("{}", table);
+
+  if (g_trace.is_open()) {
+    drain_trace_events();
+  }
+}
+
+bool MPM_Profiler::begin_trace(const std::string &path) {
+  std::lock_guard<std::mutex> lock(g_report_mutex);
+  if (g_trace.is_open()) {
+    return false;
+  }
+  g_trace.open(path, std::ios::out | std::ios::trunc);
+  if (!g_trace) {
+    MPM_ERROR("[profiler] can not open trace file {}", path);
+    return false;
+  }
+  g_trace << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+  g_trace_first = true;
+  g_trace_named_threads = 0;
+  s_tracing = true;
+  return true;
+}
+
+void MPM_Profiler::end_trace() {
+  std::lock_guard<std::mutex> lock(g_report_mutex);
+  if (!g_trace.is_open()) {
+    return;
+  }
+  s_tracing = false;
+  drain_trace_events();
+  g_trace << "\n]}\n";
+  g_trace.close();
+}
+
+} // namespace mpm
@@ -0,0 +1,219 @@
+#include "MPM/Utils/shm_stream.h"
+#include "MPM/mpm_pch.h"
+
+#include <cstring>
+
+#if defined(MPM_PLATFORM_LINUX)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace mpm {
+
+namespace {
+
+constexpr char SHM_MAGIC[8] = "MPMLIVE";
+
+size_t align_up(size_t bytes) { return (bytes + 63) & ~size_t(63); }
+
+size_t header_bytes() { return align_up(sizeof(ShmStreamHeader)); }
+
+} // namespace
+
+MPM_ShmPublisher::MPM_ShmPublisher(const std::string &name,
+                                   uint32_t slot_count,
+                                   size_t initial_slot_bytes)
+    : name(name), slot_count(std::max<uint32_t>(slot_count, 2)) {
+  if (initial_slot_bytes > 0) {
+    create(initial_slot_bytes);
+  }
+}
+
+MPM_ShmPublisher::~MPM_ShmPublisher() { retire(); }
+
+char *MPM_ShmPublisher::slot(uint64_t index) const {
+  return reinterpret_cast<char *>(header) + header_bytes() +
+         (index % slot_count) * slot_bytes;
+}
+
+bool MPM_ShmPublisher::create(size_t bytes_per_slot) {
+#if defined(MPM_PLATFORM_LINUX)
+  slot_bytes = align_up(bytes_per_slot);
+  size_t total = header_bytes() + slot_count * slot_bytes;
+  // a segment left behind by a crashed run is replaced
+  shm_unlink(name.c_str());
+  int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+  if (fd < 0) {
+    MPM_ERROR("unable to create shared memory {}", name);
+    return false;
+  }
+  if (ftruncate(fd, off_t(total)) != 0) {
+    ::close(fd);
+    shm_unlink(name.c_str());
+    MPM_ERROR("unable to size shared memory {} to {} bytes", name, total);
+    return false;
+  }
+  void *addr =
+      mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (addr == MAP_FAILED) {
+    shm_unlink(name.c_str());
+    MPM_ERROR("unable to map shared memory {}", name);
+    return false;
+  }
+  // the new pages are zero, so every slot sequence starts even
+  header = static_cast<ShmStreamHeader *>(addr);
+  mapped_bytes = total;
+  std::memcpy(header->magic, SHM_MAGIC, sizeof(SHM_MAGIC));
+  header->version = SHM_STREAM_VERSION;
+  header->slot_count = slot_count;
+  header->slot_bytes = slot_bytes;
+  header->published.store(0, std::memory_order_relaxed);
+  header->alive.store(1, std::memory_order_release);
+  return true;
+#else
+  MPM_WARN("shared memory streaming needs POSIX shm, {} not created", name);
+  return false;
+#endif
+}
+
+void MPM_ShmPublisher::retire() {
+#if defined(MPM_PLATFORM_LINUX)
+  if (!header) {
+    return;
+  }
+  header->alive.store(0, std::memory_order_release);
+  munmap(header, mapped_bytes);
+  shm_unlink(name.c_str());
+  header = nullptr;
+  mapped_bytes = 0;
+#endif
+}
+
+bool MPM_ShmPublisher::publish(const ParticleSnapshot &snapshot) {
+  if (snapshot.channels.size() > size_t(SHM_MAX_CHANNELS)) {
+    MPM_ERROR("shared memory frames hold at most {} channels",
+              SHM_MAX_CHANNELS);
+    return false;
+  }
+  size_t required = align_up(sizeof(ShmSlotHeader));
+  for (auto &buffer : snapshot.channels) {
+    required += align_up(buffer.data.size());
+  }
+  if (!header || required > slot_bytes) {
+    // readers notice the retired segment and map the new one
+    retire();
+    if (!create(required + required / 4)) {
+      return false;
+    }
+  }
+
+  uint64_t n = header->published.load(std::memory_order_relaxed);
+  auto *s = reinterpret_cast<ShmSlotHeader *>(slot(n));
+  uint64_t sequence = s->sequence.load(std::memory_order_relaxed);
+  s->sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  s->frame = snapshot.frame;
+  s->particle_count = snapshot.size;
+  s->time = snapshot.time;
+  s->channel_count = static_cast<int32_t>(snapshot.channels.size());
+  size_t offset = align_up(sizeof(ShmSlotHeader));
+  for (size_t c = 0; c < snapshot.channels.size(); c++) {
+    auto &buffer = snapshot.channels[c];
+    auto &desc = s->channels[c];
+    std::memset(desc.name, 0, sizeof(desc.name));
+    std::strncpy(desc.name, buffer.name.c_str(), sizeof(desc.name) - 1);
+    desc.type = static_cast<int32_t>(buffer.type);
+    desc.components = buffer.components;
+    desc.offset = offset;
+    desc.bytes = buffer.data.size();
+    std::memcpy(reinterpret_cast<char *>(s) + offset, buffer.data.data(),
+                buffer.data.size());
+    offset += align_up(buffer.data.size());
+  }
+
+  s->sequence.store(sequence + 2, std::memory_order_release);
+  header->published.store(n + 1, std::memory_order_release);
+  return true;
+}
+
+MPM_ShmSubscriber::MPM_ShmSubscriber(const std::string &name) : name(name) {
+  open();
+}
+
+MPM_ShmSubscriber::~MPM_ShmSubscriber() { close(); }
+
+bool MPM_ShmSubscriber::open() {
+#if defined(MPM_PLATFORM_LINUX)
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || size_t(st.st_size) < header_bytes()) {
+    ::close(fd);
+    return false;
+  }
+  void *addr = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (addr == MAP_FAILED) {
+    return false;
+  }
+  header = static_cast<const ShmStreamHeader *>(addr);
+  mapped_bytes = size_t(st.st_size);
+  if (std::memcmp(header->magic, SHM_MAGIC, sizeof(SHM_MAGIC)) != 0 ||
+      header->version != SHM_STREAM_VERSION ||
+      !header->alive.load(std::memory_order_acquire)) {
+    close();
+    return false;
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+void MPM_ShmSubscriber::close() {
+#if defined(MPM_PLATFORM_LINUX)
+  if (header) {
+    munmap(const_cast<ShmStreamHeader *>(header), mapped_bytes);
+  }
+#endif
+  header = nullptr;
+  mapped_bytes = 0;
+}
+
+bool MPM_ShmSubscriber::latest(ShmFrameView &view) {
+  if (header && !header->alive.load(std::memory_order_acquire)) {
+    close();
+  }
+  if (!header && !open()) {
+    return false;
+  }
+  uint64_t n = header->published.load(std::memory_order_acquire);
+  if (n == 0) {
+    return false;
+  }
+  auto *s = reinterpret_cast<const ShmSlotHeader *>(
+      reinterpret_cast<const char *>(header) + header_bytes() +
+      ((n - 1) % header->slot_count) * header->slot_bytes);
+  uint64_t sequence = s->sequence.load(std::memory_order_acquire);
+  if (sequence & 1) {
+    // the publisher lapped the ring while we looked
+    return false;
+  }
+  view.slot = s;
+  view.sequence = sequence;
+  return true;
+}
+
+bool MPM_ShmSubscriber::validate(const ShmFrameView &view) const {
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return view.slot &&
+         view.slot->sequence.load(std::memory_order_relaxed) == view.sequence;
+}
+
+} // namespace mpm
@@ -0,0 +1,162 @@
+#include "MPM/c_api.h"
+#include "MPM/Physics/constitutive_model.h"
+#include "MPM/Physics/plasticity.h"
+#include "MPM/mpm_pch.h"
+#include "MPM/simulator.h"
+#include "MPM/step_controller.h"
+
+#include <map>
+#include <mutex>
+
+using namespace mpm;
+
+static_assert(std::is_same<T, double>::value,
+              "mpm_span exposes particle storage as doubles");
+
+// the handle owns the materials its particles point to. objects with the
+// same model and plasticity get the same instances, so the simulator keeps
+// them in one group
+struct mpm_simulator {
+  MPM_Simulator sim;
+  std::unique_ptr<MPM_StepController> controller;
+  std::vector<std::unique_ptr<MPM_Material>> materials;
+  std::map<mpm_model, std::shared_ptr<MPM_CM>> models;
+  std::map<std::pair<int, double>, std::shared_ptr<Plasticity>> plasticities;
+};
+
+namespace {
+
+std::shared_ptr<MPM_CM> make_model(mpm_model model) {
+  switch (model) {
+  case MPM_MODEL_NEOHOOKEAN:
+    return std::make_shared<NeoHookean_Piola>();
+  case MPM_MODEL_VOLUME_PENALTY:
+    return std::make_shared<QuatraticVolumePenalty>();
+  case MPM_MODEL_NEOHOOKEAN_FLUID:
+    return std::make_shared<NeoHookean_Fluid>();
+  case MPM_MODEL_CDMPM_FLUID:
+    return std::make_shared<CDMPM_Fluid>();
+  }
+  return nullptr;
+}
+
+std::shared_ptr<Plasticity> make_plasticity(const mpm_material_desc &desc) {
+  switch (desc.plasticity) {
+  case MPM_PLASTICITY_SNOW:
+    return std::make_shared<Snow>();
+  case MPM_PLASTICITY_VON_MISES:
+    return std::make_shared<vonMises>(desc.yield_stress);
+  default:
+    return nullptr;
+  }
+}
+
+std::vector<VT> unpack(const double *xyz, size_t count) {
+  std::vector<VT> out(count, VT::Zero());
+  if (xyz) {
+    for (size_t i = 0; i < count; i++) {
+      out[i] = VT(xyz[3 * i], xyz[3 * i + 1], xyz[3 * i + 2]);
+    }
+  }
+  return out;
+}
+
+template <class Elem>
+mpm_span make_span(const StridedSpan<Elem> &span, int components) {
+  return {reinterpret_cast<const double *>(span.data), span.size(),
+          span.stride, components};
+}
+
+} // namespace
+
+extern "C" {
+
+mpm_simulator *mpm_create(const double gravity[3], const double world_size[3],
+                          double h) {
+  if (!gravity || !world_size || !(h > 0)) {
+    return nullptr;
+  }
+  static std::once_flag log_once;
+  std::call_once(log_once, [] {
+    if (!MPMLog::get_logger()) {
+      MPMLog::init();
+    }
+  });
+
+  auto handle = std::make_unique<mpm_simulator>();
+  handle->sim.mpm_initialize(VT(gravity[0], gravity[1], gravity[2]),
+                             VT(world_size[0], world_size[1], world_size[2]),
+                             h);
+  handle->controller = std::make_unique<MPM_StepController>(handle->sim);
+  return handle.release();
+}
+
+void mpm_destroy(mpm_simulator *sim) { delete sim; }
+
+int mpm_add_object(mpm_simulator *sim, const double *positions,
+                   const double *velocities, size_t count,
+                   const mpm_material_desc *material) {
+  if (!sim || !positions || !material || count == 0) {
+    return -1;
+  }
+  auto &model = sim->models[material->model];
+  if (!model) {
+    model = make_model(material->model);
+  }
+  if (!model || !(material->particle_mass > 0) || !(material->density > 0)) {
+    return -1;
+  }
+  auto &plasticity = sim->plasticities[{
+      int(material->plasticity),
+      material->plasticity == MPM_PLASTICITY_VON_MISES ? material->yield_stress
+                                                       : 0.0}];
+  if (!plasticity) {
+    plasticity = make_plasticity(*material);
+  }
+  sim->materials.push_back(std::make_unique<MPM_Material>(
+      material->youngs_modulus, material->poisson_ratio,
+      material->particle_mass, material->density));
+  sim->sim.add_object(unpack(positions, count), unpack(velocities, count),
+                      sim->materials.back().get(), model, plasticity);
+  return 0;
+}
+
+int mpm_advance(mpm_simulator *sim, double time) {
+  if (!sim || !(time >= 0)) {
+    return -1;
+  }
+  if (sim->sim.get_sim_info().particle_size == 0 || time == 0) {
+    return 0;
+  }
+  return sim->controller->advance_frame(time);
+}
+
+size_t mpm_particle_count(const mpm_simulator *sim) {
+  return sim ? size_t(sim->sim.get_sim_info().particle_size) : 0;
+}
+
+double mpm_time(const mpm_simulator *sim) {
+  return sim ? sim->sim.get_sim_info().curr_time : 0;
+}
+
+mpm_span mpm_get_channel(const mpm_simulator *sim, mpm_channel channel) {
+  if (!sim) {
+    return {};
+  }
+  auto &s = sim->sim;
+  switch (channel) {
+  case MPM_CHANNEL_POSITION:
+    return make_span(s.get_particle_span(&Particle::pos_p), DIM);
+  case MPM_CHANNEL_VELOCITY:
+    return make_span(s.get_particle_span(&Particle::vel_p), DIM);
+  case MPM_CHANNEL_F:
+    return make_span(s.get_particle_span(&Particle::F), DIM * DIM);
+  case MPM_CHANNEL_J:
+    return make_span(s.get_particle_span(&Particle::J), 1);
+  case MPM_CHANNEL_PLASTIC_JP:
+    return make_span(s.get_particle_span(&Particle::Jp), 1);
+  }
+  return {};
+}
+
+} // extern "C"
@@ -0,0 +1,390 @@
+#include "MPM/checkpoint.h"
+#include "MPM/Utils/mapped_file.h"
+#include "MPM/mpm_pch.h"
+#include "MPM/simulator.h"
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
+
+#include <limits>
+
+namespace mpm {
+
+namespace {
+
+// particles per parallel copy task
+constexpr size_t CHECKPOINT_GRAIN = 1 << 14;
+
+size_t align_up(size_t bytes) {
+  return (bytes + CHECKPOINT_ALIGN - 1) / CHECKPOINT_ALIGN * CHECKPOINT_ALIGN;
+}
+
+template <class Elem> Elem *section(char *base, uint64_t offset) {
+  return reinterpret_cast<Elem *>(base + offset);
+}
+
+template <class Elem> const Elem *section(const char *base, uint64_t offset) {
+  return reinterpret_cast<const Elem *>(base + offset);
+}
+
+// `count` elements of `elem_size` bytes at `offset` lie within the file,
+// particle sections also have to start on CHECKPOINT_ALIGN
+bool section_fits(uint64_t offset, uint64_t count, size_t elem_size,
+                  uint64_t file_size, bool aligned = true) {
+  if (offset > file_size || (aligned && offset % CHECKPOINT_ALIGN != 0)) {
+    return false;
+  }
+  return count <= (file_size - offset) / elem_size;
+}
+
+bool write_image(const std::string &path, const std::vector<char> &image) {
+  // write next to the target and rename, so a crash mid-write never
+  // clobbers the previous good checkpoint
+  auto tmp_path = path + ".tmp";
+  {
+    std::ofstream output(tmp_path, std::ios::out | std::ios::binary);
+    output.write(image.data(), image.size());
+    if (!output) {
+      MPM_ERROR("failed to write checkpoint {}", tmp_path);
+      return false;
+    }
+  }
+  std::error_code ec;
+  std::filesystem::rename(tmp_path, path, ec);
+  if (ec) {
+    MPM_ERROR("failed to move checkpoint to {}: {}", path, ec.message());
+    return false;
+  }
+  return true;
+}
+
+} // namespace
+
+void MPM_Simulator::serialize_checkpoint(std::vector<char> &image) const {
+  MPM_SCOPED_PROFILE("serialize_checkpoint");
+  const size_t n = sim_info.particle_size;
+
+  CheckpointHeader header;
+  header.particle_size = n;
+  header.grid_w = sim_info.grid_w;
+  header.grid_h = sim_info.grid_h;
+  header.grid_l = sim_info.grid_l;
+  header.transfer_scheme = static_cast<int32_t>(transfer_scheme);
+  header.alpha = sim_info.alpha;
+  for (int k = 0; k < DIM; k++) {
+    header.gravity[k] = sim_info.gravity[k];
+    header.world_area[k] = sim_info.world_area[k];
+  }
+  header.h = sim_info.h;
+  header.max_velocity = sim_info.max_velocity;
+  header.curr_time = sim_info.curr_time;
+  header.curr_step = sim_info.curr_step;
+  header.material_count = static_cast<uint32_t>(materials.size());
+  header.group_count = static_cast<uint32_t>(groups.size());
+
+  const size_t groups_offset =
+      sizeof(CheckpointHeader) + materials.size() * sizeof(CheckpointMaterial);
+  size_t offset =
+      align_up(groups_offset + groups.size() * sizeof(CheckpointGroup));
+  auto place = [&](uint64_t &section_offset, size_t elem_size) {
+    section_offset = offset;
+    offset = align_up(offset + n * elem_size);
+  };
+  place(header.pos_offset, sizeof(VT));
+  place(header.vel_offset, sizeof(VT));
+  place(header.F_offset, sizeof(MT));
+  place(header.J_offset, sizeof(T));
+  place(header.Bp_offset, sizeof(MT));
+  place(header.Jp_offset, sizeof(T));
+  place(header.gamma_p_offset, sizeof(T));
+  place(header.material_id_offset, sizeof(uint32_t));
+  header.file_size = offset;
+
+  image.resize(header.file_size);
+  char *base = image.data();
+  std::memcpy(base, &header, sizeof(header));
+
+  auto *mtls = section<CheckpointMaterial>(base, sizeof(CheckpointHeader));
+  for (size_t i = 0; i < materials.size(); i++) {
+    mtls[i] = {materials[i]->E, materials[i]->nu, materials[i]->mass,
+               materials[i]->density, uint32_t(i), 0};
+    auto level = material_levels.find(materials[i]);
+    if (level != material_levels.end() && level->second.level != 0) {
+      mtls[i].base = static_cast<uint32_t>(
+          std::find(materials.begin(), materials.end(), level->second.base) -
+          materials.begin());
+      mtls[i].level = level->second.level;
+    }
+  }
+  auto *grps = section<CheckpointGroup>(base, groups_offset);
+  for (size_t i = 0; i < groups.size(); i++) {
+    grps[i] = {uint64_t(groups[i].begin), uint64_t(groups[i].end)};
+  }
+
+  auto *pos = section<VT>(base, header.pos_offset);
+  auto *vel = section<VT>(base, header.vel_offset);
+  auto *F = section<MT>(base, header.F_offset);
+  auto *J = section<T>(base, header.J_offset);
+  auto *Bp = section<MT>(base, header.Bp_offset);
+  auto *Jp = section<T>(base, header.Jp_offset);
+  auto *gamma_p = section<T>(base, header.gamma_p_offset);
+  auto *material_id = section<uint32_t>(base, header.material_id_offset);
+
+  tbb::parallel_for(
+      tbb::blocked_range<size_t>(0, n, CHECKPOINT_GRAIN),
+      [&](const tbb::blocked_range<size_t> &r) {
+        for (auto i = r.begin(); i != r.end(); ++i) {
+          const auto &particle = particles[i];
+          pos[i] = particle.pos_p;
+          vel[i] = particle.vel_p;
+          F[i] = particle.F;
+          J[i] = particle.J;
+          Bp[i] = particle.Bp;
+          Jp[i] = particle.Jp;
+          gamma_p[i] = particle.gamma_p;
+          // only a handful of materials, a linear scan is the fastest map
+          material_id[i] = static_cast<uint32_t>(
+              std::find(materials.begin(), materials.end(),
+                        particle.material) -
+              materials.begin());
+        }
+      });
+}
+
+bool MPM_Simulator::save_checkpoint(const std::string &path) const {
+  std::vector<char> image;
+  serialize_checkpoint(image);
+  return write_image(path, image);
+}
+
+bool MPM_Simulator::load_checkpoint(const std::string &path) {
+  MPM_SCOPED_PROFILE("load_checkpoint");
+  MPM_MappedFile file(path);
+  if (!file.is_open() || file.size() < sizeof(CheckpointHeader)) {
+    MPM_ERROR("checkpoint {} not found or truncated", path);
+    return false;
+  }
+
+  CheckpointHeader expected, header;
+  std::memcpy(&header, file.data(), sizeof(header));
+  if (std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 ||
+      header.version != CHECKPOINT_VERSION || header.dim != DIM ||
+      header.scalar_size != sizeof(T) || header.file_size != file.size()) {
+    MPM_ERROR("checkpoint {} is incompatible: version {}, dim {}, "
+              "scalar size {}, size {} (expect version {})",
+              path, header.version, header.dim, header.scalar_size,
+              file.size(), CHECKPOINT_VERSION);
+    return false;
+  }
+
+  // every section has to lie within the file before anything is read
+  const size_t n = header.particle_size;
+  const uint64_t size = file.size();
+  const uint64_t groups_offset =
+      sizeof(CheckpointHeader) +
+      uint64_t(header.material_count) * sizeof(CheckpointMaterial);
+  bool fits =
+      n <= size_t(std::numeric_limits<int>::max()) &&
+      section_fits(sizeof(CheckpointHeader), header.material_count,
+                   sizeof(CheckpointMaterial), size, false) &&
+      section_fits(groups_offset, header.group_count, sizeof(CheckpointGroup),
+                   size, false) &&
+      section_fits(header.pos_offset, n, sizeof(VT), size) &&
+      section_fits(header.vel_offset, n, sizeof(VT), size) &&
+      section_fits(header.F_offset, n, sizeof(MT), size) &&
+      section_fits(header.J_offset, n, sizeof(T), size) &&
+      section_fits(header.Bp_offset, n, sizeof(MT), size) &&
+      section_fits(header.Jp_offset, n, sizeof(T), size) &&
+      section_fits(header.gamma_p_offset, n, sizeof(T), size) &&
+      section_fits(header.material_id_offset, n, sizeof(uint32_t), size);
+  const char *base = file.data();
+  auto *mtls = section<CheckpointMaterial>(base, sizeof(CheckpointHeader));
+  auto *grps = section<CheckpointGroup>(base, groups_offset);
+  // the groups tile [0, n) in order, so every particle is in exactly one
+  uint64_t covered = 0;
+  for (uint32_t i = 0; fits && i < header.group_count; i++) {
+    fits = grps[i].begin == covered && grps[i].end >= grps[i].begin;
+    covered = grps[i].end;
+  }
+  fits = fits && covered == n;
+  // a level copy has to point at a base of level 0
+  for (uint32_t i = 0; fits && i < header.material_count; i++) {
+    const auto &m = mtls[i];
+    fits = m.base < header.material_count &&
+           (m.level == 0 ? m.base == i
+                         : m.base != i && mtls[m.base].level == 0);
+  }
+  if (fits) {
+    auto *material_id = section<uint32_t>(base, header.material_id_offset);
+    fits = tbb::parallel_reduce(
+        tbb::blocked_range<size_t>(0, n, CHECKPOINT_GRAIN), true,
+        [&](const tbb::blocked_range<size_t> &r, bool known) {
+          for (auto i = r.begin(); known && i != r.end(); ++i) {
+            known = material_id[i] < header.material_count;
+          }
+          return known;
+        },
+        std::logical_and<bool>());
+  }
+  if (!fits) {
+    MPM_ERROR("checkpoint {} is corrupted: a section, group range, "
+              "material level or material id lies outside the file",
+              path);
+    return false;
+  }
+
+  // reuse the caller's materials and the ones made by earlier restores
+  // when they match, recreate the rest. the table is rebuilt, so repeated
+  // restores do not pile up material copies
+  material_levels.clear();
+  level_materials.clear();
+  auto matches = [](const MPM_Material *material,
+                    const CheckpointMaterial &m) {
+    return material && material->E == m.E && material->nu == m.nu &&
+           material->mass == m.mass && material->density == m.density;
+  };
+  auto previous = std::move(owned_materials);
+  owned_materials.clear();
+  auto take_previous = [&](MPM_Material *material) {
+    auto iter =
+        std::find_if(previous.begin(), previous.end(),
+                     [&](auto &owned) { return owned.get() == material; });
+    if (iter != previous.end()) {
+      owned_materials.push_back(std::move(*iter));
+      previous.erase(iter);
+    }
+  };
+  materials.resize(header.material_count);
+  for (uint32_t i = 0; i < header.material_count; i++) {
+    const auto &m = mtls[i];
+    if (matches(materials[i], m)) {
+      take_previous(materials[i]);
+      continue;
+    }
+    auto iter =
+        std::find_if(previous.begin(), previous.end(),
+                     [&](auto &owned) { return matches(owned.get(), m); });
+    if (iter != previous.end()) {
+      materials[i] = iter->get();
+      take_previous(materials[i]);
+    } else {
+      owned_materials.emplace_back(
+          std::make_unique<MPM_Material>(m.E, m.nu, m.mass, m.density));
+      materials[i] = owned_materials.back().get();
+    }
+  }
+  // resample keeps merging and splitting through the same level copies
+  for (uint32_t i = 0; i < header.material_count; i++) {
+    if (mtls[i].level != 0) {
+      auto *origin = materials[mtls[i].base];
+      material_levels[origin] = {origin, 0};
+      material_levels[materials[i]] = {origin, mtls[i].level};
+      level_materials[{origin, mtls[i].level}] = materials[i];
+    }
+  }
+
+  // ranges come from the file, models from the caller's groups in the
+  // order their objects were added
+  if (groups.size() != header.group_count) {
+    MPM_WARN("checkpoint {} has {} model groups, scene set up {}; "
+             "unmatched groups use the default models",
+             path, header.group_count, groups.size());
+  }
+  groups.resize(header.group_count);
+  for (uint32_t i = 0; i < header.group_count; i++) {
+    groups[i].begin = static_cast<int>(grps[i].begin);
+    groups[i].end = static_cast<int>(grps[i].end);
+  }
+
+  VT gravity, world_area;
+  for (int k = 0; k < DIM; k++) {
+    gravity[k] = header.gravity[k];
+    world_area[k] = header.world_area[k];
+  }
+  if (!grid_attrs || sim_info.grid_w != header.grid_w ||
+      sim_info.grid_h != header.grid_h || sim_info.grid_l != header.grid_l ||
+      sim_info.h != header.h) {
+    mpm_initialize(gravity, world_area, header.h);
+  }
+  sim_info.gravity = gravity;
+  sim_info.world_area = world_area;
+
+  delete[] particles;
+  particles = new Particle[n];
+
+  auto *pos = section<VT>(base, header.pos_offset);
+  auto *vel = section<VT>(base, header.vel_offset);
+  auto *F = section<MT>(base, header.F_offset);
+  auto *J = section<T>(base, header.J_offset);
+  auto *Bp = section<MT>(base, header.Bp_offset);
+  auto *Jp = section<T>(base, header.Jp_offset);
+  auto *gamma_p = section<T>(base, header.gamma_p_offset);
+  auto *material_id = section<uint32_t>(base, header.material_id_offset);
+
+  // the material ids were checked above
+  tbb::parallel_for(
+      tbb::blocked_range<size_t>(0, n, CHECKPOINT_GRAIN),
+      [&](const tbb::blocked_range<size_t> &r) {
+        for (auto i = r.begin(); i != r.end(); ++i) {
+          auto &particle = particles[i];
+          particle.pos_p = pos[i];
+          particle.vel_p = vel[i];
+          particle.F = F[i];
+          particle.J = J[i];
+          particle.Bp = Bp[i];
+          particle.Jp = Jp[i];
+          particle.gamma_p = gamma_p[i];
+          particle.material = materials[material_id[i]];
+        }
+      });
+
+  transfer_scheme = static_cast<TransferScheme>(header.transfer_scheme);
+  sim_info.particle_size = static_cast<int>(n);
+  sim_info.alpha = header.alpha;
+  sim_info.max_velocity = header.max_velocity;
+  sim_info.curr_time = header.curr_time;
+  sim_info.curr_step = static_cast<unsigned int>(header.curr_step);
+  place_particles();
+  sleep_blocks.wake_all();
+  regrid_pending = true;
+
+  MPM_INFO("restored checkpoint {}:\n"
+           "\tparticle_size: {}\n"
+           "\tcurr_step: {}\n"
+           "\tcurr_time: {}",
+           path, sim_info.particle_size, sim_info.curr_step,
+           sim_info.curr_time);
+  return true;
+}
+
+MPM_Checkpointer::MPM_Checkpointer(const std::string &output_dir,
+                                   int interval)
+    : output_dir(output_dir), interval(interval) {}
+
+MPM_Checkpointer::~MPM_Checkpointer() { wait(); }
+
+bool MPM_Checkpointer::on_frame(const MPM_Simulator &sim, int frame) {
+  if (interval <= 0 || frame % interval != 0) {
+    return true;
+  }
+  // the image is reused, so the previous write has to land first
+  bool ok = wait();
+  sim.serialize_checkpoint(image);
+
+  auto path = (std::filesystem::path(output_dir) /
+               ("checkpoint_" + std::to_string(frame) + ".mpmckpt"))
+                  .generic_string();
+  pending = std::async(std::launch::async,
+                       [this, path] { return write_image(path, image); });
+  return ok;
+}
+
+bool MPM_Checkpointer::wait() {
+  if (!pending.valid()) {
+    return true;
+  }
+  return pending.get();
+}
+
+} // namespace mpm
@@ -27,4 +27,8 @@ void MPM_Collision::solve_collision(const VT &xi, VT &vi) {
   }
 }
 
+T MPM_Collision::signed_distance(const VT &x) const {
+  return levelset->signed_distance(x);
+}
+
 } // namespace mpm
\ No newline at end of file
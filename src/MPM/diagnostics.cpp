@@ -0,0 +1,34 @@
+#include "MPM/diagnostics.h"
+#include "MPM/mpm_pch.h"
+
+namespace mpm {
+
+MPM_DiagnosticsWriter::MPM_DiagnosticsWriter(const std::string &path)
+    : out(path) {
+  if (!out) {
+    MPM_ERROR("can not open diagnostics file {}", path);
+    return;
+  }
+  out << "step,time,dt,kinetic_energy,elastic_energy,momentum_x,momentum_y,"
+         "momentum_z,grid_mass,min_J,max_J\n";
+}
+
+MPM_DiagnosticsWriter::~MPM_DiagnosticsWriter() { flush(); }
+
+void MPM_DiagnosticsWriter::write(const SimDiagnostics &d) {
+  if (!out) {
+    return;
+  }
+  out << fmt::format("{},{},{},{},{},{},{},{},{},{},{}\n", d.step, d.time,
+                     d.dt, d.kinetic_energy, d.elastic_energy, d.momentum[0],
+                     d.momentum[1], d.momentum[2], d.grid_mass, d.min_J,
+                     d.max_J);
+}
+
+void MPM_DiagnosticsWriter::flush() {
+  if (out) {
+    out.flush();
+  }
+}
+
+} // namespace mpm
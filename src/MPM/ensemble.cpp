@@ -0,0 +1,144 @@
+#include "MPM/ensemble.h"
+#include "MPM/Utils/io.h"
+#include "MPM/diagnostics.h"
+#include "MPM/mpm_pch.h"
+#include "MPM/simulator.h"
+
+#include <atomic>
+#include <numeric>
+
+#include <tbb/info.h>
+#include <tbb/parallel_for.h>
+#include <tbb/task_arena.h>
+#include <tbb/task_group.h>
+
+namespace mpm {
+
+namespace fs = std::filesystem;
+
+MPM_Ensemble::MPM_Ensemble(const EnsembleOptions &options)
+    : options(options) {}
+
+std::vector<EnsembleResult> MPM_Ensemble::run() {
+  const size_t n = runs.size();
+  std::vector<EnsembleResult> results(n);
+  std::vector<std::unique_ptr<MPM_Simulator>> sims(n);
+  int threads = options.threads > 0 ? options.threads
+                                    : tbb::info::default_concurrency();
+  tbb::task_arena arena(threads);
+
+  arena.execute([&] {
+    tbb::parallel_for(size_t(0), n, [&](size_t r) {
+      results[r].name = runs[r].name;
+      try {
+        sims[r] = std::make_unique<MPM_Simulator>();
+        runs[r].setup(*sims[r]);
+        results[r].particles = sims[r]->get_sim_info().particle_size;
+      } catch (const std::exception &e) {
+        MPM_ERROR("ensemble run {} failed to set up: {}", runs[r].name,
+                  e.what());
+        sims[r].reset();
+      }
+    });
+  });
+
+  // largest first, the remaining small runs fill in around them
+  std::vector<size_t> order(n);
+  std::iota(order.begin(), order.end(), size_t(0));
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return double(results[a].particles) * runs[a].frames >
+           double(results[b].particles) * runs[b].frames;
+  });
+
+  auto step_run = [&](size_t r) {
+    auto &run = runs[r];
+    auto &sim = *sims[r];
+    auto &result = results[r];
+    auto start = std::chrono::steady_clock::now();
+    fs::path dir = fs::path(options.output_dir) / run.name;
+    fs::create_directories(dir);
+
+    MPM_StepController controller(sim, run.step_options);
+    std::unique_ptr<MPM_DiagnosticsWriter> diagnostics;
+    if (options.write_diagnostics) {
+      sim.set_diagnostics(true);
+      diagnostics = std::make_unique<MPM_DiagnosticsWriter>(
+          (dir / "diagnostics.csv").generic_string());
+    }
+    ParticleSnapshot snapshot;
+    auto export_frame = [&](int frame) {
+      if (!options.write_frames) {
+        return;
+      }
+      sim.export_snapshot(run.export_desc, snapshot);
+      snapshot.frame = frame;
+      auto path = dir / (std::to_string(frame) + ".bgeo");
+      write_particles(path.generic_string(), snapshot);
+    };
+
+    export_frame(0);
+    for (int frame = 1; frame <= run.frames; frame++) {
+      result.substeps += controller.advance_frame(1 / run.frame_rate, [&](T) {
+        if (diagnostics) {
+          diagnostics->write(sim.get_diagnostics());
+        }
+      });
+      export_frame(frame);
+      if (diagnostics) {
+        diagnostics->flush();
+      }
+    }
+    result.frames = run.frames;
+    result.rejected_steps = controller.get_rejected_steps();
+    result.seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    result.ok = true;
+    MPM_INFO("ensemble run {} finished: {} particles, {} substeps, {:.2f}s",
+             run.name, result.particles, result.substeps, result.seconds);
+  };
+
+  // one loop per worker claims the runs in order. a run waits only for its
+  // own loops (isolate), so a thread never starts a second scene while one
+  // of its own is unfinished
+  std::atomic<size_t> next{0};
+  arena.execute([&] {
+    tbb::task_group group;
+    for (int t = 0; t < threads; t++) {
+      group.run([&] {
+        for (size_t i; (i = next.fetch_add(1)) < n;) {
+          size_t r = order[i];
+          if (!sims[r]) {
+            continue;
+          }
+          try {
+            if (results[r].particles < options.serial_particles) {
+              tbb::task_arena single(1);
+              single.execute([&] { step_run(r); });
+            } else {
+              tbb::this_task_arena::isolate([&] { step_run(r); });
+            }
+          } catch (const std::exception &e) {
+            MPM_ERROR("ensemble run {} failed: {}", runs[r].name, e.what());
+          }
+          sims[r].reset();
+        }
+      });
+    }
+    group.wait();
+  });
+
+  fs::create_directories(options.output_dir);
+  std::ofstream summary(
+      (fs::path(options.output_dir) / "ensemble.csv").generic_string());
+  summary << "name,particles,frames,substeps,rejected_steps,seconds,ok\n";
+  for (auto &result : results) {
+    summary << fmt::format("{},{},{},{},{},{:.3f},{}\n", result.name,
+                           result.particles, result.frames, result.substeps,
+                           result.rejected_steps, result.seconds,
+                           int(result.ok));
+  }
+  return results;
+}
+
+} // namespace mpm
@@ -0,0 +1,138 @@
+#include "MPM/grid_export.h"
+#include "MPM/Utils/half.h"
+#include "MPM/mpm_pch.h"
+#include "MPM/simulator.h"
+
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_sort.h>
+
+namespace mpm {
+
+namespace {
+
+void setup_buffer(GridBuffer &buffer, GridChannel channel, ExportType type,
+                  size_t nodes) {
+  buffer.channel = channel;
+  buffer.type = type == ExportType::FLOAT16 ? type : ExportType::FLOAT32;
+  buffer.components = grid_channel_components(channel);
+  buffer.name = grid_channel_name(channel);
+  buffer.data.resize(nodes * buffer.element_size());
+}
+
+void put(GridBuffer &buffer, size_t node, int k, T value) {
+  size_t i = node * buffer.components + k;
+  if (buffer.type == ExportType::FLOAT16) {
+    buffer.as<uint16_t>()[i] = float_to_half(float(value));
+  } else {
+    buffer.as<float>()[i] = float(value);
+  }
+}
+
+} // namespace
+
+int grid_channel_components(GridChannel channel) {
+  switch (channel) {
+  case GridChannel::VELOCITY:
+  case GridChannel::FORCE:
+    return DIM;
+  default:
+    return 1;
+  }
+}
+
+std::string grid_channel_name(GridChannel channel) {
+  switch (channel) {
+  case GridChannel::MASS:
+    return "mass";
+  case GridChannel::DENSITY:
+    return "density";
+  case GridChannel::VELOCITY:
+    return "v";
+  case GridChannel::FORCE:
+    return "force";
+  }
+  return "unknown";
+}
+
+void MPM_Simulator::export_grid(const GridExportDesc &desc,
+                                GridSnapshot &snapshot) const {
+  MPM_PROFILE_STAGE("export_grid");
+  MPM_ASSERT(desc.block_size > 0, "GRID TILES NEED A POSITIVE SIZE");
+  const int B = desc.block_size;
+  const int tile_nodes = B * B * B;
+  const int H = sim_info.grid_h, L = sim_info.grid_l;
+  const VINT dims(sim_info.grid_w, H, L);
+  const VINT block_dims = (dims.array() + B - 1) / B;
+  snapshot.dims = dims;
+  snapshot.h = sim_info.h;
+  snapshot.time = sim_info.curr_time;
+  snapshot.block_size = B;
+
+  // the tiles come from the active nodes, so the export never walks the
+  // empty part of the grid
+  auto node_of = [&](int index) {
+    return VINT(index / (H * L), index / L % H, index % L);
+  };
+  std::vector<int> tiles(active_nodes.size());
+  tbb::parallel_for(size_t(0), tiles.size(), [&](size_t i) {
+    VINT block = node_of(active_nodes[i]) / B;
+    tiles[i] = (block[0] * block_dims[1] + block[1]) * block_dims[2] + block[2];
+  });
+  tbb::parallel_sort(tiles.begin(), tiles.end());
+  tiles.erase(std::unique(tiles.begin(), tiles.end()), tiles.end());
+  const size_t nb = tiles.size();
+
+  snapshot.blocks.resize(nb);
+  snapshot.masks.assign(nb * snapshot.mask_bytes(), 0);
+  snapshot.channels.resize(desc.channels.size());
+  for (size_t c = 0; c < desc.channels.size(); c++) {
+    setup_buffer(snapshot.channels[c], desc.channels[c], desc.type,
+                 nb * tile_nodes);
+  }
+
+  const T inv_volume = 1 / (sim_info.h * sim_info.h * sim_info.h);
+  int stage = MPM_Profiler::current_stage();
+  tbb::parallel_for(size_t(0), nb, [&](size_t b) {
+    MPMTaskProfiler task(stage);
+    VINT block(tiles[b] / (block_dims[1] * block_dims[2]),
+               tiles[b] / block_dims[2] % block_dims[1],
+               tiles[b] % block_dims[2]);
+    snapshot.blocks[b] = block;
+    uint8_t *mask = snapshot.masks.data() + b * snapshot.mask_bytes();
+    for (int n = 0; n < tile_nodes; n++) {
+      VINT node = block * B + VINT(n / (B * B), n / B % B, n % B);
+      const GridAttr *attr = nullptr;
+      if ((node.array() < dims.array()).all()) {
+        attr = &grid_attrs[(node[0] * H + node[1]) * L + node[2]];
+        if (attr->mass_i > 0) {
+          mask[n / 8] |= uint8_t(1 << n % 8);
+        } else {
+          attr = nullptr;
+        }
+      }
+      size_t out = b * tile_nodes + n;
+      for (auto &buffer : snapshot.channels) {
+        switch (buffer.channel) {
+        case GridChannel::MASS:
+          put(buffer, out, 0, attr ? attr->mass_i : T(0));
+          break;
+        case GridChannel::DENSITY:
+          put(buffer, out, 0, attr ? attr->mass_i * inv_volume : T(0));
+          break;
+        case GridChannel::VELOCITY:
+          for (int k = 0; k < DIM; k++) {
+            put(buffer, out, k, attr ? attr->vel_i[k] : T(0));
+          }
+          break;
+        case GridChannel::FORCE:
+          for (int k = 0; k < DIM; k++) {
+            put(buffer, out, k, attr ? attr->force_i[k] : T(0));
+          }
+          break;
+        }
+      }
+    }
+  });
+}
+
+} // namespace mpm
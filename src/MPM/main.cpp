@@ -1,15 +1,22 @@
 
 
-#include <tbb/task_scheduler_init.h>
-
 #include "MPM/Math/interpolation.h"
 #include "MPM/Physics/constitutive_model.h"
 #include "MPM/Physics/plasticity.h"
+#include "MPM/Utils/async_writer.h"
 #include "MPM/Utils/io.h"
 #include "MPM/Utils/logger.h"
+#include "MPM/Utils/particle_cache.h"
 #include "MPM/Utils/profiler.h"
+#include "MPM/Utils/shm_stream.h"
+#include "MPM/checkpoint.h"
 #include "MPM/collision.h"
+#include "MPM/diagnostics.h"
+#include "MPM/ensemble.h"
+#include "MPM/resample.h"
+#include "MPM/scene.h"
 #include "MPM/simulator.h"
+#include "MPM/step_controller.h"
 
 using namespace std;
 using namespace Eigen;
@@ -43,66 +50,144 @@ void quatratic_test() {
   MPM_INFO("{} end", __func__);
 }
 
+// young's modulus x poisson ratio sweep over small falling jello cubes, the
+// FLIP/APIC choice and snow's critical compression and stretch vary along
+bool run_material_sweep(const std::string &output_dir) {
+  mpm::EnsembleOptions options;
+  options.output_dir = output_dir;
+  mpm::MPM_Ensemble ensemble(options);
+
+  std::vector<VT> cube;
+  for (int i = 0; i < 16; i++)
+    for (int j = 0; j < 16; j++)
+      for (int k = 0; k < 16; k++) {
+        cube.push_back(VT(0.4, 0.5, 0.4) + VT(i, j, k) * 0.0125);
+      }
+
+  auto add_run = [&](const std::string &name, T E, T nu,
+                     const std::function<void(mpm::MPM_Simulator &)> &model) {
+    mpm::EnsembleRun run;
+    run.name = name;
+    run.frames = 30;
+    run.step_options.max_dt = 2e-3;
+    auto material = std::make_shared<MPM_Material>(E, nu, 2e-3, 1000.0);
+    run.setup = [=](mpm::MPM_Simulator &sim) {
+      sim.mpm_initialize(VT(0, -9.8, 0), VT(1, 1, 1), 0.025);
+      sim.set_constitutive_model(std::make_shared<mpm::NeoHookean_Piola>());
+      model(sim);
+      sim.add_object(cube, material.get());
+    };
+    ensemble.add(std::move(run));
+  };
+
+  // elastic under APIC
+  for (T E : {1e4, 5e4, 2e5}) {
+    for (T nu : {0.2, 0.3, 0.4}) {
+      add_run(fmt::format("E{}_nu{}", E, nu), E, nu,
+              [](mpm::MPM_Simulator &) {});
+    }
+  }
+  // snow: critical compression / stretch and the FLIP blend. psi is left
+  // out, Snow does not apply its hardening to mu and lambda
+  const std::pair<T, T> thetas[] = {{2.5e-2, 7.5e-3}, {1.5e-2, 5e-3}};
+  for (T E : {1e4, 5e4, 2e5}) {
+    for (auto [theta_c, theta_s] : thetas) {
+      for (T alpha : {0.95, 0.99}) {
+        add_run(fmt::format("snow_E{}_tc{}_ts{}_a{}", E, theta_c, theta_s,
+                            alpha),
+                E, 0.2, [=](mpm::MPM_Simulator &sim) {
+                  sim.set_transfer_scheme(
+                      mpm::MPM_Simulator::TransferScheme::FLIP99);
+                  sim.set_flip_alpha(alpha);
+                  sim.set_plasticity(
+                      std::make_shared<mpm::Snow>(10, theta_c, theta_s));
+                });
+      }
+    }
+  }
+  auto results = ensemble.run();
+  return std::all_of(results.begin(), results.end(),
+                     [](const mpm::EnsembleResult &r) { return r.ok; });
+}
+
+// every scene file is one run, named after the file
+bool run_scenes(const std::string &output_dir,
+                const std::vector<std::string> &scene_paths) {
+  mpm::EnsembleOptions options;
+  options.output_dir = output_dir;
+  mpm::MPM_Ensemble ensemble(options);
+  for (auto &path : scene_paths) {
+    auto scene = std::make_shared<mpm::MPM_Scene>();
+    if (!scene->load(path)) {
+      return false;
+    }
+    mpm::EnsembleRun run;
+    run.name = fs::path(path).stem().string();
+    run.frames = scene->frames;
+    run.frame_rate = scene->frame_rate;
+    run.step_options = scene->step_options;
+    run.export_desc = scene->export_desc;
+    run.setup = [scene](mpm::MPM_Simulator &sim) {
+      if (!scene->build(sim)) {
+        throw std::runtime_error("unable to build " + scene->get_path());
+      }
+    };
+    ensemble.add(std::move(run));
+  }
+  auto results = ensemble.run();
+  return std::all_of(results.begin(), results.end(),
+                     [](const mpm::EnsembleResult &r) { return r.ok; });
+}
+
 int main(int argc, char **argv) {
   // initialize logger
-  mpm::MPMLog::init();
+  // workers never wait on stdout, a full queue drops the oldest messages
+  mpm::MPMLog::init(true);
+
+  // usage: MPM --cache-to-bgeo <particle cache> <output dir>
+  if (argc > 3 && std::string(argv[1]) == "--cache-to-bgeo") {
+    bool converted = mpm::convert_cache_to_bgeo(argv[2], argv[3]);
+    mpm::MPMLog::shutdown();
+    return converted ? 0 : 1;
+  }
+
+  // usage: MPM --ensemble <output dir> [scene files], without scene files
+  // a built-in material sweep
+  if (argc > 2 && std::string(argv[1]) == "--ensemble") {
+    bool finished =
+        argc > 3 ? run_scenes(argv[2], std::vector<std::string>(
+                                            argv + 3, argv + argc))
+                 : run_material_sweep(argv[2]);
+    mpm::MPMLog::shutdown();
+    return finished ? 0 : 1;
+  }
+
   // quatratic_test();
+  // usage: MPM [--scene <scene file>] [checkpoint to resume from]
+  std::string scene_path = "../../scenes/sand.scene";
+  int next_arg = 1;
+  if (argc > 2 && std::string(argv[1]) == "--scene") {
+    scene_path = argv[2];
+    next_arg = 3;
+  }
+
+  // everything up to the first step counts as setup
+  auto setup_start = std::chrono::steady_clock::now();
+  mpm::MPM_Scene scene;
   auto sim = std::make_shared<mpm::MPM_Simulator>();
+  if (!scene.load(scene_path) || !scene.build(*sim)) {
+    mpm::MPMLog::shutdown();
+    return 1;
+  }
+  T h = sim->get_sim_info().h;
 
-  auto mtl_jello = MPM_Material(50.0, 0.3, 10.0, 1.0);
-  auto mtl_water = MPM_Material(5e5, 0.4, 0.01, 1000.0);
-
-  auto cm_solid = std::make_shared<mpm::NeoHookean_Piola>();
-  auto cm_fluid = std::make_shared<mpm::NeoHookean_Fluid>();
-  auto cm_fluid_1 = std::make_shared<mpm::QuatraticVolumePenalty>();
-  auto cm_fluid_2 = std::make_shared<mpm::CDMPM_Fluid>();
-
-  auto plas_snow = std::make_shared<mpm::Snow>();
-
-  sim->clear_simulation();
-  VT gravity{0.0, -9.8, 0.0};
-  VT area{10.0, 10.0, 10.0};
-  // VT velocity{-2.5f, 0.5f, -0.3f};
-  VT velocity{0.0, 0.0, 0.0};
-  T h = 0.1;
-
-  auto wall_left = mpm::MPM_Collision(std::make_shared<mpm::HalfPlane_LevelSet>(
-      VT(1.0, 0.0, 0.0), VT(2, 0.0, 0.0)));
-  auto wall_right =
-      mpm::MPM_Collision(std::make_shared<mpm::HalfPlane_LevelSet>(
-          VT(-1.0, 0.0, 0.0), VT(8.2, 0.0, 0.0)));
-  auto wall_forward =
-      mpm::MPM_Collision(std::make_shared<mpm::HalfPlane_LevelSet>(
-          VT(0.0, 0.0, 1.0), VT(0.0, 0.0, 1.8)));
-  auto wall_back = mpm::MPM_Collision(std::make_shared<mpm::HalfPlane_LevelSet>(
-      VT(0.0, 0.0, -1.0), VT(0.0, 0.0, 6)));
-  // auto wall_bottom =
-  //     mpm::MPM_Collision(std::make_shared<mpm::HalfPlane_LevelSet>(
-  //         VT(0.0, 1.0, 0.0f), VT(0.0, 0.1, 0.0)));
-
-  sim->mpm_initialize(gravity, area, h);
-  sim->set_constitutive_model(cm_fluid_1);
-  sim->add_collision(wall_left, wall_right, wall_back, wall_forward);
-  // sim->set_plasticity(plas_snow);
-
-  sim->set_transfer_scheme(mpm::MPM_Simulator::TransferScheme::APIC);
-
-  std::vector<VT> positions;
-  auto model_path = "../../models/sand.obj";
-
-  if (mpm::read_particles(model_path, positions)) {
-    sim->add_object(positions, std::vector<VT>(positions.size(), velocity),
-                    &mtl_water);
-  } else {
-    return 0;
-  }
-
-  T CFL = 0.5;
-  T max_dt = 1e-3;
-  T dt = max_dt;
-
-  int frame_rate = 30;
-  int total_frame = 300;
+  // optimistic steps under the advective and acoustic CFL of every
+  // material: start large, roll back and halve on failure
+  mpm::StepControllerOptions step_options = scene.step_options;
+  T max_dt = step_options.max_dt;
+
+  int frame_rate = scene.frame_rate;
+  int total_frame = scene.frames;
   T time_per_frame = 1.0 / frame_rate;
   T total_time = 0.0;
 
@@ -110,54 +195,190 @@ int main(int argc, char **argv) {
            "\tframe_rate: {}\n"
            "\tmax_dt: {}\n"
            "\tparticle_size: {}",
-           frame_rate, dt, positions.size());
+           frame_rate, max_dt, sim->get_sim_info().particle_size);
 
-  fs::path output_dir("../../output/test/");
+  fs::path output_dir(scene.output_dir);
   if (!fs::exists(output_dir)) {
-    fs::create_directory(output_dir);
+    fs::create_directories(output_dir);
+  }
+
+  int start_frame = 0;
+  if (argc > next_arg) {
+    if (!sim->load_checkpoint(argv[next_arg])) {
+      mpm::MPMLog::shutdown();
+      return 1;
+    }
+    total_time = sim->get_sim_info().curr_time;
+    start_frame = static_cast<int>(std::round(total_time * frame_rate));
+  }
+
+  // a .bgeo per frame by default, `output cache 1` for one native cache per
+  // run (convert with --cache-to-bgeo)
+  std::unique_ptr<mpm::MPM_CacheWriter> cache;
+  if (scene.particle_cache) {
+    mpm::CacheOptions cache_options;
+    cache_options.position_quantum = h * 1e-3;
+    cache = std::make_unique<mpm::MPM_CacheWriter>(
+        (output_dir / ("particles_" + std::to_string(start_frame) + ".mpc"))
+            .generic_string(),
+        cache_options);
+  }
+
+  // a surface mesh per frame next to the particles, extracted on the writer
+  // threads so the simulation does not wait for it
+  std::unique_ptr<mpm::MPM_SurfaceMesher> mesher;
+  if (scene.mesh_surface) {
+    mpm::SurfaceOptions surface_options;
+    surface_options.voxel_size = h / 2;
+    mesher = std::make_unique<mpm::MPM_SurfaceMesher>(surface_options);
+  }
+
+  // frame n is written by the background writers while n+1 is simulated.
+  // the cache needs its frames in order, so it gets a single writer and
+  // compresses the chunks of each frame in parallel instead
+  mpm::MPM_AsyncWriter writer(
+      [&](const std::string &path, const mpm::ParticleSnapshot &snapshot) {
+        bool written = cache ? cache->write_frame(snapshot)
+                             : mpm::write_particles(path, snapshot);
+        if (mesher) {
+          mpm::SurfaceMesh mesh;
+          mesher->extract(snapshot, mesh);
+          written &= mpm::write_mesh(output_dir.generic_string() + "surface_" +
+                                         std::to_string(snapshot.frame) +
+                                         ".ply",
+                                     mesh);
+        }
+        return written;
+      },
+      cache ? 1 : 2, 3);
+  const mpm::ExportDesc &export_desc = scene.export_desc;
+  // grid tiles of the last substep next to every frame, for volume
+  // rendering and debugging. written in place, the tiles scale with the
+  // occupied volume
+  mpm::GridExportDesc grid_desc;
+  grid_desc.add(mpm::GridChannel::DENSITY).add(mpm::GridChannel::VELOCITY);
+  mpm::GridSnapshot grid_snapshot;
+  // the newest frame also goes to shared memory for live viewers, see
+  // MPM_ShmSubscriber. a copy per frame, readers never hold up the run
+  std::unique_ptr<mpm::MPM_ShmPublisher> live;
+  if (scene.stream_live) {
+    live = std::make_unique<mpm::MPM_ShmPublisher>("/mpm_live");
+  }
+  auto export_frame = [&](int frame) {
+    auto snapshot = writer.acquire();
+    sim->export_snapshot(export_desc, *snapshot);
+    snapshot->frame = frame;
+    if (live) {
+      live->publish(*snapshot);
+    }
+    writer.submit(output_dir.generic_string() + std::to_string(frame) +
+                      ".bgeo",
+                  snapshot);
+    if (scene.grid_fields) {
+      sim->export_grid(grid_desc, grid_snapshot);
+      grid_snapshot.frame = frame;
+      mpm::write_grid(output_dir.generic_string() + "grid_" +
+                          std::to_string(frame) + ".mpvol",
+                      grid_snapshot);
+    }
+  };
+
+  if (start_frame == 0) {
+    export_frame(0);
+  }
+
+  // per-stage timings after every frame, the trace and the counters below
+  // build on them. the chrome://tracing timeline of every stage and task
+  // grows by a few MB per frame
+  if (scene.write_trace) {
+    mpm::MPM_Profiler::begin_trace(output_dir.generic_string() +
+                                   "trace.json");
   }
 
-  write_particles(output_dir.generic_string() + "0.bgeo", sim->get_positions());
+  // per-stage cycles, instructions and LLC misses in the frame reports
+  if (scene.hw_counters) {
+    mpm::MPM_Profiler::enable_counters(true);
+  }
+  mpm::MPM_Profiler::set_enabled(scene.profile_stages || scene.write_trace ||
+                                 scene.hw_counters);
+
+  // energies, momentum, grid mass and the J range of every substep, reduced
+  // inside the step passes and written as a csv time series
+  std::unique_ptr<mpm::MPM_DiagnosticsWriter> diagnostics;
+  if (scene.write_diagnostics) {
+    sim->set_diagnostics(true);
+    diagnostics = std::make_unique<mpm::MPM_DiagnosticsWriter>(
+        (output_dir /
+         ("diagnostics_" + std::to_string(start_frame) + ".csv"))
+            .generic_string());
+  }
+
+  mpm::MPM_Checkpointer checkpointer(output_dir.generic_string(),
+                                     scene.checkpoint_interval);
 
-  for (int frame = 0; frame < total_frame;) {
+  mpm::MPM_StepController stepper(*sim, step_options);
+
+  // merge particles in calm, dense cells and split them in stretched,
+  // sparse ones every resample_options.interval frames
+  mpm::MPM_Resampler resampler(scene.resample_options);
+
+  double setup_seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - setup_start)
+                             .count();
+  auto run_start = std::chrono::steady_clock::now();
+  for (int frame = start_frame; frame < total_frame;) {
     {
       MPM_SCOPED_PROFILE("frame#" + std::to_string(frame + 1));
 
       T mmax_vel = 0.0f;
-      T curr_time = 0.0f;
       T min_dt = max_dt;
-      int steps = 0;
+      int rejected = stepper.get_rejected_steps();
 
-      while (curr_time < time_per_frame) {
-        dt = std::min(max_dt,
-                      h * CFL / std::max(T(0.0001), sim->get_max_velocity()));
+      int steps = stepper.advance_frame(time_per_frame, [&](T dt) {
         mmax_vel = std::max(mmax_vel, sim->get_max_velocity());
-
         min_dt = std::min(dt, min_dt);
-
-        if (dt + curr_time >= time_per_frame) {
-          dt = time_per_frame - curr_time;
+        if (diagnostics) {
+          diagnostics->write(sim->get_diagnostics());
         }
-        sim->substep(dt);
-
-        steps++;
-        curr_time += dt;
         total_time += dt;
-      }
+      });
 
-      write_particles(output_dir.generic_string() + std::to_string(++frame) +
-                          ".bgeo",
-                      sim->get_positions());
+      export_frame(++frame);
+      checkpointer.on_frame(*sim, frame);
+      if (scene.adaptive_sampling) {
+        resampler.on_frame(*sim, frame);
+      }
+      if (diagnostics) {
+        diagnostics->flush();
+      }
+      if (mpm::MPM_Profiler::is_enabled()) {
+        mpm::MPM_Profiler::report("frame#" + std::to_string(frame));
+      }
       MPM_INFO("frame#{} info:\n"
-               "\tsteps: {}\n"
+               "\tsteps: {} ({} rolled back)\n"
                "\tmax_vel: {}\n"
                "\tmin_dt, max_dt: {}, {}\n"
+               "\tsleeping particles: {}\n"
                "\ttotal_time: {}",
-               frame, steps, mmax_vel, min_dt, max_dt, total_time);
+               frame, steps, stepper.get_rejected_steps() - rejected, mmax_vel,
+               min_dt, max_dt, sim->get_sleeping_particle_count(), total_time);
     }
   }
   // sim->mpm_demo(cm_fluid, "neohookean_fluids/");
+  writer.flush();
+  checkpointer.wait();
+  if (cache) {
+    cache->close();
+  }
+  mpm::MPM_Profiler::end_trace();
 
-  MPM_INFO("===SIMULATION FINISHED===\n");
+  MPM_INFO("===SIMULATION FINISHED===\n"
+           "\tsetup: {:.3f}s\n"
+           "\tsimulation: {:.3f}s",
+           setup_seconds,
+           std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         run_start)
+               .count());
+  mpm::MPMLog::shutdown();
   return 0;
 }
\ No newline at end of file
@@ -11,4 +11,8 @@ MPM_Material::MPM_Material(T E, T nu, T mass, T density)
   K = E / (1 - 2 * nu) / 3.0f;
 }
 
+T MPM_Material::wave_speed() const {
+  return std::sqrt((lambda + 2 * mu) / density);
+}
+
 } // namespace mpm
@@ -0,0 +1,194 @@
+#include "MPM/particle_export.h"
+#include "MPM/Physics/constitutive_model.h"
+#include "MPM/Utils/half.h"
+#include "MPM/mpm_pch.h"
+#include "MPM/simulator.h"
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+
+namespace mpm {
+
+namespace {
+
+// particles per export task, small enough that a chunk of particles stays
+// in cache while every requested channel is evaluated for it
+constexpr size_t SNAPSHOT_GRAIN = 1 << 12;
+
+template <class Out> Out convert(T value);
+template <> inline float convert<float>(T value) { return float(value); }
+template <> inline uint16_t convert<uint16_t>(T value) {
+  return float_to_half(float(value));
+}
+template <> inline int32_t convert<int32_t>(T value) {
+  return int32_t(value);
+}
+
+template <class Out> inline void put(Out *out, T value) {
+  out[0] = convert<Out>(value);
+}
+template <class Out> inline void put(Out *out, const VT &value) {
+  for (int k = 0; k < DIM; k++) {
+    out[k] = convert<Out>(value[k]);
+  }
+}
+
+template <class Out, class Getter>
+void fill_range(ChannelBuffer &buffer, size_t begin, size_t end,
+                Getter &get) {
+  Out *out = buffer.as<Out>() + begin * buffer.components;
+  for (auto i = begin; i != end; ++i, out += buffer.components) {
+    put(out, get(i));
+  }
+}
+
+template <class Getter>
+void fill_channel(ChannelBuffer &buffer, size_t begin, size_t end,
+                  Getter &&get) {
+  switch (buffer.type) {
+  case ExportType::FLOAT32:
+    fill_range<float>(buffer, begin, end, get);
+    break;
+  case ExportType::FLOAT16:
+    fill_range<uint16_t>(buffer, begin, end, get);
+    break;
+  case ExportType::INT32:
+    fill_range<int32_t>(buffer, begin, end, get);
+    break;
+  }
+}
+
+void setup_buffer(ChannelBuffer &buffer, ExportChannel channel,
+                  ExportType type, size_t n) {
+  buffer.channel = channel;
+  // ids stay integers, everything else is a float channel
+  if (channel == ExportChannel::MATERIAL_ID) {
+    buffer.type = ExportType::INT32;
+  } else {
+    buffer.type = type == ExportType::INT32 ? ExportType::FLOAT32 : type;
+  }
+  buffer.components = export_channel_components(channel);
+  buffer.name = export_channel_name(channel);
+  buffer.data.resize(n * buffer.element_size());
+}
+
+} // namespace
+
+int export_channel_components(ExportChannel channel) {
+  switch (channel) {
+  case ExportChannel::POSITION:
+  case ExportChannel::VELOCITY:
+    return DIM;
+  default:
+    return 1;
+  }
+}
+
+std::string export_channel_name(ExportChannel channel) {
+  // houdini naming where one exists
+  switch (channel) {
+  case ExportChannel::POSITION:
+    return "position";
+  case ExportChannel::VELOCITY:
+    return "v";
+  case ExportChannel::J:
+    return "J";
+  case ExportChannel::DET_F:
+    return "detF";
+  case ExportChannel::PLASTIC_JP:
+    return "Jp";
+  case ExportChannel::MATERIAL_ID:
+    return "material_id";
+  case ExportChannel::VON_MISES:
+    return "von_mises";
+  }
+  return "unknown";
+}
+
+float ChannelBuffer::get(size_t i, int k) const {
+  switch (type) {
+  case ExportType::FLOAT16:
+    return half_to_float(as<uint16_t>()[i * components + k]);
+  case ExportType::INT32:
+    return float(as<int32_t>()[i * components + k]);
+  default:
+    return as<float>()[i * components + k];
+  }
+}
+
+void MPM_Simulator::export_snapshot(const ExportDesc &desc,
+                                    ParticleSnapshot &snapshot) const {
+  MPM_PROFILE_STAGE("export_snapshot");
+  const size_t n = sim_info.particle_size;
+  snapshot.size = sim_info.particle_size;
+  snapshot.time = sim_info.curr_time;
+  snapshot.channels.resize(1 + desc.channels.size());
+  setup_buffer(snapshot.channels[0], ExportChannel::POSITION,
+               desc.position_type, n);
+  for (size_t c = 0; c < desc.channels.size(); c++) {
+    setup_buffer(snapshot.channels[c + 1], desc.channels[c].channel,
+                 desc.channels[c].type, n);
+  }
+
+  // one pass over particle chunks, only the requested channels are visited
+  int stage = MPM_Profiler::current_stage();
+  tbb::parallel_for(
+      tbb::blocked_range<size_t>(0, n, SNAPSHOT_GRAIN),
+      [&](const tbb::blocked_range<size_t> &r) {
+        MPMTaskProfiler task(stage);
+        for (auto &buffer : snapshot.channels) {
+          switch (buffer.channel) {
+          case ExportChannel::POSITION:
+            fill_channel(buffer, r.begin(), r.end(),
+                         [&](size_t i) { return particles[i].pos_p; });
+            break;
+          case ExportChannel::VELOCITY:
+            fill_channel(buffer, r.begin(), r.end(),
+                         [&](size_t i) { return particles[i].vel_p; });
+            break;
+          case ExportChannel::J:
+            fill_channel(buffer, r.begin(), r.end(),
+                         [&](size_t i) { return particles[i].J; });
+            break;
+          case ExportChannel::DET_F:
+            fill_channel(buffer, r.begin(), r.end(), [&](size_t i) {
+              return particles[i].F.determinant();
+            });
+            break;
+          case ExportChannel::PLASTIC_JP:
+            fill_channel(buffer, r.begin(), r.end(),
+                         [&](size_t i) { return particles[i].Jp; });
+            break;
+          case ExportChannel::MATERIAL_ID:
+            fill_channel(buffer, r.begin(), r.end(), [&](size_t i) {
+              return T(std::find(materials.begin(), materials.end(),
+                                 particles[i].material) -
+                       materials.begin());
+            });
+            break;
+          case ExportChannel::VON_MISES: {
+            // kirchhoff stress J * sigma through each group's batch kernel
+            std::vector<MT> tau(r.size(), MT::Zero());
+            for (auto &group : groups) {
+              auto begin = std::max<size_t>(r.begin(), group.begin);
+              auto end = std::min<size_t>(r.end(), group.end);
+              auto group_model = group_cm(group);
+              if (begin < end && group_model) {
+                group_model->calc_kirchhoff_stress_batch(
+                    particles + begin, int(end - begin),
+                    tau.data() + (begin - r.begin()));
+              }
+            }
+            fill_channel(buffer, r.begin(), r.end(), [&](size_t i) {
+              MT sigma = tau[i - r.begin()] / particles[i].J;
+              MT dev = sigma - sigma.trace() / 3 * MT::Identity();
+              return std::sqrt(T(1.5) * dev.squaredNorm());
+            });
+            break;
+          }
+          }
+        }
+      });
+}
+
+} // namespace mpm
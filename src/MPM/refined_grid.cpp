@@ -0,0 +1,80 @@
+#include "MPM/refined_grid.h"
+#include "MPM/mpm_pch.h"
+
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
+
+namespace mpm {
+
+MPM_RefinedLevel::MPM_RefinedLevel(int level, T h, const VINT &cells,
+                                   int block_size)
+    : level(level), h(h), cell_dims(cells), block_size(block_size),
+      block_volume(block_size * block_size * block_size) {
+  for (int d = 0; d < DIM; d++) {
+    block_dims[d] = (cell_dims[d] + block_size - 1) / block_size;
+  }
+  slot_of.assign(block_dims.prod(), -1);
+}
+
+void MPM_RefinedLevel::build(const std::vector<uint8_t> &refined) {
+  MPM_ASSERT(refined.size() == slot_of.size(),
+             "REFINED FLAGS DO NOT MATCH THE BLOCK GRID");
+  std::fill(slot_of.begin(), slot_of.end(), -1);
+  block_slots.clear();
+  for (int b = 0; b < static_cast<int>(refined.size()); b++) {
+    if (refined[b]) {
+      slot_of[b] = static_cast<int>(block_slots.size());
+      block_slots.push_back(b);
+    }
+  }
+
+  size_t node_count = block_slots.size() * block_volume;
+  if (mutex_count < node_count) {
+    mutexs.reset(new tbb::spin_mutex[node_count]);
+    mutex_count = node_count;
+  }
+  nodes.resize(node_count);
+  active.resize(node_count);
+
+  // the support of node k spans the cells k - 1, k and k + 1
+  auto cell_refined = [&](const VINT &cell) {
+    return in_grid(cell) && slot_of[block_of_node(cell)] >= 0;
+  };
+  active_nodes = tbb::parallel_reduce(
+      tbb::blocked_range<size_t>(0, block_slots.size()), size_t(0),
+      [&](const tbb::blocked_range<size_t> &r, size_t count) {
+        for (size_t slot = r.begin(); slot != r.end(); ++slot) {
+          int b = block_slots[slot];
+          VINT block(b / (block_dims[1] * block_dims[2]),
+                     b / block_dims[2] % block_dims[1], b % block_dims[2]);
+          for (int i = 0; i < block_size; i++)
+            for (int j = 0; j < block_size; j++)
+              for (int k = 0; k < block_size; k++) {
+                int index = static_cast<int>(slot) * block_volume +
+                            (i * block_size + j) * block_size + k;
+                VINT node = block * block_size + VINT(i, j, k);
+                nodes[index].Xi = node;
+                bool inside = in_grid(node);
+                for (int c = 0; c < 27 && inside; c++) {
+                  VINT offset(c / 9, c / 3 % 3, c % 3);
+                  inside = cell_refined(node + offset - VINT::Ones());
+                }
+                active[index] = inside;
+                count += inside;
+              }
+        }
+        return count;
+      },
+      std::plus<size_t>());
+}
+
+void MPM_RefinedLevel::clear_nodes() {
+  tbb::parallel_for(size_t(0), nodes.size(), [&](size_t i) {
+    nodes[i].mass_i = 0;
+    nodes[i].force_i = VT::Zero();
+    nodes[i].vel_i = VT::Zero();
+    nodes[i].vel_in = VT::Zero();
+  });
+}
+
+} // namespace mpm
@@ -0,0 +1,472 @@
+#include "MPM/Math/interpolation.h"
+#include "MPM/collision.h"
+#include "MPM/mpm_pch.h"
+#include "MPM/refined_grid.h"
+#include "MPM/simulator.h"
+
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
+
+namespace mpm {
+
+namespace {
+
+// two-scale relation of the quadratic B-spline, per axis
+constexpr T TWO_SCALE[4] = {T(0.25), T(0.75), T(0.75), T(0.25)};
+
+inline VINT support_offset(int n) { return VINT(n / 9, n / 3 % 3, n % 3); }
+
+} // namespace
+
+void MPM_Simulator::set_refinement(const RefinementOptions &options) {
+  MPM_ASSERT(options.levels >= 0 && options.levels <= 2 &&
+                 options.block_size >= 2 && options.block_size % 2 == 0,
+             "REFINEMENT SUPPORTS 1 OR 2 EXTRA LEVELS WITH EVEN BLOCK SIZES");
+  refinement = options;
+  // levels are sized from the grid at the next substep
+  refined_levels.clear();
+  regrid_pending = options.levels > 0;
+}
+
+T MPM_Simulator::get_min_h() const {
+  for (auto iter = refined_levels.rbegin(); iter != refined_levels.rend();
+       ++iter) {
+    if ((*iter)->get_active_node_count() > 0) {
+      return (*iter)->h;
+    }
+  }
+  return sim_info.h;
+}
+
+void MPM_Simulator::regrid() {
+  MPM_PROFILE_STAGE("regrid");
+  if (refined_levels.empty()) {
+    VINT coarse_cells(sim_info.grid_w - 1, sim_info.grid_h - 1,
+                      sim_info.grid_l - 1);
+    for (int l = 1; l <= refinement.levels; l++) {
+      refined_levels.emplace_back(std::make_unique<MPM_RefinedLevel>(
+          l, std::ldexp(sim_info.h, -l), coarse_cells * (1 << l),
+          refinement.block_size));
+    }
+  }
+
+  const int n = sim_info.particle_size;
+  for (auto &level_ptr : refined_levels) {
+    auto &level = *level_ptr;
+    const VINT &dims = level.block_dims;
+    const int block_count = dims.prod();
+    const T inv_h = 1 / level.h;
+    const T parent_h = 2 * level.h;
+    const MPM_RefinedLevel *parent =
+        level.level > 1 ? refined_levels[level.level - 2].get() : nullptr;
+
+    // particles per block; neighbouring particles mostly share a block,
+    // so runs are added at once instead of one atomic per particle
+    std::unique_ptr<std::atomic<int>[]> counts(
+        new std::atomic<int>[block_count]);
+    for (int b = 0; b < block_count; b++) {
+      counts[b].store(0, std::memory_order_relaxed);
+    }
+    tbb::parallel_for(
+        tbb::blocked_range<int>(0, n), [&](const tbb::blocked_range<int> &r) {
+          int last = -1, run = 0;
+          for (int i = r.begin(); i != r.end(); ++i) {
+            VINT cell =
+                (particles[i].pos_p * inv_h).array().floor().cast<int>();
+            cell = cell.cwiseMax(0).cwiseMin(level.cell_dims - VINT::Ones());
+            int b = level.block_of_node(cell);
+            if (b != last) {
+              if (run) {
+                counts[last].fetch_add(run, std::memory_order_relaxed);
+              }
+              last = b;
+              run = 0;
+            }
+            run++;
+          }
+          if (run) {
+            counts[last].fetch_add(run, std::memory_order_relaxed);
+          }
+        });
+
+    auto inside = [&](const VINT &block) {
+      return (block.array() >= 0).all() && (block.array() < dims.array()).all();
+    };
+    auto count_of = [&](const VINT &block) {
+      return counts[level.block_index(block)].load(std::memory_order_relaxed);
+    };
+    // the refined region of a level lies in the one of its parent
+    auto nested = [&](const VINT &block) {
+      return !parent || parent->is_refined(block / 2);
+    };
+    const T parent_cells = std::pow(T(level.block_size) / 2, 3);
+
+    std::vector<uint8_t> flagged(block_count, 0);
+    tbb::parallel_for(0, dims[0], [&](int x) {
+      for (int y = 0; y < dims[1]; y++)
+        for (int z = 0; z < dims[2]; z++) {
+          VINT block(x, y, z);
+          int count = count_of(block);
+          if (count == 0 || !nested(block)) {
+            continue;
+          }
+          bool refine = refinement.refine_ppc > 0 &&
+                        count >= refinement.refine_ppc * parent_cells;
+          for (int c = 0; c < 27 && refinement.refine_surface && !refine;
+               c++) {
+            VINT neighbour = block + support_offset(c) - VINT::Ones();
+            refine = inside(neighbour) && count_of(neighbour) == 0;
+          }
+          VT center = (block.cast<T>().array() + T(0.5)).matrix() *
+                      level.block_size * level.h;
+          for (auto &coll : colls) {
+            if (!refine && std::abs(coll.signed_distance(center)) <
+                               refinement.collider_band * parent_h) {
+              refine = true;
+            }
+          }
+          flagged[level.block_index(block)] = refine;
+        }
+    });
+
+    // grow by one block, so the active nodes cover the flagged blocks and
+    // particles leaving them until the next regrid
+    std::vector<uint8_t> refined(block_count, 0);
+    tbb::parallel_for(0, dims[0], [&](int x) {
+      for (int y = 0; y < dims[1]; y++)
+        for (int z = 0; z < dims[2]; z++) {
+          VINT block(x, y, z);
+          if (!nested(block)) {
+            continue;
+          }
+          for (int c = 0; c < 27; c++) {
+            VINT neighbour = block + support_offset(c) - VINT::Ones();
+            if (inside(neighbour) && flagged[level.block_index(neighbour)]) {
+              refined[level.block_index(block)] = 1;
+              break;
+            }
+          }
+        }
+    });
+    level.build(refined);
+  }
+  regrid_pending = false;
+}
+
+int MPM_Simulator::finest_level(const VT &pos) const {
+  for (auto iter = refined_levels.rbegin(); iter != refined_levels.rend();
+       ++iter) {
+    auto &level = **iter;
+    if (level.get_active_node_count() == 0) {
+      continue;
+    }
+    VINT base = (pos / level.h).array().floor().cast<int>() - 1;
+    // the support spans at most two blocks per axis
+    bool refined = false;
+    for (int corner = 0; corner < 8 && !refined; corner++) {
+      VINT node = base + 2 * VINT(corner & 1, corner >> 1 & 1, corner >> 2);
+      refined =
+          level.in_grid(node) && level.is_refined(node / level.block_size);
+    }
+    if (!refined) {
+      continue;
+    }
+    for (int n = 0; n < 27; n++) {
+      if (level.active_index(base + support_offset(n)) >= 0) {
+        return level.level;
+      }
+    }
+  }
+  return 0;
+}
+
+int MPM_Simulator::composite_weights(const VT &pos, int finest,
+                                     CompositeWeight *weights) const {
+  // truncated weights of the 3^3 support on the current level, starting
+  // with the plain B-splines of the finest one
+  T tw[27];
+  VT tdw[27];
+  auto &finest_level = *refined_levels[finest - 1];
+  T inv_h = 1 / finest_level.h;
+  auto [base, wp, dwp] =
+      quatratic_interpolation(pos * inv_h - VT::Constant(0.5));
+  for (int n = 0; n < 27; n++) {
+    int i = n / 9, j = n / 3 % 3, k = n % 3;
+    tw[n] = wp(i, 0) * wp(j, 1) * wp(k, 2);
+    tdw[n] = VT(dwp(i, 0) * wp(j, 1) * wp(k, 2),
+                wp(i, 0) * dwp(j, 1) * wp(k, 2),
+                wp(i, 0) * wp(j, 1) * dwp(k, 2)) *
+             inv_h;
+  }
+
+  int count = 0;
+  for (int l = finest;; l--) {
+    // active nodes take their weight, the passive rest is handed on
+    bool passive = false;
+    for (int n = 0; n < 27; n++) {
+      if (tw[n] == T(0) && tdw[n].isZero()) {
+        continue;
+      }
+      VINT node = base + support_offset(n);
+      int index;
+      VT x;
+      if (l > 0) {
+        auto &level = *refined_levels[l - 1];
+        index = level.active_index(node);
+        x = level.node_position(node);
+      } else {
+        index = (node[0] * sim_info.grid_h + node[1]) * sim_info.grid_l +
+                node[2];
+        x = node.cast<T>() * sim_info.h;
+      }
+      if (index < 0) {
+        passive = true;
+        continue;
+      }
+      weights[count++] = {l, index, tw[n], tdw[n], x};
+      tw[n] = 0;
+      tdw[n] = VT::Zero();
+    }
+    // deep inside a level its nodes take everything
+    if (l == 0 || !passive) {
+      break;
+    }
+
+    // parent node I has the children 2I + offset + j, j in [0, 4)
+    VINT parent_base;
+    int offset;
+    if (l == 1) {
+      parent_base = (pos / sim_info.h - VT::Constant(0.5))
+                        .array()
+                        .floor()
+                        .cast<int>();
+      offset = -2;
+    } else {
+      parent_base =
+          (pos / refined_levels[l - 2]->h).array().floor().cast<int>() - 1;
+      offset = -1;
+    }
+    T restrict_axis[DIM][3][3];
+    for (int d = 0; d < DIM; d++)
+      for (int a = 0; a < 3; a++)
+        for (int c = 0; c < 3; c++) {
+          int j = base[d] + c - 2 * (parent_base[d] + a) - offset;
+          restrict_axis[d][a][c] = j >= 0 && j < 4 ? TWO_SCALE[j] : T(0);
+        }
+
+    // separable, one axis at a time
+    for (int d = 0; d < DIM; d++) {
+      int stride = d == 0 ? 9 : d == 1 ? 3 : 1;
+      T pw[27];
+      VT pdw[27];
+      for (int n = 0; n < 27; n++) {
+        int a = n / stride % 3;
+        int line = n - a * stride;
+        pw[n] = 0;
+        pdw[n] = VT::Zero();
+        for (int c = 0; c < 3; c++) {
+          T r = restrict_axis[d][a][c];
+          pw[n] += r * tw[line + c * stride];
+          pdw[n] += r * tdw[line + c * stride];
+        }
+      }
+      std::copy(pw, pw + 27, tw);
+      std::copy(pdw, pdw + 27, tdw);
+    }
+    base = parent_base;
+  }
+  return count;
+}
+
+void MPM_Simulator::transfer_weights(
+    const VT &pos, std::vector<CompositeWeight> &weights) const {
+  int finest = refinement.levels > 0 ? finest_level(pos) : 0;
+  if (finest > 0) {
+    weights.resize(MAX_COMPOSITE_WEIGHTS);
+    weights.resize(composite_weights(pos, finest, weights.data()));
+    return;
+  }
+  T inv_h = 1 / sim_info.h;
+  auto [base, wp, dwp] = quatratic_interpolation(pos * inv_h);
+  weights.clear();
+  for (int n = 0; n < 27; n++) {
+    int i = n / 9, j = n / 3 % 3, k = n % 3;
+    VINT node = base + support_offset(n);
+    weights.push_back(
+        {0, (node[0] * sim_info.grid_h + node[1]) * sim_info.grid_l + node[2],
+         wp(i, 0) * wp(j, 1) * wp(k, 2),
+         VT(dwp(i, 0) * wp(j, 1) * wp(k, 2), wp(i, 0) * dwp(j, 1) * wp(k, 2),
+            wp(i, 0) * wp(j, 1) * dwp(k, 2)) *
+             inv_h,
+         node.cast<T>() * sim_info.h});
+  }
+}
+
+void MPM_Simulator::refined_prestep() {
+  for (auto &level : refined_levels) {
+    level->clear_nodes();
+  }
+  particle_owner.resize(sim_info.particle_size);
+  stress_cache.resize(sim_info.particle_size);
+  traced_parallel_for(0, sim_info.particle_size, [&](int iter) {
+    particle_owner[iter] = is_asleep(particles[iter])
+                               ? 0
+                               : static_cast<uint8_t>(
+                                     finest_level(particles[iter].pos_p));
+  });
+}
+
+T MPM_Simulator::refined_P2G() {
+  MPM_PROFILE_STAGE("refined_P2G");
+  traced_parallel_for(0, sim_info.particle_size, [&](int iter) {
+    int owner = particle_owner[iter];
+    if (!owner) {
+      return;
+    }
+    auto &particle = particles[iter];
+    auto mass_p = particle.material->mass;
+    CompositeWeight weights[MAX_COMPOSITE_WEIGHTS];
+    int count = composite_weights(particle.pos_p, owner, weights);
+    // Bp is kept in units of the simulator grid
+    MT C = MT::Zero();
+    if (transfer_scheme == TransferScheme::APIC) {
+      C = particle.Bp * 4 / sim_info.h;
+    }
+    for (int n = 0; n < count; n++) {
+      auto &weight = weights[n];
+      VT plus = C * (weight.x - particle.pos_p);
+      VT momentum = weight.w * mass_p * (particle.vel_p + plus);
+      tbb::spin_mutex::scoped_lock lock(composite_mutex(weight));
+      auto &node = composite_node(weight);
+      node.vel_in += momentum;
+      node.mass_i += weight.w * mass_p;
+    }
+  });
+
+  T mass = 0;
+  for (auto &level : refined_levels) {
+    mass += tbb::parallel_reduce(
+        tbb::blocked_range<size_t>(0, level->nodes.size()), T(0),
+        [&](const tbb::blocked_range<size_t> &r, T mass) -> T {
+          for (size_t i = r.begin(); i != r.end(); ++i) {
+            auto &node = level->nodes[i];
+            if (node.mass_i != T(0)) {
+              mass += node.mass_i;
+              node.vel_in /= node.mass_i;
+            }
+          }
+          return mass;
+        },
+        std::plus<T>());
+  }
+  return mass;
+}
+
+void MPM_Simulator::refined_grid_force() {
+  MPM_PROFILE_STAGE("refined_grid_force");
+  // volume * kirchhoff stress from update_grid_force
+  traced_parallel_for(0, sim_info.particle_size, [&](int iter) {
+    int owner = particle_owner[iter];
+    if (!owner) {
+      return;
+    }
+    const MT &vol_tau = stress_cache[iter];
+    CompositeWeight weights[MAX_COMPOSITE_WEIGHTS];
+    int count = composite_weights(particles[iter].pos_p, owner, weights);
+    for (int n = 0; n < count; n++) {
+      VT force = vol_tau * weights[n].dw;
+      tbb::spin_mutex::scoped_lock lock(composite_mutex(weights[n]));
+      composite_node(weights[n]).force_i -= force;
+    }
+  });
+}
+
+void MPM_Simulator::refined_grid_velocity(T dt) {
+  MPM_PROFILE_STAGE("refined_grid_velocity");
+  const int thickness = 2;
+  const VINT coarse_nodes(sim_info.grid_w, sim_info.grid_h, sim_info.grid_l);
+  for (auto &level : refined_levels) {
+    tbb::parallel_for(size_t(0), level->nodes.size(), [&](size_t i) {
+      auto &node = level->nodes[i];
+      if (node.mass_i == T(0)) {
+        return;
+      }
+      node.vel_i = node.vel_in +
+                   dt * (node.force_i / node.mass_i + sim_info.gravity);
+      VT pos = level->node_position(node.Xi);
+
+      if (sleeping_enabled) {
+        int block = sleep_blocks.block_of(pos);
+        if (sleep_blocks.asleep(block)) {
+          if (node.vel_in.norm() > sleep_blocks.get_options().wake_velocity) {
+            sleep_blocks.request_wake(block);
+          }
+          node.vel_i = VT::Zero();
+        }
+      }
+      // the sticky walls of solve_grid_boundary, in world space
+      for (int d = 0; d < DIM; d++) {
+        T lower = (thickness - T(0.5)) * sim_info.h;
+        T upper = (coarse_nodes[d] - thickness - T(0.5)) * sim_info.h;
+        if (pos[d] < lower && node.vel_i[d] < 0) {
+          node.vel_i[d] = 0;
+        }
+        if (pos[d] > upper && node.vel_i[d] > 0) {
+          node.vel_i[d] = 0;
+        }
+      }
+      for (auto &coll : colls) {
+        coll.solve_collision(pos, node.vel_i);
+      }
+    });
+  }
+}
+
+MT MPM_Simulator::refined_grad_v(const VT &pos, int owner) const {
+  CompositeWeight weights[MAX_COMPOSITE_WEIGHTS];
+  int count = composite_weights(pos, owner, weights);
+  MT grad_v = MT::Zero();
+  for (int n = 0; n < count; n++) {
+    grad_v += composite_node(weights[n]).vel_i * weights[n].dw.transpose();
+  }
+  return grad_v;
+}
+
+void MPM_Simulator::refined_G2P(Particle &particle, int owner) const {
+  CompositeWeight weights[MAX_COMPOSITE_WEIGHTS];
+  int count = composite_weights(particle.pos_p, owner, weights);
+  VT v_pic = VT::Zero();
+  VT v_flip = particle.vel_p;
+  // APIC with the inertia-like D of the mixed basis, it is h^2 / 4 only
+  // for the plain B-splines of one level
+  bool mixed = weights[0].level != weights[count - 1].level;
+  MT B = MT::Zero(), D = MT::Zero();
+  for (int n = 0; n < count; n++) {
+    auto &weight = weights[n];
+    auto &node = composite_node(weight);
+    VT r = weight.x - particle.pos_p;
+    v_pic += weight.w * node.vel_i;
+    v_flip += weight.w * (node.vel_i - node.vel_in);
+    B += weight.w * node.vel_i * r.transpose();
+    if (mixed) {
+      D += weight.w * r * r.transpose();
+    }
+  }
+  if (!mixed) {
+    T h = refined_levels[owner - 1]->h;
+    D = MT::Identity() * (h * h / 4);
+  }
+  // back to units of the simulator grid
+  particle.Bp = B * D.inverse() * sim_info.h / 4;
+
+  switch (transfer_scheme) {
+  case TransferScheme::APIC:
+    particle.vel_p = v_pic;
+    break;
+  case TransferScheme::FLIP99:
+  case TransferScheme::FLIP95:
+    particle.vel_p = (1 - sim_info.alpha) * v_pic + sim_info.alpha * v_flip;
+  }
+}
+
+} // namespace mpm
@@ -0,0 +1,293 @@
+#include "MPM/resample.h"
+#include "MPM/material.h"
+#include "MPM/mpm_pch.h"
+#include "MPM/simulator.h"
+
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_sort.h>
+
+namespace mpm {
+
+namespace {
+
+// particle index sorted block by block, cell by cell inside a block
+struct CellKey {
+  uint64_t block;
+  uint32_t cell;
+  int index;
+
+  bool operator<(const CellKey &other) const {
+    return block != other.block ? block < other.block
+                                : (cell != other.cell ? cell < other.cell
+                                                      : index < other.index);
+  }
+};
+
+T strain_of(const Particle &particle) {
+  return (particle.F.transpose() * particle.F - MT::Identity()).norm();
+}
+
+} // namespace
+
+MPM_Resampler::MPM_Resampler(const ResampleOptions &options)
+    : options(options) {}
+
+bool MPM_Resampler::on_frame(MPM_Simulator &sim, int frame) {
+  if (options.interval <= 0 || frame % options.interval != 0) {
+    return false;
+  }
+  last_stats = sim.resample(options);
+  MPM_INFO("resampled frame#{}: {} pairs merged, {} particles split, "
+           "{} -> {} particles",
+           frame, last_stats.merged, last_stats.split,
+           last_stats.particles_before, last_stats.particles_after);
+  return true;
+}
+
+void MPM_Simulator::prepare_material_levels(const ResampleOptions &options) {
+  // every level is created up front so the parallel pass only reads.
+  // bases restored from a checkpoint already have some of theirs
+  auto registered = materials;
+  for (auto *material : registered) {
+    auto known = material_levels.find(material);
+    if (known != material_levels.end() && known->second.level != 0) {
+      continue;
+    }
+    material_levels[material] = {material, 0};
+    for (int level = -options.max_split_level;
+         level <= options.max_merge_level; level++) {
+      if (level == 0 || level_materials.count({material, level})) {
+        continue;
+      }
+      owned_materials.emplace_back(std::make_unique<MPM_Material>(
+          material->E, material->nu, std::ldexp(material->mass, level),
+          material->density));
+      auto *variant = owned_materials.back().get();
+      register_material(variant);
+      level_materials[{material, level}] = variant;
+      material_levels[variant] = {material, level};
+    }
+  }
+}
+
+ResampleStats MPM_Simulator::resample(const ResampleOptions &options) {
+  MPM_PROFILE_STAGE("resample");
+  ResampleStats stats;
+  stats.particles_before = sim_info.particle_size;
+  stats.particles_after = sim_info.particle_size;
+  if (!particles || sim_info.particle_size == 0) {
+    return stats;
+  }
+  MPM_ASSERT(options.block_size > 0 && options.min_ppc <= options.max_ppc,
+             "RESAMPLE NEEDS block_size > 0 AND min_ppc <= max_ppc");
+  prepare_material_levels(options);
+
+  const int B = options.block_size;
+  const VINT cells(sim_info.grid_w, sim_info.grid_h, sim_info.grid_l);
+  VINT blocks;
+  for (int d = 0; d < DIM; d++) {
+    blocks[d] = (cells[d] + B - 1) / B;
+  }
+  const T h = sim_info.h;
+  const T inv_h = 1 / h;
+
+  auto level_of = [&](const MPM_Material *material) {
+    return material_levels.at(material);
+  };
+  auto at_level = [&](const MaterialLevel &origin, int level) {
+    return level == 0 ? origin.base
+                      : level_materials.at({origin.base, level});
+  };
+
+  std::atomic<int> merged{0}, split{0};
+
+  // resample one cell of `count` particles, appending to `out`
+  auto resample_cell = [&](const CellKey *cell, int count,
+                           std::vector<Particle> &out) {
+    auto emit_all = [&]() {
+      for (int i = 0; i < count; i++) {
+        out.push_back(particles[cell[i].index]);
+      }
+    };
+    const Particle &first = particles[cell[0].index];
+    // particles in sleeping blocks stay as they are
+    if ((count <= options.max_ppc && count >= options.min_ppc) ||
+        is_asleep(first)) {
+      emit_all();
+      return;
+    }
+
+    if (count > options.max_ppc) {
+      int merges_left = count - options.max_ppc;
+      std::vector<char> used(count, 0);
+      std::vector<char> candidate(count, 0);
+      for (int i = 0; i < count; i++) {
+        auto &p = particles[cell[i].index];
+        T strain_rate = 4 * p.Bp.norm() * inv_h;
+        candidate[i] = strain_of(p) < options.merge_strain &&
+                       strain_rate < options.merge_strain_rate &&
+                       level_of(p.material).level < options.max_merge_level;
+      }
+      for (int i = 0; i < count && merges_left > 0; i++) {
+        if (!candidate[i] || used[i]) {
+          continue;
+        }
+        auto &a = particles[cell[i].index];
+        // nearest unused partner of the same material
+        int partner = -1;
+        T best = std::numeric_limits<T>::max();
+        for (int j = i + 1; j < count; j++) {
+          auto &b = particles[cell[j].index];
+          if (!candidate[j] || used[j] || b.material != a.material) {
+            continue;
+          }
+          T distance = (b.pos_p - a.pos_p).squaredNorm();
+          if (distance < best) {
+            best = distance;
+            partner = j;
+          }
+        }
+        if (partner < 0) {
+          continue;
+        }
+        auto &b = particles[cell[partner].index];
+        used[i] = used[partner] = 1;
+        merges_left--;
+        merged++;
+
+        // mass, momentum and affine momentum are conserved, F is averaged
+        // over the current volumes
+        T ma = a.material->mass, mb = b.material->mass, m = ma + mb;
+        T va = a.material->volume * a.J, vb = b.material->volume * b.J;
+        Particle p = a;
+        p.pos_p = (ma * a.pos_p + mb * b.pos_p) / m;
+        p.vel_p = (ma * a.vel_p + mb * b.vel_p) / m;
+        // Bp is kept in grid units (see transfer_G2P)
+        p.Bp = (ma * (a.Bp + (a.vel_p - p.vel_p) *
+                                 (a.pos_p - p.pos_p).transpose() * inv_h) +
+                mb * (b.Bp + (b.vel_p - p.vel_p) *
+                                 (b.pos_p - p.pos_p).transpose() * inv_h)) /
+               m;
+        p.F = (va * a.F + vb * b.F) / (va + vb);
+        p.J = (va + vb) / (a.material->volume + b.material->volume);
+        p.Jp = (ma * a.Jp + mb * b.Jp) / m;
+        p.gamma_p = (ma * a.gamma_p + mb * b.gamma_p) / m;
+        auto origin = level_of(a.material);
+        p.material = at_level(origin, origin.level + 1);
+        out.push_back(p);
+      }
+      for (int i = 0; i < count; i++) {
+        if (!used[i]) {
+          out.push_back(particles[cell[i].index]);
+        }
+      }
+      return;
+    }
+
+    int splits_left = options.min_ppc - count;
+    for (int i = 0; i < count; i++) {
+      auto &p = particles[cell[i].index];
+      auto origin = level_of(p.material);
+      if (splits_left <= 0 || strain_of(p) <= options.split_strain ||
+          origin.level <= -options.max_split_level) {
+        out.push_back(p);
+        continue;
+      }
+      splits_left--;
+      split++;
+
+      // halves along the direction of largest stretch, same velocity and
+      // Bp so momentum and affine momentum stay the same
+      Eigen::SelfAdjointEigenSolver<MT> eigen(p.F * p.F.transpose());
+      VT direction = eigen.eigenvectors().col(DIM - 1);
+      VT offset =
+          T(0.25) * std::cbrt(p.material->volume * p.J) * direction;
+      Particle child = p;
+      child.material = at_level(origin, origin.level - 1);
+      child.pos_p = p.pos_p + offset;
+      out.push_back(child);
+      child.pos_p = p.pos_p - offset;
+      out.push_back(child);
+    }
+  };
+
+  // per group: sort by block and cell, resample the blocks in parallel
+  std::vector<std::vector<std::vector<Particle>>> group_blocks(groups.size());
+  for (size_t g = 0; g < groups.size(); g++) {
+    auto &group = groups[g];
+    int count = group.end - group.begin;
+    std::vector<CellKey> keys(count);
+    tbb::parallel_for(0, count, [&](int i) {
+      int index = group.begin + i;
+      VINT node, block, local;
+      for (int d = 0; d < DIM; d++) {
+        node[d] = std::min(
+            std::max(static_cast<int>(particles[index].pos_p[d] * inv_h), 0),
+            cells[d] - 1);
+        block[d] = node[d] / B;
+        local[d] = node[d] % B;
+      }
+      keys[i] = {(uint64_t(block[0]) * blocks[1] + block[1]) * blocks[2] +
+                     block[2],
+                 uint32_t((local[0] * B + local[1]) * B + local[2]), index};
+    });
+    tbb::parallel_sort(keys.begin(), keys.end());
+
+    std::vector<int> block_begin;
+    for (int i = 0; i < count; i++) {
+      if (i == 0 || keys[i].block != keys[i - 1].block) {
+        block_begin.push_back(i);
+      }
+    }
+    block_begin.push_back(count);
+
+    auto &out = group_blocks[g];
+    out.resize(block_begin.size() - 1);
+    tbb::parallel_for(0, int(out.size()), [&](int s) {
+      out[s].reserve(block_begin[s + 1] - block_begin[s]);
+      int cell_begin = block_begin[s];
+      for (int i = block_begin[s] + 1; i <= block_begin[s + 1]; i++) {
+        if (i == block_begin[s + 1] || keys[i].cell != keys[cell_begin].cell) {
+          resample_cell(&keys[cell_begin], i - cell_begin, out[s]);
+          cell_begin = i;
+        }
+      }
+    });
+  }
+
+  // gather the blocks into the new particle array, group after group
+  std::vector<std::pair<size_t, size_t>> block_offsets;
+  size_t total = 0;
+  for (size_t g = 0; g < groups.size(); g++) {
+    groups[g].begin = static_cast<int>(total);
+    for (size_t s = 0; s < group_blocks[g].size(); s++) {
+      block_offsets.push_back({g, s});
+      total += group_blocks[g][s].size();
+    }
+    groups[g].end = static_cast<int>(total);
+  }
+  Particle *resampled = new Particle[total];
+  std::vector<size_t> offsets(block_offsets.size() + 1, 0);
+  for (size_t i = 0; i < block_offsets.size(); i++) {
+    auto [g, s] = block_offsets[i];
+    offsets[i + 1] = offsets[i] + group_blocks[g][s].size();
+  }
+  tbb::parallel_for(size_t(0), block_offsets.size(), [&](size_t i) {
+    auto [g, s] = block_offsets[i];
+    std::copy(group_blocks[g][s].begin(), group_blocks[g][s].end(),
+              resampled + offsets[i]);
+  });
+
+  delete[] particles;
+  particles = resampled;
+  sim_info.particle_size = static_cast<int>(total);
+  place_particles();
+  regrid_pending = true;
+
+  stats.merged = merged;
+  stats.split = split;
+  stats.particles_after = sim_info.particle_size;
+  return stats;
+}
+
+} // namespace mpm
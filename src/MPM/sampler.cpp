@@ -0,0 +1,237 @@
+#include "MPM/sampler.h"
+#include "MPM/mpm_pch.h"
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
+
+namespace mpm {
+
+namespace {
+
+// more background cells than this are most likely a wrong spacing
+constexpr int64_t MAX_SAMPLE_CELLS = int64_t(1) << 30;
+// distance samples per axis when integrating the volume of a boundary cell
+constexpr int VOLUME_SUBSAMPLES = 4;
+
+// COVERED cells lie entirely within r of one particle and take no darts
+enum CellState : uint8_t { OUTSIDE, BOUNDARY, INTERIOR, FILLED, COVERED };
+
+uint64_t splitmix64(uint64_t &state) {
+  uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+T uniform(uint64_t &state) { return T(splitmix64(state) >> 11) * 0x1.0p-53; }
+
+} // namespace
+
+MPM_PoissonSampler::MPM_PoissonSampler(const PoissonSampleOptions &options)
+    : options(options) {}
+
+bool MPM_PoissonSampler::sample(const MPM_LevelSet &levelset,
+                                const VT &box_min, const VT &box_max, T h,
+                                PoissonSamples &samples) const {
+  auto start = std::chrono::steady_clock::now();
+  samples = PoissonSamples();
+  const T r = options.spacing * h;
+  if (!(r > 0) || (box_max - box_min).minCoeff() <= 0) {
+    MPM_ERROR("poisson sampling needs a positive spacing and a non-empty box");
+    return false;
+  }
+  // cells with diagonal r hold at most one particle, a particle's
+  // neighbours lie within two cells
+  const T cell = r / std::sqrt(T(3));
+  const int reach = 2;
+  const VINT cells =
+      ((box_max - box_min) / cell).array().ceil().cast<int>().max(1);
+  const int64_t total = cells.cast<int64_t>().prod();
+  if (total > MAX_SAMPLE_CELLS) {
+    MPM_ERROR("poisson sampling needs {} cells, raise the spacing", total);
+    return false;
+  }
+  const int block = std::max(options.block_cells, reach);
+  const VINT blocks = (cells.array() + block - 1) / block;
+
+  auto index = [&](int i, int j, int k) {
+    return (size_t(k) * cells[1] + j) * cells[0] + i;
+  };
+  auto corner = [&](int i, int j, int k) {
+    return VT(box_min + VINT(i, j, k).cast<T>() * cell);
+  };
+  // the last cells may stick out of the box
+  auto inside = [&](const VT &p) {
+    return (p.array() <= box_max.array()).all() && levelset.inside(p);
+  };
+  auto distance = [&](const VT &p) {
+    return std::max(levelset.signed_distance(p), (p - box_max).maxCoeff());
+  };
+
+  std::vector<uint8_t> state(total);
+  std::vector<VT> points(total);
+
+  // classify the cells against the level set and integrate its volume.
+  // a boundary cell adds the part of every sub-cell behind the surface,
+  // taken as planar at the distance of the sub-cell center
+  const T cell_volume = cell * cell * cell;
+  const T half_diagonal = T(0.5) * r;
+  const T sub = cell / VOLUME_SUBSAMPLES;
+  T volume = tbb::parallel_reduce(
+      tbb::blocked_range<int>(0, cells[2]), T(0),
+      [&](const tbb::blocked_range<int> &range, T sum) {
+        for (int k = range.begin(); k < range.end(); k++)
+          for (int j = 0; j < cells[1]; j++)
+            for (int i = 0; i < cells[0]; i++) {
+              VT lo = corner(i, j, k);
+              T center = distance(lo + VT::Constant(cell / 2));
+              auto &s = state[index(i, j, k)];
+              if (center > half_diagonal) {
+                s = OUTSIDE;
+              } else if (center < -half_diagonal) {
+                s = INTERIOR;
+                sum += cell_volume;
+              } else {
+                s = BOUNDARY;
+                T fraction = 0;
+                for (int c = 0; c < VOLUME_SUBSAMPLES * VOLUME_SUBSAMPLES *
+                                        VOLUME_SUBSAMPLES;
+                     c++) {
+                  VT f(c % VOLUME_SUBSAMPLES,
+                       c / VOLUME_SUBSAMPLES % VOLUME_SUBSAMPLES,
+                       c / (VOLUME_SUBSAMPLES * VOLUME_SUBSAMPLES));
+                  T d = distance(lo + (f.array() + T(0.5)).matrix() * sub);
+                  fraction += std::clamp(T(0.5) - d / sub, T(0), T(1));
+                }
+                sum += fraction * sub * sub * sub;
+              }
+            }
+        return sum;
+      },
+      std::plus<T>());
+
+  // blocks of the eight phases that touch the level set
+  std::vector<VINT> phases[8];
+  for (int bk = 0; bk < blocks[2]; bk++)
+    for (int bj = 0; bj < blocks[1]; bj++)
+      for (int bi = 0; bi < blocks[0]; bi++) {
+        VINT lo = VINT(bi, bj, bk) * block;
+        VINT hi = (lo.array() + block).min(cells.array());
+        bool active = false;
+        for (int k = lo[2]; k < hi[2] && !active; k++)
+          for (int j = lo[1]; j < hi[1] && !active; j++)
+            for (int i = lo[0]; i < hi[0] && !active; i++) {
+              active = state[index(i, j, k)] != OUTSIDE;
+            }
+        if (active) {
+          phases[(bi & 1) | (bj & 1) << 1 | (bk & 1) << 2].push_back(
+              VINT(bi, bj, bk));
+        }
+      }
+
+  const T r2 = r * r;
+  // the particle too close to p, nullptr if there is none
+  auto conflict = [&](int i, int j, int k, const VT &p) -> const VT * {
+    for (int z = std::max(k - reach, 0);
+         z <= std::min(k + reach, cells[2] - 1); z++)
+      for (int y = std::max(j - reach, 0);
+           y <= std::min(j + reach, cells[1] - 1); y++)
+        for (int x = std::max(i - reach, 0);
+             x <= std::min(i + reach, cells[0] - 1); x++) {
+          size_t n = index(x, y, z);
+          if (state[n] == FILLED && (points[n] - p).squaredNorm() < r2) {
+            return &points[n];
+          }
+        }
+    return nullptr;
+  };
+
+  for (int round = 0; round < options.attempts; round++) {
+    for (auto &phase : phases) {
+      tbb::parallel_for(size_t(0), phase.size(), [&](size_t b) {
+        VINT lo = phase[b] * block;
+        VINT hi = (lo.array() + block).min(cells.array());
+        for (int k = lo[2]; k < hi[2]; k++)
+          for (int j = lo[1]; j < hi[1]; j++)
+            for (int i = lo[0]; i < hi[0]; i++) {
+              size_t n = index(i, j, k);
+              if (state[n] != BOUNDARY && state[n] != INTERIOR) {
+                continue;
+              }
+              uint64_t stream = options.seed * 0x9e3779b97f4a7c15ull +
+                                uint64_t(n) * uint64_t(options.attempts) +
+                                uint64_t(round);
+              VT p = corner(i, j, k);
+              for (int d = 0; d < DIM; d++) {
+                p[d] += uniform(stream) * cell;
+              }
+              if (state[n] == BOUNDARY && !inside(p)) {
+                continue;
+              }
+              if (auto *q = conflict(i, j, k, p)) {
+                VT lo = corner(i, j, k);
+                VT far = (*q - lo).cwiseAbs().cwiseMax(
+                    (*q - lo - VT::Constant(cell)).cwiseAbs());
+                if (far.squaredNorm() < r2) {
+                  state[n] = COVERED;
+                }
+                continue;
+              }
+              points[n] = p;
+              state[n] = FILLED;
+            }
+      });
+    }
+  }
+
+  // gather in cell order, so the result does not depend on the threads
+  std::vector<size_t> offsets(cells[2] + 1, 0);
+  tbb::parallel_for(0, cells[2], [&](int k) {
+    size_t count = 0;
+    for (size_t n = index(0, 0, k); n < index(0, 0, k + 1); n++) {
+      count += state[n] == FILLED;
+    }
+    offsets[k + 1] = count;
+  });
+  for (int k = 0; k < cells[2]; k++) {
+    offsets[k + 1] += offsets[k];
+  }
+  samples.positions.resize(offsets.back());
+  tbb::parallel_for(0, cells[2], [&](int k) {
+    size_t out = offsets[k];
+    for (size_t n = index(0, 0, k); n < index(0, 0, k + 1); n++) {
+      if (state[n] == FILLED) {
+        samples.positions[out++] = points[n];
+      }
+    }
+  });
+
+  if (samples.positions.empty()) {
+    MPM_ERROR("poisson sampling found no room for particles");
+    return false;
+  }
+  samples.volume = volume;
+  samples.particle_volume = volume / T(samples.positions.size());
+  MPM_INFO("poisson sampled {} particles (spacing {}h, {:.2f} ppc) in "
+           "{:.3f}s",
+           samples.positions.size(), options.spacing,
+           h * h * h / samples.particle_volume,
+           std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start)
+               .count());
+  return true;
+}
+
+bool MPM_PoissonSampler::sample(const SurfaceMesh &mesh, T h,
+                                PoissonSamples &samples) const {
+  if (mesh.triangles.empty()) {
+    MPM_ERROR("poisson sampling needs a mesh with triangles");
+    return false;
+  }
+  // the distance field at the resolution of the background cells
+  Mesh_LevelSet levelset(mesh, options.spacing * h / std::sqrt(T(3)));
+  return sample(levelset, levelset.get_min(), levelset.get_max(), h, samples);
+}
+
+} // namespace mpm
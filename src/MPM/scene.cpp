@@ -0,0 +1,568 @@
+#include "MPM/scene.h"
+#include "MPM/Physics/constitutive_model.h"
+#include "MPM/Physics/plasticity.h"
+#include "MPM/Utils/io.h"
+#include "MPM/mpm_pch.h"
+#include "MPM/sampler.h"
+
+namespace mpm {
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// keys a directive accepts and how many values follow each
+using KeyArity = std::map<std::string, int>;
+
+const std::map<std::string, KeyArity> &directive_keys() {
+  static const std::map<std::string, KeyArity> keys = {
+      {"grid", {{"gravity", 3}, {"area", 3}, {"h", 1}}},
+      {"transfer", {}},
+      {"material", {{"E", 1}, {"nu", 1}, {"mass", 1}, {"density", 1}}},
+      {"model", {}},
+      {"plasticity",
+       {{"psi", 1},
+        {"theta_c", 1},
+        {"theta_s", 1},
+        {"min_Jp", 1},
+        {"max_Jp", 1},
+        {"yield", 1},
+        {"xi", 1},
+        {"alpha", 1}}},
+      {"default", {{"model", 1}, {"plasticity", 1}}},
+      {"wall", {{"normal", 3}, {"point", 3}, {"sticky", 0}, {"friction", 1}}},
+      {"sphere",
+       {{"center", 3}, {"radius", 1}, {"sticky", 0}, {"friction", 1}}},
+      {"object",
+       {{"file", 1},
+        {"box_min", 3},
+        {"box_max", 3},
+        {"spacing", 1},
+        {"sample", 1},
+        {"material", 1},
+        {"model", 1},
+        {"plasticity", 1},
+        {"velocity", 3}}},
+      {"export", {}},
+      {"time",
+       {{"frame_rate", 1},
+        {"frames", 1},
+        {"max_dt", 1},
+        {"min_dt", 1},
+        {"initial_dt", 1},
+        {"cfl", 1},
+        {"acoustic_cfl", 1}}},
+      {"output",
+       {{"dir", 1},
+        {"cache", 1},
+        {"surface", 1},
+        {"grid", 1},
+        {"live", 1},
+        {"diagnostics", 1},
+        {"checkpoint_interval", 1}}},
+      {"profile", {{"stages", 1}, {"trace", 1}, {"counters", 1}}},
+      {"sleeping", {}},
+      {"numa", {{"domains", 1}, {"place_interval", 1}}},
+      {"refinement",
+       {{"levels", 1},
+        {"block_size", 1},
+        {"regrid_interval", 1},
+        {"refine_ppc", 1},
+        {"collider_band", 1}}},
+      {"resample", {{"interval", 1}, {"min_ppc", 1}, {"max_ppc", 1}}},
+  };
+  return keys;
+}
+
+// leading words before the key value pairs, e.g. the name of a material
+size_t positional_count(const std::string &keyword) {
+  if (keyword == "model" || keyword == "plasticity") {
+    return 2;
+  }
+  if (keyword == "material" || keyword == "transfer" ||
+      keyword == "sleeping" || keyword == "numa" || keyword == "resample") {
+    return 1;
+  }
+  return 0;
+}
+
+bool is_text_key(const std::string &key) {
+  return key == "file" || key == "material" || key == "model" ||
+         key == "plasticity" || key == "dir";
+}
+
+bool parse_number(const std::string &word, T &value) {
+  const char *first = word.c_str();
+  char *last = nullptr;
+  value = std::strtod(first, &last);
+  return last == first + word.size() && std::isfinite(value);
+}
+
+struct Directive {
+  std::string keyword;
+  std::vector<std::string> words;
+  std::map<std::string, std::vector<T>> numbers;
+  std::map<std::string, std::string> texts;
+
+  bool has(const std::string &key) const {
+    return numbers.count(key) || texts.count(key);
+  }
+  T number(const std::string &key, T fallback) const {
+    auto iter = numbers.find(key);
+    return iter == numbers.end() ? fallback : iter->second[0];
+  }
+  VT vector(const std::string &key, const VT &fallback) const {
+    auto iter = numbers.find(key);
+    return iter == numbers.end()
+               ? fallback
+               : VT(iter->second[0], iter->second[1], iter->second[2]);
+  }
+  // a 0 / 1 switch
+  bool flag(const std::string &key, bool fallback) const {
+    return number(key, fallback) != 0;
+  }
+  std::string text(const std::string &key) const {
+    auto iter = texts.find(key);
+    return iter == texts.end() ? std::string() : iter->second;
+  }
+};
+
+// empty on success, the error otherwise
+std::string parse_directive(const std::vector<std::string> &tokens,
+                            Directive &directive) {
+  directive.keyword = tokens[0];
+  auto keys = directive_keys().find(directive.keyword);
+  if (keys == directive_keys().end()) {
+    return fmt::format("unknown directive `{}`", directive.keyword);
+  }
+  size_t i = 1;
+  size_t positional = directive.keyword == "export"
+                          ? tokens.size() - 1
+                          : positional_count(directive.keyword);
+  for (; i < tokens.size() && directive.words.size() < positional; i++) {
+    directive.words.push_back(tokens[i]);
+  }
+  if (directive.words.size() < positional) {
+    return fmt::format("`{}` expects {} leading words", directive.keyword,
+                       positional);
+  }
+  while (i < tokens.size()) {
+    const std::string &key = tokens[i++];
+    auto arity = keys->second.find(key);
+    if (arity == keys->second.end()) {
+      return fmt::format("`{}` has no key `{}`", directive.keyword, key);
+    }
+    if (i + arity->second > tokens.size()) {
+      return fmt::format("`{}` needs {} values", key, arity->second);
+    }
+    if (is_text_key(key)) {
+      directive.texts[key] = tokens[i++];
+      continue;
+    }
+    auto &values = directive.numbers[key];
+    values.resize(arity->second);
+    for (auto &value : values) {
+      if (!parse_number(tokens[i], value)) {
+        return fmt::format("`{}` is not a number (key `{}`)", tokens[i], key);
+      }
+      i++;
+    }
+  }
+  return {};
+}
+
+std::shared_ptr<MPM_CM> make_model(const std::string &type) {
+  if (type == "neohookean") {
+    return std::make_shared<NeoHookean_Piola>();
+  }
+  if (type == "volume_penalty") {
+    return std::make_shared<QuatraticVolumePenalty>();
+  }
+  if (type == "neohookean_fluid") {
+    return std::make_shared<NeoHookean_Fluid>();
+  }
+  if (type == "cdmpm_fluid") {
+    return std::make_shared<CDMPM_Fluid>();
+  }
+  return nullptr;
+}
+
+} // namespace
+
+bool MPM_Scene::load(const std::string &scene_path) {
+  std::ifstream in(scene_path);
+  if (!in) {
+    MPM_ERROR("scene {} can not be opened", scene_path);
+    return false;
+  }
+  path = scene_path;
+  fs::path base = fs::path(scene_path).parent_path();
+  auto resolve = [&](const std::string &file) {
+    return fs::path(file).is_absolute() ? file
+                                        : (base / file).generic_string();
+  };
+
+  bool ok = true;
+  int line = 0;
+  auto fail = [&](const std::string &message) {
+    MPM_ERROR("{}:{}: {}", path, line, message);
+    ok = false;
+  };
+  for (std::string text; std::getline(in, text);) {
+    ++line;
+    std::istringstream stream(text.substr(0, text.find('#')));
+    std::vector<std::string> tokens;
+    for (std::string token; stream >> token;) {
+      tokens.push_back(token);
+    }
+    if (tokens.empty()) {
+      continue;
+    }
+    Directive d;
+    auto error = parse_directive(tokens, d);
+    if (!error.empty()) {
+      fail(error);
+      continue;
+    }
+
+    if (d.keyword == "grid") {
+      gravity = d.vector("gravity", gravity);
+      area = d.vector("area", area);
+      h = d.number("h", h);
+      if (!(h > 0) || (area.array() <= 0).any()) {
+        fail("grid needs a positive h and area");
+      }
+    } else if (d.keyword == "transfer") {
+      auto &scheme = d.words[0];
+      if (scheme == "apic") {
+        transfer = MPM_Simulator::APIC;
+      } else if (scheme == "flip99") {
+        transfer = MPM_Simulator::FLIP99;
+      } else if (scheme == "flip95") {
+        transfer = MPM_Simulator::FLIP95;
+      } else {
+        fail(fmt::format("unknown transfer scheme `{}`", scheme));
+      }
+    } else if (d.keyword == "material") {
+      if (!d.has("E") || !d.has("nu") || !d.has("mass") || !d.has("density")) {
+        fail("material needs E, nu, mass and density");
+        continue;
+      }
+      materials[d.words[0]] = std::make_unique<MPM_Material>(
+          d.number("E", 0), d.number("nu", 0), d.number("mass", 0),
+          d.number("density", 0));
+    } else if (d.keyword == "model") {
+      auto model = make_model(d.words[1]);
+      if (!model) {
+        fail(fmt::format("unknown constitutive model `{}`", d.words[1]));
+        continue;
+      }
+      models[d.words[0]] = model;
+    } else if (d.keyword == "plasticity") {
+      if (d.words[1] == "snow") {
+        Snow defaults;
+        T psi = d.number("psi", defaults.psi);
+        T theta_c = d.number("theta_c", defaults.theta_c);
+        T theta_s = d.number("theta_s", defaults.theta_s);
+        T min_Jp = d.number("min_Jp", defaults.min_Jp);
+        T max_Jp = d.number("max_Jp", defaults.max_Jp);
+        plasticities[d.words[0]] = [=] {
+          return std::make_shared<Snow>(psi, theta_c, theta_s, min_Jp, max_Jp);
+        };
+      } else if (d.words[1] == "von_mises") {
+        T yield = d.number("yield", 0);
+        T xi = d.number("xi", 0);
+        T alpha = d.number("alpha", 0);
+        plasticities[d.words[0]] = [=] {
+          return std::make_shared<vonMises>(yield, xi, alpha);
+        };
+      } else {
+        fail(fmt::format("unknown plasticity `{}`", d.words[1]));
+      }
+    } else if (d.keyword == "default") {
+      default_model = d.text("model");
+      default_plasticity = d.text("plasticity");
+      if (!default_model.empty() && !models.count(default_model)) {
+        fail(fmt::format("model `{}` is not defined", default_model));
+      }
+      if (!default_plasticity.empty() &&
+          !plasticities.count(default_plasticity)) {
+        fail(fmt::format("plasticity `{}` is not defined",
+                         default_plasticity));
+      }
+    } else if (d.keyword == "wall" || d.keyword == "sphere") {
+      std::shared_ptr<MPM_LevelSet> levelset;
+      if (d.keyword == "wall") {
+        if (!d.has("normal") || !d.has("point")) {
+          fail("wall needs a normal and a point");
+          continue;
+        }
+        levelset = std::make_shared<HalfPlane_LevelSet>(
+            d.vector("normal", VT::Zero()).normalized(),
+            d.vector("point", VT::Zero()));
+      } else {
+        if (!d.has("center") || !(d.number("radius", 0) > 0)) {
+          fail("sphere needs a center and a positive radius");
+          continue;
+        }
+        levelset = std::make_shared<Sphere_LevelSet>(
+            d.vector("center", VT::Zero()), d.number("radius", 0));
+      }
+      colliders.emplace_back(levelset,
+                             d.has("sticky") ? MPM_Collision::STICKY
+                                             : MPM_Collision::SLIP,
+                             d.number("friction", 0));
+    } else if (d.keyword == "object") {
+      ObjectDesc object;
+      object.line = line;
+      object.material = d.text("material");
+      object.model = d.text("model");
+      object.plasticity = d.text("plasticity");
+      object.velocity = d.vector("velocity", VT::Zero());
+      object.sample = d.number("sample", 0);
+      if (d.has("file")) {
+        object.file = resolve(d.text("file"));
+      } else if (d.has("box_min") && d.has("box_max") &&
+                 (d.number("spacing", 0) > 0 || object.sample > 0)) {
+        object.box_min = d.vector("box_min", VT::Zero());
+        object.box_max = d.vector("box_max", VT::Zero());
+        object.spacing = d.number("spacing", 0);
+      } else {
+        fail("object needs a file or box_min, box_max and spacing or sample");
+        continue;
+      }
+      if (!materials.count(object.material)) {
+        fail(fmt::format("material `{}` is not defined", object.material));
+      }
+      if (!object.model.empty() && !models.count(object.model)) {
+        fail(fmt::format("model `{}` is not defined", object.model));
+      }
+      if (!object.plasticity.empty() &&
+          !plasticities.count(object.plasticity)) {
+        fail(fmt::format("plasticity `{}` is not defined",
+                         object.plasticity));
+      }
+      objects.push_back(object);
+    } else if (d.keyword == "export") {
+      // channel names as in the exported files
+      bool found = false;
+      for (auto channel :
+           {ExportChannel::VELOCITY, ExportChannel::J, ExportChannel::DET_F,
+            ExportChannel::PLASTIC_JP, ExportChannel::MATERIAL_ID,
+            ExportChannel::VON_MISES}) {
+        if (!d.words.empty() && export_channel_name(channel) == d.words[0]) {
+          auto type = d.words.size() > 1 && d.words[1] == "float16"
+                          ? ExportType::FLOAT16
+                          : ExportType::FLOAT32;
+          export_desc.add(channel, type);
+          found = true;
+        }
+      }
+      if (!found) {
+        fail("export needs a channel: v, J, detF, Jp, material_id or "
+             "von_mises");
+      }
+    } else if (d.keyword == "time") {
+      frame_rate = static_cast<int>(d.number("frame_rate", frame_rate));
+      frames = static_cast<int>(d.number("frames", frames));
+      step_options.max_dt = d.number("max_dt", step_options.max_dt);
+      step_options.min_dt = d.number("min_dt", step_options.min_dt);
+      step_options.initial_dt =
+          d.number("initial_dt", step_options.initial_dt);
+      step_options.cfl = d.number("cfl", step_options.cfl);
+      step_options.acoustic_cfl =
+          d.number("acoustic_cfl", step_options.acoustic_cfl);
+      if (frame_rate <= 0 || frames < 0) {
+        fail("time needs a positive frame_rate");
+      }
+    } else if (d.keyword == "output") {
+      // frames are written as <output_dir><frame>.bgeo
+      if (d.has("dir")) {
+        output_dir =
+            (fs::path(resolve(d.text("dir"))) / "").generic_string();
+      }
+      particle_cache = d.flag("cache", particle_cache);
+      mesh_surface = d.flag("surface", mesh_surface);
+      grid_fields = d.flag("grid", grid_fields);
+      stream_live = d.flag("live", stream_live);
+      write_diagnostics = d.flag("diagnostics", write_diagnostics);
+      checkpoint_interval = static_cast<int>(
+          d.number("checkpoint_interval", checkpoint_interval));
+      if (checkpoint_interval < 0) {
+        fail("output needs a checkpoint_interval of 0 or more");
+      }
+    } else if (d.keyword == "profile") {
+      profile_stages = d.flag("stages", profile_stages);
+      write_trace = d.flag("trace", write_trace);
+      hw_counters = d.flag("counters", hw_counters);
+    } else if (d.keyword == "sleeping") {
+      sleeping = d.words[0] == "on";
+    } else if (d.keyword == "numa") {
+      numa.enabled = d.words[0] == "on";
+      numa.domains = static_cast<int>(d.number("domains", 0));
+      numa.place_interval = static_cast<int>(
+          d.number("place_interval", numa.place_interval));
+    } else if (d.keyword == "refinement") {
+      refinement = RefinementOptions();
+      refinement.levels = static_cast<int>(d.number("levels", 1));
+      refinement.block_size =
+          static_cast<int>(d.number("block_size", refinement.block_size));
+      refinement.regrid_interval = static_cast<int>(
+          d.number("regrid_interval", refinement.regrid_interval));
+      refinement.refine_ppc = d.number("refine_ppc", refinement.refine_ppc);
+      refinement.collider_band =
+          d.number("collider_band", refinement.collider_band);
+      // set_refinement asserts on these
+      if (refinement.levels < 0 || refinement.levels > 2 ||
+          refinement.block_size < 2 || refinement.block_size % 2 != 0 ||
+          refinement.regrid_interval <= 0) {
+        fail("refinement needs 0 to 2 levels, an even block_size of 2 or "
+             "more and a positive regrid_interval");
+      }
+    } else if (d.keyword == "resample") {
+      adaptive_sampling = d.words[0] == "on";
+      resample_options.interval = static_cast<int>(
+          d.number("interval", resample_options.interval));
+      resample_options.min_ppc =
+          static_cast<int>(d.number("min_ppc", resample_options.min_ppc));
+      resample_options.max_ppc =
+          static_cast<int>(d.number("max_ppc", resample_options.max_ppc));
+      if (resample_options.interval <= 0 || resample_options.min_ppc < 0 ||
+          resample_options.min_ppc > resample_options.max_ppc) {
+        fail("resample needs a positive interval and min_ppc <= max_ppc");
+      }
+    }
+  }
+
+  for (auto &object : objects) {
+    if (object.model.empty() && default_model.empty()) {
+      line = object.line;
+      fail("object has no model and the scene no default model");
+    }
+  }
+  if (ok) {
+    ok = sample_objects();
+  }
+  return ok;
+}
+
+bool MPM_Scene::sample_objects() {
+  for (auto &object : objects) {
+    if (!(object.sample > 0)) {
+      continue;
+    }
+    PoissonSampleOptions options;
+    options.spacing = object.sample;
+    MPM_PoissonSampler sampler(options);
+    PoissonSamples samples;
+    bool sampled;
+    if (!object.file.empty()) {
+      SurfaceMesh mesh;
+      sampled =
+          read_mesh(object.file, mesh) && sampler.sample(mesh, h, samples);
+    } else {
+      sampled = sampler.sample(Box_LevelSet(object.box_min, object.box_max),
+                               object.box_min, object.box_max, h, samples);
+    }
+    if (!sampled) {
+      MPM_ERROR("{}:{}: object can not be sampled", path, object.line);
+      return false;
+    }
+    // the particle mass follows the density of the samples
+    auto &base = *materials.at(object.material);
+    object.sampled_material = std::make_shared<MPM_Material>(
+        base.E, base.nu, base.density * samples.particle_volume,
+        base.density);
+    object.positions = std::move(samples.positions);
+  }
+  return true;
+}
+
+bool MPM_Scene::build(MPM_Simulator &sim) const {
+  auto start = std::chrono::steady_clock::now();
+  // placed as they are allocated
+  if (numa.enabled) {
+    sim.set_numa(numa);
+  }
+  sim.mpm_initialize(gravity, area, h);
+  sim.set_transfer_scheme(transfer);
+  if (!default_model.empty()) {
+    sim.set_constitutive_model(models.at(default_model));
+  }
+  // one instance per plasticity and simulator, so no model object is
+  // shared between runs; the hardening state itself lives in the particles
+  std::map<std::string, std::shared_ptr<Plasticity>> plasticity;
+  auto plasticity_of =
+      [&](const std::string &name) -> std::shared_ptr<Plasticity> {
+    if (name.empty()) {
+      return nullptr;
+    }
+    auto &instance = plasticity[name];
+    if (!instance) {
+      instance = plasticities.at(name)();
+    }
+    return instance;
+  };
+  if (!default_plasticity.empty()) {
+    sim.set_plasticity(plasticity_of(default_plasticity));
+  }
+  for (auto &collider : colliders) {
+    sim.add_collision(collider);
+  }
+
+  for (auto &object : objects) {
+    std::vector<VT> positions;
+    if (object.sample > 0) {
+      positions = object.positions;
+    } else if (!object.file.empty()) {
+      if (!read_particles(object.file, positions)) {
+        return false;
+      }
+    } else {
+      VINT count = ((object.box_max - object.box_min) / object.spacing)
+                       .array()
+                       .floor()
+                       .cast<int>()
+                       .max(0);
+      positions.reserve(size_t(count.prod()));
+      for (int i = 0; i < count[0]; i++)
+        for (int j = 0; j < count[1]; j++)
+          for (int k = 0; k < count[2]; k++) {
+            positions.push_back(
+                object.box_min +
+                (VINT(i, j, k).cast<T>().array() + T(0.5)).matrix() *
+                    object.spacing);
+          }
+    }
+    auto model = object.model.empty() ? nullptr : models.at(object.model);
+    sim.add_object(positions,
+                   std::vector<VT>(positions.size(), object.velocity),
+                   object.sampled_material
+                       ? object.sampled_material.get()
+                       : materials.at(object.material).get(),
+                   model, plasticity_of(object.plasticity));
+  }
+
+  if (sleeping) {
+    sim.set_sleeping(true);
+  }
+  if (refinement.levels > 0) {
+    sim.set_refinement(refinement);
+  }
+  if (numa.enabled) {
+    auto grid = sim.get_grid_locality();
+    auto particles = sim.get_particle_locality();
+    MPM_INFO("numa locality: grid {:.1f}% of {} pages local, particles "
+             "{:.1f}% of {} pages local",
+             100 * grid.local_fraction(), grid.pages,
+             100 * particles.local_fraction(), particles.pages);
+  }
+  MPM_INFO("scene {} built in {:.3f}s: {} particles, {} colliders", path,
+           std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start)
+               .count(),
+           sim.get_sim_info().particle_size, colliders.size());
+  return true;
+}
+
+} // namespace mpm
@@ -9,10 +9,54 @@
 
 #include <tbb/parallel_for.h>
 #include <tbb/parallel_reduce.h>
+#include <tbb/parallel_sort.h>
 #include <tbb/spin_mutex.h>
 
+#include <functional>
+#include <limits>
+
 namespace mpm {
 
+namespace {
+
+// partial results of the reductions fused into update_F and advection
+struct DeformationSums {
+  T elastic_energy = 0;
+  T min_J = std::numeric_limits<T>::max();
+  T max_J = std::numeric_limits<T>::lowest();
+
+  DeformationSums &merge(const DeformationSums &other) {
+    elastic_energy += other.elastic_energy;
+    min_J = std::min(min_J, other.min_J);
+    max_J = std::max(max_J, other.max_J);
+    return *this;
+  }
+};
+
+struct AdvectionSums {
+  int asleep = 0;
+  T max_velocity = 0;
+
+  AdvectionSums &merge(const AdvectionSums &other) {
+    asleep += other.asleep;
+    max_velocity = std::max(max_velocity, other.max_velocity);
+    return *this;
+  }
+};
+
+struct MomentumSums {
+  T kinetic_energy = 0;
+  VT momentum = VT::Zero();
+
+  MomentumSums &merge(const MomentumSums &other) {
+    kinetic_energy += other.kinetic_energy;
+    momentum += other.momentum;
+    return *this;
+  }
+};
+
+} // namespace
+
 MPM_Simulator::MPM_Simulator()
     : sim_info(), particles(nullptr), grid_attrs(nullptr),
       grid_mutexs(nullptr) {}
@@ -48,6 +92,16 @@ void MPM_Simulator::clear_simulation() {
     grid_mutexs = nullptr;
   }
   sim_info = SimInfo();
+  sleep_blocks.clear();
+  groups.clear();
+  materials.clear();
+  owned_materials.clear();
+  material_levels.clear();
+  level_materials.clear();
+  refined_levels.clear();
+  grid_bounds.clear();
+  particle_bounds.clear();
+  active_bounds.clear();
 }
 
 /*
@@ -103,33 +157,111 @@ void MPM_Simulator::mpm_demo(const std::shared_ptr<MPM_CM> &cm_demo,
 }*/
 
 void MPM_Simulator::substep(T dt) {
-  // MPM_SCOPED_PROFILE_FUNCTION();
-  // TODO: add profiler later
-  MPM_ASSERT(cm, "PLEASE SET CONSTITUTIVE_MODEL BEFORE SIMULATION");
+  MPM_PROFILE_STAGE("substep");
+  for (auto &group : groups) {
+    MPM_ASSERT(group_cm(group),
+               "PLEASE SET CONSTITUTIVE_MODEL BEFORE SIMULATION");
+  }
+
+  if (sleeping_enabled && !sleep_blocks.is_initialized()) {
+    sleep_blocks.initialize(sim_info, sleep_options);
+  }
+  // before the rollback copy, which is taken in particle order
+  if (numa->active() && numa_options.place_interval > 0 &&
+      sim_info.curr_step > 0 &&
+      sim_info.curr_step % numa_options.place_interval == 0) {
+    place_particles();
+  }
+  if (rollback_enabled) {
+    rollback_particles.resize(sim_info.particle_size);
+    rollback_info = sim_info;
+    if (sleeping_enabled) {
+      sleep_blocks.save(rollback_sleep);
+      rollback_sleeping = sleeping_particles;
+    }
+  }
+  failed_step.store(false, std::memory_order_relaxed);
+
+  bool refined = refinement.levels > 0;
+  if (refined && (regrid_pending || refined_levels.empty() ||
+                  sim_info.curr_step % refinement.regrid_interval == 0)) {
+    regrid();
+  }
 
   prestep();
+  if (refined) {
+    refined_prestep();
+  }
   transfer_P2G();
   add_gravity();
   update_grid_force();
+  if (refined) {
+    refined_grid_force();
+  }
   update_grid_velocity(dt);
   solve_grid_boundary(2);
   solve_grid_collision();
+  if (refined) {
+    refined_grid_velocity(dt);
+  }
   update_F(dt);
   transfer_G2P();
   advection(dt);
   solve_particle_collision();
+  if (sleeping_enabled) {
+    sleep_blocks.update(colls);
+  }
   sim_info.curr_step++;
+  sim_info.curr_time += dt;
+  if (diagnostics_enabled) {
+    diagnostics.step = sim_info.curr_step;
+    diagnostics.time = sim_info.curr_time;
+    diagnostics.dt = dt;
+  }
+  log_aggregates.flush();
+}
+
+void MPM_Simulator::rollback_step() {
+  MPM_PROFILE_STAGE("rollback_step");
+  MPM_ASSERT(rollback_enabled &&
+                 rollback_particles.size() == size_t(sim_info.particle_size),
+             "ROLLBACK NEEDS set_rollback(true) BEFORE THE SUBSTEP");
+  tbb::parallel_for(0, sim_info.particle_size,
+                    [&](int i) { particles[i] = rollback_particles[i]; });
+  sim_info = rollback_info;
+  if (sleeping_enabled) {
+    sleep_blocks.restore(rollback_sleep);
+    sleeping_particles = rollback_sleeping;
+  }
+  failed_step.store(false, std::memory_order_relaxed);
+}
+
+void MPM_Simulator::set_sleeping(bool enabled, const SleepOptions &options) {
+  sleeping_enabled = enabled;
+  sleep_options = options;
+  sleeping_particles = 0;
+  // blocks are sized from the grid at the next substep
+  sleep_blocks.clear();
 }
 
 std::vector<VT> MPM_Simulator::get_positions() const {
-  std::vector<VT> positions(sim_info.particle_size);
+  std::vector<VT> positions;
+  get_positions(positions);
+  return positions;
+}
+
+void MPM_Simulator::get_positions(std::vector<VT> &positions) const {
+  positions.resize(sim_info.particle_size);
   tbb::parallel_for(0, sim_info.particle_size,
                     [&](int i) { positions[i] = particles[i].pos_p; });
-  return positions;
 }
 
 T MPM_Simulator::get_max_velocity() const { return sim_info.max_velocity; }
 
+bool MPM_Simulator::export_particles(const std::string &export_path) const {
+  return write_particles(export_path, get_particle_span(&Particle::pos_p));
+}
+
 // bool MPM_Simulator::export_result(const std::string &export_dir,
 //                                   int curr_frame) {
 //   // MPM_INFO("export frame_{}'s result.", curr_frame);
@@ -158,8 +290,7 @@ void MPM_Simulator::mpm_initialize(const VT &gravity, const VT &world_area,
   sim_info.grid_h = H;
   sim_info.grid_l = L;
   sim_info.grid_size = W * H * L;
-  grid_attrs = new GridAttr[sim_info.grid_size];
-  grid_mutexs = new tbb::spin_mutex[sim_info.grid_size];
+  place_grid();
 
   MPM_INFO("MPM simulation space info:\n"
            "\tgrid_size: {}->{}x{}x{}\n"
@@ -168,17 +299,87 @@ void MPM_Simulator::mpm_initialize(const VT &gravity, const VT &world_area,
            "\tworld area: {}",
            sim_info.grid_size, W, H, L, sim_info.h,
            sim_info.gravity.transpose(), sim_info.world_area.transpose());
+}
 
-  for (int i = 0; i < W; i++)
-    for (int j = 0; j < H; j++)
-      for (int k = 0; k < L; k++) {
-        int index = i * H * L + j * L + k;
-        grid_attrs[index].mass_i = 0;
-        grid_attrs[index].force_i = VT::Zero();
-        grid_attrs[index].vel_i = VT::Zero();
-        grid_attrs[index].vel_in = VT::Zero();
-        grid_attrs[index].Xi = VINT(i, j, k);
-      }
+void MPM_Simulator::place_grid() {
+  delete[] grid_attrs;
+  delete[] grid_mutexs;
+  grid_attrs = new GridAttr[sim_info.grid_size];
+  grid_mutexs = new tbb::spin_mutex[sim_info.grid_size];
+  grid_bounds = numa->split(0, sim_info.grid_size);
+
+  // the pages go to the node of the first thread writing them
+  const int H = sim_info.grid_h, L = sim_info.grid_l;
+  numa->for_each(grid_bounds, 0, sim_info.grid_size, [&](int index) {
+    grid_attrs[index].mass_i = 0;
+    grid_attrs[index].force_i = VT::Zero();
+    grid_attrs[index].vel_i = VT::Zero();
+    grid_attrs[index].vel_in = VT::Zero();
+    grid_attrs[index].Xi = VINT(index / (H * L), index / L % H, index % L);
+  });
+}
+
+void MPM_Simulator::place_particles() {
+  const int n = sim_info.particle_size;
+  particle_bounds.clear();
+  if (!numa->active() || n == 0) {
+    particle_bounds = {0, n};
+    return;
+  }
+
+  // grid node of every particle, the particles of a group are sorted by it
+  // and cut where the grid partition is cut
+  std::vector<std::pair<int, int>> keys(n);
+  const T inv_h = 1 / sim_info.h;
+  const VINT last(sim_info.grid_w - 1, sim_info.grid_h - 1,
+                  sim_info.grid_l - 1);
+  tbb::parallel_for(0, n, [&](int i) {
+    VINT node = (particles[i].pos_p * inv_h)
+                    .array()
+                    .round()
+                    .cast<int>()
+                    .max(0)
+                    .min(last.array());
+    keys[i] = {(node[0] * sim_info.grid_h + node[1]) * sim_info.grid_l +
+                   node[2],
+               i};
+  });
+  for (auto &group : groups) {
+    auto first = keys.begin() + group.begin, last = keys.begin() + group.end;
+    tbb::parallel_sort(first, last);
+    particle_bounds.push_back(group.begin);
+    for (size_t d = 1; d + 1 < grid_bounds.size(); d++) {
+      auto cut = std::lower_bound(
+          first, last,
+          std::make_pair(grid_bounds[d], std::numeric_limits<int>::min()));
+      particle_bounds.push_back(static_cast<int>(cut - keys.begin()));
+    }
+  }
+  particle_bounds.push_back(n);
+
+  Particle *placed = new Particle[n];
+  numa->for_each(particle_bounds, 0, n,
+                 [&](int i) { placed[i] = particles[keys[i].second]; });
+  delete[] particles;
+  particles = placed;
+  regrid_pending = true;
+}
+
+void MPM_Simulator::set_numa(const NumaOptions &options) {
+  numa_options = options;
+  numa = std::make_unique<MPM_NumaDomains>(options);
+  if (grid_attrs) {
+    place_grid();
+  }
+  place_particles();
+}
+
+NumaLocality MPM_Simulator::get_grid_locality() const {
+  return numa->locality(grid_attrs, sizeof(GridAttr), grid_bounds);
+}
+
+NumaLocality MPM_Simulator::get_particle_locality() const {
+  return numa->locality(particles, sizeof(Particle), particle_bounds);
 }
 
 void MPM_Simulator::add_collision(const MPM_Collision &coll) {
@@ -187,58 +388,87 @@ void MPM_Simulator::add_collision(const MPM_Collision &coll) {
 
 void MPM_Simulator::add_object(const std::vector<VT> &positions,
                                const std::vector<VT> &velocities,
-                               MPM_Material *material) {
+                               MPM_Material *material,
+                               const std::shared_ptr<MPM_CM> &object_cm,
+                               const std::shared_ptr<Plasticity> &object_plas) {
 
   MPM_ASSERT(positions.size() == velocities.size() && material != nullptr,
              "PLEASE CHECK OBJECT's POSITION SIZE IFF EQUALS VELOCITY SIZE");
-  auto new_size = sim_info.particle_size + positions.size();
+  int count = static_cast<int>(positions.size());
+  auto new_size = sim_info.particle_size + count;
+
+  // objects sharing the same models are stored in one contiguous range
+  auto group = std::find_if(groups.begin(), groups.end(), [&](auto &g) {
+    return g.cm == object_cm && g.plasticity == object_plas;
+  });
+  if (group == groups.end()) {
+    groups.push_back({sim_info.particle_size, sim_info.particle_size,
+                      object_cm, object_plas});
+    group = groups.end() - 1;
+  }
+  int insert_at = group->end;
 
+  Particle *new_particles = new Particle[new_size];
   if (particles) {
-    Particle *new_particles = new Particle[new_size];
-    memcpy(new_particles, particles, sim_info.particle_size * sizeof(Particle));
+    std::copy(particles, particles + insert_at, new_particles);
+    std::copy(particles + insert_at, particles + sim_info.particle_size,
+              new_particles + insert_at + count);
     delete[] particles;
-    particles = new_particles;
-  } else {
-    particles = new Particle[new_size];
+  }
+  particles = new_particles;
+
+  for (int i = 0; i < count; i++) {
+    auto &particle = particles[insert_at + i];
+    particle.pos_p = positions[i];
+    particle.vel_p = velocities[i];
+    particle.F = MT::Identity();
+    particle.J = 1;
+    // particle.Fe = MT::Identity();
+    // particle.Fp = MT::Identity();
+    particle.Bp = MT::Zero();
+    particle.Jp = 1;
+    particle.gamma_p = 0;
+    particle.material = material;
   }
 
-  for (auto i = sim_info.particle_size; i < new_size; i++) {
-    particles[i].pos_p = positions[i - sim_info.particle_size];
-    particles[i].vel_p = velocities[i - sim_info.particle_size];
-    particles[i].F = MT::Identity();
-    particles[i].J = 1;
-    // particles[i].Fe = MT::Identity();
-    // particles[i].Fp = MT::Identity();
-    particles[i].Bp = MT::Zero();
-    particles[i].material = material;
+  group->end += count;
+  for (auto iter = group + 1; iter != groups.end(); iter++) {
+    iter->begin += count;
+    iter->end += count;
   }
 
+  register_material(material);
   sim_info.particle_size = new_size;
+  place_particles();
+  // the new particles may land in sleeping blocks
+  sleep_blocks.wake_all();
+  regrid_pending = true;
 }
 
 void MPM_Simulator::add_object(const std::vector<VT> &positions,
-                               MPM_Material *material) {
+                               MPM_Material *material,
+                               const std::shared_ptr<MPM_CM> &object_cm,
+                               const std::shared_ptr<Plasticity> &object_plas) {
   MPM_ASSERT(material != nullptr, "MATERIAL SHOULD NOT BE NULLPTR");
-  auto new_size = sim_info.particle_size + positions.size();
+  add_object(positions, std::vector<VT>(positions.size(), VT::Zero()),
+             material, object_cm, object_plas);
+}
 
-  if (particles) {
-    Particle *new_particles = new Particle[new_size];
-    memcpy(new_particles, particles, sim_info.particle_size * sizeof(Particle));
-    delete[] particles;
-    particles = new_particles;
-  } else {
-    particles = new Particle[new_size];
-  }
+MPM_CM *MPM_Simulator::group_cm(const ParticleGroup &group) const {
+  return group.cm ? group.cm.get() : cm.get();
+}
+
+Plasticity *MPM_Simulator::group_plasticity(const ParticleGroup &group) const {
+  return group.plasticity ? group.plasticity.get() : plasticity.get();
+}
 
-  for (auto i = sim_info.particle_size; i < new_size; i++) {
-    particles[i].pos_p = positions[i - sim_info.particle_size];
-    particles[i].F = MT::Identity();
-    // particles[i].Fe = MT::Identity();
-    // particles[i].Fp = MT::Identity();
-    particles[i].Bp = MT::Zero();
-    particles[i].material = material;
+int MPM_Simulator::register_material(MPM_Material *material) {
+  auto iter = std::find(materials.begin(), materials.end(), material);
+  if (iter != materials.end()) {
+    return static_cast<int>(iter - materials.begin());
   }
-  sim_info.particle_size = new_size;
+  materials.push_back(material);
+  return static_cast<int>(materials.size()) - 1;
 }
 
 void MPM_Simulator::set_constitutive_model(const std::shared_ptr<MPM_CM> &cm) {
@@ -258,8 +488,13 @@ void MPM_Simulator::set_transfer_scheme(TransferScheme ts) {
   }
 }
 
+void MPM_Simulator::set_flip_alpha(T alpha) {
+  MPM_ASSERT(alpha >= 0 && alpha <= 1, "FLIP ALPHA SHOULD BE IN [0, 1]");
+  sim_info.alpha = alpha;
+}
+
 void MPM_Simulator::prestep() {
-  // MPM_SCOPED_PROFILE_FUNCTION();
+  MPM_PROFILE_STAGE("prestep");
   /*
   @MetaRu: follow parts calculate M : inertia tensor
   tbb::parallel_for(0, (int)sim_info.particle_size, [&](int iter) {
@@ -290,7 +525,7 @@ void MPM_Simulator::prestep() {
   });
   */
 
-  tbb::parallel_for(0, sim_info.grid_size, [&](int i) {
+  numa->for_each(grid_bounds, 0, sim_info.grid_size, [&](int i) {
     grid_attrs[i].mass_i = 0;
     grid_attrs[i].force_i = VT::Zero();
     grid_attrs[i].vel_i = VT::Zero();
@@ -301,8 +536,8 @@ void MPM_Simulator::prestep() {
 }
 
 void MPM_Simulator::transfer_P2G() {
-  // MPM_SCOPED_PROFILE_FUNCTION();
-  tbb::parallel_for(0, (int)sim_info.particle_size, [&](int iter) {
+  MPM_PROFILE_STAGE("transfer_P2G");
+  numa->for_each(particle_bounds, 0, sim_info.particle_size, [&](int iter) {
     // for (int iter = 0; iter < sim_info.particle_size; iter++) {
     // convert particles position to grid space by divide h
     // particle position in grid space
@@ -312,6 +547,16 @@ void MPM_Simulator::transfer_P2G() {
 
     auto particle = particles[iter];
     auto mass_p = particle.material->mass;
+    if (rollback_enabled) {
+      rollback_particles[iter] = particle;
+    }
+    if (is_asleep(particle)) {
+      return;
+    }
+    // near refined levels, see refined_P2G
+    if (owner_level(iter)) {
+      return;
+    }
 
     for (int i = 0; i < 3; i++)
       for (int j = 0; j < 3; j++)
@@ -322,12 +567,12 @@ void MPM_Simulator::transfer_P2G() {
                       curr_node(1) * sim_info.grid_l + curr_node(2);
 
           // check if particles run out of boundaries
-          MPM_ASSERT(0 <= index && index < sim_info.grid_size,
-                     " PARTICLE[{}] OUT OF GRID at Transfer_P2G\n"
-                     "\tposition: {}"
-                     "\tvelocity: {}",
-                     iter, particle.pos_p.transpose(),
-                     particle.vel_p.transpose());
+          MPM_DEBUG_ASSERT(0 <= index && index < sim_info.grid_size,
+                           " PARTICLE[{}] OUT OF GRID at Transfer_P2G\n"
+                           "\tposition: {}"
+                           "\tvelocity: {}",
+                           iter, particle.pos_p.transpose(),
+                           particle.vel_p.transpose());
 
           T wijk = wp(i, 0) * wp(j, 1) * wp(k, 2);
           VT plus = VT::Zero();
@@ -347,25 +592,51 @@ void MPM_Simulator::transfer_P2G() {
           }
         }
   });
-
-  tbb::parallel_for(0, (int)sim_info.grid_size, [&](int iter) {
-    if (grid_attrs[iter].mass_i != T(0)) {
-      {
-        // critical section
-        active_nodes.push_back(iter);
-      }
-      grid_attrs[iter].vel_in =
-          grid_attrs[iter].vel_in / grid_attrs[iter].mass_i;
-    } else {
-      grid_attrs[iter].vel_in = VT::Zero();
+  // the composite transfers also reach the simulator grid, so they go
+  // before its nodes are normalized
+  T refined_mass = refinement.levels > 0 ? refined_P2G() : T(0);
+
+  // the grid mass diagnostic is summed in the same pass
+  int stage = MPM_Profiler::current_stage();
+  T grid_mass = numa->parallel_reduce(
+      grid_bounds, tbb::blocked_range<int>(0, sim_info.grid_size), T(0),
+      [&](const tbb::blocked_range<int> &r, T mass) -> T {
+        MPMTaskProfiler task(stage);
+        for (int iter = r.begin(); iter != r.end(); ++iter) {
+          if (grid_attrs[iter].mass_i != T(0)) {
+            {
+              // critical section
+              active_nodes.push_back(iter);
+            }
+            mass += grid_attrs[iter].mass_i;
+            grid_attrs[iter].vel_in =
+                grid_attrs[iter].vel_in / grid_attrs[iter].mass_i;
+          } else {
+            grid_attrs[iter].vel_in = VT::Zero();
+          }
+        }
+        return mass;
+      },
+      std::plus<T>());
+  if (numa->active()) {
+    // the grid loops split the active nodes where the grid is split
+    tbb::parallel_sort(active_nodes.begin(), active_nodes.end());
+    active_bounds.clear();
+    for (int bound : grid_bounds) {
+      active_bounds.push_back(static_cast<int>(
+          std::lower_bound(active_nodes.begin(), active_nodes.end(), bound) -
+          active_nodes.begin()));
     }
-  });
+  }
+  if (diagnostics_enabled) {
+    diagnostics.grid_mass = grid_mass + refined_mass;
+  }
 } // namespace mpm
 
 void MPM_Simulator::add_gravity() {
-  // MPM_SCOPED_PROFILE_FUNCTION();
+  MPM_PROFILE_STAGE("add_gravity");
   // MPM_ASSERT(active_nodes.size() < sim_info.grid_size);
-  tbb::parallel_for(0, (int)active_nodes.size(), [&](int i) {
+  numa->for_each(active_bounds, 0, (int)active_nodes.size(), [&](int i) {
     int index = active_nodes[i];
     grid_attrs[index].force_i += sim_info.gravity * grid_attrs[index].mass_i;
   });
@@ -374,95 +645,180 @@ void MPM_Simulator::add_gravity() {
 void MPM_Simulator::update_grid_force() {
   // update grid forcing from particles F(deformation gradients)
 
-  // MPM_SCOPED_PROFILE_FUNCTION();
-  tbb::parallel_for(0, (int)sim_info.particle_size, [&](int iter) {
-    // for (int iter = 0; iter < sim_info.particle_size; iter++) {
-    auto F = particles[iter].F;
-    auto vol_p = particles[iter].material->volume;
-    auto inv_h = 1.0f / sim_info.h;
-
-    // return [F_based_stress and J_based_stress]
-    // to reduce numerical calculation errors
-    // all in first piola-kirchhoff stress
-    auto [stress_F, stress_J] = cm->calc_mixed_stress_tensor(particles[iter]);
-
-    auto [base_node, wp, dwp] =
-        quatratic_interpolation(particles[iter].pos_p * inv_h);
-    for (int i = 0; i < 3; i++)
-      for (int j = 0; j < 3; j++)
-        for (int k = 0; k < 3; k++) {
-          VINT curr_node = base_node + VINT(i, j, k);
-          VT grad_wip{dwp(i, 0) * wp(j, 1) * wp(k, 2) * inv_h,
-                      wp(i, 0) * dwp(j, 1) * wp(k, 2) * inv_h,
-                      wp(i, 0) * wp(j, 1) * dwp(k, 2) * inv_h};
-
-          auto index = curr_node.x() * sim_info.grid_h * sim_info.grid_l +
-                       curr_node.y() * sim_info.grid_l + curr_node.z();
-          MPM_ASSERT(0 <= index && index < sim_info.grid_size,
-                     "PARTICLE OUT OF GRID");
-
-          {
-            // critical section
-            tbb::spin_mutex::scoped_lock lock(grid_mutexs[index]);
-
-            grid_attrs[index].force_i -=
-                vol_p * (stress_F * F.transpose() + stress_J) * grad_wip;
+  MPM_PROFILE_STAGE("update_grid_force");
+  auto inv_h = 1.0f / sim_info.h;
+  int stage = MPM_Profiler::current_stage();
+  // one loop over the batches of all groups, a loop per group would wait
+  // for the slowest task of every group in turn. groups are cut at the
+  // parts of particle_bounds, so every batch runs on its particles' domain
+  stress_runs.clear();
+  stress_bounds.clear();
+  int batch_count = 0;
+  for (size_t q = 0; q + 1 < particle_bounds.size(); q++) {
+    stress_bounds.push_back(batch_count);
+    for (auto &group : groups) {
+      int begin = std::max(group.begin, particle_bounds[q]);
+      int end = std::min(group.end, particle_bounds[q + 1]);
+      if (begin < end) {
+        stress_runs.push_back({begin, end, batch_count, group_cm(group)});
+        batch_count += (end - begin + STRESS_BATCH - 1) / STRESS_BATCH;
+      }
+    }
+  }
+  stress_bounds.push_back(batch_count);
+  numa->parallel_for(
+      stress_bounds, tbb::blocked_range<int>(0, batch_count),
+      [&](const tbb::blocked_range<int> &r) {
+        MPMTaskProfiler task(stage);
+        auto run = std::upper_bound(stress_runs.begin(), stress_runs.end(),
+                                    r.begin(),
+                                    [](int batch, const StressRun &run) {
+                                      return batch < run.first_batch;
+                                    }) -
+                   1;
+        // kirchhoff stress = stress_F * F^T + stress_J, F and J based
+        // parts are kept apart to reduce numerical errors
+        MT tau[STRESS_BATCH];
+        for (int n = r.begin(); n != r.end(); ++n) {
+          while (run + 1 != stress_runs.end() && n >= (run + 1)->first_batch) {
+            ++run;
+          }
+          int batch = run->begin + (n - run->first_batch) * STRESS_BATCH;
+          int count = std::min(STRESS_BATCH, run->end - batch);
+          if (sleeping_enabled &&
+              std::all_of(particles + batch, particles + batch + count,
+                          [&](auto &p) { return is_asleep(p); })) {
+            continue;
+          }
+          run->cm->calc_kirchhoff_stress_batch(particles + batch, count, tau);
+
+          for (int b = 0; b < count; b++) {
+            auto &particle = particles[batch + b];
+            if (is_asleep(particle)) {
+              continue;
+            }
+            MT vol_tau = particle.material->volume * tau[b];
+            if (owner_level(batch + b)) {
+              // spread by refined_grid_force
+              stress_cache[batch + b] = vol_tau;
+              continue;
+            }
+            auto [base_node, wp, dwp] =
+                quatratic_interpolation(particle.pos_p * inv_h);
+            for (int i = 0; i < 3; i++)
+              for (int j = 0; j < 3; j++)
+                for (int k = 0; k < 3; k++) {
+                  VINT curr_node = base_node + VINT(i, j, k);
+                  VT grad_wip{dwp(i, 0) * wp(j, 1) * wp(k, 2) * inv_h,
+                              wp(i, 0) * dwp(j, 1) * wp(k, 2) * inv_h,
+                              wp(i, 0) * wp(j, 1) * dwp(k, 2) * inv_h};
+
+                  auto index =
+                      curr_node.x() * sim_info.grid_h * sim_info.grid_l +
+                      curr_node.y() * sim_info.grid_l + curr_node.z();
+                  MPM_DEBUG_ASSERT(0 <= index && index < sim_info.grid_size,
+                                   "PARTICLE OUT OF GRID");
+
+                  {
+                    // critical section
+                    tbb::spin_mutex::scoped_lock lock(grid_mutexs[index]);
+                    grid_attrs[index].force_i -= vol_tau * grad_wip;
+                  }
+                }
           }
         }
-  });
+      });
 }
 
 void MPM_Simulator::update_grid_velocity(T dt) {
-  // MPM_SCOPED_PROFILE_FUNCTION();
-  tbb::parallel_for(0, (int)active_nodes.size(), [&](int i) {
+  MPM_PROFILE_STAGE("update_grid_velocity");
+  numa->for_each(active_bounds, 0, (int)active_nodes.size(), [&](int i) {
     int index = active_nodes[i];
     // vel_n+1 = vel_n + f_i / m_i * dt
     grid_attrs[index].vel_i =
         grid_attrs[index].vel_in +
         dt * grid_attrs[index].force_i / grid_attrs[index].mass_i;
+
+    // sleeping blocks hold still under the awake material, which wakes
+    // them when it arrives fast enough
+    if (sleeping_enabled) {
+      int block = sleep_blocks.block_of_node(grid_attrs[index].Xi);
+      if (sleep_blocks.asleep(block)) {
+        if (grid_attrs[index].vel_in.norm() >
+            sleep_blocks.get_options().wake_velocity) {
+          sleep_blocks.request_wake(block);
+        }
+        grid_attrs[index].vel_i = VT::Zero();
+      }
+    }
   });
 }
 
 void MPM_Simulator::update_F(T dt) {
-  // MPM_SCOPED_PROFILE_FUNCTION();
-  tbb::parallel_for(0, (int)sim_info.particle_size, [&](int iter) {
+  MPM_PROFILE_STAGE("update_F");
+  auto update_particle = [&](int iter, Plasticity *plas) {
     // for (int iter = 0; iter < sim_info.particle_size; iter++) {
+    int block = 0;
+    if (sleeping_enabled) {
+      block = sleep_blocks.block_of(particles[iter].pos_p);
+      if (sleep_blocks.asleep(block)) {
+        return;
+      }
+    }
     auto F = particles[iter].F;
     auto J = particles[iter].J;
-    auto inv_h = 1.0f / sim_info.h;
-    auto [base_node, wp, dwp] =
-        quatratic_interpolation(particles[iter].pos_p * inv_h);
-
     MT grad_v = MT::Zero();
-    for (int i = 0; i < 3; i++)
-      for (int j = 0; j < 3; j++)
-        for (int k = 0; k < 3; k++) {
-          VINT curr_node = base_node + VINT(i, j, k);
-          VT grad_wip{dwp(i, 0) * wp(j, 1) * wp(k, 2) * inv_h,
-                      wp(i, 0) * dwp(j, 1) * wp(k, 2) * inv_h,
-                      wp(i, 0) * wp(j, 1) * dwp(k, 2) * inv_h};
+    if (int owner = owner_level(iter)) {
+      grad_v = refined_grad_v(particles[iter].pos_p, owner);
+    } else {
+      auto inv_h = 1.0f / sim_info.h;
+      auto [base_node, wp, dwp] =
+          quatratic_interpolation(particles[iter].pos_p * inv_h);
 
-          auto index = curr_node(0) * sim_info.grid_h * sim_info.grid_l +
-                       curr_node(1) * sim_info.grid_l + curr_node(2);
+      for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+          for (int k = 0; k < 3; k++) {
+            VINT curr_node = base_node + VINT(i, j, k);
+            VT grad_wip{dwp(i, 0) * wp(j, 1) * wp(k, 2) * inv_h,
+                        wp(i, 0) * dwp(j, 1) * wp(k, 2) * inv_h,
+                        wp(i, 0) * wp(j, 1) * dwp(k, 2) * inv_h};
 
-          MPM_ASSERT(0 <= index && index < sim_info.grid_size,
-                     "PARTICLE OUT OF GRID");
+            auto index = curr_node(0) * sim_info.grid_h * sim_info.grid_l +
+                         curr_node(1) * sim_info.grid_l + curr_node(2);
 
-          grad_v += grid_attrs[index].vel_i * grad_wip.transpose();
-        }
+            MPM_DEBUG_ASSERT(0 <= index && index < sim_info.grid_size,
+                             "PARTICLE OUT OF GRID");
+
+            grad_v += grid_attrs[index].vel_i * grad_wip.transpose();
+          }
+    }
 
     particles[iter].F = (MT::Identity() + dt * grad_v) * F;
 
     // @MetaRu some trick from ZIRAN ? but it works and really stable.
     particles[iter].J = (1 + dt * grad_v.trace()) * J;
+    // written so that a NaN gradient counts as motion
+    if (sleeping_enabled &&
+        !(grad_v.norm() <= sleep_blocks.get_options().strain_rate)) {
+      sleep_blocks.mark_busy(block);
+    }
 
-    MPM_ASSERT(grad_v == grad_v, "FATAL GRAD_VELOCITY OCCURED!");
-    if (plasticity) {
-      plasticity->projectStrain(particles[iter]);
+    // NaN velocity gradient or inverted element, the step controller
+    // rolls back and retries with a smaller dt
+    if (!(grad_v == grad_v) || !(particles[iter].J > 0)) {
+      failed_step.store(true, std::memory_order_relaxed);
+      MPM_WARN_AGGREGATED(log_aggregates,
+                          "step failed on {} particles (NaN grad_v or J<=0)",
+                          "particles[{}] failed: J = {}, grad_v:\n{}", iter,
+                          particles[iter].J, grad_v);
+    }
+    if (plas) {
+      plas->projectStrain(particles[iter]);
     }
 
     if (J < 0) {
-      MPM_WARN(
+      MPM_WARN_AGGREGATED(
+          log_aggregates, "J<0 on {} particles this step",
           "particles[{}]'s J = determinat(F) is negative!\n{}, determinant: {}\n"
           "original F:\n{}, determinant: {}\n"
           "grad_v:\n {}, determinant: {}\n"
@@ -495,13 +851,70 @@ void MPM_Simulator::update_F(T dt) {
       //     }
       // assert(false);
     }
-  });
+  };
+
+  // one loop over all particles instead of one per group; every range
+  // finds the group of its first particle and walks on from there, like
+  // the stress batches. psi and J are read while the particle is still in
+  // cache
+  int stage = MPM_Profiler::current_stage();
+  auto update_range = [&](const tbb::blocked_range<int> &r,
+                          DeformationSums sums) {
+    MPMTaskProfiler task(stage);
+    auto group = std::upper_bound(groups.begin(), groups.end(), r.begin(),
+                                  [](int iter, const ParticleGroup &group) {
+                                    return iter < group.begin;
+                                  }) -
+                 1;
+    Plasticity *plas = group_plasticity(*group);
+    MPM_CM *energy_cm = group_cm(*group);
+    for (int iter = r.begin(); iter != r.end(); ++iter) {
+      if (iter >= group->end) {
+        while (iter >= group->end) {
+          ++group;
+        }
+        plas = group_plasticity(*group);
+        energy_cm = group_cm(*group);
+      }
+      update_particle(iter, plas);
+      if (diagnostics_enabled) {
+        auto &particle = particles[iter];
+        sums.elastic_energy +=
+            particle.material->volume * energy_cm->calc_psi(particle);
+        sums.min_J = std::min(sums.min_J, particle.J);
+        sums.max_J = std::max(sums.max_J, particle.J);
+      }
+    }
+    return sums;
+  };
+
+  tbb::blocked_range<int> range(0, sim_info.particle_size);
+  if (!diagnostics_enabled) {
+    numa->parallel_for(particle_bounds, range,
+                       [&](const tbb::blocked_range<int> &r) {
+                         update_range(r, DeformationSums());
+                       });
+    return;
+  }
+  auto sums = numa->parallel_reduce(
+      particle_bounds, range, DeformationSums(), update_range,
+      [](DeformationSums x, const DeformationSums &y) { return x.merge(y); });
+  diagnostics.elastic_energy = sums.elastic_energy;
+  diagnostics.min_J = sums.min_J;
+  diagnostics.max_J = sums.max_J;
   // MPM_INFO("particles[0]'s F:\n{}", particles[0].F);
 }
 
 void MPM_Simulator::transfer_G2P() {
-  // MPM_SCOPED_PROFILE_FUNCTION();
-  tbb::parallel_for(0, (int)sim_info.particle_size, [&](int iter) {
+  MPM_PROFILE_STAGE("transfer_G2P");
+  numa->for_each(particle_bounds, 0, sim_info.particle_size, [&](int iter) {
+    if (is_asleep(particles[iter])) {
+      return;
+    }
+    if (int owner = owner_level(iter)) {
+      refined_G2P(particles[iter], owner);
+      return;
+    }
     // particle position in grid space
     VT particle_pos = particles[iter].pos_p;
     auto inv_h = 1.0f / sim_info.h;
@@ -519,8 +932,8 @@ void MPM_Simulator::transfer_G2P() {
           auto index = curr_node(0) * sim_info.grid_h * sim_info.grid_l +
                        curr_node(1) * sim_info.grid_l + curr_node(2);
 
-          MPM_ASSERT(0 <= index && index < sim_info.grid_size,
-                     "PARTICLE OUT OF GRID");
+          MPM_DEBUG_ASSERT(0 <= index && index < sim_info.grid_size,
+                           "PARTICLE OUT OF GRID");
 
           v_pic += wijk * grid_attrs[index].vel_i;
           v_flip += wijk * (grid_attrs[index].vel_i - grid_attrs[index].vel_in);
@@ -542,23 +955,47 @@ void MPM_Simulator::transfer_G2P() {
 }
 
 void MPM_Simulator::advection(T dt) {
-  // MPM_SCOPED_PROFILE_FUNCTION();
-  sim_info.max_velocity = tbb::parallel_reduce(
-      tbb::blocked_range<Particle *>(particles,
-                                     particles + sim_info.particle_size),
-      0.0f,
-      [&](const tbb::blocked_range<Particle *> &r, T max_vel) -> T {
-        for (auto iter = r.begin(); iter != r.end(); ++iter) {
+  MPM_PROFILE_STAGE("advection");
+  int stage = MPM_Profiler::current_stage();
+  bool sleeping = sleeping_enabled;
+  T rest_velocity = sleep_blocks.get_options().velocity;
+  auto sums = numa->parallel_reduce(
+      particle_bounds, tbb::blocked_range<int>(0, sim_info.particle_size),
+      AdvectionSums(),
+      [&](const tbb::blocked_range<int> &r, AdvectionSums sums) {
+        MPMTaskProfiler task(stage);
+        for (auto iter = particles + r.begin(); iter != particles + r.end();
+             ++iter) {
+          if (sleeping && is_asleep(*iter)) {
+            sums.asleep++;
+            continue;
+          }
           iter->pos_p += dt * iter->vel_p;
-          max_vel = std::max(max_vel, iter->vel_p.norm());
+          T speed = iter->vel_p.norm();
+          sums.max_velocity = std::max(sums.max_velocity, speed);
+          if (sleeping) {
+            int block = sleep_blocks.block_of(iter->pos_p);
+            if (sleep_blocks.asleep(block)) {
+              // moved into a sleeping block
+              sleep_blocks.request_wake(block);
+            }
+            sleep_blocks.mark_occupied(block);
+            if (!(speed <= rest_velocity)) {
+              sleep_blocks.mark_busy(block);
+            }
+          }
         }
-        return max_vel;
+        return sums;
       },
-      [&](T x, T y) { return std::max(x, y); });
+      [](AdvectionSums x, const AdvectionSums &y) { return x.merge(y); });
+
+  sim_info.max_velocity = sums.max_velocity;
+  sleeping_particles = sums.asleep;
 }
 
 void MPM_Simulator::solve_grid_collision() {
-  tbb::parallel_for(0, (int)active_nodes.size(), [&](int i) {
+  MPM_PROFILE_STAGE("solve_grid_collision");
+  numa->for_each(active_bounds, 0, (int)active_nodes.size(), [&](int i) {
     int index = active_nodes[i];
     for (auto &coll : colls) {
       coll.solve_collision(grid_attrs[index].Xi.cast<T>() * sim_info.h,
@@ -568,15 +1005,48 @@ void MPM_Simulator::solve_grid_collision() {
 }
 
 void MPM_Simulator::solve_particle_collision() {
-  tbb::parallel_for(0, (int)sim_info.particle_size, [&](int i) {
+  MPM_PROFILE_STAGE("solve_particle_collision");
+  auto collide = [&](Particle &particle) {
     for (auto &coll : colls) {
-      coll.solve_collision(particles[i].pos_p, particles[i].vel_p);
+      coll.solve_collision(particle.pos_p, particle.vel_p);
     }
-  });
+  };
+  if (!diagnostics_enabled) {
+    numa->for_each(particle_bounds, 0, sim_info.particle_size, [&](int i) {
+      if (!is_asleep(particles[i])) {
+        collide(particles[i]);
+      }
+    });
+    return;
+  }
+
+  // the last pass over the particles, so the energy and momentum of the
+  // end of the step are summed here once the colliders are applied
+  int stage = MPM_Profiler::current_stage();
+  auto sums = numa->parallel_reduce(
+      particle_bounds, tbb::blocked_range<int>(0, sim_info.particle_size),
+      MomentumSums(),
+      [&](const tbb::blocked_range<int> &r, MomentumSums sums) {
+        MPMTaskProfiler task(stage);
+        for (int i = r.begin(); i != r.end(); ++i) {
+          auto &particle = particles[i];
+          if (is_asleep(particle)) {
+            continue;
+          }
+          collide(particle);
+          T mass = particle.material->mass;
+          sums.kinetic_energy += 0.5f * mass * particle.vel_p.squaredNorm();
+          sums.momentum += mass * particle.vel_p;
+        }
+        return sums;
+      },
+      [](MomentumSums x, const MomentumSums &y) { return x.merge(y); });
+  diagnostics.kinetic_energy = sums.kinetic_energy;
+  diagnostics.momentum = sums.momentum;
 }
 
 void MPM_Simulator::solve_grid_boundary(int thickness) {
-  // MPM_SCOPED_PROFILE_FUNCTION();
+  MPM_PROFILE_STAGE("solve_grid_boundary");
   // Sticky boundary
   auto [W, H, L] = std::tie(sim_info.grid_w, sim_info.grid_h, sim_info.grid_l);
   // check x-axis bound
@@ -0,0 +1,162 @@
+#include "MPM/sleep_blocks.h"
+#include "MPM/collision.h"
+#include "MPM/mpm_pch.h"
+
+#include <tbb/parallel_for.h>
+
+namespace mpm {
+
+void MPM_SleepBlocks::initialize(const SimInfo &info,
+                                 const SleepOptions &options) {
+  MPM_ASSERT(options.block_size > 0 && options.quiet_steps > 0,
+             "SLEEP BLOCKS NEED A POSITIVE BLOCK SIZE AND QUIET STEPS");
+  this->options = options;
+  h = info.h;
+  inv_h = 1 / info.h;
+  cells = VINT(info.grid_w, info.grid_h, info.grid_l);
+  for (int d = 0; d < DIM; d++) {
+    blocks[d] = (cells[d] + options.block_size - 1) / options.block_size;
+  }
+  block_count = blocks.prod();
+
+  asleep_flags.assign(block_count, 0);
+  next_asleep.assign(block_count, 0);
+  quiet.assign(block_count, 0);
+  sleep_distance.assign(block_count, 0);
+  occupied.reset(new std::atomic<uint8_t>[block_count]);
+  busy.reset(new std::atomic<uint8_t>[block_count]);
+  wake.reset(new std::atomic<uint8_t>[block_count]);
+  wake_all();
+}
+
+void MPM_SleepBlocks::clear() {
+  block_count = 0;
+  asleep_blocks = 0;
+  asleep_flags.clear();
+  next_asleep.clear();
+  quiet.clear();
+  sleep_distance.clear();
+  occupied.reset();
+  busy.reset();
+  wake.reset();
+}
+
+void MPM_SleepBlocks::wake_all() {
+  for (int b = 0; b < block_count; b++) {
+    asleep_flags[b] = 0;
+    quiet[b] = 0;
+    occupied[b].store(0, std::memory_order_relaxed);
+    busy[b].store(0, std::memory_order_relaxed);
+    wake[b].store(0, std::memory_order_relaxed);
+  }
+  asleep_blocks = 0;
+}
+
+void MPM_SleepBlocks::save(Snapshot &snapshot) const {
+  snapshot.asleep = asleep_flags;
+  snapshot.quiet = quiet;
+  snapshot.sleep_distance = sleep_distance;
+  snapshot.asleep_blocks = asleep_blocks;
+}
+
+void MPM_SleepBlocks::restore(const Snapshot &snapshot) {
+  if (snapshot.asleep.size() != size_t(block_count)) {
+    // the blocks were set up again since, nothing to go back to
+    return;
+  }
+  asleep_flags = snapshot.asleep;
+  quiet = snapshot.quiet;
+  sleep_distance = snapshot.sleep_distance;
+  asleep_blocks = snapshot.asleep_blocks;
+  // the reports as update() leaves them
+  for (int b = 0; b < block_count; b++) {
+    occupied[b].store(asleep_flags[b], std::memory_order_relaxed);
+    busy[b].store(0, std::memory_order_relaxed);
+    wake[b].store(0, std::memory_order_relaxed);
+  }
+}
+
+T MPM_SleepBlocks::collider_distance(
+    int block, const std::vector<MPM_Collision> &colls) const {
+  VINT coord(block / (blocks[1] * blocks[2]), block / blocks[2] % blocks[1],
+             block % blocks[2]);
+  VT center = (coord.cast<T>() + VT::Constant(0.5)) * options.block_size * h;
+  T distance = std::numeric_limits<T>::max();
+  for (auto &coll : colls) {
+    distance = std::min(distance, coll.signed_distance(center));
+  }
+  return distance;
+}
+
+void MPM_SleepBlocks::update(const std::vector<MPM_Collision> &colls) {
+  MPM_PROFILE_STAGE("sleep_update");
+  const uint16_t quiet_steps = static_cast<uint16_t>(options.quiet_steps);
+  auto relaxed = std::memory_order_relaxed;
+
+  // rest counters of the awake blocks, explicit wakes of the sleeping ones
+  tbb::parallel_for(0, block_count, [&](int b) {
+    if (asleep_flags[b]) {
+      bool disturbed = wake[b].load(relaxed) != 0;
+      if (!disturbed && !colls.empty()) {
+        disturbed = std::abs(collider_distance(b, colls) - sleep_distance[b]) >
+                    options.wake_distance * h;
+      }
+      if (disturbed) {
+        asleep_flags[b] = 0;
+        quiet[b] = 0;
+      }
+    } else if (occupied[b].load(relaxed)) {
+      quiet[b] = busy[b].load(relaxed)
+                     ? 0
+                     : std::min<uint16_t>(quiet[b] + 1, quiet_steps);
+    } else {
+      quiet[b] = 0;
+    }
+  });
+
+  // a block sleeps when it and every occupied neighbour are at rest, and
+  // wakes when a neighbour moves
+  tbb::parallel_for(0, blocks[0], [&](int x) {
+    for (int y = 0; y < blocks[1]; y++)
+      for (int z = 0; z < blocks[2]; z++) {
+        int b = (x * blocks[1] + y) * blocks[2] + z;
+        bool holds_particles = asleep_flags[b] || occupied[b].load(relaxed);
+        next_asleep[b] = 0;
+        if (!holds_particles || (!asleep_flags[b] && quiet[b] < quiet_steps)) {
+          continue;
+        }
+        bool moving_neighbour = false;
+        for (int i = std::max(x - 1, 0);
+             i <= std::min(x + 1, blocks[0] - 1) && !moving_neighbour; i++)
+          for (int j = std::max(y - 1, 0); j <= std::min(y + 1, blocks[1] - 1);
+               j++)
+            for (int k = std::max(z - 1, 0);
+                 k <= std::min(z + 1, blocks[2] - 1); k++) {
+              int n = (i * blocks[1] + j) * blocks[2] + k;
+              if (!asleep_flags[n] && occupied[n].load(relaxed) &&
+                  quiet[n] < quiet_steps) {
+                moving_neighbour = true;
+              }
+            }
+        next_asleep[b] = !moving_neighbour;
+      }
+  });
+
+  tbb::parallel_for(0, block_count, [&](int b) {
+    if (asleep_flags[b] && !next_asleep[b]) {
+      // woken as halo, its own particles are still at rest
+      quiet[b] = quiet_steps;
+    } else if (!asleep_flags[b] && next_asleep[b] && !colls.empty()) {
+      sleep_distance[b] = collider_distance(b, colls);
+    }
+    asleep_flags[b] = next_asleep[b];
+    occupied[b].store(next_asleep[b], relaxed);
+    busy[b].store(0, relaxed);
+    wake[b].store(0, relaxed);
+  });
+
+  asleep_blocks = static_cast<int>(
+      std::count(asleep_flags.begin(), asleep_flags.end(), uint8_t(1)));
+}
+
+} // namespace mpm
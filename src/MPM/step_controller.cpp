@@ -0,0 +1,86 @@
+#include "MPM/step_controller.h"
+#include "MPM/material.h"
+#include "MPM/mpm_pch.h"
+#include "MPM/simulator.h"
+
+namespace mpm {
+
+MPM_StepController::MPM_StepController(MPM_Simulator &sim,
+                                       const StepControllerOptions &options)
+    : sim(sim), options(options),
+      dt(options.initial_dt > 0 ? options.initial_dt : options.max_dt) {
+  sim.set_rollback(true);
+}
+
+bool MPM_StepController::step_failed(T step_dt) const {
+  if (sim.step_failed()) {
+    return true;
+  }
+  T max_velocity = sim.get_max_velocity();
+  return !(max_velocity * step_dt <= options.spike_cfl * sim.get_min_h());
+}
+
+T MPM_StepController::stable_dt() const {
+  auto h = sim.get_min_h();
+  T limit = std::min(dt, options.cfl * h /
+                             std::max(T(0.0001), sim.get_max_velocity()));
+  // the material table holds a handful of entries, no need to cache
+  for (auto material : sim.get_materials()) {
+    T wave_speed = material->wave_speed();
+    if (wave_speed > 0) {
+      limit = std::min(limit, options.acoustic_cfl * h / wave_speed);
+    }
+  }
+  return std::max(limit, options.min_dt);
+}
+
+T MPM_StepController::advance(T remaining) {
+  for (;;) {
+    T limit = stable_dt();
+    // the slack keeps rounding from adding a whole step
+    T steps = std::ceil(remaining / limit - T(1e-6));
+    T step_dt = steps > 1 ? remaining / steps : remaining;
+
+    sim.substep(step_dt);
+    if (!step_failed(step_dt)) {
+      accepted_steps++;
+      if (++success_run >= options.grow_after) {
+        dt = std::min(options.max_dt, dt * options.grow);
+        success_run = 0;
+      }
+      return step_dt;
+    }
+
+    success_run = 0;
+    if (step_dt <= options.min_dt) {
+      // nothing smaller to try, keep the step and let the caller see it
+      MPM_WARN("step failed at min_dt {}, keeping it", step_dt);
+      accepted_steps++;
+      return step_dt;
+    }
+    sim.rollback_step();
+    rejected_steps++;
+    dt = std::max(options.min_dt, step_dt * options.shrink);
+    MPM_TRACE("step of {} rejected, retrying with {}", step_dt, dt);
+  }
+}
+
+int MPM_StepController::advance_frame(T frame_time,
+                                      const std::function<void(T)> &on_step) {
+  int steps = 0;
+  T elapsed = 0;
+  while (elapsed < frame_time) {
+    T remaining = frame_time - elapsed;
+    T step_dt = advance(remaining);
+    // the last step covers the exact remainder, so rounding can not leave
+    // a sliver of the frame for another substep
+    elapsed = step_dt == remaining ? frame_time : elapsed + step_dt;
+    steps++;
+    if (on_step) {
+      on_step(step_dt);
+    }
+  }
+  return steps;
+}
+
+} // namespace mpm
@@ -0,0 +1,404 @@
+#include "MPM/surface.h"
+#include "MPM/Math/interpolation.h"
+#include "MPM/mpm_pch.h"
+
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/parallel_sort.h>
+
+namespace mpm {
+
+namespace {
+
+constexpr int KEY_BITS = 21;
+constexpr int64_t KEY_OFFSET = int64_t(1) << (KEY_BITS - 1);
+
+uint64_t block_key(const VINT &block) {
+  return (uint64_t(block[0] + KEY_OFFSET) << (2 * KEY_BITS)) |
+         (uint64_t(block[1] + KEY_OFFSET) << KEY_BITS) |
+         uint64_t(block[2] + KEY_OFFSET);
+}
+
+VINT key_block(uint64_t key) {
+  const uint64_t mask = (uint64_t(1) << KEY_BITS) - 1;
+  return VINT(int(int64_t(key >> (2 * KEY_BITS)) - KEY_OFFSET),
+              int(int64_t(key >> KEY_BITS & mask) - KEY_OFFSET),
+              int(int64_t(key & mask) - KEY_OFFSET));
+}
+
+VINT floor_div(const VINT &a, int b) {
+  VINT q;
+  for (int d = 0; d < DIM; d++) {
+    q[d] = a[d] >= 0 ? a[d] / b : -((-a[d] + b - 1) / b);
+  }
+  return q;
+}
+
+// Marching cubes cases. Corner c sits at (c & 1, c >> 1 & 1, c >> 2 & 1),
+// edge d * 4 + u + 2 * v runs along axis d from the corner with bit u on
+// axis d + 1 and bit v on axis d + 2. Instead of the usual hand-written
+// table the cases are derived once: on every cube face the cut edges are
+// paired around each run of inside corners, with diagonal inside corners
+// kept apart. The pairing depends on the face alone, so two cubes sharing
+// a face always agree and the surface is closed; chaining the face segments
+// gives the loops of a case, which are triangulated as fans.
+using CaseTriangles = std::vector<std::array<int8_t, 3>>;
+
+int corner_edge(int a, int b) {
+  int diff = a ^ b;
+  int d = diff == 1 ? 0 : diff == 2 ? 1 : 2;
+  int start = a & b;
+  return d * 4 + (start >> (d + 1) % 3 & 1) + 2 * (start >> (d + 2) % 3 & 1);
+}
+
+VINT edge_start(int edge) {
+  int d = edge / 4;
+  VINT node = VINT::Zero();
+  node[(d + 1) % 3] = edge & 1;
+  node[(d + 2) % 3] = edge >> 1 & 1;
+  return node;
+}
+
+std::vector<CaseTriangles> build_cases() {
+  std::vector<CaseTriangles> cases(256);
+  for (int mask = 0; mask < 256; mask++) {
+    auto inside = [&](int corner) { return (mask >> corner & 1) != 0; };
+    // the cut edge that follows each cut edge on its loop
+    int next[12];
+    std::fill(next, next + 12, -1);
+    for (int d = 0; d < DIM; d++)
+      for (int side = 0; side < 2; side++) {
+        int u = (d + 1) % 3, v = (d + 2) % 3;
+        // counter-clockwise seen from outside the cube
+        int cycle[4];
+        for (int i = 0; i < 4; i++) {
+          int cu = i == 1 || i == 2, cv = i >= 2;
+          cycle[side ? i : 3 - i] = side << d | cu << u | cv << v;
+        }
+        for (int i = 0; i < 4; i++) {
+          int prev = cycle[(i + 3) % 4];
+          if (!inside(cycle[i]) || inside(prev)) {
+            continue;
+          }
+          int j = i;
+          while (inside(cycle[(j + 1) % 4])) {
+            j = (j + 1) % 4;
+          }
+          next[corner_edge(cycle[j], cycle[(j + 1) % 4])] =
+              corner_edge(prev, cycle[i]);
+        }
+      }
+
+    bool visited[12] = {};
+    for (int first = 0; first < 12; first++) {
+      if (next[first] < 0 || visited[first]) {
+        continue;
+      }
+      std::vector<int> loop;
+      for (int e = first; !visited[e]; e = next[e]) {
+        visited[e] = true;
+        loop.push_back(e);
+      }
+      for (size_t k = 1; k + 1 < loop.size(); k++) {
+        cases[mask].push_back(
+            {int8_t(loop[0]), int8_t(loop[k]), int8_t(loop[k + 1])});
+      }
+    }
+  }
+
+  // wind the triangles so their normals leave the inside corners
+  auto midpoint = [](int e) -> VT {
+    VT axis = VT::Zero();
+    axis[e / 4] = T(0.5);
+    return edge_start(e).cast<T>() + axis;
+  };
+  auto &tri = cases[1][0];
+  VT normal = (midpoint(tri[1]) - midpoint(tri[0]))
+                  .cross(midpoint(tri[2]) - midpoint(tri[0]));
+  if (normal.dot(midpoint(tri[0])) < 0) {
+    for (auto &triangles : cases) {
+      for (auto &t : triangles) {
+        std::swap(t[1], t[2]);
+      }
+    }
+  }
+  return cases;
+}
+
+const std::vector<CaseTriangles> &marching_cubes_cases() {
+  static const std::vector<CaseTriangles> cases = build_cases();
+  return cases;
+}
+
+} // namespace
+
+MPM_SurfaceMesher::MPM_SurfaceMesher(const SurfaceOptions &options)
+    : options(options) {
+  MPM_ASSERT(options.voxel_size > 0 && options.block_size >= 4,
+             "SURFACE NEEDS A POSITIVE VOXEL SIZE AND BLOCKS OF 4+ VOXELS");
+}
+
+void MPM_SurfaceMesher::extract(const StridedSpan<VT> &positions,
+                                SurfaceMesh &mesh) const {
+  extract(positions.size(), [&](size_t i) { return positions[i]; }, mesh);
+}
+
+void MPM_SurfaceMesher::extract(const ParticleSnapshot &snapshot,
+                                SurfaceMesh &mesh) const {
+  MPM_ASSERT(!snapshot.channels.empty() &&
+                 snapshot.channels[0].channel == ExportChannel::POSITION,
+             "SNAPSHOT SHOULD START WITH THE POSITION CHANNEL");
+  auto &buffer = snapshot.channels[0];
+  extract(
+      size_t(snapshot.size),
+      [&](size_t i) {
+        return VT(buffer.get(i, 0), buffer.get(i, 1), buffer.get(i, 2));
+      },
+      mesh);
+}
+
+template <class Position>
+void MPM_SurfaceMesher::extract(size_t n, Position &&position,
+                                SurfaceMesh &mesh) const {
+  MPM_PROFILE_STAGE("surface_extract");
+  mesh.clear();
+  if (n == 0) {
+    return;
+  }
+  const int B = options.block_size;
+  const int V = B * B * B;
+  const T inv_voxel = 1 / options.voxel_size;
+
+  // particles sorted by the block of their cell
+  std::vector<std::pair<uint64_t, uint32_t>> order(n);
+  tbb::parallel_for(size_t(0), n, [&](size_t i) {
+    VINT cell = (position(i) * inv_voxel).array().floor().template cast<int>();
+    order[i] = {block_key(floor_div(cell, B)), uint32_t(i)};
+  });
+  tbb::parallel_sort(order.begin(), order.end());
+  std::vector<uint64_t> occupied;
+  std::vector<size_t> ranges;
+  for (size_t i = 0; i < n; i++) {
+    if (occupied.empty() || occupied.back() != order[i].first) {
+      occupied.push_back(order[i].first);
+      ranges.push_back(i);
+    }
+  }
+  ranges.push_back(n);
+
+  // the supports of the particles reach one block further
+  std::vector<uint64_t> keys;
+  keys.reserve(occupied.size() * 27);
+  for (auto key : occupied) {
+    VINT block = key_block(key);
+    for (int c = 0; c < 27; c++) {
+      keys.push_back(
+          block_key(block + VINT(c / 9 - 1, c / 3 % 3 - 1, c % 3 - 1)));
+    }
+  }
+  tbb::parallel_sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+  const int nb = static_cast<int>(keys.size());
+
+  auto find = [](const std::vector<uint64_t> &sorted, uint64_t key) {
+    auto iter = std::lower_bound(sorted.begin(), sorted.end(), key);
+    return iter != sorted.end() && *iter == key ? int(iter - sorted.begin())
+                                                : -1;
+  };
+  std::vector<std::array<int, 27>> neighbours(nb);
+  std::vector<int> occupied_slot(nb);
+  tbb::parallel_for(0, nb, [&](int b) {
+    VINT block = key_block(keys[b]);
+    for (int c = 0; c < 27; c++) {
+      neighbours[b][c] = find(
+          keys, block_key(block + VINT(c / 9 - 1, c / 3 % 3 - 1, c % 3 - 1)));
+    }
+    occupied_slot[b] = find(occupied, keys[b]);
+  });
+
+  // splat: every particle once into the block of its cell, padded by the
+  // nodes its support reaches beyond the block (one below, two above),
+  // then every block sums the padded blocks overlapping it, without locks
+  const int P = B + 3;
+  const size_t PV = size_t(P) * P * P;
+  const int no = static_cast<int>(occupied.size());
+  std::vector<float> padded(size_t(no) * PV);
+  tbb::parallel_for(0, no, [&](int o) {
+    VINT origin = key_block(occupied[o]) * B - VINT::Ones();
+    float *values = padded.data() + size_t(o) * PV;
+    std::fill(values, values + PV, 0.0f);
+    for (size_t p = ranges[o]; p < ranges[o + 1]; p++) {
+      VT u = position(order[p].second) * inv_voxel;
+      auto [base, wp, dwp] = quatratic_interpolation(u);
+      VINT local = base - origin;
+      for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+          for (int k = 0; k < 3; k++) {
+            values[((local[0] + i) * P + local[1] + j) * P + local[2] + k] +=
+                float(wp(i, 0) * wp(j, 1) * wp(k, 2));
+          }
+    }
+  });
+
+  std::vector<float> field(size_t(nb) * V), smoothed;
+  tbb::parallel_for(0, nb, [&](int b) {
+    VINT origin = key_block(keys[b]) * B;
+    float *values = field.data() + size_t(b) * V;
+    std::fill(values, values + V, 0.0f);
+    for (int c = 0; c < 27; c++) {
+      int slot = neighbours[b][c] < 0 ? -1 : occupied_slot[neighbours[b][c]];
+      if (slot < 0) {
+        continue;
+      }
+      // this block's nodes in the padded block of the neighbour
+      VINT shift = origin - (key_block(occupied[slot]) * B - VINT::Ones());
+      VINT lo = (-shift).cwiseMax(0);
+      VINT hi = (VINT::Constant(P) - shift).cwiseMin(B);
+      const float *source = padded.data() + size_t(slot) * PV;
+      for (int x = lo[0]; x < hi[0]; x++)
+        for (int y = lo[1]; y < hi[1]; y++)
+          for (int z = lo[2]; z < hi[2]; z++) {
+            values[(x * B + y) * B + z] +=
+                source[((x + shift[0]) * P + y + shift[1]) * P + z +
+                       shift[2]];
+          }
+    }
+  });
+  padded = std::vector<float>();
+
+  // value of a node given relative to a block, 0 outside the blocks
+  auto value = [&](const std::vector<float> &values, int b, VINT local) {
+    int c = 13;
+    for (int d = 0; d < DIM; d++) {
+      int o = local[d] < 0 ? -1 : local[d] >= B ? 1 : 0;
+      c += o * (d == 0 ? 9 : d == 1 ? 3 : 1);
+      local[d] -= o * B;
+    }
+    int slot = neighbours[b][c];
+    return slot < 0 ? 0.0f
+                    : values[size_t(slot) * V +
+                             (local[0] * B + local[1]) * B + local[2]];
+  };
+
+  smoothed.resize(field.size());
+  for (int pass = 0; pass < options.smoothing; pass++) {
+    for (int d = 0; d < DIM; d++) {
+      VINT step = VINT::Zero();
+      step[d] = 1;
+      tbb::parallel_for(0, nb, [&](int b) {
+        for (int i = 0; i < V; i++) {
+          VINT local(i / (B * B), i / B % B, i % B);
+          smoothed[size_t(b) * V + i] =
+              0.25f * value(field, b, local - step) +
+              0.5f * field[size_t(b) * V + i] +
+              0.25f * value(field, b, local + step);
+        }
+      });
+      field.swap(smoothed);
+    }
+  }
+
+  // density weighted mean density, which the bulk dominates
+  auto moments = tbb::parallel_reduce(
+      tbb::blocked_range<size_t>(0, field.size()), std::pair<double, double>(),
+      [&](const tbb::blocked_range<size_t> &r, std::pair<double, double> sum) {
+        for (size_t i = r.begin(); i != r.end(); ++i) {
+          sum.first += field[i];
+          sum.second += double(field[i]) * field[i];
+        }
+        return sum;
+      },
+      [](std::pair<double, double> x, const std::pair<double, double> &y) {
+        return std::make_pair(x.first + y.first, x.second + y.second);
+      });
+  if (moments.first <= 0) {
+    return;
+  }
+  const float iso = float(options.iso * moments.second / moments.first);
+
+  // vertices on the crossing edges each block owns
+  std::vector<int> edge_vertex(size_t(nb) * V * 3, -1);
+  std::vector<std::vector<std::array<float, 3>>> block_vertices(nb);
+  tbb::parallel_for(0, nb, [&](int b) {
+    VINT origin = key_block(keys[b]) * B;
+    for (int i = 0; i < V; i++) {
+      VINT local(i / (B * B), i / B % B, i % B);
+      float fa = field[size_t(b) * V + i];
+      for (int d = 0; d < DIM; d++) {
+        VINT step = VINT::Zero();
+        step[d] = 1;
+        float fb = value(field, b, local + step);
+        if ((fa > iso) == (fb > iso)) {
+          continue;
+        }
+        T t = (iso - fa) / (fb - fa);
+        VT pos = (origin + local).template cast<T>();
+        pos[d] += t;
+        pos *= options.voxel_size;
+        edge_vertex[(size_t(b) * V + i) * 3 + d] =
+            static_cast<int>(block_vertices[b].size());
+        block_vertices[b].push_back(
+            {float(pos[0]), float(pos[1]), float(pos[2])});
+      }
+    }
+  });
+  std::vector<uint32_t> vertex_offset(nb + 1, 0);
+  for (int b = 0; b < nb; b++) {
+    vertex_offset[b + 1] =
+        vertex_offset[b] + static_cast<uint32_t>(block_vertices[b].size());
+  }
+
+  // triangles of the cells, whose upper corners may lie in the next blocks
+  const auto &cases = marching_cubes_cases();
+  std::vector<std::vector<std::array<uint32_t, 3>>> block_triangles(nb);
+  tbb::parallel_for(0, nb, [&](int b) {
+    for (int i = 0; i < V; i++) {
+      VINT cell(i / (B * B), i / B % B, i % B);
+      int mask = 0;
+      for (int c = 0; c < 8; c++) {
+        VINT corner = cell + VINT(c & 1, c >> 1 & 1, c >> 2 & 1);
+        mask |= int(value(field, b, corner) > iso) << c;
+      }
+      for (auto &triangle : cases[mask]) {
+        std::array<uint32_t, 3> ids;
+        bool complete = true;
+        for (int k = 0; k < 3; k++) {
+          int e = triangle[k];
+          VINT node = cell + edge_start(e);
+          VINT o = (node.array() >= B).template cast<int>();
+          int slot = neighbours[b][o[0] * 9 + o[1] * 3 + o[2] + 13];
+          if (slot < 0) {
+            complete = false;
+            break;
+          }
+          node -= o * B;
+          int id = edge_vertex[(size_t(slot) * V +
+                                (node[0] * B + node[1]) * B + node[2]) *
+                                   3 +
+                               e / 4];
+          MPM_DEBUG_ASSERT(id >= 0, "SURFACE EDGE WITHOUT A VERTEX");
+          complete = complete && id >= 0;
+          ids[k] = vertex_offset[slot] + uint32_t(id);
+        }
+        if (complete) {
+          block_triangles[b].push_back(ids);
+        }
+      }
+    }
+  });
+
+  std::vector<size_t> triangle_offset(nb + 1, 0);
+  for (int b = 0; b < nb; b++) {
+    triangle_offset[b + 1] = triangle_offset[b] + block_triangles[b].size();
+  }
+  mesh.vertices.resize(vertex_offset[nb]);
+  mesh.triangles.resize(triangle_offset[nb]);
+  tbb::parallel_for(0, nb, [&](int b) {
+    std::copy(block_vertices[b].begin(), block_vertices[b].end(),
+              mesh.vertices.begin() + vertex_offset[b]);
+    std::copy(block_triangles[b].begin(), block_triangles[b].end(),
+              mesh.triangles.begin() + triangle_offset[b]);
+  });
+}
+
+} // namespace mpm